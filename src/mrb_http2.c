@@ -134,8 +134,13 @@ void mrb_http2_free_nva(mrb_state *mrb, nghttp2_nv *nva, size_t nvlen)
 {
   int i;
   for (i = 0; i < nvlen; i++) {
-    mrb_free(mrb, nva[i].name);
-    mrb_free(mrb, nva[i].value);
+    // borrowed by mrb_http2_ref_nv
+    if (!(nva[i].flags & NGHTTP2_NV_FLAG_NO_COPY_NAME)) {
+      mrb_free(mrb, nva[i].name);
+    }
+    if (!(nva[i].flags & NGHTTP2_NV_FLAG_NO_COPY_VALUE)) {
+      mrb_free(mrb, nva[i].value);
+    }
     nva[i].namelen = 0;
     nva[i].valuelen = 0;
   }
@@ -156,6 +161,17 @@ void mrb_http2_create_nv(mrb_state *mrb, nghttp2_nv *nv, const uint8_t *name, si
   nv->flags = NGHTTP2_NV_FLAG_NONE;
 }
 
+// refer to name and value without copying, they must outlive the nghttp2_nv
+// and nghttp2 doesn't copy them either when the nv is submitted
+void mrb_http2_ref_nv(nghttp2_nv *nv, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen)
+{
+  nv->name = (uint8_t *)name;
+  nv->namelen = namelen;
+  nv->value = (uint8_t *)value;
+  nv->valuelen = valuelen;
+  nv->flags = NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE;
+}
+
 // add nghttp2_nv into existing nghttp2_nv array
 size_t mrb_http2_add_nv(nghttp2_nv *nva, size_t nvlen, nghttp2_nv *nv)
 {
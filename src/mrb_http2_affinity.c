@@ -0,0 +1,164 @@
+/*
+// mrb_http2_affinity.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+// CPU_SET and sched_setaffinity
+#define _GNU_SOURCE
+#include "mrb_http2.h"
+#include "mrb_http2_affinity.h"
+
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <linux/filter.h>
+
+// CPUs the server was started on, the ids may not be contiguous
+static int affinity_allowed(cpu_set_t *allowed)
+{
+  CPU_ZERO(allowed);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), allowed) != 0) {
+    fprintf(stderr, "affinity: sched_getaffinity failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// "0-3,8-11" of /sys/devices/system/node/nodeN/cpulist
+static int affinity_node_cpus(unsigned int node, cpu_set_t *set)
+{
+  char path[64], buf[1024], *p, *end;
+  long from, to;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  p = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  if (p == NULL) {
+    return -1;
+  }
+
+  CPU_ZERO(set);
+  while (*p != '\0' && *p != '\n') {
+    from = to = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      to = strtol(p, &end, 10);
+    }
+    for (; from <= to && from < CPU_SETSIZE; from++) {
+      CPU_SET(from, set);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
+
+static unsigned int affinity_nodes(void)
+{
+  cpu_set_t set;
+  unsigned int nodes = 0;
+
+  while (affinity_node_cpus(nodes, &set) == 0) {
+    nodes++;
+  }
+  return nodes;
+}
+
+int mrb_http2_affinity_set(mrb_http2_affinity_type type, unsigned int id, unsigned int workers)
+{
+  cpu_set_t allowed, set;
+  unsigned int cpu, nodes, ncpu;
+
+  if (type == MRB_HTTP2_AFFINITY_NONE || workers == 0 || affinity_allowed(&allowed) != 0) {
+    return -1;
+  }
+
+  if (type == MRB_HTTP2_AFFINITY_NUMA) {
+    nodes = affinity_nodes();
+    if (nodes == 0 || affinity_node_cpus(id % nodes, &set) != 0) {
+      fprintf(stderr, "affinity: no NUMA node found\n");
+      return -1;
+    }
+    CPU_AND(&set, &set, &allowed);
+  } else {
+    // more workers than CPUs share them round robin
+    ncpu = (unsigned int)CPU_COUNT(&allowed);
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < (unsigned int)CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && (workers <= ncpu ? cpu % workers == id : cpu == id % ncpu)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+  }
+
+  if (CPU_COUNT(&set) == 0) {
+    fprintf(stderr, "affinity: no CPU left for worker %u\n", id);
+    return -1;
+  }
+  // pid 0 is the calling thread
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &set) != 0) {
+    fprintf(stderr, "affinity: sched_setaffinity failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int mrb_http2_affinity_steer(int fd, unsigned int workers)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+  cpu_set_t allowed;
+  int cpu, maxcpu = -1;
+
+  // index of the listener in the group is the receiving CPU % workers,
+  // which is a CPU of that worker
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+  if (workers == 0 || affinity_allowed(&allowed) != 0) {
+    return -1;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      maxcpu = cpu;
+    }
+  }
+  // workers without a CPU of their own would get no connections
+  if (workers > (unsigned int)CPU_COUNT(&allowed) || (unsigned int)(maxcpu + 1) < workers) {
+    fprintf(stderr, "affinity: more workers than CPUs, connections are not steered\n");
+    return -1;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+    fprintf(stderr, "affinity: SO_ATTACH_REUSEPORT_CBPF failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+#else
+
+int mrb_http2_affinity_set(mrb_http2_affinity_type type, unsigned int id, unsigned int workers)
+{
+  return -1;
+}
+
+int mrb_http2_affinity_steer(int fd, unsigned int workers)
+{
+  return -1;
+}
+
+#endif
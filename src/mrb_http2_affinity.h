@@ -0,0 +1,30 @@
+/*
+// mrb_http2_affinity.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_AFFINITY_H
+#define MRB_HTTP2_AFFINITY_H
+
+#include "mrb_http2.h"
+
+typedef enum {
+  MRB_HTTP2_AFFINITY_NONE,
+
+  // worker i runs on the CPUs c with c % workers == i, and connections are
+  // steered to the listener of the CPU that received them
+  MRB_HTTP2_AFFINITY_CPU,
+
+  // worker i runs on the CPUs of NUMA node i % nodes
+  MRB_HTTP2_AFFINITY_NUMA
+} mrb_http2_affinity_type;
+
+// pin the calling process or thread, returns -1 when it can't be pinned
+int mrb_http2_affinity_set(mrb_http2_affinity_type type, unsigned int id, unsigned int workers);
+
+// steer connections of the reuseport group of fd by the receiving CPU, the
+// listeners must have joined the group in the order of worker ids
+int mrb_http2_affinity_steer(int fd, unsigned int workers);
+
+#endif
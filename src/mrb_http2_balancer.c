@@ -0,0 +1,608 @@
+/*
+// mrb_http2_balancer.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_balancer.h"
+#include "mrb_http2_upstream.h"
+
+#include <math.h>
+
+#define mrb_http2_balancer_get_obj(mrb, hash, lit) mrb_hash_get(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, lit)))
+
+// upper bound of ejection backoff, fail_timeout * 2^5
+#define MRB_HTTP2_BALANCER_EJECTION_SHIFT_MAX 5
+
+double mrb_http2_balancer_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *balancer_strndup(const char *s, size_t len)
+{
+  char *p = malloc(len + 1);
+
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+// "host:port", "[::1]:port", "host" as port 80 or "unix:/path/to.sock"
+static void balancer_parse_server(mrb_state *mrb, mrb_http2_balancer_backend *backend, const char *server)
+{
+  const char *port = NULL;
+  const char *end;
+
+  if (mrb_http2_upstream_is_unix(server)) {
+    if (server[sizeof(MRB_HTTP2_UPSTREAM_UNIX_PREFIX) - 1] == '\0') {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream server: %S", mrb_str_new_cstr(mrb, server));
+    }
+    backend->host = strdup(server);
+    backend->port = 0;
+    return;
+  }
+
+  if (server[0] == '[') {
+    end = strchr(server, ']');
+    if (end == NULL) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream server: %S", mrb_str_new_cstr(mrb, server));
+    }
+    backend->host = balancer_strndup(server + 1, end - server - 1);
+    if (end[1] == ':') {
+      port = end + 2;
+    }
+  } else {
+    end = strrchr(server, ':');
+    if (end != NULL) {
+      backend->host = balancer_strndup(server, end - server);
+      port = end + 1;
+    } else {
+      backend->host = strdup(server);
+    }
+  }
+
+  backend->port = port != NULL ? atoi(port) : 80;
+  if (backend->host[0] == '\0' || backend->port <= 0 || backend->port > 65535) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream server: %S", mrb_str_new_cstr(mrb, server));
+  }
+}
+
+static unsigned int balancer_get_uint(mrb_state *mrb, mrb_value val, unsigned int def)
+{
+  if (mrb_nil_p(val)) {
+    return def;
+  }
+  if (!mrb_fixnum_p(val) || mrb_fixnum(val) < 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstreams parameter: %S", val);
+  }
+  return (unsigned int)mrb_fixnum(val);
+}
+
+static mrb_http2_balancer_policy balancer_get_policy(mrb_state *mrb, mrb_value val)
+{
+  const char *policy;
+
+  if (mrb_nil_p(val)) {
+    return MRB_HTTP2_BALANCER_ROUND_ROBIN;
+  }
+  policy = mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, val));
+  if (strcmp(policy, "round_robin") == 0) {
+    return MRB_HTTP2_BALANCER_ROUND_ROBIN;
+  } else if (strcmp(policy, "least_outstanding") == 0) {
+    return MRB_HTTP2_BALANCER_LEAST_OUTSTANDING;
+  } else if (strcmp(policy, "peak_ewma") == 0) {
+    return MRB_HTTP2_BALANCER_PEAK_EWMA;
+  } else if (strcmp(policy, "maglev") == 0) {
+    return MRB_HTTP2_BALANCER_MAGLEV;
+  }
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "unknown upstream balance: %S", val);
+  return MRB_HTTP2_BALANCER_ROUND_ROBIN;
+}
+
+// milliseconds, or "p95" for a quantile of observed latency
+static void balancer_set_hedge(mrb_state *mrb, mrb_http2_balancer_group *group, mrb_value val)
+{
+  const char *s;
+  char *end;
+  double q;
+
+  if (mrb_nil_p(val)) {
+    return;
+  }
+  if (mrb_fixnum_p(val) && mrb_fixnum(val) > 0) {
+    group->hedge_delay = mrb_fixnum(val) / 1000.0;
+    return;
+  }
+  s = mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, val));
+  if (s[0] == 'p') {
+    q = strtod(s + 1, &end);
+    if (end != s + 1 && *end == '\0' && q > 0 && q < 100) {
+      group->hedge_quantile = q / 100;
+      return;
+    }
+  }
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream hedge_delay: %S", val);
+}
+
+// FNV-1a with murmur3 finalizer
+static uint64_t balancer_hash(const uint8_t *p, size_t len, uint64_t seed)
+{
+  uint64_t h = 14695981039346656037ULL ^ seed;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// "uri", "header:name" or "cookie:name"
+static void balancer_set_key(mrb_state *mrb, mrb_http2_balancer_group *group, mrb_value val)
+{
+  const char *key;
+  size_t i;
+
+  group->key_type = MRB_HTTP2_BALANCER_KEY_URI;
+  group->key_name = NULL;
+  group->key_namelen = 0;
+  if (mrb_nil_p(val)) {
+    return;
+  }
+  key = mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, val));
+  if (strcmp(key, "uri") == 0) {
+    return;
+  } else if (strncmp(key, "header:", sizeof("header:") - 1) == 0 && key[sizeof("header:") - 1] != '\0') {
+    group->key_type = MRB_HTTP2_BALANCER_KEY_HEADER;
+    group->key_name = strdup(key + sizeof("header:") - 1);
+  } else if (strncmp(key, "cookie:", sizeof("cookie:") - 1) == 0 && key[sizeof("cookie:") - 1] != '\0') {
+    group->key_type = MRB_HTTP2_BALANCER_KEY_COOKIE;
+    group->key_name = strdup(key + sizeof("cookie:") - 1);
+  } else {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream hash_key: %S", val);
+  }
+  group->key_namelen = strlen(group->key_name);
+
+  // request header names are lower case
+  if (group->key_type == MRB_HTTP2_BALANCER_KEY_HEADER) {
+    for (i = 0; i < group->key_namelen; i++) {
+      group->key_name[i] = tolower((unsigned char)group->key_name[i]);
+    }
+  }
+}
+
+// fill the lookup table by turns in each backend's preference order, so
+// only about 1/N of entries move when a backend is added or removed
+static void balancer_maglev_populate(mrb_state *mrb, mrb_http2_balancer_group *group)
+{
+  uint64_t offset[MRB_HTTP2_BALANCER_BACKEND_MAX];
+  uint64_t skip[MRB_HTTP2_BALANCER_BACKEND_MAX];
+  uint64_t next[MRB_HTTP2_BALANCER_BACKEND_MAX];
+  char name[NI_MAXHOST + 8];
+  uint64_t c, filled = 0;
+  unsigned int i;
+  size_t len;
+
+  for (i = 0; i < group->backendslen; i++) {
+    len = snprintf(name, sizeof(name), "%s:%d", group->backends[i].host, group->backends[i].port);
+    offset[i] = balancer_hash((uint8_t *)name, len, 0) % MRB_HTTP2_BALANCER_MAGLEV_SIZE;
+    skip[i] = balancer_hash((uint8_t *)name, len, 1) % (MRB_HTTP2_BALANCER_MAGLEV_SIZE - 1) + 1;
+    next[i] = 0;
+  }
+
+  group->lookup = (uint16_t *)mrb_malloc(mrb, sizeof(uint16_t) * MRB_HTTP2_BALANCER_MAGLEV_SIZE);
+  memset(group->lookup, 0xff, sizeof(uint16_t) * MRB_HTTP2_BALANCER_MAGLEV_SIZE);
+
+  while (filled < MRB_HTTP2_BALANCER_MAGLEV_SIZE) {
+    for (i = 0; i < group->backendslen && filled < MRB_HTTP2_BALANCER_MAGLEV_SIZE; i++) {
+      do {
+        c = (offset[i] + next[i] * skip[i]) % MRB_HTTP2_BALANCER_MAGLEV_SIZE;
+        next[i]++;
+      } while (group->lookup[c] != 0xffff);
+      group->lookup[c] = (uint16_t)i;
+      filled++;
+    }
+  }
+}
+
+static void balancer_group_init(mrb_state *mrb, mrb_http2_balancer_group *group, mrb_value name, mrb_value conf)
+{
+  mrb_value servers;
+  mrb_int i;
+
+  if (!mrb_hash_p(conf)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream %S must be Hash", name);
+  }
+  servers = mrb_http2_balancer_get_obj(mrb, conf, "servers");
+  if (!mrb_array_p(servers) || RARRAY_LEN(servers) == 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream %S needs :servers", name);
+  }
+  if (RARRAY_LEN(servers) > MRB_HTTP2_BALANCER_BACKEND_MAX) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream %S has too many servers", name);
+  }
+
+  group->name = strdup(mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, name)));
+  group->policy = balancer_get_policy(mrb, mrb_http2_balancer_get_obj(mrb, conf, "balance"));
+  group->max_fails =
+      balancer_get_uint(mrb, mrb_http2_balancer_get_obj(mrb, conf, "max_fails"), MRB_HTTP2_BALANCER_MAX_FAILS);
+  group->fail_timeout =
+      balancer_get_uint(mrb, mrb_http2_balancer_get_obj(mrb, conf, "fail_timeout"), MRB_HTTP2_BALANCER_FAIL_TIMEOUT);
+  group->slow_start =
+      balancer_get_uint(mrb, mrb_http2_balancer_get_obj(mrb, conf, "slow_start"), MRB_HTTP2_BALANCER_SLOW_START);
+  group->next = 0;
+  group->lookup = NULL;
+  pthread_mutex_init(&group->lock, NULL);
+  balancer_set_key(mrb, group, mrb_http2_balancer_get_obj(mrb, conf, "hash_key"));
+  balancer_set_hedge(mrb, group, mrb_http2_balancer_get_obj(mrb, conf, "hedge_delay"));
+
+  group->backendslen = RARRAY_LEN(servers);
+  group->backends =
+      (mrb_http2_balancer_backend *)mrb_malloc(mrb, sizeof(mrb_http2_balancer_backend) * group->backendslen);
+  memset(group->backends, 0, sizeof(mrb_http2_balancer_backend) * group->backendslen);
+  for (i = 0; i < group->backendslen; i++) {
+    mrb_value server = mrb_ary_ref(mrb, servers, i);
+    if (!mrb_string_p(server)) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid upstream server: %S", server);
+    }
+    balancer_parse_server(mrb, &group->backends[i], mrb_str_to_cstr(mrb, server));
+  }
+
+  if (group->policy == MRB_HTTP2_BALANCER_MAGLEV) {
+    balancer_maglev_populate(mrb, group);
+  }
+}
+
+mrb_http2_balancer *mrb_http2_balancer_new(mrb_state *mrb, mrb_value upstreams)
+{
+  mrb_http2_balancer *balancer;
+  mrb_value keys;
+  mrb_int i;
+
+  if (!mrb_hash_p(upstreams)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "upstreams must be Hash");
+  }
+  keys = mrb_hash_keys(mrb, upstreams);
+
+  balancer = (mrb_http2_balancer *)mrb_malloc(mrb, sizeof(mrb_http2_balancer));
+  memset(balancer, 0, sizeof(mrb_http2_balancer));
+  balancer->groupslen = RARRAY_LEN(keys);
+  balancer->groups = (mrb_http2_balancer_group *)mrb_malloc(mrb, sizeof(mrb_http2_balancer_group) * balancer->groupslen);
+  memset(balancer->groups, 0, sizeof(mrb_http2_balancer_group) * balancer->groupslen);
+
+  for (i = 0; i < balancer->groupslen; i++) {
+    mrb_value name = mrb_ary_ref(mrb, keys, i);
+    balancer_group_init(mrb, &balancer->groups[i], name, mrb_hash_get(mrb, upstreams, name));
+  }
+
+  return balancer;
+}
+
+void mrb_http2_balancer_free(mrb_state *mrb, mrb_http2_balancer *balancer)
+{
+  mrb_http2_balancer_group *group;
+  unsigned int i, j;
+
+  if (balancer == NULL) {
+    return;
+  }
+  for (i = 0; i < balancer->groupslen; i++) {
+    group = &balancer->groups[i];
+    for (j = 0; j < group->backendslen; j++) {
+      free(group->backends[j].host);
+    }
+    mrb_free(mrb, group->backends);
+    mrb_free(mrb, group->lookup);
+    free(group->key_name);
+    free(group->name);
+    pthread_mutex_destroy(&group->lock);
+  }
+  mrb_free(mrb, balancer->groups);
+  mrb_free(mrb, balancer);
+}
+
+mrb_http2_balancer_group *mrb_http2_balancer_find(mrb_http2_balancer *balancer, const char *name)
+{
+  unsigned int i;
+
+  if (balancer == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < balancer->groupslen; i++) {
+    if (strcmp(balancer->groups[i].name, name) == 0) {
+      return &balancer->groups[i];
+    }
+  }
+  return NULL;
+}
+
+// 0 when ejected, otherwise (0, 1] ramping up during slow start
+static double balancer_admission(mrb_http2_balancer_group *group, mrb_http2_balancer_backend *backend, double now)
+{
+  double ratio;
+
+  if (backend->ejected_until > now) {
+    return 0;
+  }
+  if (backend->ejected_until > 0) {
+    // ejection expired, start admitting it again
+    backend->ejected_until = 0;
+    backend->admitted_at = now;
+  }
+  if (backend->admitted_at == 0) {
+    return 1;
+  }
+  if (group->slow_start == 0 || now - backend->admitted_at >= group->slow_start) {
+    backend->admitted_at = 0;
+    backend->ejections = 0;
+    return 1;
+  }
+  ratio = (now - backend->admitted_at) / group->slow_start;
+  return ratio < 0.1 ? 0.1 : ratio;
+}
+
+static double balancer_ewma(mrb_http2_balancer_backend *backend, double now)
+{
+  double elapsed = now - backend->ewma_time;
+
+  if (elapsed <= 0) {
+    return backend->ewma;
+  }
+  return backend->ewma * exp(-elapsed / MRB_HTTP2_BALANCER_EWMA_DECAY);
+}
+
+// mean latency of the sampled backends, which a backend never sampled is
+// assumed to have so that it gets picked and sampled
+static double balancer_ewma_seed(mrb_http2_balancer_group *group, const double *admission, double now)
+{
+  double sum = 0;
+  unsigned int i, n = 0;
+
+  for (i = 0; i < group->backendslen; i++) {
+    if (admission[i] > 0 && group->backends[i].ewma > 0) {
+      sum += balancer_ewma(&group->backends[i], now);
+      n++;
+    }
+  }
+  return n > 0 ? sum / n : MRB_HTTP2_BALANCER_EWMA_DEFAULT;
+}
+
+static double balancer_cost(mrb_http2_balancer_group *group, mrb_http2_balancer_backend *backend, double admission,
+                            double seed, double now)
+{
+  double cost;
+
+  if (group->policy == MRB_HTTP2_BALANCER_PEAK_EWMA) {
+    cost = (backend->ewma > 0 ? balancer_ewma(backend, now) : seed) * (backend->outstanding + 1);
+  } else {
+    cost = backend->outstanding + 1;
+  }
+  return cost / admission;
+}
+
+// exclude is never picked, and NULL is returned instead of an ejected backend
+// when it is set
+static mrb_http2_balancer_backend *balancer_select(mrb_http2_balancer_group *group, const uint8_t *key,
+                                                   size_t keylen, mrb_http2_balancer_backend *exclude)
+{
+  mrb_http2_balancer_backend *backend = NULL;
+  unsigned int avail[MRB_HTTP2_BALANCER_BACKEND_MAX];
+  double admission[MRB_HTTP2_BALANCER_BACKEND_MAX];
+  unsigned int availlen = 0;
+  unsigned int i, a, b;
+  double seed, now = mrb_http2_balancer_now();
+
+  for (i = 0; i < group->backendslen; i++) {
+    admission[i] = &group->backends[i] == exclude ? 0 : balancer_admission(group, &group->backends[i], now);
+    if (admission[i] > 0) {
+      avail[availlen++] = i;
+    }
+  }
+  if (exclude != NULL && availlen == 0) {
+    return NULL;
+  }
+
+  if (group->policy == MRB_HTTP2_BALANCER_MAGLEV && key != NULL && availlen > 0) {
+    // keys of an ejected backend are spread over the rest by rehashing,
+    // keys of healthy backends don't move
+    for (i = 0; i < group->backendslen; i++) {
+      b = group->lookup[balancer_hash(key, keylen, i) % MRB_HTTP2_BALANCER_MAGLEV_SIZE];
+      if (admission[b] > 0) {
+        backend = &group->backends[b];
+        break;
+      }
+    }
+  }
+
+  if (backend != NULL) {
+    // found by maglev
+  } else if (availlen == 0) {
+    // every backend is ejected, try the one coming back first
+    backend = &group->backends[0];
+    for (i = 1; i < group->backendslen; i++) {
+      if (group->backends[i].ejected_until < backend->ejected_until) {
+        backend = &group->backends[i];
+      }
+    }
+  } else if (group->policy == MRB_HTTP2_BALANCER_ROUND_ROBIN) {
+    for (i = 0; i < group->backendslen; i++) {
+      b = (group->next + i) % group->backendslen;
+      // backends in slow start are skipped by chance
+      if (admission[b] > 0 && (admission[b] >= 1 || rand() < admission[b] * RAND_MAX)) {
+        backend = &group->backends[b];
+        break;
+      }
+    }
+    if (backend == NULL) {
+      b = avail[0];
+      backend = &group->backends[b];
+    }
+    group->next = (b + 1) % group->backendslen;
+  } else if (availlen == 1) {
+    backend = &group->backends[avail[0]];
+  } else {
+    // power of two choices
+    a = avail[rand() % availlen];
+    b = avail[rand() % (availlen - 1)];
+    if (b == a) {
+      b = avail[availlen - 1];
+    }
+    seed = group->policy == MRB_HTTP2_BALANCER_PEAK_EWMA ? balancer_ewma_seed(group, admission, now) : 0;
+    if (balancer_cost(group, &group->backends[a], admission[a], seed, now) <=
+        balancer_cost(group, &group->backends[b], admission[b], seed, now)) {
+      backend = &group->backends[a];
+    } else {
+      backend = &group->backends[b];
+    }
+  }
+
+  backend->outstanding++;
+  return backend;
+}
+
+mrb_http2_balancer_backend *mrb_http2_balancer_select(mrb_http2_balancer_group *group, const uint8_t *key,
+                                                      size_t keylen)
+{
+  mrb_http2_balancer_backend *backend;
+
+  pthread_mutex_lock(&group->lock);
+  // every request earns a part of a hedged request
+  if (group->hedge_delay > 0 || group->hedge_quantile > 0) {
+    group->hedge_tokens += MRB_HTTP2_BALANCER_HEDGE_RATIO;
+    if (group->hedge_tokens > MRB_HTTP2_BALANCER_HEDGE_BURST) {
+      group->hedge_tokens = MRB_HTTP2_BALANCER_HEDGE_BURST;
+    }
+  }
+  backend = balancer_select(group, key, keylen, NULL);
+  pthread_mutex_unlock(&group->lock);
+
+  return backend;
+}
+
+mrb_http2_balancer_backend *mrb_http2_balancer_select_hedge(mrb_http2_balancer_group *group, const uint8_t *key,
+                                                            size_t keylen, mrb_http2_balancer_backend *exclude)
+{
+  mrb_http2_balancer_backend *backend = NULL;
+
+  pthread_mutex_lock(&group->lock);
+  if (group->hedge_tokens >= 1) {
+    backend = balancer_select(group, key, keylen, exclude);
+    if (backend != NULL) {
+      group->hedge_tokens -= 1;
+    }
+  }
+  pthread_mutex_unlock(&group->lock);
+
+  return backend;
+}
+
+static void balancer_record_latency(mrb_http2_balancer_group *group, double latency)
+{
+  double ms = latency * 1000;
+  unsigned int b, i;
+
+  b = ms < 1 ? 0 : (unsigned int)(log2(ms) * 4) + 1;
+  if (b >= MRB_HTTP2_BALANCER_LATENCY_BUCKETS) {
+    b = MRB_HTTP2_BALANCER_LATENCY_BUCKETS - 1;
+  }
+  group->latency_hist[b]++;
+  group->latency_count++;
+
+  if (group->latency_count >= MRB_HTTP2_BALANCER_LATENCY_WINDOW) {
+    group->latency_count = 0;
+    for (i = 0; i < MRB_HTTP2_BALANCER_LATENCY_BUCKETS; i++) {
+      group->latency_hist[i] /= 2;
+      group->latency_count += group->latency_hist[i];
+    }
+  }
+}
+
+double mrb_http2_balancer_hedge_delay(mrb_http2_balancer_group *group)
+{
+  unsigned int i, sum = 0, target;
+
+  if (group->backendslen < 2) {
+    return -1;
+  }
+  if (group->hedge_delay > 0) {
+    return group->hedge_delay;
+  }
+  pthread_mutex_lock(&group->lock);
+  if (group->hedge_quantile == 0 || group->latency_count < MRB_HTTP2_BALANCER_HEDGE_MIN_SAMPLES) {
+    pthread_mutex_unlock(&group->lock);
+    return -1;
+  }
+
+  // upper bound of the bucket the quantile falls in
+  target = (unsigned int)(group->latency_count * group->hedge_quantile);
+  for (i = 0; i < MRB_HTTP2_BALANCER_LATENCY_BUCKETS - 1; i++) {
+    sum += group->latency_hist[i];
+    if (sum > target) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&group->lock);
+
+  return pow(2, i / 4.0) / 1000;
+}
+
+static void balancer_eject(mrb_http2_balancer_group *group, mrb_http2_balancer_backend *backend, double now)
+{
+  unsigned int shift;
+
+  shift = backend->ejections < MRB_HTTP2_BALANCER_EJECTION_SHIFT_MAX ? backend->ejections
+                                                                     : MRB_HTTP2_BALANCER_EJECTION_SHIFT_MAX;
+  backend->ejections++;
+  backend->ejected_until = now + ((double)group->fail_timeout * (1 << shift));
+  backend->admitted_at = 0;
+  backend->fails = 0;
+  fprintf(stderr, "upstream %s: %s:%d is ejected for %u sec\n", group->name, backend->host, backend->port,
+          group->fail_timeout * (1 << shift));
+}
+
+void mrb_http2_balancer_release(mrb_http2_balancer_group *group, mrb_http2_balancer_backend *backend,
+                                mrb_http2_balancer_result result, double latency)
+{
+  double now = mrb_http2_balancer_now();
+  double w;
+
+  pthread_mutex_lock(&group->lock);
+  if (backend->outstanding > 0) {
+    backend->outstanding--;
+  }
+
+  switch (result) {
+  case MRB_HTTP2_BALANCER_OK:
+    backend->fails = 0;
+    if (group->hedge_quantile > 0) {
+      balancer_record_latency(group, latency);
+    }
+    if (latency > backend->ewma) {
+      // peak is taken at once and decays slowly
+      backend->ewma = latency;
+    } else {
+      w = exp(-(now - backend->ewma_time) / MRB_HTTP2_BALANCER_EWMA_DECAY);
+      backend->ewma = backend->ewma * w + latency * (1 - w);
+    }
+    backend->ewma_time = now;
+    break;
+  case MRB_HTTP2_BALANCER_FAILED:
+    backend->fails++;
+    // a failure during slow start ejects at once
+    if (group->max_fails > 0 && (backend->fails >= group->max_fails || backend->admitted_at > 0)) {
+      balancer_eject(group, backend, now);
+    }
+    break;
+  case MRB_HTTP2_BALANCER_CANCELLED:
+    break;
+  }
+  pthread_mutex_unlock(&group->lock);
+}
@@ -0,0 +1,149 @@
+/*
+// mrb_http2_balancer.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_BALANCER_H
+#define MRB_HTTP2_BALANCER_H
+
+#include "mrb_http2.h"
+
+#define MRB_HTTP2_BALANCER_BACKEND_MAX 256
+
+// defaults of passive health check
+#define MRB_HTTP2_BALANCER_MAX_FAILS 3
+#define MRB_HTTP2_BALANCER_FAIL_TIMEOUT 10
+#define MRB_HTTP2_BALANCER_SLOW_START 30
+
+// decay time of peak EWMA latency in seconds
+#define MRB_HTTP2_BALANCER_EWMA_DECAY 10.0
+
+// latency assumed for backends when none of them is sampled yet
+#define MRB_HTTP2_BALANCER_EWMA_DEFAULT 0.1
+
+// prime size of Maglev lookup table, much larger than the backends
+#define MRB_HTTP2_BALANCER_MAGLEV_SIZE 65537
+
+// log-scale histogram of response header latency for the hedge delay, 4
+// buckets per doubling from 1ms. counts are halved past the window so that
+// the quantile follows recent latency
+#define MRB_HTTP2_BALANCER_LATENCY_BUCKETS 64
+#define MRB_HTTP2_BALANCER_LATENCY_WINDOW 1024
+#define MRB_HTTP2_BALANCER_HEDGE_MIN_SAMPLES 64
+
+// hedged requests are at most this ratio of requests, with bursts up to
+// HEDGE_BURST
+#define MRB_HTTP2_BALANCER_HEDGE_RATIO 0.1
+#define MRB_HTTP2_BALANCER_HEDGE_BURST 10.0
+
+typedef enum {
+  MRB_HTTP2_BALANCER_ROUND_ROBIN,
+  MRB_HTTP2_BALANCER_LEAST_OUTSTANDING,
+  MRB_HTTP2_BALANCER_PEAK_EWMA,
+  MRB_HTTP2_BALANCER_MAGLEV
+} mrb_http2_balancer_policy;
+
+// request attribute hashed by maglev
+typedef enum {
+  MRB_HTTP2_BALANCER_KEY_URI,
+  MRB_HTTP2_BALANCER_KEY_HEADER,
+  MRB_HTTP2_BALANCER_KEY_COOKIE
+} mrb_http2_balancer_key_type;
+
+typedef enum {
+  // response headers arrived
+  MRB_HTTP2_BALANCER_OK,
+
+  // connect error, timeout or 502/503/504 from the backend
+  MRB_HTTP2_BALANCER_FAILED,
+
+  // the client went away before the response, no feedback
+  MRB_HTTP2_BALANCER_CANCELLED
+} mrb_http2_balancer_result;
+
+typedef struct {
+  // 127.0.0.1
+  char *host;
+
+  // 8080
+  int port;
+
+  // requests sent and not answered yet
+  unsigned int outstanding;
+
+  // peak EWMA of response header latency in seconds
+  double ewma;
+  double ewma_time;
+
+  // consecutive failures, ejected until ejected_until and then admitted
+  // slowly from admitted_at
+  unsigned int fails;
+  unsigned int ejections;
+  double ejected_until;
+  double admitted_at;
+} mrb_http2_balancer_backend;
+
+typedef struct {
+  char *name;
+  mrb_http2_balancer_policy policy;
+
+  mrb_http2_balancer_backend *backends;
+  unsigned int backendslen;
+
+  // next backend of round robin
+  unsigned int next;
+
+  unsigned int max_fails;
+  unsigned int fail_timeout;
+  unsigned int slow_start;
+
+  // maglev key like "uri", "header:x-user-id" or "cookie:session" and
+  // lookup table of backend index
+  mrb_http2_balancer_key_type key_type;
+  char *key_name;
+  size_t key_namelen;
+  uint16_t *lookup;
+
+  // :hedge_delay => 50 sends a hedged request after 50ms, "p95" after the
+  // observed 95th percentile latency
+  double hedge_delay;
+  double hedge_quantile;
+  double hedge_tokens;
+  unsigned int latency_hist[MRB_HTTP2_BALANCER_LATENCY_BUCKETS];
+  unsigned int latency_count;
+
+  // worker threads share the health of backends
+  pthread_mutex_t lock;
+} mrb_http2_balancer_group;
+
+typedef struct {
+  mrb_http2_balancer_group *groups;
+  unsigned int groupslen;
+} mrb_http2_balancer;
+
+// :upstreams => {"name" => {:servers => ["host:port", ...], :balance => "peak_ewma"}}
+mrb_http2_balancer *mrb_http2_balancer_new(mrb_state *mrb, mrb_value upstreams);
+void mrb_http2_balancer_free(mrb_state *mrb, mrb_http2_balancer *balancer);
+mrb_http2_balancer_group *mrb_http2_balancer_find(mrb_http2_balancer *balancer, const char *name);
+
+double mrb_http2_balancer_now(void);
+
+// pick a backend and count the request as outstanding, every selected
+// backend must be released once. key is hashed by maglev, NULL falls back
+// to least outstanding
+mrb_http2_balancer_backend *mrb_http2_balancer_select(mrb_http2_balancer_group *group, const uint8_t *key,
+                                                      size_t keylen);
+void mrb_http2_balancer_release(mrb_http2_balancer_group *group, mrb_http2_balancer_backend *backend,
+                                mrb_http2_balancer_result result, double latency);
+
+// seconds to wait before hedging a request, or -1 when the group doesn't
+// hedge or hasn't seen enough responses yet
+double mrb_http2_balancer_hedge_delay(mrb_http2_balancer_group *group);
+
+// pick an available backend other than exclude for a hedged request within
+// the hedge budget, NULL when there is none. released like select
+mrb_http2_balancer_backend *mrb_http2_balancer_select_hedge(mrb_http2_balancer_group *group, const uint8_t *key,
+                                                            size_t keylen, mrb_http2_balancer_backend *exclude);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+// mrb_http2_blocking.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_blocking.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+struct mrb_http2_blocking {
+  mrb_state *mrb;
+  pthread_t tids[MRB_HTTP2_BLOCKING_THREADS_MAX];
+  unsigned int threadslen;
+
+  mrb_http2_blocking_init_cb init;
+  mrb_http2_blocking_fini_cb fini;
+  void *arg;
+
+  // jobs waiting for a thread
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  mrb_http2_blocking_job *head, *tail;
+  unsigned int queued;
+  unsigned int stopping : 1;
+
+  // finished jobs pushed by the threads without a lock, and taken all at
+  // once by the event loop when the eventfd wakes it up
+  mrb_http2_blocking_job *finished;
+  int efd;
+  struct event *ev;
+};
+
+static void blocking_finish(mrb_http2_blocking *pool, mrb_http2_blocking_job *job)
+{
+  uint64_t one = 1;
+
+  job->next = __atomic_load_n(&pool->finished, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&pool->finished, &job->next, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  // the counter adds up while the loop is busy, so one read wakes it for all
+  while (write(pool->efd, &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+}
+
+static void *blocking_thread_main(void *arg)
+{
+  mrb_http2_blocking *pool = (mrb_http2_blocking *)arg;
+  mrb_http2_blocking_job *job;
+  void *thread_data = NULL;
+  mrb_state *mrb;
+
+  mrb = mrb_open();
+  if (mrb == NULL) {
+    fprintf(stderr, "blocking: mrb_open failed, jobs of this thread fail\n");
+  } else if (pool->init != NULL) {
+    thread_data = pool->init(mrb, pool->arg);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->head == NULL && !pool->stopping) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    job = pool->head;
+    pool->head = job->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    job->result = mrb != NULL ? job->run(mrb, thread_data, job) : -1;
+    blocking_finish(pool, job);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (mrb != NULL) {
+    if (pool->fini != NULL) {
+      pool->fini(mrb, thread_data);
+    }
+    mrb_close(mrb);
+  }
+  return NULL;
+}
+
+// done callbacks in the order the jobs finished
+static void blocking_dispatch(mrb_http2_blocking *pool)
+{
+  mrb_http2_blocking_job *job, *next, *jobs = NULL;
+
+  job = __atomic_exchange_n(&pool->finished, NULL, __ATOMIC_ACQUIRE);
+  while (job != NULL) {
+    next = job->next;
+    job->next = jobs;
+    jobs = job;
+    job = next;
+  }
+  while (jobs != NULL) {
+    next = jobs->next;
+    jobs->done(jobs, jobs->result);
+    jobs = next;
+  }
+}
+
+static void blocking_eventfd_cb(evutil_socket_t fd, short events, void *arg)
+{
+  uint64_t n;
+
+  TRACER;
+  while (read(fd, &n, sizeof(n)) == -1 && errno == EINTR)
+    ;
+  blocking_dispatch((mrb_http2_blocking *)arg);
+}
+
+mrb_http2_blocking *mrb_http2_blocking_new(mrb_state *mrb, struct event_base *evbase, unsigned int threads,
+                                           mrb_http2_blocking_init_cb init, mrb_http2_blocking_fini_cb fini,
+                                           void *arg)
+{
+  mrb_http2_blocking *pool;
+  unsigned int i;
+  int efd, rv;
+
+  efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd == -1) {
+    fprintf(stderr, "blocking: eventfd failed: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  pool = (mrb_http2_blocking *)mrb_malloc(mrb, sizeof(mrb_http2_blocking));
+  memset(pool, 0, sizeof(mrb_http2_blocking));
+  pool->mrb = mrb;
+  pool->init = init;
+  pool->fini = fini;
+  pool->arg = arg;
+  pool->efd = efd;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->ev = event_new(evbase, efd, EV_READ | EV_PERSIST, blocking_eventfd_cb, pool);
+  event_add(pool->ev, NULL);
+
+  if (threads == 0) {
+    threads = MRB_HTTP2_BLOCKING_THREADS;
+  } else if (threads > MRB_HTTP2_BLOCKING_THREADS_MAX) {
+    threads = MRB_HTTP2_BLOCKING_THREADS_MAX;
+  }
+  for (i = 0; i < threads; i++) {
+    if ((rv = pthread_create(&pool->tids[i], NULL, blocking_thread_main, pool)) != 0) {
+      fprintf(stderr, "blocking: pthread_create failed: %s\n", strerror(rv));
+      break;
+    }
+    pool->threadslen++;
+  }
+  if (pool->threadslen == 0) {
+    mrb_http2_blocking_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void mrb_http2_blocking_free(mrb_http2_blocking *pool)
+{
+  mrb_http2_blocking_job *job, *next;
+  unsigned int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->threadslen; i++) {
+    pthread_join(pool->tids[i], NULL);
+  }
+
+  // jobs run by now get their result, the ones never taken fail
+  blocking_dispatch(pool);
+  for (job = pool->head; job;) {
+    next = job->next;
+    job->done(job, -1);
+    job = next;
+  }
+
+  event_free(pool->ev);
+  close(pool->efd);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  mrb_free(pool->mrb, pool);
+}
+
+int mrb_http2_blocking_submit(mrb_http2_blocking *pool, mrb_http2_blocking_job *job)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queued >= MRB_HTTP2_BLOCKING_QUEUE_MAX) {
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+  }
+  job->next = NULL;
+  if (pool->tail != NULL) {
+    pool->tail->next = job;
+  } else {
+    pool->head = job;
+  }
+  pool->tail = job;
+  pool->queued++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
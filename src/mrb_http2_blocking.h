@@ -0,0 +1,49 @@
+/*
+// mrb_http2_blocking.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_BLOCKING_H
+#define MRB_HTTP2_BLOCKING_H
+
+#include "mrb_http2.h"
+
+#include <event2/event.h>
+
+// default threads of a pool, and the max
+#define MRB_HTTP2_BLOCKING_THREADS 4
+#define MRB_HTTP2_BLOCKING_THREADS_MAX 64
+
+// jobs waiting for a thread, submit fails over this
+#define MRB_HTTP2_BLOCKING_QUEUE_MAX 1024
+
+typedef struct mrb_http2_blocking mrb_http2_blocking;
+typedef struct mrb_http2_blocking_job mrb_http2_blocking_job;
+
+// run is called on a pool thread with its mrb_state, and done on the event
+// loop thread with the result of run, or -1 when the job wasn't run
+struct mrb_http2_blocking_job {
+  mrb_http2_blocking_job *next;
+  int (*run)(mrb_state *mrb, void *thread_data, mrb_http2_blocking_job *job);
+  void (*done)(mrb_http2_blocking_job *job, int result);
+  int result;
+};
+
+// init is called on each thread after mrb_open, and its result is given to
+// run and to fini before mrb_close
+typedef void *(*mrb_http2_blocking_init_cb)(mrb_state *mrb, void *arg);
+typedef void (*mrb_http2_blocking_fini_cb)(mrb_state *mrb, void *thread_data);
+
+// NULL when no thread can be started
+mrb_http2_blocking *mrb_http2_blocking_new(mrb_state *mrb, struct event_base *evbase, unsigned int threads,
+                                           mrb_http2_blocking_init_cb init, mrb_http2_blocking_fini_cb fini,
+                                           void *arg);
+
+// threads finish their jobs and exit, done is called for the jobs left
+void mrb_http2_blocking_free(mrb_http2_blocking *pool);
+
+// returns -1 when the queue is full
+int mrb_http2_blocking_submit(mrb_http2_blocking *pool, mrb_http2_blocking_job *job);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+// mrb_http2_body.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_body.h"
+
+#include <errno.h>
+
+typedef struct mrb_http2_body_chunk mrb_http2_body_chunk;
+
+struct mrb_http2_body_chunk {
+  mrb_http2_body_chunk *next;
+  size_t len;
+  size_t capacity;
+  uint8_t data[1];
+};
+
+struct mrb_http2_body {
+  mrb_state *mrb;
+
+  // chunks in memory, or an unlinked spill file when fd is not -1
+  mrb_http2_body_chunk *head;
+  mrb_http2_body_chunk *tail;
+  int fd;
+
+  size_t len;
+  size_t buffer_size;
+  char *dir;
+
+  // read position of ruby
+  size_t pos;
+};
+
+mrb_http2_body *mrb_http2_body_new(mrb_state *mrb, size_t buffer_size, const char *dir)
+{
+  mrb_http2_body *body = (mrb_http2_body *)mrb_malloc(mrb, sizeof(mrb_http2_body));
+
+  memset(body, 0, sizeof(mrb_http2_body));
+  body->mrb = mrb;
+  body->fd = -1;
+  body->buffer_size = buffer_size > 0 ? buffer_size : MRB_HTTP2_BODY_BUFFER_SIZE;
+  body->dir = dir != NULL ? strdup(dir) : NULL;
+
+  return body;
+}
+
+static void body_chunks_free(mrb_http2_body *body)
+{
+  mrb_http2_body_chunk *chunk, *next;
+
+  for (chunk = body->head; chunk;) {
+    next = chunk->next;
+    mrb_free(body->mrb, chunk);
+    chunk = next;
+  }
+  body->head = body->tail = NULL;
+}
+
+void mrb_http2_body_free(mrb_http2_body *body)
+{
+  body_chunks_free(body);
+  if (body->fd != -1) {
+    close(body->fd);
+  }
+  free(body->dir);
+  mrb_free(body->mrb, body);
+}
+
+static int body_write_fd(int fd, const uint8_t *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// move the chunks to an unlinked temporary file
+static int body_spill(mrb_http2_body *body)
+{
+  const char *dir = body->dir != NULL ? body->dir : MRB_HTTP2_BODY_DIR;
+  size_t len = strlen(dir) + sizeof("/mrb_http2_body.XXXXXX");
+  char *path = alloca(len);
+  mrb_http2_body_chunk *chunk;
+
+  snprintf(path, len, "%s/mrb_http2_body.XXXXXX", dir);
+  body->fd = mkstemp(path);
+  if (body->fd == -1) {
+    fprintf(stderr, "body: mkstemp %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+
+  for (chunk = body->head; chunk; chunk = chunk->next) {
+    if (body_write_fd(body->fd, chunk->data, chunk->len) != 0) {
+      fprintf(stderr, "body: write %s failed: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+  body_chunks_free(body);
+  return 0;
+}
+
+int mrb_http2_body_append(mrb_http2_body *body, const uint8_t *data, size_t len)
+{
+  mrb_http2_body_chunk *chunk;
+  size_t n, capacity;
+
+  if (body->fd == -1 && body->len + len > body->buffer_size) {
+    if (body_spill(body) != 0) {
+      return -1;
+    }
+  }
+
+  if (body->fd != -1) {
+    if (body_write_fd(body->fd, data, len) != 0) {
+      fprintf(stderr, "body: write failed: %s\n", strerror(errno));
+      return -1;
+    }
+    body->len += len;
+    return 0;
+  }
+
+  while (len > 0) {
+    chunk = body->tail;
+    if (chunk == NULL || chunk->len == chunk->capacity) {
+      // double the chunk size, earlier chunks are never copied again
+      capacity = chunk != NULL ? chunk->capacity * 2 : MRB_HTTP2_BODY_CHUNK_MIN;
+      if (capacity > MRB_HTTP2_BODY_CHUNK_MAX) {
+        capacity = MRB_HTTP2_BODY_CHUNK_MAX;
+      }
+      chunk = (mrb_http2_body_chunk *)mrb_malloc(body->mrb, sizeof(mrb_http2_body_chunk) + capacity);
+      chunk->next = NULL;
+      chunk->len = 0;
+      chunk->capacity = capacity;
+      if (body->tail != NULL) {
+        body->tail->next = chunk;
+      } else {
+        body->head = chunk;
+      }
+      body->tail = chunk;
+    }
+    n = chunk->capacity - chunk->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(chunk->data + chunk->len, data, n);
+    chunk->len += n;
+    body->len += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+size_t mrb_http2_body_length(const mrb_http2_body *body)
+{
+  return body->len;
+}
+
+ssize_t mrb_http2_body_read(mrb_http2_body *body, size_t offset, uint8_t *buf, size_t len)
+{
+  mrb_http2_body_chunk *chunk;
+  ssize_t nread;
+  size_t n, copied = 0;
+
+  if (offset >= body->len) {
+    return 0;
+  }
+  if (len > body->len - offset) {
+    len = body->len - offset;
+  }
+  if (body->fd != -1) {
+    while ((nread = pread(body->fd, buf, len, offset)) == -1 && errno == EINTR)
+      ;
+    return nread;
+  }
+
+  for (chunk = body->head; chunk && copied < len; chunk = chunk->next) {
+    if (offset >= chunk->len) {
+      offset -= chunk->len;
+      continue;
+    }
+    n = chunk->len - offset;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+    memcpy(buf + copied, chunk->data + offset, n);
+    copied += n;
+    offset = 0;
+  }
+  return copied;
+}
+
+int mrb_http2_body_add_evbuffer(mrb_http2_body *body, struct evbuffer *buf)
+{
+  mrb_http2_body_chunk *chunk;
+  int fd;
+
+  if (body->fd != -1) {
+    // evbuffer closes the fd when the data is drained
+    fd = dup(body->fd);
+    if (fd == -1) {
+      return -1;
+    }
+    if (evbuffer_add_file(buf, fd, 0, body->len) != 0) {
+      close(fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  for (chunk = body->head; chunk; chunk = chunk->next) {
+    if (evbuffer_add(buf, chunk->data, chunk->len) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+size_t mrb_http2_body_pos(const mrb_http2_body *body)
+{
+  return body->pos;
+}
+
+void mrb_http2_body_seek(mrb_http2_body *body, size_t pos)
+{
+  body->pos = pos > body->len ? body->len : pos;
+}
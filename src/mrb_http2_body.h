@@ -0,0 +1,41 @@
+/*
+// mrb_http2_body.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_BODY_H
+#define MRB_HTTP2_BODY_H
+
+#include "mrb_http2.h"
+
+#include <event2/buffer.h>
+
+// default bytes of request body kept in memory before spilling to a file
+#define MRB_HTTP2_BODY_BUFFER_SIZE (1 << 18)
+
+// default directory of spill files
+#define MRB_HTTP2_BODY_DIR "/tmp"
+
+// first chunk size, chunks double up to the max
+#define MRB_HTTP2_BODY_CHUNK_MIN 4096
+#define MRB_HTTP2_BODY_CHUNK_MAX (1 << 20)
+
+typedef struct mrb_http2_body mrb_http2_body;
+
+mrb_http2_body *mrb_http2_body_new(mrb_state *mrb, size_t buffer_size, const char *dir);
+void mrb_http2_body_free(mrb_http2_body *body);
+
+// returns -1 when the spill file can't be written
+int mrb_http2_body_append(mrb_http2_body *body, const uint8_t *data, size_t len);
+size_t mrb_http2_body_length(const mrb_http2_body *body);
+ssize_t mrb_http2_body_read(mrb_http2_body *body, size_t offset, uint8_t *buf, size_t len);
+
+// the spill file is added without copying
+int mrb_http2_body_add_evbuffer(mrb_http2_body *body, struct evbuffer *buf);
+
+// current position of sequential reads from ruby
+size_t mrb_http2_body_pos(const mrb_http2_body *body);
+void mrb_http2_body_seek(mrb_http2_body *body, size_t pos);
+
+#endif
@@ -0,0 +1,776 @@
+/*
+// mrb_http2_cache.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_cache.h"
+
+#include <errno.h>
+#include <strings.h>
+
+struct mrb_http2_cache {
+  mrb_state *mrb;
+
+  // hash table of entries, a key has one entry per Vary variant
+  mrb_http2_cache_entry **buckets;
+  size_t bucketslen;
+  size_t entrieslen;
+
+  // most recently used at head
+  mrb_http2_cache_entry *head;
+  mrb_http2_cache_entry *tail;
+
+  // memory budget and bytes of spill files
+  size_t size;
+  size_t used;
+  size_t max_object;
+  char *dir;
+  size_t disk_size;
+  size_t disk_used;
+};
+
+struct mrb_http2_cache_writer {
+  mrb_http2_cache *cache;
+  mrb_http2_cache_entry *entry;
+  size_t capacity;
+};
+
+typedef struct {
+  unsigned int no_store : 1;
+  unsigned int no_cache : 1;
+  unsigned int private_ : 1;
+  unsigned int public_ : 1;
+  unsigned int must_revalidate : 1;
+  int64_t max_age;
+  int64_t s_maxage;
+  int64_t stale_while_revalidate;
+  int64_t stale_if_error;
+} cache_control;
+
+#define cache_nv_is(nv, lit) ((nv)->namelen == sizeof(lit) - 1 && memcmp(lit, (nv)->name, (nv)->namelen) == 0)
+
+static uint64_t cache_hash(const char *p, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t)p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+mrb_http2_cache *mrb_http2_cache_new(mrb_state *mrb, size_t size, size_t max_object, const char *dir,
+                                     size_t disk_size)
+{
+  mrb_http2_cache *cache = (mrb_http2_cache *)mrb_malloc(mrb, sizeof(mrb_http2_cache));
+  memset(cache, 0, sizeof(mrb_http2_cache));
+
+  cache->mrb = mrb;
+  cache->bucketslen = MRB_HTTP2_CACHE_BUCKETS;
+  cache->buckets = (mrb_http2_cache_entry **)mrb_malloc(mrb, sizeof(mrb_http2_cache_entry *) * cache->bucketslen);
+  memset(cache->buckets, 0, sizeof(mrb_http2_cache_entry *) * cache->bucketslen);
+  cache->size = size;
+  cache->max_object = max_object > 0 ? max_object : MRB_HTTP2_CACHE_MAX_OBJECT;
+  if (cache->max_object > size) {
+    cache->max_object = size;
+  }
+  cache->dir = dir != NULL ? strdup(dir) : NULL;
+  cache->disk_size = disk_size > 0 ? disk_size : MRB_HTTP2_CACHE_DISK_SIZE;
+
+  return cache;
+}
+
+static void cache_entry_free(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  mrb_state *mrb = cache->mrb;
+
+  TRACER;
+  if (entry->fd != -1) {
+    close(entry->fd);
+  }
+  mrb_http2_free_nva(mrb, entry->headers, entry->headerslen);
+  free(entry->body);
+  free(entry->key);
+  free(entry->vary);
+  free(entry->varyvalues);
+  free(entry->unparsed_host);
+  mrb_free(mrb, entry);
+}
+
+// freed now or when the last stream sending it ends
+static void cache_entry_release(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  entry->removed = 1;
+  if (entry->refcnt == 0) {
+    cache_entry_free(cache, entry);
+  }
+}
+
+// unlink from the hash table and LRU list
+static void cache_remove(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  mrb_http2_cache_entry **p;
+
+  for (p = &cache->buckets[entry->hash & (cache->bucketslen - 1)]; *p; p = &(*p)->hnext) {
+    if (*p == entry) {
+      *p = entry->hnext;
+      break;
+    }
+  }
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->hnext = entry->prev = entry->next = NULL;
+
+  cache->entrieslen--;
+  cache->used -= entry->size;
+  if (entry->fd != -1) {
+    cache->disk_used -= entry->bodylen;
+  }
+  cache_entry_release(cache, entry);
+}
+
+void mrb_http2_cache_free(mrb_http2_cache *cache)
+{
+  while (cache->head != NULL) {
+    cache_remove(cache, cache->head);
+  }
+  free(cache->dir);
+  mrb_free(cache->mrb, cache->buckets);
+  mrb_free(cache->mrb, cache);
+}
+
+static void cache_lru_touch(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  if (cache->head == entry) {
+    return;
+  }
+  entry->prev->next = entry->next;
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = cache->head;
+  cache->head->prev = entry;
+  cache->head = entry;
+}
+
+static void cache_grow(mrb_http2_cache *cache)
+{
+  mrb_http2_cache_entry **buckets;
+  mrb_http2_cache_entry *entry, *next;
+  size_t len = cache->bucketslen * 2;
+  size_t i;
+
+  buckets = (mrb_http2_cache_entry **)mrb_malloc(cache->mrb, sizeof(mrb_http2_cache_entry *) * len);
+  memset(buckets, 0, sizeof(mrb_http2_cache_entry *) * len);
+  for (i = 0; i < cache->bucketslen; i++) {
+    for (entry = cache->buckets[i]; entry; entry = next) {
+      next = entry->hnext;
+      entry->hnext = buckets[entry->hash & (len - 1)];
+      buckets[entry->hash & (len - 1)] = entry;
+    }
+  }
+  mrb_free(cache->mrb, cache->buckets);
+  cache->buckets = buckets;
+  cache->bucketslen = len;
+}
+
+static void cache_evict(mrb_http2_cache *cache, size_t size, size_t disk)
+{
+  while (cache->tail != NULL && (cache->used + size > cache->size || cache->disk_used + disk > cache->disk_size)) {
+    cache_remove(cache, cache->tail);
+  }
+}
+
+// delta-seconds, larger values are taken as 2^31 (RFC 9111 1.2.2)
+static int64_t cache_parse_int(const uint8_t *p, size_t len)
+{
+  int64_t n = 0;
+  size_t i;
+
+  if (len == 0 || !isdigit(p[0])) {
+    return -1;
+  }
+  for (i = 0; i < len && isdigit(p[i]); i++) {
+    n = n * 10 + (p[i] - '0');
+    if (n > MRB_HTTP2_CACHE_DELTA_SECONDS_MAX) {
+      return MRB_HTTP2_CACHE_DELTA_SECONDS_MAX;
+    }
+  }
+  return n;
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"
+static time_t cache_parse_http_date(const uint8_t *value, size_t len)
+{
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  char buf[64];
+  char mon[4];
+  struct tm tm;
+  int i;
+
+  if (len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, value, len);
+  buf[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(buf, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) !=
+      6) {
+    return -1;
+  }
+  for (i = 0; i < 12; i++) {
+    if (strcmp(months[i], mon) == 0) {
+      break;
+    }
+  }
+  if (i == 12) {
+    return -1;
+  }
+  tm.tm_mon = i;
+  tm.tm_year -= 1900;
+  return timegm(&tm);
+}
+
+static void cache_parse_cache_control(const uint8_t *p, size_t len, cache_control *cc)
+{
+  const uint8_t *end = p + len;
+  const uint8_t *name, *value;
+  size_t namelen, valuelen;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ',' || *p == '\t')) {
+      p++;
+    }
+    name = p;
+    while (p < end && *p != '=' && *p != ',' && *p != ' ') {
+      p++;
+    }
+    namelen = p - name;
+    value = NULL;
+    valuelen = 0;
+    if (p < end && *p == '=') {
+      p++;
+      if (p < end && *p == '"') {
+        p++;
+      }
+      value = p;
+      while (p < end && *p != ',' && *p != '"') {
+        p++;
+      }
+      valuelen = p - value;
+    }
+    while (p < end && *p != ',') {
+      p++;
+    }
+
+#define CC_IS(lit) (namelen == sizeof(lit) - 1 && strncasecmp(lit, (const char *)name, namelen) == 0)
+    if (CC_IS("no-store")) {
+      cc->no_store = 1;
+    } else if (CC_IS("no-cache")) {
+      cc->no_cache = 1;
+    } else if (CC_IS("private")) {
+      cc->private_ = 1;
+    } else if (CC_IS("public")) {
+      cc->public_ = 1;
+    } else if (CC_IS("must-revalidate") || CC_IS("proxy-revalidate")) {
+      cc->must_revalidate = 1;
+    } else if (CC_IS("max-age") && value != NULL) {
+      cc->max_age = cache_parse_int(value, valuelen);
+    } else if (CC_IS("s-maxage") && value != NULL) {
+      cc->s_maxage = cache_parse_int(value, valuelen);
+    } else if (CC_IS("stale-while-revalidate") && value != NULL) {
+      cc->stale_while_revalidate = cache_parse_int(value, valuelen);
+    } else if (CC_IS("stale-if-error") && value != NULL) {
+      cc->stale_if_error = cache_parse_int(value, valuelen);
+    }
+#undef CC_IS
+  }
+}
+
+int mrb_http2_cache_request_cacheable(const char *method, const nghttp2_nv *nva, size_t nvlen, int *lookup)
+{
+  cache_control cc;
+  size_t i;
+
+  *lookup = 1;
+  if (method == NULL || strcmp(method, "GET") != 0) {
+    return -1;
+  }
+  memset(&cc, 0, sizeof(cc));
+  cc.max_age = cc.s_maxage = -1;
+  for (i = 0; i < nvlen; i++) {
+    if (cache_nv_is(&nva[i], "authorization")) {
+      return -1;
+    } else if (cache_nv_is(&nva[i], "cache-control")) {
+      cache_parse_cache_control(nva[i].value, nva[i].valuelen, &cc);
+    } else if (cache_nv_is(&nva[i], "pragma") && nva[i].valuelen >= sizeof("no-cache") - 1 &&
+               strncasecmp("no-cache", (const char *)nva[i].value, sizeof("no-cache") - 1) == 0) {
+      cc.no_cache = 1;
+    }
+  }
+  if (cc.no_store) {
+    return -1;
+  }
+  // the client wants a response from the origin, which is stored again
+  if (cc.no_cache || cc.max_age == 0) {
+    *lookup = 0;
+  }
+  return 0;
+}
+
+// "name: value\n" for each name of Vary, NULL when Vary has "*"
+static char *cache_vary_values(const char *vary, const nghttp2_nv *nva, size_t nvlen)
+{
+  char *buf = NULL;
+  size_t buflen = 0;
+  const char *p = vary;
+  const char *name;
+  size_t namelen, i;
+
+  buf = malloc(1);
+  buf[0] = '\0';
+  while (*p) {
+    while (*p == ' ' || *p == ',' || *p == '\t') {
+      p++;
+    }
+    name = p;
+    while (*p && *p != ',' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    namelen = p - name;
+    if (namelen == 0) {
+      continue;
+    }
+    if (namelen == 1 && name[0] == '*') {
+      free(buf);
+      return NULL;
+    }
+
+    buf = realloc(buf, buflen + namelen + 2 + 1);
+    memcpy(buf + buflen, name, namelen);
+    memcpy(buf + buflen + namelen, ": ", 2);
+    buflen += namelen + 2;
+    for (i = 0; i < nvlen; i++) {
+      if (nva[i].namelen == namelen && strncasecmp((const char *)nva[i].name, name, namelen) == 0) {
+        buf = realloc(buf, buflen + nva[i].valuelen + 2 + 1);
+        memcpy(buf + buflen, nva[i].value, nva[i].valuelen);
+        memcpy(buf + buflen + nva[i].valuelen, ", ", 2);
+        buflen += nva[i].valuelen + 2;
+      }
+    }
+    buf[buflen++] = '\n';
+    buf[buflen] = '\0';
+  }
+  return buf;
+}
+
+int mrb_http2_cache_entry_match(const mrb_http2_cache_entry *entry, const nghttp2_nv *nva, size_t nvlen)
+{
+  char *values;
+  int match;
+
+  if (entry->vary == NULL) {
+    return 1;
+  }
+  values = cache_vary_values(entry->vary, nva, nvlen);
+  match = values != NULL && strcmp(values, entry->varyvalues) == 0;
+  free(values);
+  return match;
+}
+
+mrb_http2_cache_entry *mrb_http2_cache_lookup(mrb_http2_cache *cache, const char *key, size_t keylen,
+                                              const nghttp2_nv *nva, size_t nvlen)
+{
+  mrb_http2_cache_entry *entry;
+  uint64_t hash = cache_hash(key, keylen);
+
+  for (entry = cache->buckets[hash & (cache->bucketslen - 1)]; entry; entry = entry->hnext) {
+    if (entry->hash != hash || entry->keylen != keylen || memcmp(entry->key, key, keylen) != 0) {
+      continue;
+    }
+    if (!mrb_http2_cache_entry_match(entry, nva, nvlen)) {
+      continue;
+    }
+    cache_lru_touch(cache, entry);
+    return entry;
+  }
+  return NULL;
+}
+
+int mrb_http2_cache_fresh(const mrb_http2_cache_entry *entry, time_t now)
+{
+  return now < entry->expires;
+}
+
+int mrb_http2_cache_stale_usable(const mrb_http2_cache_entry *entry, time_t now, mrb_http2_cache_stale_type type)
+{
+  if (type == MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE) {
+    return now < entry->expires + (time_t)entry->stale_while_revalidate;
+  }
+  return now < entry->expires + (time_t)entry->stale_if_error;
+}
+
+int64_t mrb_http2_cache_age(const mrb_http2_cache_entry *entry, time_t now)
+{
+  return entry->initial_age + (now - entry->stored);
+}
+
+void mrb_http2_cache_entry_ref(mrb_http2_cache_entry *entry)
+{
+  entry->refcnt++;
+}
+
+void mrb_http2_cache_entry_unref(mrb_http2_cache *cache, mrb_http2_cache_entry *entry)
+{
+  entry->refcnt--;
+  if (entry->refcnt == 0 && entry->removed) {
+    cache_entry_free(cache, entry);
+  }
+}
+
+ssize_t mrb_http2_cache_entry_read(mrb_http2_cache_entry *entry, size_t offset, uint8_t *buf, size_t len)
+{
+  ssize_t nread;
+
+  if (offset >= entry->bodylen) {
+    return 0;
+  }
+  if (len > entry->bodylen - offset) {
+    len = entry->bodylen - offset;
+  }
+  if (entry->fd == -1) {
+    memcpy(buf, entry->body + offset, len);
+    return len;
+  }
+  while ((nread = pread(entry->fd, buf, len, offset)) == -1 && errno == EINTR)
+    ;
+  return nread;
+}
+
+// freshness lifetime from Cache-Control, Expires and Date, -1 when the
+// response has no explicit freshness or must not be stored
+static int64_t cache_lifetime(const nghttp2_nv *headers, size_t headerslen, cache_control *cc, int64_t *age,
+                              time_t now)
+{
+  time_t expires = -1;
+  time_t date = -1;
+  size_t i;
+
+  *age = 0;
+  cc->max_age = cc->s_maxage = -1;
+  cc->stale_while_revalidate = cc->stale_if_error = 0;
+  for (i = 0; i < headerslen; i++) {
+    const nghttp2_nv *nv = &headers[i];
+    if (cache_nv_is(nv, "cache-control")) {
+      cache_parse_cache_control(nv->value, nv->valuelen, cc);
+    } else if (cache_nv_is(nv, "expires")) {
+      // invalid Expires like "0" means already expired
+      expires = cache_parse_http_date(nv->value, nv->valuelen);
+      if (expires == -1) {
+        expires = 0;
+      }
+    } else if (cache_nv_is(nv, "date")) {
+      date = cache_parse_http_date(nv->value, nv->valuelen);
+    } else if (cache_nv_is(nv, "age")) {
+      *age = cache_parse_int(nv->value, nv->valuelen);
+      if (*age < 0) {
+        *age = 0;
+      }
+    }
+  }
+
+  if (cc->s_maxage >= 0) {
+    return cc->s_maxage;
+  }
+  if (cc->max_age >= 0) {
+    return cc->max_age;
+  }
+  if (expires != -1) {
+    return expires > (date != -1 ? date : now) ? expires - (date != -1 ? date : now) : 0;
+  }
+  return -1;
+}
+
+void mrb_http2_cache_entry_refresh(mrb_http2_cache_entry *entry, const nghttp2_nv *headers, size_t headerslen,
+                                   time_t now)
+{
+  cache_control cc;
+  int64_t lifetime, age;
+
+  memset(&cc, 0, sizeof(cc));
+  lifetime = cache_lifetime(headers, headerslen, &cc, &age, now);
+  if (lifetime < 0) {
+    // 304 without freshness keeps the last lifetime
+    lifetime = entry->expires - entry->stored + entry->initial_age;
+    age = 0;
+  }
+  entry->stored = now;
+  entry->initial_age = age;
+  entry->expires = now + lifetime - age;
+}
+
+static int cache_status_cacheable(int status)
+{
+  switch (status) {
+  case 200:
+  case 203:
+  case 204:
+  case 300:
+  case 301:
+  case 308:
+  case 404:
+  case 405:
+  case 410:
+  case 414:
+  case 501:
+    return 1;
+  }
+  return 0;
+}
+
+mrb_http2_cache_writer *mrb_http2_cache_writer_new(mrb_http2_cache *cache, const char *key, size_t keylen,
+                                                   const nghttp2_nv *reqnva, size_t reqnvlen, int status,
+                                                   const nghttp2_nv *headers, size_t headerslen,
+                                                   int64_t content_length, const char *unparsed_host, time_t now)
+{
+  mrb_state *mrb = cache->mrb;
+  mrb_http2_cache_writer *writer;
+  mrb_http2_cache_entry *entry;
+  cache_control cc;
+  int64_t lifetime, age;
+  char *vary = NULL;
+  char *varyvalues = NULL;
+  size_t i;
+
+  if (!cache_status_cacheable(status)) {
+    return NULL;
+  }
+  if (content_length > (int64_t)cache->max_object &&
+      (cache->dir == NULL || content_length > (int64_t)cache->disk_size)) {
+    return NULL;
+  }
+
+  memset(&cc, 0, sizeof(cc));
+  lifetime = cache_lifetime(headers, headerslen, &cc, &age, now);
+  if (cc.no_store || cc.no_cache || cc.private_) {
+    return NULL;
+  }
+  if (cc.must_revalidate) {
+    cc.stale_while_revalidate = cc.stale_if_error = 0;
+  }
+  if (lifetime < 0 || (lifetime - age <= 0 && cc.stale_while_revalidate <= 0 && cc.stale_if_error <= 0)) {
+    return NULL;
+  }
+
+  for (i = 0; i < headerslen; i++) {
+    if (cache_nv_is(&headers[i], "set-cookie")) {
+      free(vary);
+      return NULL;
+    } else if (cache_nv_is(&headers[i], "vary")) {
+      size_t len = vary != NULL ? strlen(vary) : 0;
+      vary = realloc(vary, len + headers[i].valuelen + 2);
+      if (len > 0) {
+        vary[len++] = ',';
+      }
+      memcpy(vary + len, headers[i].value, headers[i].valuelen);
+      vary[len + headers[i].valuelen] = '\0';
+    }
+  }
+  if (vary != NULL) {
+    varyvalues = cache_vary_values(vary, reqnva, reqnvlen);
+    if (varyvalues == NULL) {
+      free(vary);
+      return NULL;
+    }
+  }
+
+  entry = (mrb_http2_cache_entry *)mrb_malloc(mrb, sizeof(mrb_http2_cache_entry));
+  memset(entry, 0, sizeof(mrb_http2_cache_entry));
+  entry->hash = cache_hash(key, keylen);
+  entry->key = malloc(keylen);
+  memcpy(entry->key, key, keylen);
+  entry->keylen = keylen;
+  entry->vary = vary;
+  entry->varyvalues = varyvalues;
+  entry->status = status;
+  entry->size = sizeof(mrb_http2_cache_entry) + keylen;
+  for (i = 0; i < headerslen && i < MRB_HTTP2_HEADER_MAX; i++) {
+    mrb_http2_create_nv(mrb, &entry->headers[i], headers[i].name, headers[i].namelen, headers[i].value,
+                        headers[i].valuelen);
+    entry->size += headers[i].namelen + headers[i].valuelen;
+  }
+  entry->headerslen = i;
+  entry->unparsed_host = strdup(unparsed_host);
+  entry->fd = -1;
+  entry->stored = now;
+  entry->initial_age = age;
+  entry->expires = now + lifetime - age;
+  entry->stale_while_revalidate = cc.stale_while_revalidate;
+  entry->stale_if_error = cc.stale_if_error;
+
+  writer = (mrb_http2_cache_writer *)mrb_malloc(mrb, sizeof(mrb_http2_cache_writer));
+  writer->cache = cache;
+  writer->entry = entry;
+  writer->capacity = 0;
+
+  return writer;
+}
+
+// entry being written, streams may send it while the body grows
+mrb_http2_cache_entry *mrb_http2_cache_writer_entry(mrb_http2_cache_writer *writer)
+{
+  return writer->entry;
+}
+
+// move the body to an unlinked temporary file in the cache directory
+static int cache_writer_spill(mrb_http2_cache_writer *writer)
+{
+  mrb_http2_cache_entry *entry = writer->entry;
+  size_t len = strlen(writer->cache->dir) + sizeof("/mrb_http2_cache.XXXXXX");
+  char *path = alloca(len);
+  ssize_t n;
+  size_t off = 0;
+
+  snprintf(path, len, "%s/mrb_http2_cache.XXXXXX", writer->cache->dir);
+  entry->fd = mkstemp(path);
+  if (entry->fd == -1) {
+    fprintf(stderr, "cache: mkstemp %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+
+  while (off < entry->bodylen) {
+    n = write(entry->fd, entry->body + off, entry->bodylen - off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    off += n;
+  }
+  free(entry->body);
+  entry->body = NULL;
+  writer->capacity = 0;
+  return 0;
+}
+
+int mrb_http2_cache_writer_write(mrb_http2_cache_writer *writer, const uint8_t *data, size_t len)
+{
+  mrb_http2_cache_entry *entry = writer->entry;
+  ssize_t n;
+
+  if (entry->fd == -1 && entry->bodylen + len > writer->cache->max_object) {
+    if (writer->cache->dir == NULL || cache_writer_spill(writer) != 0) {
+      return -1;
+    }
+  }
+
+  if (entry->fd != -1) {
+    if (entry->bodylen + len > writer->cache->disk_size) {
+      return -1;
+    }
+    while (len > 0) {
+      n = write(entry->fd, data, len);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      data += n;
+      len -= n;
+      entry->bodylen += n;
+    }
+    return 0;
+  }
+
+  if (entry->bodylen + len > writer->capacity) {
+    // grow geometrically up to max_object
+    writer->capacity = writer->capacity > 0 ? writer->capacity * 2 : 4096;
+    while (writer->capacity < entry->bodylen + len) {
+      writer->capacity *= 2;
+    }
+    if (writer->capacity > writer->cache->max_object) {
+      writer->capacity = writer->cache->max_object;
+    }
+    entry->body = realloc(entry->body, writer->capacity);
+  }
+  memcpy(entry->body + entry->bodylen, data, len);
+  entry->bodylen += len;
+  return 0;
+}
+
+// store the entry replacing the same variant, the writer is freed
+void mrb_http2_cache_writer_commit(mrb_http2_cache_writer *writer)
+{
+  mrb_http2_cache *cache = writer->cache;
+  mrb_http2_cache_entry *entry = writer->entry;
+  mrb_http2_cache_entry *e, *next;
+  size_t disk = 0;
+
+  if (entry->fd == -1) {
+    entry->size += entry->bodylen;
+  } else {
+    disk = entry->bodylen;
+  }
+
+  for (e = cache->buckets[entry->hash & (cache->bucketslen - 1)]; e; e = next) {
+    next = e->hnext;
+    if (e->hash == entry->hash && e->keylen == entry->keylen && memcmp(e->key, entry->key, e->keylen) == 0 &&
+        ((e->varyvalues == NULL && entry->varyvalues == NULL) ||
+         (e->varyvalues != NULL && entry->varyvalues != NULL && strcmp(e->varyvalues, entry->varyvalues) == 0))) {
+      cache_remove(cache, e);
+    }
+  }
+
+  if (entry->size > cache->size) {
+    cache_entry_release(cache, entry);
+    mrb_free(cache->mrb, writer);
+    return;
+  }
+  cache_evict(cache, entry->size, disk);
+
+  if (cache->entrieslen >= cache->bucketslen) {
+    cache_grow(cache);
+  }
+  entry->hnext = cache->buckets[entry->hash & (cache->bucketslen - 1)];
+  cache->buckets[entry->hash & (cache->bucketslen - 1)] = entry;
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+  cache->entrieslen++;
+  cache->used += entry->size;
+  cache->disk_used += disk;
+
+  mrb_free(cache->mrb, writer);
+}
+
+void mrb_http2_cache_writer_free(mrb_http2_cache_writer *writer)
+{
+  if (writer == NULL) {
+    return;
+  }
+  cache_entry_release(writer->cache, writer->entry);
+  mrb_free(writer->cache->mrb, writer);
+}
@@ -0,0 +1,109 @@
+/*
+// mrb_http2_cache.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_CACHE_H
+#define MRB_HTTP2_CACHE_H
+
+#include "mrb_http2.h"
+
+// default size limit of a cached response body
+#define MRB_HTTP2_CACHE_MAX_OBJECT (1 << 20)
+
+// default size limit of spill files in the cache directory
+#define MRB_HTTP2_CACHE_DISK_SIZE (1 << 30)
+
+// upper bound of max-age, Age and other delta-seconds
+#define MRB_HTTP2_CACHE_DELTA_SECONDS_MAX 2147483648LL
+
+// initial buckets of hash table, doubled as entries grow
+#define MRB_HTTP2_CACHE_BUCKETS 1024
+
+typedef struct mrb_http2_cache mrb_http2_cache;
+typedef struct mrb_http2_cache_entry mrb_http2_cache_entry;
+typedef struct mrb_http2_cache_writer mrb_http2_cache_writer;
+
+struct mrb_http2_cache_entry {
+  // hash chain and LRU list
+  mrb_http2_cache_entry *hnext;
+  mrb_http2_cache_entry *prev;
+  mrb_http2_cache_entry *next;
+
+  uint64_t hash;
+  char *key;
+  size_t keylen;
+
+  // Vary of the response and the request header values it was stored for
+  char *vary;
+  char *varyvalues;
+
+  // upstream response, header names are lower case
+  int status;
+  nghttp2_nv headers[MRB_HTTP2_HEADER_MAX];
+  size_t headerslen;
+
+  // upstream authority used to rewrite location
+  char *unparsed_host;
+
+  // body in memory, or in an unlinked spill file when fd is not -1
+  uint8_t *body;
+  size_t bodylen;
+  int fd;
+
+  // freshness in seconds of time(2)
+  time_t stored;
+  time_t expires;
+  int64_t initial_age;
+  unsigned int stale_while_revalidate;
+  unsigned int stale_if_error;
+
+  // bytes counted for the memory budget
+  size_t size;
+
+  // streams sending this entry, freed at 0 after removed from cache
+  unsigned int refcnt;
+
+  unsigned int removed : 1;
+  unsigned int revalidating : 1;
+};
+
+typedef enum { MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE, MRB_HTTP2_CACHE_STALE_IF_ERROR } mrb_http2_cache_stale_type;
+
+mrb_http2_cache *mrb_http2_cache_new(mrb_state *mrb, size_t size, size_t max_object, const char *dir,
+                                     size_t disk_size);
+void mrb_http2_cache_free(mrb_http2_cache *cache);
+
+// only GET without Authorization is cached, returns 0 when the request may
+// be stored and sets lookup when a stored response may be used
+int mrb_http2_cache_request_cacheable(const char *method, const nghttp2_nv *nva, size_t nvlen, int *lookup);
+
+// find a response stored for the key and the request headers, fresh or not
+mrb_http2_cache_entry *mrb_http2_cache_lookup(mrb_http2_cache *cache, const char *key, size_t keylen,
+                                              const nghttp2_nv *nva, size_t nvlen);
+// the request has the Vary header values the entry was stored for
+int mrb_http2_cache_entry_match(const mrb_http2_cache_entry *entry, const nghttp2_nv *nva, size_t nvlen);
+int mrb_http2_cache_fresh(const mrb_http2_cache_entry *entry, time_t now);
+int mrb_http2_cache_stale_usable(const mrb_http2_cache_entry *entry, time_t now, mrb_http2_cache_stale_type type);
+int64_t mrb_http2_cache_age(const mrb_http2_cache_entry *entry, time_t now);
+
+void mrb_http2_cache_entry_ref(mrb_http2_cache_entry *entry);
+void mrb_http2_cache_entry_unref(mrb_http2_cache *cache, mrb_http2_cache_entry *entry);
+ssize_t mrb_http2_cache_entry_read(mrb_http2_cache_entry *entry, size_t offset, uint8_t *buf, size_t len);
+
+// a 304 response to revalidation makes the entry fresh again
+void mrb_http2_cache_entry_refresh(mrb_http2_cache_entry *entry, const nghttp2_nv *headers, size_t headerslen,
+                                   time_t now);
+
+// returns NULL when the response can't be stored
+mrb_http2_cache_writer *mrb_http2_cache_writer_new(mrb_http2_cache *cache, const char *key, size_t keylen,
+                                                   const nghttp2_nv *reqnva, size_t reqnvlen, int status,
+                                                   const nghttp2_nv *headers, size_t headerslen,
+                                                   int64_t content_length, const char *unparsed_host, time_t now);
+mrb_http2_cache_entry *mrb_http2_cache_writer_entry(mrb_http2_cache_writer *writer);
+int mrb_http2_cache_writer_write(mrb_http2_cache_writer *writer, const uint8_t *data, size_t len);
+void mrb_http2_cache_writer_commit(mrb_http2_cache_writer *writer);
+void mrb_http2_cache_writer_free(mrb_http2_cache_writer *writer);
+
+#endif
@@ -100,11 +100,125 @@ static void set_config_port(mrb_state *mrb, mrb_value args, mrb_http2_config_t *
   config->service = mrb_str_to_cstr(mrb, mrb_fixnum_to_str(mrb, val, 10));
 }
 
+// listen => "host:port", "unix:/path" or an array of them
+static void set_config_listen(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  mrb_value addr;
+  mrb_int i, len;
+
+  if (mrb_nil_p(val)) {
+    return;
+  }
+  if (!mrb_array_p(val)) {
+    if (!mrb_string_p(val)) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid listen parameter: %S", val);
+    }
+    config->listen[config->listenlen++] = strdup(mrb_str_to_cstr(mrb, val));
+    return;
+  }
+  len = RARRAY_LEN(val);
+  if (len > MRB_HTTP2_LISTENER_MAX) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid listen parameter: %S > MRB_HTTP2_LISTENER_MAX(%S)",
+               mrb_fixnum_value(len), mrb_fixnum_value(MRB_HTTP2_LISTENER_MAX));
+  }
+  for (i = 0; i < len; i++) {
+    addr = mrb_ary_ref(mrb, val, i);
+    if (!mrb_string_p(addr)) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid listen parameter: %S", addr);
+    }
+    config->listen[config->listenlen++] = strdup(mrb_str_to_cstr(mrb, addr));
+  }
+}
+
+// a string or an array of strings
+static char **config_get_cstr_list(mrb_state *mrb, mrb_value val, const char *key, unsigned int *len)
+{
+  char **list;
+  mrb_value v;
+  mrb_int i, n;
+
+  *len = 0;
+  if (mrb_nil_p(val)) {
+    return NULL;
+  }
+  n = mrb_array_p(val) ? RARRAY_LEN(val) : 1;
+  list = (char **)malloc(sizeof(char *) * n);
+  for (i = 0; i < n; i++) {
+    v = mrb_array_p(val) ? mrb_ary_ref(mrb, val, i) : val;
+    if (!mrb_string_p(v)) {
+      free(list);
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid %S parameter: %S", mrb_str_new_cstr(mrb, key), v);
+    }
+    list[i] = strdup(mrb_str_to_cstr(mrb, v));
+  }
+  *len = n;
+
+  return list;
+}
+
+static void set_config_preload_libraries(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->preload_libraries = config_get_cstr_list(mrb, val, "preload_libraries", &config->preload_librarieslen);
+}
+
+static void set_config_preload_handlers(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->preload_handlers = config_get_cstr_list(mrb, val, "preload_handlers", &config->preload_handlerslen);
+}
+
+static void set_config_blocking_locations(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->blocking_locations = config_get_cstr_list(mrb, val, "blocking_locations", &config->blocking_locationslen);
+}
+
 static void set_config_worker(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
 {
   config->worker = mrb_http2_config_get_worker(mrb, args, val);
 }
 
+static void set_config_worker_min(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->worker_min = mrb_http2_config_get_worker(mrb, args, val);
+}
+
+static void set_config_worker_max(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->worker_max = mrb_http2_config_get_worker(mrb, args, val);
+}
+
+static void set_config_worker_threads(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  config->worker_threads = mrb_http2_config_get_worker(mrb, args, val);
+}
+
+// worker_cpu_affinity => "auto", "cpu" or "numa"
+static void set_config_worker_cpu_affinity(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config,
+                                           mrb_value val)
+{
+  if (mrb_nil_p(val)) {
+    config->worker_cpu_affinity = MRB_HTTP2_AFFINITY_NONE;
+  } else if (mrb_type(val) == MRB_TT_STRING && (mrb_equal(mrb, val, mrb_str_new_lit(mrb, "auto")) ||
+                                                 mrb_equal(mrb, val, mrb_str_new_lit(mrb, "cpu")))) {
+    config->worker_cpu_affinity = MRB_HTTP2_AFFINITY_CPU;
+  } else if (mrb_type(val) == MRB_TT_STRING && mrb_equal(mrb, val, mrb_str_new_lit(mrb, "numa"))) {
+    config->worker_cpu_affinity = MRB_HTTP2_AFFINITY_NUMA;
+  } else {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid worker_cpu_affinity parameter: %S", val);
+  }
+}
+
+static void set_config_upstreams(mrb_state *mrb, mrb_value args, mrb_http2_config_t *config, mrb_value val)
+{
+  if (mrb_nil_p(val)) {
+    config->upstreams = NULL;
+    return;
+  }
+  config->upstreams = mrb_http2_balancer_new(mrb, val);
+
+  // upstream groups imply proxying
+  config->upstream = MRB_HTTP2_CONFIG_ENABLED;
+}
+
 //
 // Configuration API
 //
@@ -180,17 +294,41 @@ static void config_defualt_value(mrb_state *mrb, mrb_http2_config_t *config)
   config->connection_record = MRB_HTTP2_CONFIG_ENABLED;
   config->tcp_nopush = MRB_HTTP2_CONFIG_DISABLED;
   config->server_status = MRB_HTTP2_CONFIG_DISABLED;
+  config->connection_rebalance = MRB_HTTP2_CONFIG_DISABLED;
   config->upstream = MRB_HTTP2_CONFIG_DISABLED;
+  config->upstream_request_streaming = MRB_HTTP2_CONFIG_DISABLED;
 
   config->server_host = MRB_HTTP2_CONFIG_LIT("0.0.0.0");
   config->server_name = MRB_HTTP2_CONFIG_LIT(MRUBY_HTTP2_SERVER);
   config->document_root = MRB_HTTP2_CONFIG_LIT("./");
   config->run_user = NULL;
   config->dh_params_file = NULL;
+  config->upstreams = NULL;
+  config->upstream_cache_dir = NULL;
+  config->request_body_dir = NULL;
+  config->worker_script = NULL;
+  config->worker_cpu_affinity = MRB_HTTP2_AFFINITY_NONE;
 
   config->rlimit_nofile = 0;
   config->write_packet_buffer_expand_size = 0;
   config->write_packet_buffer_limit_size = 0;
+  config->upstream_buffer_size = 0;
+  config->request_body_buffer_size = 0;
+  config->http2_initial_window_size = 0;
+  config->http2_connection_window_size = 0;
+  config->upstream_cache_size = 0;
+  config->upstream_cache_max_object = 0;
+  config->upstream_cache_disk_size = 0;
+  config->upstream_dns_ttl = 0;
+  config->upstream_dns_negative_ttl = 0;
+  config->graceful_timeout = 0;
+  config->listen_backlog = 0;
+  config->connection_max_requests = 0;
+  config->connection_max_age = 0;
+  config->worker_scale_streams = 0;
+  config->tcp_fastopen = 0;
+  config->tcp_defer_accept = 0;
+  config->blocking_threads = 0;
 }
 
 mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args)
@@ -207,24 +345,84 @@ mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args)
   mrb_http2_config_define_flag(mrb, args, &config->connection_record, NULL, "connection_record");
   mrb_http2_config_define_flag(mrb, args, &config->tcp_nopush, NULL, "tcp_nopush");
   mrb_http2_config_define_flag(mrb, args, &config->server_status, NULL, "server_status");
+  mrb_http2_config_define_flag(mrb, args, &config->connection_rebalance, NULL, "connection_rebalance");
+  if (config->connection_rebalance) {
+    // load of workers is read from the scoreboard counters
+    config->server_status = MRB_HTTP2_CONFIG_ENABLED;
+  }
   mrb_http2_config_define_flag(mrb, args, &config->upstream, NULL, "upstream");
+  mrb_http2_config_define_flag(mrb, args, &config->upstream_request_streaming, NULL, "upstream_request_streaming");
 
   mrb_http2_config_define_cstr(mrb, args, &config->server_host, NULL, "server_host");
   mrb_http2_config_define_cstr(mrb, args, &config->server_name, NULL, "server_name");
   mrb_http2_config_define_cstr(mrb, args, &config->document_root, NULL, "document_root");
   mrb_http2_config_define_cstr(mrb, args, &config->run_user, NULL, "run_user");
   mrb_http2_config_define_cstr(mrb, args, &config->dh_params_file, NULL, "dh_params_file");
+  mrb_http2_config_define_cstr(mrb, args, &config->upstream_cache_dir, NULL, "upstream_cache_dir");
+  mrb_http2_config_define_cstr(mrb, args, &config->request_body_dir, NULL, "request_body_dir");
+  mrb_http2_config_define_cstr(mrb, args, &config->worker_script, NULL, "worker_script");
 
   mrb_http2_config_define_fixnum(mrb, args, &config->rlimit_nofile, NULL, "rlimit_nofile");
   mrb_http2_config_define_fixnum(mrb, args, &config->write_packet_buffer_expand_size, NULL,
                                  "write_packet_buffer_expand_size");
   mrb_http2_config_define_fixnum(mrb, args, &config->write_packet_buffer_limit_size, NULL,
                                  "write_packet_buffer_limit_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_buffer_size, NULL, "upstream_buffer_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->request_body_buffer_size, NULL, "request_body_buffer_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->http2_initial_window_size, NULL, "http2_initial_window_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->http2_connection_window_size, NULL,
+                                 "http2_connection_window_size");
+  if (config->http2_initial_window_size > NGHTTP2_MAX_WINDOW_SIZE ||
+      config->http2_connection_window_size > NGHTTP2_MAX_WINDOW_SIZE) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "http2 window size exceeds 2^31-1");
+  }
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_size, NULL, "upstream_cache_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_max_object, NULL, "upstream_cache_max_object");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_cache_disk_size, NULL, "upstream_cache_disk_size");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_dns_ttl, NULL, "upstream_dns_ttl");
+  mrb_http2_config_define_fixnum(mrb, args, &config->upstream_dns_negative_ttl, NULL, "upstream_dns_negative_ttl");
+  mrb_http2_config_define_fixnum(mrb, args, &config->graceful_timeout, NULL, "graceful_timeout");
+  mrb_http2_config_define_fixnum(mrb, args, &config->listen_backlog, NULL, "listen_backlog");
+  mrb_http2_config_define_fixnum(mrb, args, &config->connection_max_requests, NULL, "connection_max_requests");
+  mrb_http2_config_define_fixnum(mrb, args, &config->connection_max_age, NULL, "connection_max_age");
+  mrb_http2_config_define_fixnum(mrb, args, &config->worker_scale_streams, NULL, "worker_scale_streams");
+  mrb_http2_config_define_fixnum(mrb, args, &config->tcp_fastopen, NULL, "tcp_fastopen");
+  mrb_http2_config_define_fixnum(mrb, args, &config->tcp_defer_accept, NULL, "tcp_defer_accept");
+  mrb_http2_config_define_fixnum(mrb, args, &config->blocking_threads, NULL, "blocking_threads");
 
   mrb_http2_config_define(mrb, args, config, set_config_port, "port");
+  mrb_http2_config_define(mrb, args, config, set_config_listen, "listen");
+  mrb_http2_config_define(mrb, args, config, set_config_preload_libraries, "preload_libraries");
+  mrb_http2_config_define(mrb, args, config, set_config_preload_handlers, "preload_handlers");
+  mrb_http2_config_define(mrb, args, config, set_config_blocking_locations, "blocking_locations");
   mrb_http2_config_define(mrb, args, config, set_config_worker, "worker");
+  mrb_http2_config_define(mrb, args, config, set_config_worker_threads, "worker_threads");
+  if (config->worker > 0 && config->worker_threads > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "worker and worker_threads can't be used together");
+  }
+  mrb_http2_config_define(mrb, args, config, set_config_worker_min, "worker_min");
+  mrb_http2_config_define(mrb, args, config, set_config_worker_max, "worker_max");
+  if (config->worker_max > 0) {
+    if (config->worker_threads > 0) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "worker_max can't be used with worker_threads");
+    }
+    if (config->worker_min == 0) {
+      config->worker_min = 1;
+    }
+    if (config->worker_min > config->worker_max) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "worker_min exceeds worker_max");
+    }
+    // worker is the number to start with
+    if (config->worker < config->worker_min) {
+      config->worker = config->worker_min;
+    } else if (config->worker > config->worker_max) {
+      config->worker = config->worker_max;
+    }
+  }
+  mrb_http2_config_define(mrb, args, config, set_config_worker_cpu_affinity, "worker_cpu_affinity");
   mrb_http2_config_define(mrb, args, config, set_config_key, "key");
   mrb_http2_config_define(mrb, args, config, set_config_crt, "crt");
+  mrb_http2_config_define(mrb, args, config, set_config_upstreams, "upstreams");
 
   config->cb_list = mruby_cb_list_init(mrb);
 
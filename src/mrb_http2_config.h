@@ -8,6 +8,9 @@
 #define MRB_HTTP2_CONFIG_H
 
 #include "mrb_http2.h"
+#include "mrb_http2_affinity.h"
+#include "mrb_http2_balancer.h"
+#include "mrb_http2_listener.h"
 
 #define MRB_HTTP2_WORKER_MAX 1024
 
@@ -46,6 +49,13 @@ typedef struct {
   mrb_http2_config_flag server_status;
   mrb_http2_config_flag upstream;
 
+  // GOAWAY a connection after this many streams or seconds, or when the
+  // worker has more active streams than the average of workers, so that
+  // the client reconnects to another worker. 0 disables them
+  mrb_http2_config_fixnum connection_max_requests;
+  mrb_http2_config_fixnum connection_max_age;
+  mrb_http2_config_flag connection_rebalance;
+
   // connection record option
   // default enabled and can use connection methods
   mrb_http2_config_flag connection_record;
@@ -62,11 +72,60 @@ typedef struct {
   // server listen hostname
   mrb_http2_config_cstr *server_host;
 
+  // listen addresses, server_host and port when empty
+  char *listen[MRB_HTTP2_LISTENER_MAX];
+  unsigned int listenlen;
+
+  // listen queue length, SOMAXCONN when 0
+  mrb_http2_config_fixnum listen_backlog;
+
+  // TCP Fast Open queue length, and seconds to wait for the first data
+  // before accepting, 0 disables them
+  mrb_http2_config_fixnum tcp_fastopen;
+  mrb_http2_config_fixnum tcp_defer_accept;
+
   mruby_cb_list *cb_list;
 
   // the number of worker process, need SO_REUSEPORT linux kernel 3.9 or later
   unsigned int worker;
 
+  // worker is scaled between worker_min and worker_max by load when
+  // worker_max is set, worker_scale_streams is the target of active streams
+  // per worker
+  unsigned int worker_min;
+  unsigned int worker_max;
+  mrb_http2_config_fixnum worker_scale_streams;
+
+  // the number of worker threads in a process, each thread loads
+  // worker_script ($0 by default) into an mrb_state of its own. TLS
+  // sessions and upstream health are shared, the proxy cache is kept per
+  // thread
+  unsigned int worker_threads;
+  mrb_http2_config_cstr *worker_script;
+
+  // pin workers to CPUs or NUMA nodes, "cpu" steers connections to the
+  // worker of the CPU that received them as well
+  mrb_http2_affinity_type worker_cpu_affinity;
+
+  // seconds to finish streams in flight when a worker is drained on reload,
+  // 0 is default
+  mrb_http2_config_fixnum graceful_timeout;
+
+  // ruby files run once by the master before forking workers, and handler
+  // scripts compiled then for enable_shared_mruby. handler paths are the
+  // filenames requests map to under document_root
+  char **preload_libraries;
+  unsigned int preload_librarieslen;
+  char **preload_handlers;
+  unsigned int preload_handlerslen;
+
+  // ruby handlers under these uri prefixes run on a pool of
+  // blocking_threads threads with mrb_states of their own, so that slow
+  // handlers don't stall the other streams of the worker
+  char **blocking_locations;
+  unsigned int blocking_locationslen;
+  mrb_http2_config_fixnum blocking_threads;
+
   mrb_http2_config_cstr *run_user;
   uid_t run_uid;
 
@@ -76,6 +135,36 @@ typedef struct {
   mrb_http2_config_fixnum write_packet_buffer_expand_size;
   mrb_http2_config_fixnum write_packet_buffer_limit_size;
 
+  // bytes of upstream response body buffered per stream, 0 is default
+  mrb_http2_config_fixnum upstream_buffer_size;
+
+  // flow-control windows advertised to clients, 0 is default
+  mrb_http2_config_fixnum http2_initial_window_size;
+  mrb_http2_config_fixnum http2_connection_window_size;
+
+  // bytes of request body kept in memory, the rest is spilled to an
+  // unlinked file in request_body_dir
+  mrb_http2_config_fixnum request_body_buffer_size;
+  mrb_http2_config_cstr *request_body_dir;
+
+  // process a request with body when its headers arrive and stream the body
+  // to upstream. a request not going upstream is still buffered for handlers
+  mrb_http2_config_flag upstream_request_streaming;
+
+  // proxy cache of upstream responses, disabled when the size is 0. bodies
+  // larger than max_object are spilled to files in the dir when it is set
+  mrb_http2_config_fixnum upstream_cache_size;
+  mrb_http2_config_fixnum upstream_cache_max_object;
+  mrb_http2_config_cstr *upstream_cache_dir;
+  mrb_http2_config_fixnum upstream_cache_disk_size;
+
+  // seconds to cache resolved and failed upstream hostnames, 0 is default
+  mrb_http2_config_fixnum upstream_dns_ttl;
+  mrb_http2_config_fixnum upstream_dns_negative_ttl;
+
+  // named upstream groups selected by HTTP2::Server#upstream_group=
+  mrb_http2_balancer *upstreams;
+
 } mrb_http2_config_t;
 
 mrb_http2_config_t *mrb_http2_s_config_init(mrb_state *mrb, mrb_value args);
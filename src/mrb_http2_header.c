@@ -0,0 +1,98 @@
+/*
+// mrb_http2_header.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_header.h"
+
+#include <strings.h>
+
+#define HEADER_IS(NAME, TOKEN)                                                                                         \
+  if (memcmp(NAME, name, sizeof(NAME) - 1) == 0) {                                                                     \
+    return TOKEN;                                                                                                      \
+  }
+
+mrb_http2_header_token mrb_http2_header_lookup(const uint8_t *name, size_t namelen)
+{
+  switch (namelen) {
+  case 2:
+    HEADER_IS("te", MRB_HTTP2_HEADER_TOKEN_TE);
+    break;
+  case 3:
+    if (name[0] == 'a') {
+      HEADER_IS("age", MRB_HTTP2_HEADER_TOKEN_AGE);
+    } else {
+      HEADER_IS("via", MRB_HTTP2_HEADER_TOKEN_VIA);
+    }
+    break;
+  case 4:
+    HEADER_IS("host", MRB_HTTP2_HEADER_TOKEN_HOST);
+    break;
+  case 6:
+    HEADER_IS("cookie", MRB_HTTP2_HEADER_TOKEN_COOKIE);
+    break;
+  case 7:
+    HEADER_IS("upgrade", MRB_HTTP2_HEADER_TOKEN_UPGRADE);
+    break;
+  case 8:
+    HEADER_IS("location", MRB_HTTP2_HEADER_TOKEN_LOCATION);
+    break;
+  case 10:
+    if (name[0] == 'c') {
+      HEADER_IS("connection", MRB_HTTP2_HEADER_TOKEN_CONNECTION);
+    } else {
+      HEADER_IS("keep-alive", MRB_HTTP2_HEADER_TOKEN_KEEP_ALIVE);
+    }
+    break;
+  case 14:
+    HEADER_IS("content-length", MRB_HTTP2_HEADER_TOKEN_CONTENT_LENGTH);
+    break;
+  case 16:
+    HEADER_IS("proxy-connection", MRB_HTTP2_HEADER_TOKEN_PROXY_CONNECTION);
+    break;
+  case 17:
+    HEADER_IS("transfer-encoding", MRB_HTTP2_HEADER_TOKEN_TRANSFER_ENCODING);
+    break;
+  }
+  return MRB_HTTP2_HEADER_TOKEN_OTHER;
+}
+
+#undef HEADER_IS
+
+int mrb_http2_header_hop_by_hop(mrb_http2_header_token token)
+{
+  switch (token) {
+  case MRB_HTTP2_HEADER_TOKEN_CONNECTION:
+  case MRB_HTTP2_HEADER_TOKEN_KEEP_ALIVE:
+  case MRB_HTTP2_HEADER_TOKEN_PROXY_CONNECTION:
+  case MRB_HTTP2_HEADER_TOKEN_TE:
+  case MRB_HTTP2_HEADER_TOKEN_TRANSFER_ENCODING:
+  case MRB_HTTP2_HEADER_TOKEN_UPGRADE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// "Connection: close, X-Foo"
+int mrb_http2_header_connection_listed(const nghttp2_nv *connection, const uint8_t *name, size_t namelen)
+{
+  const uint8_t *p = connection->value;
+  const uint8_t *end = connection->value + connection->valuelen;
+  const uint8_t *tok;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    tok = p;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    if ((size_t)(p - tok) == namelen && strncasecmp((const char *)tok, (const char *)name, namelen) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
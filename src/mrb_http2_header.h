@@ -0,0 +1,38 @@
+/*
+// mrb_http2_header.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_HEADER_H
+#define MRB_HTTP2_HEADER_H
+
+#include "mrb_http2.h"
+
+// header names the proxy looks at, found by length and one memcmp
+typedef enum {
+  MRB_HTTP2_HEADER_TOKEN_OTHER,
+  MRB_HTTP2_HEADER_TOKEN_AGE,
+  MRB_HTTP2_HEADER_TOKEN_CONNECTION,
+  MRB_HTTP2_HEADER_TOKEN_CONTENT_LENGTH,
+  MRB_HTTP2_HEADER_TOKEN_COOKIE,
+  MRB_HTTP2_HEADER_TOKEN_HOST,
+  MRB_HTTP2_HEADER_TOKEN_KEEP_ALIVE,
+  MRB_HTTP2_HEADER_TOKEN_LOCATION,
+  MRB_HTTP2_HEADER_TOKEN_PROXY_CONNECTION,
+  MRB_HTTP2_HEADER_TOKEN_TE,
+  MRB_HTTP2_HEADER_TOKEN_TRANSFER_ENCODING,
+  MRB_HTTP2_HEADER_TOKEN_UPGRADE,
+  MRB_HTTP2_HEADER_TOKEN_VIA
+} mrb_http2_header_token;
+
+// name must be lower case
+mrb_http2_header_token mrb_http2_header_lookup(const uint8_t *name, size_t namelen);
+
+// not forwarded between HTTP/1.1 and HTTP/2 hops
+int mrb_http2_header_hop_by_hop(mrb_http2_header_token token);
+
+// the name is listed in the value of a Connection header
+int mrb_http2_header_connection_listed(const nghttp2_nv *connection, const uint8_t *name, size_t namelen);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+// mrb_http2_listener.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_listener.h"
+
+#include <errno.h>
+#include <stddef.h>
+
+static int listener_resolve_unix(const char *path, mrb_http2_listener_addr *addr)
+{
+  struct sockaddr_un *sun = (struct sockaddr_un *)&addr->addr;
+  size_t len = strlen(path);
+
+  if (len == 0 || len >= sizeof(sun->sun_path)) {
+    fprintf(stderr, "listener: invalid unix socket path: %s\n", path);
+    return -1;
+  }
+  memset(addr, 0, sizeof(mrb_http2_listener_addr));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, path, len + 1);
+  // same length as getsockname returns
+  addr->addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+  return 0;
+}
+
+static int listener_port(const mrb_http2_listener_addr *addr)
+{
+  if (addr->addr.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6 *)&addr->addr)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in *)&addr->addr)->sin_port);
+}
+
+// IPv6 sockets accept IPv4 too unless IPV6_V6ONLY, which conflicts with an
+// IPv4 listener on the same port
+static void listener_mark_v6only(mrb_http2_listener_addr *addrs, unsigned int n)
+{
+  unsigned int i, j;
+
+  for (i = 0; i < n; i++) {
+    if (addrs[i].addr.ss_family != AF_INET6) {
+      continue;
+    }
+    for (j = 0; j < n; j++) {
+      if (addrs[j].addr.ss_family == AF_INET && listener_port(&addrs[j]) == listener_port(&addrs[i])) {
+        addrs[i].v6only = 1;
+        break;
+      }
+    }
+  }
+}
+
+int mrb_http2_listener_resolve(const char *spec, const char *service, mrb_http2_listener_addr *addrs, unsigned int n,
+                               unsigned int max)
+{
+  struct addrinfo hints, *res, *rp;
+  char *host, *port = NULL, *p;
+  unsigned int first = n;
+  int rv;
+
+  if (n >= max) {
+    fprintf(stderr, "listener: %s: more than %u listen addresses\n", spec, max);
+    return -1;
+  }
+  if (strncmp(spec, "unix:", sizeof("unix:") - 1) == 0) {
+    return listener_resolve_unix(spec + sizeof("unix:") - 1, &addrs[n]) == 0 ? (int)n + 1 : -1;
+  }
+
+  // "[::1]:443", "127.0.0.1:443", "::1" and "*:443"
+  host = strdup(spec);
+  if (host[0] == '[' && (p = strchr(host, ']')) != NULL) {
+    *p = '\0';
+    memmove(host, host + 1, p - host);
+    if (p[1] == ':') {
+      port = p + 2;
+    }
+  } else if ((p = strchr(host, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+    *p = '\0';
+    port = p + 1;
+  }
+  if (port == NULL || *port == '\0') {
+    port = (char *)service;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  rv = getaddrinfo(host[0] == '\0' || strcmp(host, "*") == 0 ? NULL : host, port, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "listener: %s: %s\n", spec, gai_strerror(rv));
+    free(host);
+    return -1;
+  }
+  for (rp = res; rp && n < max; rp = rp->ai_next) {
+    if ((rp->ai_family != AF_INET && rp->ai_family != AF_INET6) || rp->ai_addrlen > sizeof(addrs[n].addr)) {
+      continue;
+    }
+    memset(&addrs[n], 0, sizeof(mrb_http2_listener_addr));
+    memcpy(&addrs[n].addr, rp->ai_addr, rp->ai_addrlen);
+    addrs[n].addrlen = rp->ai_addrlen;
+    n++;
+  }
+  freeaddrinfo(res);
+  free(host);
+
+  if (n == first) {
+    fprintf(stderr, "listener: %s: no address found\n", spec);
+    return -1;
+  }
+  listener_mark_v6only(addrs, n);
+  return n;
+}
+
+int mrb_http2_listener_is_unix(const mrb_http2_listener_addr *addr)
+{
+  return addr->addr.ss_family == AF_UNIX;
+}
+
+// a socket file nobody accepts on is left by a previous run and removed.
+// returns -1 when a server is still listening on it
+static int listener_unlink_stale(const mrb_http2_listener_addr *addr)
+{
+  const char *path = ((struct sockaddr_un *)&addr->addr)->sun_path;
+  evutil_socket_t fd;
+  int rv;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  rv = connect(fd, (struct sockaddr *)&addr->addr, addr->addrlen);
+  evutil_closesocket(fd);
+  if (rv == 0) {
+    fprintf(stderr, "listener: %s is in use by another server\n", path);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  if (errno == ECONNREFUSED) {
+    unlink(path);
+  }
+  return 0;
+}
+
+evutil_socket_t mrb_http2_listener_bind(const mrb_http2_listener_addr *addr, int reuseport, int fastopen,
+                                        int defer_accept)
+{
+  evutil_socket_t fd;
+  int on = 1;
+
+  if (mrb_http2_listener_is_unix(addr) && listener_unlink_stale(addr) != 0) {
+    return -1;
+  }
+
+  fd = socket(addr->addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  evutil_make_socket_nonblocking(fd);
+
+  if (!mrb_http2_listener_is_unix(addr)) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    if (reuseport) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+    }
+#endif
+    if (addr->v6only) {
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&on, sizeof(on));
+    }
+#ifdef TCP_FASTOPEN
+    if (fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (char *)&fastopen, sizeof(fastopen)) != 0) {
+      fprintf(stderr, "listener: TCP_FASTOPEN failed: %s\n", strerror(errno));
+    }
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    if (defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *)&defer_accept, sizeof(defer_accept)) != 0) {
+      fprintf(stderr, "listener: TCP_DEFER_ACCEPT failed: %s\n", strerror(errno));
+    }
+#endif
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr->addr, addr->addrlen) < 0) {
+    evutil_closesocket(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int mrb_http2_listener_match(evutil_socket_t fd, const mrb_http2_listener_addr *addr)
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof(ss);
+
+  if (getsockname(fd, (struct sockaddr *)&ss, &sslen) != 0) {
+    return 0;
+  }
+  return sslen == addr->addrlen && memcmp(&ss, &addr->addr, sslen) == 0;
+}
@@ -0,0 +1,46 @@
+/*
+// mrb_http2_listener.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_LISTENER_H
+#define MRB_HTTP2_LISTENER_H
+
+#include "mrb_http2.h"
+
+#include <sys/un.h>
+#include <event2/util.h>
+
+// listen addresses of a server, after resolving
+#define MRB_HTTP2_LISTENER_MAX 16
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  // IPv4 is bound to the same port by another listener
+  unsigned int v6only : 1;
+} mrb_http2_listener_addr;
+
+// "host:port", "[v6addr]:port", "*:port" or "unix:/path". a spec without a
+// port takes service, and "*" or an empty host binds IPv4 and IPv6 both.
+// the addresses are added after the n ones of addrs, returns the new count
+// or -1 when it can't be resolved
+int mrb_http2_listener_resolve(const char *spec, const char *service, mrb_http2_listener_addr *addrs, unsigned int n,
+                               unsigned int max);
+
+// a non-blocking socket bound to addr, TCP sockets join the SO_REUSEPORT
+// group of the address when reuseport is set. a unix socket file is
+// replaced unless a server is listening on it. fastopen is the TFO queue
+// length and defer_accept the seconds to wait for data before accept, 0
+// disables them
+evutil_socket_t mrb_http2_listener_bind(const mrb_http2_listener_addr *addr, int reuseport, int fastopen,
+                                        int defer_accept);
+
+int mrb_http2_listener_is_unix(const mrb_http2_listener_addr *addr);
+
+// whether fd is bound to addr, to pick up listeners across exec
+int mrb_http2_listener_match(evutil_socket_t fd, const mrb_http2_listener_addr *addr);
+
+#endif
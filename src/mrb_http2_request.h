@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "mrb_http2_upstream.h"
+#include "mrb_http2_body.h"
 #include "mruby.h"
 
 typedef enum mrb_http2_response_type {
@@ -139,7 +140,7 @@ typedef struct {
   char *authority;
 
   // request body
-  char *request_body;
+  mrb_http2_body *request_body;
 
   // filename is mapped from uri
   char *filename;
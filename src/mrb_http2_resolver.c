@@ -0,0 +1,281 @@
+/*
+// mrb_http2_resolver.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_resolver.h"
+
+#include <event2/dns.h>
+#include <event2/util.h>
+
+typedef struct mrb_http2_resolver_entry mrb_http2_resolver_entry;
+
+struct mrb_http2_resolver_query {
+  mrb_http2_resolver_query *prev, *next;
+  mrb_http2_resolver_entry *entry;
+  int port;
+  mrb_http2_resolver_cb cb;
+  void *arg;
+};
+
+struct mrb_http2_resolver_entry {
+  mrb_http2_resolver_entry *next;
+  mrb_http2_resolver *resolver;
+  char *host;
+
+  struct sockaddr_storage addrs[MRB_HTTP2_RESOLVER_ADDR_MAX];
+  int addrlens[MRB_HTTP2_RESOLVER_ADDR_MAX];
+  size_t addrslen;
+
+  // next address to connect for round robin
+  size_t next_addr;
+
+  // the result is used until expires, a failure is cached as well
+  time_t expires;
+  unsigned int failed : 1;
+
+  // lookup in flight and the queries waiting for it
+  unsigned int resolving : 1;
+  struct evdns_getaddrinfo_request *req;
+  mrb_http2_resolver_query *queries;
+};
+
+struct mrb_http2_resolver {
+  mrb_state *mrb;
+  struct evdns_base *dns;
+  unsigned int ttl;
+  unsigned int negative_ttl;
+
+  mrb_http2_resolver_entry *entries;
+  size_t entrieslen;
+};
+
+mrb_http2_resolver *mrb_http2_resolver_new(mrb_state *mrb, struct event_base *evbase, unsigned int ttl,
+                                           unsigned int negative_ttl)
+{
+  mrb_http2_resolver *resolver;
+  struct evdns_base *dns;
+
+  // nameservers from /etc/resolv.conf, and /etc/hosts is used as well
+  dns = evdns_base_new(evbase, 1);
+  if (dns == NULL) {
+    fprintf(stderr, "resolver: evdns_base_new failed, resolve upstream hostnames with blocking getaddrinfo\n");
+    return NULL;
+  }
+
+  resolver = (mrb_http2_resolver *)mrb_malloc(mrb, sizeof(mrb_http2_resolver));
+  memset(resolver, 0, sizeof(mrb_http2_resolver));
+  resolver->mrb = mrb;
+  resolver->dns = dns;
+  resolver->ttl = ttl > 0 ? ttl : MRB_HTTP2_RESOLVER_TTL;
+  resolver->negative_ttl = negative_ttl > 0 ? negative_ttl : MRB_HTTP2_RESOLVER_NEGATIVE_TTL;
+
+  return resolver;
+}
+
+static void resolver_entry_free(mrb_http2_resolver_entry *entry)
+{
+  mrb_http2_resolver_query *query, *next;
+  mrb_state *mrb = entry->resolver->mrb;
+
+  for (query = entry->queries; query;) {
+    next = query->next;
+    mrb_free(mrb, query);
+    query = next;
+  }
+  free(entry->host);
+  mrb_free(mrb, entry);
+}
+
+void mrb_http2_resolver_free(mrb_http2_resolver *resolver)
+{
+  mrb_http2_resolver_entry *entry, *next;
+
+  // lookups in flight are dropped without their callbacks
+  evdns_base_free(resolver->dns, 0);
+  for (entry = resolver->entries; entry;) {
+    next = entry->next;
+    resolver_entry_free(entry);
+    entry = next;
+  }
+  mrb_free(resolver->mrb, resolver);
+}
+
+// drop expired entries nobody waits for, called when the cache is full
+static void resolver_purge(mrb_http2_resolver *resolver, time_t now)
+{
+  mrb_http2_resolver_entry **p, *entry;
+
+  for (p = &resolver->entries; *p;) {
+    entry = *p;
+    if (!entry->resolving && now >= entry->expires) {
+      *p = entry->next;
+      resolver->entrieslen--;
+      resolver_entry_free(entry);
+      continue;
+    }
+    p = &entry->next;
+  }
+}
+
+static mrb_http2_resolver_entry *resolver_entry_get(mrb_http2_resolver *resolver, const char *host, time_t now)
+{
+  mrb_http2_resolver_entry *entry;
+
+  for (entry = resolver->entries; entry; entry = entry->next) {
+    if (strcmp(entry->host, host) == 0) {
+      return entry;
+    }
+  }
+
+  if (resolver->entrieslen >= MRB_HTTP2_RESOLVER_CACHE_MAX) {
+    resolver_purge(resolver, now);
+  }
+  entry = (mrb_http2_resolver_entry *)mrb_malloc(resolver->mrb, sizeof(mrb_http2_resolver_entry));
+  memset(entry, 0, sizeof(mrb_http2_resolver_entry));
+  entry->resolver = resolver;
+  entry->host = strdup(host);
+  entry->next = resolver->entries;
+  resolver->entries = entry;
+  resolver->entrieslen++;
+
+  return entry;
+}
+
+// copy the next address of the entry with the port of the query
+static void resolver_entry_addr(mrb_http2_resolver_entry *entry, int port, struct sockaddr_storage *addr,
+                                int *addrlen)
+{
+  size_t i = entry->next_addr++ % entry->addrslen;
+
+  memcpy(addr, &entry->addrs[i], entry->addrlens[i]);
+  *addrlen = entry->addrlens[i];
+  if (addr->ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+  }
+}
+
+static void resolver_getaddrinfo_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+  mrb_http2_resolver_entry *entry = (mrb_http2_resolver_entry *)arg;
+  mrb_http2_resolver *resolver = entry->resolver;
+  mrb_http2_resolver_query *query;
+  struct evutil_addrinfo *ai;
+  struct sockaddr_storage addr;
+  int addrlen;
+  time_t now = time(NULL);
+
+  TRACER;
+  entry->req = NULL;
+  entry->resolving = 0;
+
+  entry->addrslen = 0;
+  if (result == 0) {
+    for (ai = res; ai && entry->addrslen < MRB_HTTP2_RESOLVER_ADDR_MAX; ai = ai->ai_next) {
+      if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(addr)) {
+        continue;
+      }
+      memcpy(&entry->addrs[entry->addrslen], ai->ai_addr, ai->ai_addrlen);
+      entry->addrlens[entry->addrslen] = ai->ai_addrlen;
+      entry->addrslen++;
+    }
+  }
+  if (res != NULL) {
+    evutil_freeaddrinfo(res);
+  }
+
+  if (entry->addrslen == 0) {
+    fprintf(stderr, "resolver: %s: %s\n", entry->host,
+            result != 0 ? evutil_gai_strerror(result) : "no address found");
+    entry->failed = 1;
+    entry->expires = now + resolver->negative_ttl;
+  } else {
+    entry->failed = 0;
+    entry->expires = now + resolver->ttl;
+  }
+
+  // a callback may cancel other queries of the entry
+  while ((query = entry->queries) != NULL) {
+    entry->queries = query->next;
+    if (entry->queries != NULL) {
+      entry->queries->prev = NULL;
+    }
+    if (entry->failed) {
+      query->cb(-1, NULL, 0, query->arg);
+    } else {
+      resolver_entry_addr(entry, query->port, &addr, &addrlen);
+      query->cb(0, (struct sockaddr *)&addr, addrlen, query->arg);
+    }
+    mrb_free(resolver->mrb, query);
+  }
+}
+
+int mrb_http2_resolver_resolve(mrb_http2_resolver *resolver, const char *host, int port,
+                               struct sockaddr_storage *addr, int *addrlen, mrb_http2_resolver_cb cb, void *arg,
+                               mrb_http2_resolver_query **query)
+{
+  mrb_http2_resolver_entry *entry;
+  mrb_http2_resolver_query *q;
+  struct evutil_addrinfo hints;
+  struct evdns_getaddrinfo_request *req;
+  time_t now = time(NULL);
+
+  entry = resolver_entry_get(resolver, host, now);
+  if (!entry->resolving && now >= entry->expires) {
+    TRACER;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    // numeric hosts and /etc/hosts are answered before returning
+    entry->resolving = 1;
+    req = evdns_getaddrinfo(resolver->dns, host, NULL, &hints, resolver_getaddrinfo_cb, entry);
+    if (entry->resolving) {
+      entry->req = req;
+    }
+  }
+
+  if (!entry->resolving) {
+    if (entry->failed) {
+      return -1;
+    }
+    resolver_entry_addr(entry, port, addr, addrlen);
+    return 0;
+  }
+
+  q = (mrb_http2_resolver_query *)mrb_malloc(resolver->mrb, sizeof(mrb_http2_resolver_query));
+  q->entry = entry;
+  q->port = port;
+  q->cb = cb;
+  q->arg = arg;
+  q->prev = NULL;
+  q->next = entry->queries;
+  if (entry->queries != NULL) {
+    entry->queries->prev = q;
+  }
+  entry->queries = q;
+  *query = q;
+
+  return 1;
+}
+
+// the lookup goes on and its result is cached for others
+void mrb_http2_resolver_cancel(mrb_http2_resolver_query *query)
+{
+  mrb_http2_resolver_entry *entry = query->entry;
+
+  if (query->prev != NULL) {
+    query->prev->next = query->next;
+  } else {
+    entry->queries = query->next;
+  }
+  if (query->next != NULL) {
+    query->next->prev = query->prev;
+  }
+  mrb_free(entry->resolver->mrb, query);
+}
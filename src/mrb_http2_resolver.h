@@ -0,0 +1,45 @@
+/*
+// mrb_http2_resolver.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_RESOLVER_H
+#define MRB_HTTP2_RESOLVER_H
+
+#include "mrb_http2.h"
+
+#include <event2/event.h>
+
+// seconds to cache resolved and failed hostnames
+#define MRB_HTTP2_RESOLVER_TTL 60
+#define MRB_HTTP2_RESOLVER_NEGATIVE_TTL 5
+
+// addresses kept per hostname, connections rotate over them
+#define MRB_HTTP2_RESOLVER_ADDR_MAX 16
+
+// expired entries are purged when the cache grows over this
+#define MRB_HTTP2_RESOLVER_CACHE_MAX 1024
+
+typedef struct mrb_http2_resolver mrb_http2_resolver;
+typedef struct mrb_http2_resolver_query mrb_http2_resolver_query;
+
+// result is 0 with the address to connect, or -1 when the hostname can't be
+// resolved
+typedef void (*mrb_http2_resolver_cb)(int result, const struct sockaddr *addr, int addrlen, void *arg);
+
+// NULL when evdns can't be initialized, hostnames are resolved by blocking
+// getaddrinfo then
+mrb_http2_resolver *mrb_http2_resolver_new(mrb_state *mrb, struct event_base *evbase, unsigned int ttl,
+                                           unsigned int negative_ttl);
+void mrb_http2_resolver_free(mrb_http2_resolver *resolver);
+
+// returns 0 with addr set from the cache, -1 when the hostname is known to
+// fail, or 1 when cb will be called with the result. the query can be
+// cancelled until then
+int mrb_http2_resolver_resolve(mrb_http2_resolver *resolver, const char *host, int port,
+                               struct sockaddr_storage *addr, int *addrlen, mrb_http2_resolver_cb cb, void *arg,
+                               mrb_http2_resolver_query **query);
+void mrb_http2_resolver_cancel(mrb_http2_resolver_query *query);
+
+#endif
@@ -10,23 +10,29 @@
 #include "mrb_http2_ssl.h"
 #include "mrb_http2_error.c.h"
 #include "mrb_http2_worker.h"
+#include "mrb_http2_upstream.h"
+#include "mrb_http2_cache.h"
+#include "mrb_http2_body.h"
+#include "mrb_http2_header.h"
+#include "mrb_http2_subrequest.h"
+#include "mrb_http2_listener.h"
+#include "mrb_http2_blocking.h"
 
 #include <event.h>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/listener.h>
-#include <event2/keyvalq_struct.h>
 #include <event2/util.h>
-#include <event2/http.h>
-#include <event2/http_compat.h>
-#include <event2/http_struct.h>
 
 #include "mruby/value.h"
 #include "mruby/string.h"
 #include "mruby/compile.h"
+#include "mruby/variable.h"
+#include "mruby/array.h"
 
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/queue.h>
 #include <unistd.h>
@@ -37,26 +43,66 @@ typedef struct st_mrb_http2_iovec_t {
   size_t len;
 } mrb_http2_iovec_t;
 
+typedef struct upstream_collapse upstream_collapse;
+typedef struct blocking_reply_job blocking_reply_job;
+
 typedef struct {
   SSL_CTX *ssl_ctx;
   struct event_base *evbase;
   mrb_http2_server_t *server;
   mrb_http2_request_rec *r;
   mrb_value self;
+  mrb_http2_upstream_pool *upstream_pool;
+  mrb_http2_resolver *resolver;
+  mrb_http2_cache *cache;
+
+  // upstream requests other streams can wait on
+  upstream_collapse *collapses;
+
+  // mirrored requests in flight
+  unsigned int mirrors;
+
+  // threads running ruby handlers of blocking_locations
+  mrb_http2_blocking *blocking;
+
+  // sessions are closed after their streams when draining, and the worker
+  // exits when none is left
+  struct evconnlistener *listeners[MRB_HTTP2_LISTENER_MAX];
+  unsigned int listenerslen;
+  struct event *drain_ev;
+  struct event *term_ev;
+  struct event *goaway_ev;
+  struct http2_session_data *sessions;
+
+  // event loop lag sampled for the master to autoscale workers
+  struct event *lag_ev;
+  struct timeval lag_expected;
+
+  // checks connections to GOAWAY for rebalancing
+  struct event *rebalance_ev;
+  unsigned int draining : 1;
 } app_context;
 
-typedef struct mrb_http2_request_body {
-  char *data;
-  int64_t len;
-  size_t pos;
-  unsigned int last : 1;
-} mrb_http2_request_body;
-
 typedef struct http2_stream_data {
   struct http2_stream_data *prev, *next;
   char *request_path;
   char *request_args;
-  mrb_http2_request_body *request_body;
+  mrb_http2_body *request_body;
+
+  // the body was too large or couldn't be stored, DATA is dropped
+  unsigned int request_body_rejected : 1;
+
+  // the request was processed, and DATA received since then is streamed to
+  // upstream. unconsumed bytes are given back to the flow-control window
+  // when written to upstream
+  unsigned int processed : 1;
+  unsigned int request_streaming : 1;
+  size_t request_unconsumed;
+
+  // request_rec of a request not going upstream while its body is buffered,
+  // the content phase runs with it at END_STREAM
+  mrb_http2_request_rec *content_rec;
+
   char *unparsed_uri;
   char *percent_encode_uri;
   char method[16];
@@ -67,27 +113,105 @@ typedef struct http2_stream_data {
   int64_t readleft;
   nghttp2_nv nva[MRB_HTTP2_HEADER_MAX];
   size_t nvlen;
-  struct evhttp_request *upstream_req;
+  struct http2_session_data *session_data;
+
+  // proxy request in flight, upstream and nva are owned by the stream until
+  // the response headers are submitted
+  mrb_http2_upstream_req *upstream_req;
+  mrb_http2_upstream *upstream;
+  unsigned int upstream_deferred : 1;
+
+  // backend picked from an upstream group, released when the response
+  // headers arrive or the request fails
+  mrb_http2_balancer_group *upstream_group;
+  mrb_http2_balancer_backend *upstream_backend;
+  double upstream_start;
+
+  // hedged request to another backend of the group after the hedge delay,
+  // the request answering first is kept in upstream_req
+  struct event *hedge_ev;
+  mrb_http2_upstream_req *hedge_req;
+  mrb_http2_balancer_backend *hedge_backend;
+  double hedge_start;
+
+  // proxy cache key of the request, the response is stored by cache_writer
+  // or sent from cache_entry
+  char *cache_key;
+  size_t cache_keylen;
+  mrb_http2_cache_writer *cache_writer;
+  mrb_http2_cache_entry *cache_entry;
+  size_t cache_offset;
+
+  // request collapsing, the leader sends the request to upstream and the
+  // other streams wait on collapse_list for its response
+  upstream_collapse *collapse;
+  struct http2_stream_data *collapse_prev, *collapse_next;
+  struct http2_stream_data **collapse_list;
+
+  // ruby handler running on the blocking pool
+  blocking_reply_job *blocking_job;
 } http2_stream_data;
 
+// upstream GET shared by streams asking for the same cacheable response, the
+// body is sent to every stream from the cache entry the leader is storing
+struct upstream_collapse {
+  upstream_collapse *prev, *next;
+  app_context *app_ctx;
+  char *key;
+  size_t keylen;
+
+  // the stream sending the request, NULL after it's gone
+  http2_stream_data *leader;
+
+  // streams waiting for the response headers, and streams sending the body
+  http2_stream_data *waiters;
+  http2_stream_data *readers;
+
+  mrb_http2_cache_entry *entry;
+  int64_t content_length;
+
+  // fans out the response outside of nghttp2 and upstream callbacks
+  struct event *ev;
+
+  unsigned int headers : 1;
+  unsigned int finished : 1;
+  unsigned int failed : 1;
+  unsigned int dispatching : 1;
+};
+
+// ruby handler run by a pool thread. the request record of the stream is
+// moved out of app_ctx->r to saved while the thread runs with r, and moved
+// back with the response when the job is done
+struct blocking_reply_job {
+  mrb_http2_blocking_job job;
+  app_context *app_ctx;
+
+  // NULL after the stream is closed, the job is freed when it's done then
+  http2_stream_data *stream_data;
+
+  mrb_http2_request_rec saved;
+  mrb_http2_request_rec r;
+
+  // copies of the request, the stream may be gone before the thread is done
+  nghttp2_nv reqhdr[MRB_HTTP2_HEADER_MAX];
+  mrb_http2_conn_rec conn;
+};
+
 typedef struct http2_session_data {
+  struct http2_session_data *prev, *next;
   http2_stream_data root;
   struct bufferevent *bev;
   app_context *app_ctx;
   nghttp2_session *session;
   char client_addr[NI_MAXHOST];
   mrb_http2_conn_rec *conn;
-  struct event_base *upstream_base;
-  struct evhttp_connection *upstream_conn;
-} http2_session_data;
 
-struct mrb_http2_upstream_client {
-  http2_stream_data *stream_data;
-  http2_session_data *session_data;
-  nghttp2_session *session;
-  app_context *app_ctx;
-  struct evhttp_connection *conn;
-};
+  // streams opened and accept time, for connection_max_requests and
+  // connection_max_age. GOAWAY is sent once
+  unsigned int streams;
+  time_t accepted;
+  unsigned int goaway : 1;
+} http2_session_data;
 
 static void mrb_http2_large_buf_init(mrb_http2_large_buf *b)
 {
@@ -262,6 +386,7 @@ static http2_stream_data *create_http2_stream_data(mrb_state *mrb, http2_session
   stream_data->readleft = 0;
   stream_data->nvlen = 0;
   stream_data->request_body = NULL;
+  stream_data->content_rec = NULL;
   stream_data->request_args = NULL;
   stream_data->request_path = NULL;
   stream_data->unparsed_uri = NULL;
@@ -269,16 +394,130 @@ static http2_stream_data *create_http2_stream_data(mrb_state *mrb, http2_session
   stream_data->method[0] = '\0';
   stream_data->scheme[0] = '\0';
   stream_data->authority[0] = '\0';
+  stream_data->session_data = session_data;
   stream_data->upstream_req = NULL;
+  stream_data->upstream = NULL;
+  stream_data->upstream_deferred = 0;
+  stream_data->upstream_group = NULL;
+  stream_data->upstream_backend = NULL;
 
   add_stream(session_data, stream_data);
   if (config->server_status) {
-    server->worker->stream_requests_per_worker++;
-    server->worker->active_stream++;
+    MRB_HTTP2_WORKER_INC(server->worker, stream_requests_per_worker);
+    MRB_HTTP2_WORKER_INC(server->worker, active_stream);
+  }
+
+  // this stream is served and later ones are refused, the client retries
+  // them on a new connection. GOAWAY is sent after the callback
+  session_data->streams++;
+  if (config->connection_max_requests > 0 && session_data->streams >= config->connection_max_requests &&
+      !session_data->goaway) {
+    session_data->goaway = 1;
+    nghttp2_submit_goaway(session_data->session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_NO_ERROR, NULL, 0);
   }
   return stream_data;
 }
 
+static void collapse_list_add(http2_stream_data **list, http2_stream_data *stream_data)
+{
+  stream_data->collapse_list = list;
+  stream_data->collapse_prev = NULL;
+  stream_data->collapse_next = *list;
+  if (*list != NULL) {
+    (*list)->collapse_prev = stream_data;
+  }
+  *list = stream_data;
+}
+
+static void collapse_list_remove(http2_stream_data *stream_data)
+{
+  if (stream_data->collapse_prev != NULL) {
+    stream_data->collapse_prev->collapse_next = stream_data->collapse_next;
+  } else {
+    *stream_data->collapse_list = stream_data->collapse_next;
+  }
+  if (stream_data->collapse_next != NULL) {
+    stream_data->collapse_next->collapse_prev = stream_data->collapse_prev;
+  }
+  stream_data->collapse_prev = stream_data->collapse_next = NULL;
+  stream_data->collapse_list = NULL;
+}
+
+static void upstream_collapse_notify(upstream_collapse *c)
+{
+  struct timeval tv = {0, 0};
+
+  if (c != NULL && c->ev != NULL) {
+    event_add(c->ev, &tv);
+  }
+}
+
+static void upstream_collapse_free_if_unused(upstream_collapse *c)
+{
+  app_context *app_ctx = c->app_ctx;
+
+  if (c->dispatching || c->leader != NULL || c->waiters != NULL || c->readers != NULL) {
+    return;
+  }
+  TRACER;
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    app_ctx->collapses = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  if (c->ev != NULL) {
+    event_free(c->ev);
+  }
+  if (c->entry != NULL) {
+    mrb_http2_cache_entry_unref(app_ctx->cache, c->entry);
+  }
+  mrb_free(app_ctx->server->mrb, c->key);
+  mrb_free(app_ctx->server->mrb, c);
+}
+
+static void upstream_collapse_leave(http2_stream_data *stream_data)
+{
+  upstream_collapse *c = stream_data->collapse;
+
+  if (c == NULL) {
+    return;
+  }
+  stream_data->collapse = NULL;
+  if (c->leader == stream_data) {
+    // waiters send their own requests, readers are reset unless the body
+    // is complete
+    c->leader = NULL;
+    if (!c->finished) {
+      c->failed = 1;
+    }
+    upstream_collapse_notify(c);
+  } else {
+    collapse_list_remove(stream_data);
+  }
+  upstream_collapse_free_if_unused(c);
+}
+
+// drop the hedged request or the timer sending it
+static void upstream_hedge_cancel(http2_stream_data *stream_data)
+{
+  if (stream_data->hedge_ev != NULL) {
+    event_free(stream_data->hedge_ev);
+    stream_data->hedge_ev = NULL;
+  }
+  if (stream_data->hedge_req != NULL) {
+    mrb_http2_upstream_request_free(stream_data->hedge_req);
+    stream_data->hedge_req = NULL;
+  }
+  if (stream_data->hedge_backend != NULL) {
+    mrb_http2_balancer_release(stream_data->upstream_group, stream_data->hedge_backend, MRB_HTTP2_BALANCER_CANCELLED,
+                               0);
+    stream_data->hedge_backend = NULL;
+  }
+}
+
 static void delete_http2_stream_data(mrb_state *mrb, http2_session_data *session_data, http2_stream_data *stream_data)
 {
   TRACER;
@@ -292,17 +531,35 @@ static void delete_http2_stream_data(mrb_state *mrb, http2_session_data *session
     mrb_free(mrb, stream_data->request_args);
   }
   if (stream_data->request_body != NULL) {
-    stream_data->request_body->len = 0;
-    stream_data->request_body->pos = 0;
-    stream_data->request_body->last = 0;
-    mrb_free(mrb, stream_data->request_body->data);
-    mrb_free(mrb, stream_data->request_body);
+    mrb_http2_body_free(stream_data->request_body);
   }
+  if (stream_data->content_rec != NULL) {
+    mrb_http2_request_rec_free(mrb, stream_data->content_rec);
+    mrb_free(mrb, stream_data->content_rec);
+  }
+  upstream_collapse_leave(stream_data);
+  upstream_hedge_cancel(stream_data);
   if (stream_data->upstream_req != NULL) {
-    evhttp_request_free(stream_data->upstream_req);
+    mrb_http2_upstream_request_free(stream_data->upstream_req);
+  }
+  if (stream_data->upstream_backend != NULL) {
+    mrb_http2_balancer_release(stream_data->upstream_group, stream_data->upstream_backend,
+                               MRB_HTTP2_BALANCER_CANCELLED, 0);
+  }
+  if (stream_data->upstream != NULL) {
+    mrb_http2_free_nva(mrb, stream_data->nva, stream_data->nvlen);
+    mrb_http2_upstream_free(mrb, stream_data->upstream);
+  }
+  mrb_http2_cache_writer_free(stream_data->cache_writer);
+  if (stream_data->cache_entry != NULL) {
+    mrb_http2_cache_entry_unref(session_data->app_ctx->cache, stream_data->cache_entry);
+  }
+  mrb_free_unless_null(mrb, stream_data->cache_key);
+  if (stream_data->blocking_job != NULL) {
+    stream_data->blocking_job->stream_data = NULL;
   }
   if (session_data->app_ctx->server->config->server_status) {
-    session_data->app_ctx->server->worker->active_stream--;
+    MRB_HTTP2_WORKER_DEC(session_data->app_ctx->server->worker, active_stream);
   }
   mrb_free(mrb, stream_data);
 }
@@ -334,14 +591,19 @@ static void delete_http2_session_data(http2_session_data *session_data)
     delete_http2_stream_data(mrb, session_data, stream_data);
     stream_data = next;
   }
-  if (session_data->upstream_base != NULL) {
-    event_base_free(session_data->upstream_base);
+  if (config->server_status) {
+    MRB_HTTP2_WORKER_DEC(server->worker, connected_sessions);
+  }
+  if (session_data->prev != NULL) {
+    session_data->prev->next = session_data->next;
+  } else {
+    session_data->app_ctx->sessions = session_data->next;
   }
-  if (session_data->upstream_conn != NULL) {
-    evhttp_connection_free(session_data->upstream_conn);
+  if (session_data->next != NULL) {
+    session_data->next->prev = session_data->prev;
   }
-  if (config->server_status) {
-    server->worker->connected_sessions--;
+  if (session_data->app_ctx->draining && session_data->app_ctx->sessions == NULL) {
+    event_base_loopexit(session_data->app_ctx->evbase, NULL);
   }
   mrb_http2_conn_rec_free(mrb, session_data->conn);
   mrb_free(mrb, session_data);
@@ -466,25 +728,44 @@ static ssize_t upstream_read_callback(nghttp2_session *session, int32_t stream_i
 {
   ssize_t nread;
   http2_stream_data *stream_data = source->ptr;
-  struct evbuffer *upstream_buf;
+  mrb_http2_upstream_req *req = stream_data->upstream_req;
 
-  if (stream_data->upstream_req == NULL) {
+  // upstream failed in the middle of the body, so reset the stream
+  if (req == NULL || req->failed) {
     return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
   }
-  upstream_buf = evhttp_request_get_input_buffer(stream_data->upstream_req);
-  nread = evbuffer_remove(upstream_buf, buf, length);
+  nread = evbuffer_remove(req->body, buf, length);
   TRACER;
 
   if (nread == -1) {
     return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
   }
+  if (nread > 0) {
+    mrb_http2_upstream_request_consumed(req);
+    if (stream_data->cache_writer != NULL && mrb_http2_cache_writer_write(stream_data->cache_writer, buf, nread) != 0) {
+      mrb_http2_cache_writer_free(stream_data->cache_writer);
+      stream_data->cache_writer = NULL;
+      upstream_collapse_leave(stream_data);
+    }
+    upstream_collapse_notify(stream_data->collapse);
+  }
 
-  stream_data->readleft -= nread;
-  if (nread == 0 || stream_data->readleft == 0) {
-    if (stream_data->readleft != 0) {
-      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  if (req->finished && evbuffer_get_length(req->body) == 0) {
+    if (stream_data->cache_writer != NULL) {
+      mrb_http2_cache_writer_commit(stream_data->cache_writer);
+      stream_data->cache_writer = NULL;
+      if (stream_data->collapse != NULL) {
+        stream_data->collapse->finished = 1;
+        upstream_collapse_notify(stream_data->collapse);
+      }
     }
     *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    return nread;
+  }
+  if (nread == 0) {
+    // resumed by upstream_on_body or upstream_on_done
+    stream_data->upstream_deferred = 1;
+    return NGHTTP2_ERR_DEFERRED;
   }
   TRACER;
   return nread;
@@ -529,6 +810,78 @@ static int send_upstream_response(app_context *app_ctx, nghttp2_session *session
   return 0;
 }
 
+static ssize_t cache_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                                   uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+  ssize_t nread;
+  http2_stream_data *stream_data = source->ptr;
+  mrb_http2_cache_entry *entry = stream_data->cache_entry;
+
+  upstream_collapse *c = stream_data->collapse;
+
+  if (c != NULL && c->failed) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  nread = mrb_http2_cache_entry_read(entry, stream_data->cache_offset, buf, length);
+  TRACER;
+
+  if (nread == -1) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  stream_data->cache_offset += nread;
+  if (c != NULL && !c->finished) {
+    if (nread == 0) {
+      // resumed when the leader stored more of the body
+      stream_data->upstream_deferred = 1;
+      return NGHTTP2_ERR_DEFERRED;
+    }
+    return nread;
+  }
+  if (stream_data->cache_offset >= entry->bodylen) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return nread;
+}
+
+static int send_cache_response(app_context *app_ctx, nghttp2_session *session, nghttp2_nv *nva, size_t nvlen,
+                               http2_stream_data *stream_data)
+{
+  int rv;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_request_rec *r = app_ctx->r;
+  int i;
+
+  nghttp2_data_provider data_prd;
+  data_prd.source.ptr = stream_data;
+  data_prd.read_callback = cache_read_callback;
+
+  if (app_ctx->server->config->debug) {
+    for (i = 0; i < nvlen; i++) {
+      debug_header(__func__, nva[i].name, nva[i].namelen, nva[i].value, nva[i].valuelen);
+    }
+  }
+
+  TRACER;
+  rv = nghttp2_submit_response(session, stream_data->stream_id, nva, nvlen, &data_prd);
+  if (rv != 0) {
+    fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+    mrb_http2_request_rec_free(mrb, r);
+    return -1;
+  }
+  //
+  // "set_logging_cb" callback ruby block
+  //
+  if (app_ctx->server->config->callback) {
+    r->phase = MRB_HTTP2_SERVER_LOGGING;
+    callback_ruby_block(mrb, app_ctx->self, app_ctx->server->config->callback,
+                        app_ctx->server->config->cb_list->logging_cb, app_ctx->server->config->cb_list);
+  }
+
+  mrb_http2_request_rec_free(mrb, r);
+  TRACER;
+  return 0;
+}
+
 static ssize_t large_buf_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
                                        uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
 {
@@ -758,278 +1111,328 @@ static int upstream_reply(app_context *app_ctx, nghttp2_session *session, http2_
   return 0;
 }
 
-void http_request_done(struct evhttp_request *req, void *user_data)
+static void set_request_rec_from_stream(app_context *app_ctx, http2_stream_data *stream_data)
 {
-  struct mrb_http2_upstream_client *c = user_data;
-  mrb_state *mrb = c->app_ctx->server->mrb;
-  mrb_http2_request_rec *r = c->app_ctx->r;
-  int find_via = 0;
-
-  struct evkeyval *header;
-  struct evkeyvalq *input_headers;
-
-  if (req != NULL) {
-    input_headers = evhttp_request_get_input_headers(req);
-  } else {
-    c->stream_data->upstream_req = req;
-    event_base_loopexit(c->session_data->upstream_base, NULL);
-    return;
-  }
-
-  TRACER;
-  set_status_record(r, req->response_code);
-  fixup_status_header(mrb, r);
-
-  TAILQ_FOREACH(header, input_headers, next)
-  {
-    if (memcmp("Via", header->key, sizeof("Via") - 1) == 0) {
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, c->app_ctx->server->config->server_name);
-      r->reshdrslen += 1;
-      find_via = 1;
-    } else if (strlen(header->key) == sizeof("Connection") - 1 &&
-               memcmp("Connection", header->key, sizeof("Connection") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Transfer-Encoding") - 1 &&
-               memcmp("Transfer-Encoding", header->key, sizeof("Transfer-Encoding") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Keep-Alive") - 1 &&
-               memcmp("Keep-Alive", header->key, sizeof("Keep-Alive") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Proxy-Connection") - 1 &&
-               memcmp("Proxy-Connection", header->key, sizeof("Proxy-Connection") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Upgrade") - 1 &&
-               memcmp("Upgrade", header->key, sizeof("Upgrade") - 1) == 0) {
-      // do nothing
-    } else if (strlen(header->key) == sizeof("Location") - 1 &&
-               memcmp("Location", header->key, sizeof("Location") - 1) == 0) {
-      char *buf;
-      // "+ 1" is to http[s]
-      buf = alloca(strlen(header->value) - strlen(r->upstream->unparsed_host) + strlen(r->authority) + 1);
-      memcpy(buf, header->value, strlen(header->value) + 1);
-      mrb_http2_strrep(buf, r->upstream->unparsed_host, r->authority);
-
-      // scheme checke
-      // TODO: http(front) <=> https(back) check
-      if (strlen(r->scheme) == 5 && memcmp(buf, r->scheme, strlen(r->scheme)) != 0) {
-        mrb_http2_strrep(buf, (char *)"http", r->scheme);
-      }
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
 
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, buf);
-      r->reshdrslen += 1;
-    } else {
-      MRB_HTTP2_CREATE_NV_CS_CS(mrb, &r->reshdrs[r->reshdrslen], header->key, header->value);
-      r->reshdrslen += 1;
-    }
-  }
-  if (!find_via) {
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "via", c->app_ctx->server->config->server_name);
-    r->reshdrslen += 1;
-  }
+  // r-> will free at request_rec_free
+  r->filename = mrb_http2_strcat(mrb, config->document_root, stream_data->request_path);
 
-  c->stream_data->readleft = req->body_size;
-  snprintf(r->content_length, 64, "%ld", req->body_size);
-  c->stream_data->upstream_req = req;
-  event_base_loopexit(c->session_data->upstream_base, NULL);
+  r->authority = stream_data->authority;
+  r->scheme = stream_data->scheme;
+  r->method = stream_data->method;
+  r->unparsed_uri = stream_data->unparsed_uri;
+  r->percent_encode_uri = stream_data->percent_encode_uri;
+  r->uri = stream_data->request_path;
+  r->args = stream_data->request_args;
+  r->response_type = MRB_HTTP2_RESPONSE_TYPE_NONE;
 
-  TRACER;
+  r->request_body = stream_data->request_body;
 }
 
-static int read_upstream_response(http2_session_data *session_data, app_context *app_ctx, nghttp2_session *session,
-                                  http2_stream_data *stream_data)
+// request_rec is shared by all streams, so set it again from the stream when
+// the upstream response arrives
+static void restore_upstream_request_rec(http2_stream_data *stream_data)
 {
-  struct evhttp_request *req;
-  struct mrb_http2_upstream_client *c;
+  http2_session_data *session_data = stream_data->session_data;
+  app_context *app_ctx = session_data->app_ctx;
   mrb_http2_request_rec *r = app_ctx->r;
-  mrb_state *mrb = app_ctx->server->mrb;
-  size_t len;
-  int i;
-  int method;
-  char *cookiebuf = NULL;
-  size_t cookiebuflen = 0;
-  size_t cookiebaselen = 0;
-  char root_path[] = "/";
+  time_t now = time(NULL);
 
-  TRACER;
-  if (session_data->upstream_base == NULL) {
-    session_data->upstream_base = event_base_new();
-  }
-  if (session_data->upstream_conn == NULL) {
-    session_data->upstream_conn =
-        evhttp_connection_base_new(session_data->upstream_base, NULL, r->upstream->host, r->upstream->port);
-  }
-  if (session_data->upstream_conn == NULL) {
-    fprintf(stderr, "evhttp_connection_base_new failed");
-    return -1;
+  if (now != r->prev_req_time) {
+    r->prev_req_time = now;
+    set_http_date_str(&now, r->date);
   }
+  r->conn = session_data->conn;
+  r->reqhdr = stream_data->nva;
+  r->reqhdrlen = stream_data->nvlen;
+  set_request_rec_from_stream(app_ctx, stream_data);
 
-  c = (struct mrb_http2_upstream_client *)alloca(sizeof(struct mrb_http2_upstream_client));
-  c->app_ctx = app_ctx;
-  c->stream_data = stream_data;
-  c->session = session;
-  c->session_data = session_data;
-
-  req = evhttp_request_new(http_request_done, c);
-  if (req == NULL) {
-    fprintf(stderr, "evhttp_request_new failed");
-    return -1;
-  }
-  evhttp_request_own(req);
+  // request_rec_free will free upstream and request headers from now
+  r->upstream = stream_data->upstream;
+  stream_data->upstream = NULL;
+}
 
-  len = strlen(r->upstream->host) + sizeof(":65525");
-  r->upstream->unparsed_host = alloca(len);
-  snprintf(r->upstream->unparsed_host, len, "%s:%d", r->upstream->host, r->upstream->port);
-  r->upstream->unparsed_host[len] = '\0';
+// request attribute hashed by a maglev upstream group, NULL when the request
+// doesn't have it
+static const uint8_t *upstream_balancer_key(http2_stream_data *stream_data, mrb_http2_balancer_group *group,
+                                            size_t *keylen)
+{
+  size_t i;
+  const uint8_t *p, *end;
 
-  evhttp_add_header(req->output_headers, "Host", r->upstream->unparsed_host);
-  req->major = r->upstream->proto_major;
-  req->minor = r->upstream->proto_minor;
-  if (!r->upstream->keepalive && r->upstream->proto_minor == 1) {
-    evhttp_add_header(req->output_headers, "Connection", "close");
+  if (group->policy != MRB_HTTP2_BALANCER_MAGLEV) {
+    return NULL;
   }
-
-  // r->reqhdr don't include HTTP/2 specified headders
-  for (i = 0; i < r->reqhdrlen; i++) {
-    char keybuf[4096], valbuf[4096];
-    size_t len;
-
-    if (memcmp("cookie", r->reqhdr[i].name, 6) == 0) {
-      cookiebaselen = cookiebuflen;
-      cookiebuflen += r->reqhdr[i].valuelen + 2;
-      cookiebuf = mrb_realloc(mrb, cookiebuf, cookiebuflen);
-      memcpy(cookiebuf + cookiebaselen, r->reqhdr[i].value, r->reqhdr[i].valuelen);
-      memcpy(cookiebuf + cookiebaselen + r->reqhdr[i].valuelen, "; ", 2);
-    } else {
-      len = r->reqhdr[i].namelen;
-      if (len > 4096)
-        len = 4096;
-      memcpy(keybuf, r->reqhdr[i].name, len);
-      keybuf[len] = '\0';
-
-      len = r->reqhdr[i].valuelen;
-      if (len > 4096)
-        len = 4096;
-      memcpy(valbuf, r->reqhdr[i].value, len);
-      valbuf[len] = '\0';
-
-      evhttp_add_header(req->output_headers, keybuf, valbuf);
+  if (group->key_type == MRB_HTTP2_BALANCER_KEY_URI) {
+    if (stream_data->unparsed_uri == NULL) {
+      return NULL;
     }
-  }
-  if (cookiebuf != NULL) {
-    cookiebuf[cookiebuflen] = '\0';
-    evhttp_add_header(req->output_headers, "Cookie", cookiebuf);
-    mrb_free(mrb, cookiebuf);
+    *keylen = strlen(stream_data->unparsed_uri);
+    return (uint8_t *)stream_data->unparsed_uri;
   }
 
-  if (app_ctx->server->config->debug) {
-    int i = 0;
-    struct evkeyval *header;
-    struct evkeyvalq *output_headers = evhttp_request_get_output_headers(req);
-    fprintf(stderr, "== DBUEG: request header at proxy START\n");
-    TAILQ_FOREACH(header, output_headers, next)
-    {
-      fprintf(stderr, "%s: nva[%d]={name=%s, value=%s}\n", __func__, i, header->key, header->value);
-      i++;
-    }
-    fprintf(stderr, "== DBUEG: request header at proxy END\n");
-  }
+  for (i = 0; i < stream_data->nvlen; i++) {
+    nghttp2_nv *nv = &stream_data->nva[i];
 
-  // POST check
-  if (memcmp(r->method, "POST", 4) == 0) {
-    if (r->request_body != NULL) {
-      evbuffer_add(req->output_buffer, r->request_body, strlen(r->request_body));
+    if (group->key_type == MRB_HTTP2_BALANCER_KEY_HEADER) {
+      if (nv->namelen == group->key_namelen && memcmp(group->key_name, nv->name, nv->namelen) == 0) {
+        *keylen = nv->valuelen;
+        return nv->value;
+      }
+      continue;
     }
-    method = EVHTTP_REQ_POST;
-    if (app_ctx->server->config->debug) {
-      fprintf(stderr, "== DEBUG: send POST method to upstream server\n");
-      fprintf(stderr, "== DEBUG: request body=%s\n", r->request_body);
+
+    // "cookie: a=b; name=value"
+    if (nv->namelen != sizeof("cookie") - 1 || memcmp("cookie", nv->name, nv->namelen) != 0) {
+      continue;
     }
-  } else {
-    method = EVHTTP_REQ_GET;
-    if (app_ctx->server->config->debug) {
-      fprintf(stderr, "== DEBUG: send GET method to upstream server\n");
+    p = nv->value;
+    end = nv->value + nv->valuelen;
+    while (p < end) {
+      const uint8_t *crumb_end = memchr(p, ';', end - p);
+      if (crumb_end == NULL) {
+        crumb_end = end;
+      }
+      while (p < crumb_end && *p == ' ') {
+        p++;
+      }
+      if ((size_t)(crumb_end - p) > group->key_namelen && memcmp(group->key_name, p, group->key_namelen) == 0 &&
+          p[group->key_namelen] == '=') {
+        p += group->key_namelen + 1;
+        *keylen = crumb_end - p;
+        return p;
+      }
+      p = crumb_end + 1;
     }
   }
-  if (r->upstream->uri == NULL) {
-    r->upstream->uri = root_path;
+  return NULL;
+}
+
+static void upstream_balancer_release(http2_stream_data *stream_data, mrb_http2_balancer_result result)
+{
+  if (stream_data->upstream_backend == NULL) {
+    return;
   }
+  mrb_http2_balancer_release(stream_data->upstream_group, stream_data->upstream_backend, result,
+                             mrb_http2_balancer_now() - stream_data->upstream_start);
+  stream_data->upstream_backend = NULL;
+}
 
-  if (evhttp_make_request(session_data->upstream_conn, req, method, r->upstream->uri) == -1) {
-    evhttp_request_free(req);
-    fprintf(stderr, "evhttp_connection_base_new failed");
-    return -1;
+static void upstream_session_send(http2_session_data *session_data)
+{
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
   }
+}
 
-  evhttp_connection_set_timeout(req->evcon, r->upstream->timeout);
-  event_base_dispatch(session_data->upstream_base);
-  if (stream_data->upstream_req == NULL) {
-    return -1;
+static void upstream_resume_stream(http2_stream_data *stream_data)
+{
+  http2_session_data *session_data = stream_data->session_data;
+
+  if (!stream_data->upstream_deferred) {
+    return;
   }
-  TRACER;
+  stream_data->upstream_deferred = 0;
+  nghttp2_session_resume_data(session_data->session, stream_data->stream_id);
+  upstream_session_send(session_data);
+}
 
-  return 0;
+// give the flow-control window back for the streamed request body written
+// to upstream, or all of it when upstream doesn't take it any more
+static void upstream_request_body_consume(http2_stream_data *stream_data)
+{
+  size_t pending = 0;
+
+  if (stream_data->upstream_req != NULL && !stream_data->upstream_req->finished) {
+    pending = mrb_http2_upstream_request_body_pending(stream_data->upstream_req);
+  }
+  if (stream_data->request_unconsumed > pending) {
+    nghttp2_session_consume(stream_data->session_data->session, stream_data->stream_id,
+                            stream_data->request_unconsumed - pending);
+    stream_data->request_unconsumed = pending;
+  }
 }
 
-static int content_cb_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+// translate upstream response headers into r->reshdrs, age and
+// content-length are skipped for a cached response. the headers are referred
+// without copying, they live in the upstream request or the cache entry until
+// the stream is closed
+static void upstream_set_response_headers(app_context *app_ctx, nghttp2_nv *headers, size_t headerslen,
+                                          char *unparsed_host, int cached)
 {
   mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
   mrb_state *mrb = app_ctx->server->mrb;
+  const char *server_name = app_ctx->server->config->server_name;
+  uint8_t tokens[MRB_HTTP2_HEADER_MAX];
+  nghttp2_nv *connection = NULL;
+  size_t i;
 
-  int rv;
-  int pipefd[2];
-  int64_t size;
-
-  TRACER;
-  rv = pipe(pipefd);
-  if (rv != 0) {
-    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-    mrb_http2_request_rec_free(mrb, r);
-    if (rv != 0) {
-      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-      return -1;
+  for (i = 0; i < headerslen; i++) {
+    tokens[i] = mrb_http2_header_lookup(headers[i].name, headers[i].namelen);
+    if (tokens[i] == MRB_HTTP2_HEADER_TOKEN_CONNECTION) {
+      connection = &headers[i];
     }
-    return 0;
   }
-  r->write_large_buf = NULL;
-  r->write_fd = pipefd[1];
 
-  //
-  // "set_content" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_CONTENT;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->content_cb, config->cb_list);
-  }
+  for (i = 0; i < headerslen && r->reshdrslen < MRB_HTTP2_HEADER_MAX - 1; i++) {
+    nghttp2_nv *nv = &headers[i];
 
-  fixup_status_header(mrb, r);
+    switch (tokens[i]) {
+    case MRB_HTTP2_HEADER_TOKEN_VIA:
+      // replaced with ours below
+      continue;
+    case MRB_HTTP2_HEADER_TOKEN_LOCATION: {
+      char *buf;
+      // "+ 1" is to http[s]
+      buf = alloca(nv->valuelen + strlen(r->authority) + 1 + 1);
+      memcpy(buf, nv->value, nv->valuelen);
+      buf[nv->valuelen] = '\0';
+      mrb_http2_strrep(buf, unparsed_host, r->authority);
 
-  // create headers for HTTP/2
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+      // scheme checke
+      // TODO: http(front) <=> https(back) check
+      if (strlen(r->scheme) == 5 && memcmp(buf, r->scheme, strlen(r->scheme)) != 0) {
+        mrb_http2_strrep(buf, (char *)"http", r->scheme);
+      }
+
+      MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "location", buf);
+      r->reshdrslen += 1;
+      continue;
+    }
+    case MRB_HTTP2_HEADER_TOKEN_AGE:
+    case MRB_HTTP2_HEADER_TOKEN_CONTENT_LENGTH:
+      if (cached) {
+        // set from the cache entry
+        continue;
+      }
+      break;
+    default:
+      if (mrb_http2_header_hop_by_hop(tokens[i])) {
+        continue;
+      }
+      break;
+    }
+    if (connection != NULL && mrb_http2_header_connection_listed(connection, nv->name, nv->namelen)) {
+      continue;
+    }
+    mrb_http2_ref_nv(&r->reshdrs[r->reshdrslen], nv->name, nv->namelen, nv->value, nv->valuelen);
+    r->reshdrslen += 1;
+  }
+
+  // server_name lives as long as the server
+  mrb_http2_ref_nv(&r->reshdrs[r->reshdrslen], (uint8_t *)"via", sizeof("via") - 1, (uint8_t *)server_name,
+                   strlen(server_name));
   r->reshdrslen += 1;
+}
 
-  if (r->status >= 200 && r->status < 300) {
-    size = r->write_size;
-  } else {
-    const char *msg = mrb_http2_error_message(r->status);
-    size = strlen(msg);
-    rv = write(pipefd[1], msg, size);
+// refer client request headers from the upstream request, returns 1 when
+// content-length is included. crumbs of cookie are joined into one header.
+// headers are copied for a request outliving the stream like revalidation
+// or a mirror, and conditional headers of the client are left out for
+// revalidation
+#define UPSTREAM_HEADERS_COPY 0x1
+#define UPSTREAM_HEADERS_REVALIDATE (0x2 | UPSTREAM_HEADERS_COPY)
+
+static int upstream_add_request_headers(mrb_state *mrb, mrb_http2_upstream_req *req, const nghttp2_nv *nva,
+                                        size_t nvlen, int flags)
+{
+  int revalidate = (flags & UPSTREAM_HEADERS_REVALIDATE) == UPSTREAM_HEADERS_REVALIDATE;
+  int copy = flags & UPSTREAM_HEADERS_COPY;
+  size_t i;
+  int has_content_length = 0;
+  mrb_http2_header_token token;
+  const nghttp2_nv *cookie = NULL;
+  size_t cookies = 0;
+  size_t cookielen = 0;
+  char *cookiebuf, *p;
+
+  for (i = 0; i < nvlen; i++) {
+    const nghttp2_nv *nv = &nva[i];
+
+    token = mrb_http2_header_lookup(nv->name, nv->namelen);
+    switch (token) {
+    case MRB_HTTP2_HEADER_TOKEN_COOKIE:
+      cookie = nv;
+      cookies++;
+      cookielen += nv->valuelen + 2;
+      continue;
+    case MRB_HTTP2_HEADER_TOKEN_HOST:
+      // Host is made from upstream
+      continue;
+    case MRB_HTTP2_HEADER_TOKEN_CONTENT_LENGTH:
+      has_content_length = 1;
+      break;
+    case MRB_HTTP2_HEADER_TOKEN_OTHER:
+      if (revalidate && nv->namelen > sizeof("if-") - 1 && memcmp("if-", nv->name, sizeof("if-") - 1) == 0) {
+        // replaced with the validators of the cached response
+        continue;
+      }
+      break;
+    default:
+      if (mrb_http2_header_hop_by_hop(token)) {
+        continue;
+      }
+      break;
+    }
+    if (copy) {
+      mrb_http2_upstream_request_add_header(req, nv->name, nv->namelen, nv->value, nv->valuelen);
+    } else {
+      mrb_http2_upstream_request_add_header_ref(req, nv->name, nv->namelen, nv->value, nv->valuelen);
+    }
   }
 
-  close(pipefd[1]);
-  if (r->write_large_buf != NULL) {
-    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+  if (cookies == 1 && !copy) {
+    mrb_http2_upstream_request_add_header_ref(req, cookie->name, cookie->namelen, cookie->value, cookie->valuelen);
+  } else if (cookies > 0) {
+    // HTTP/2 splits cookie into crumbs, joined by "; " in one allocation
+    cookiebuf = p = mrb_malloc(mrb, cookielen);
+    for (i = 0; i < nvlen; i++) {
+      if (mrb_http2_header_lookup(nva[i].name, nva[i].namelen) == MRB_HTTP2_HEADER_TOKEN_COOKIE) {
+        memcpy(p, nva[i].value, nva[i].valuelen);
+        p += nva[i].valuelen;
+        *p++ = ';';
+        *p++ = ' ';
+      }
+    }
+    // strip the last "; "
+    mrb_http2_upstream_request_add_header(req, (uint8_t *)"cookie", sizeof("cookie") - 1, (uint8_t *)cookiebuf,
+                                          cookielen - 2);
+    mrb_free(mrb, cookiebuf);
   }
-  stream_data->fd = pipefd[0];
-  stream_data->readleft = size;
+  return has_content_length;
+}
+
+// send a stored response, the stream holds the entry until the body is sent
+static int cache_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data,
+                       mrb_http2_cache_entry *entry, int64_t content_length)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+  char age[32];
+
   TRACER;
+  set_status_record(r, entry->status);
+  fixup_status_header(mrb, r);
+  upstream_set_response_headers(app_ctx, entry->headers, entry->headerslen, entry->unparsed_host, 1);
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)size);
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  snprintf(age, sizeof(age), "%ld", (long)mrb_http2_cache_age(entry, time(NULL)));
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "age", age);
   r->reshdrslen += 1;
+  if (content_length >= 0) {
+    snprintf(r->content_length, 64, "%ld", (long)content_length);
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+    r->reshdrslen += 1;
+  } else {
+    r->content_length[0] = '\0';
+  }
+
+  mrb_http2_cache_entry_ref(entry);
+  stream_data->cache_entry = entry;
+  stream_data->cache_offset = 0;
 
   //
   // "set_fixups_cb" callback ruby block
@@ -1038,405 +1441,2014 @@ static int content_cb_reply(app_context *app_ctx, nghttp2_session *session, http
     r->phase = MRB_HTTP2_SERVER_FIXUPS;
     callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
   }
-  if (r->write_large_buf == NULL) {
-    TRACER;
-    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      return -1;
-    }
-  } else {
-    TRACER;
-    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      mrb_http2_large_buf_free(r->write_large_buf);
-      free(r->write_large_buf);
-      r->write_large_buf = NULL;
-      return -1;
-    }
+
+  if (send_cache_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+    return -1;
   }
   TRACER;
   return 0;
 }
 
-static int mruby_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+// serve a stale response instead of an upstream error, returns 1 when there
+// is none to serve
+static int cache_stale_if_error_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
 {
-  mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
-  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_cache_entry *entry;
+  upstream_collapse *c;
 
-  int rv;
-  int pipefd[2];
-  mrb_state *mrb_inner;
-  struct mrb_parser_state *p = NULL;
-  struct RProc *proc = NULL;
-  FILE *rfp;
-  mrbc_context *c;
-  int64_t size;
+  if (app_ctx->cache == NULL || stream_data->cache_key == NULL) {
+    return 1;
+  }
+  entry = mrb_http2_cache_lookup(app_ctx->cache, stream_data->cache_key, stream_data->cache_keylen, stream_data->nva,
+                                 stream_data->nvlen);
+  if (entry == NULL || !mrb_http2_cache_stale_usable(entry, time(NULL), MRB_HTTP2_CACHE_STALE_IF_ERROR)) {
+    return 1;
+  }
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "serve stale cache on upstream error: %s\n", stream_data->cache_key);
+  }
 
-  if (r->shared_mruby) {
-    // share one mrb_state
-    mrb_inner = mrb;
-  } else if (r->mruby) {
-    // when use new mrb_state
-    mrb_inner = mrb_open();
-  } else {
-    mrb_inner = mrb_open();
+  // streams waiting on this request get the stale response too
+  c = stream_data->collapse;
+  if (c != NULL && c->leader == stream_data && c->entry == NULL) {
+    mrb_http2_cache_entry_ref(entry);
+    c->entry = entry;
+    c->content_length = entry->bodylen;
+    c->headers = 1;
+    c->finished = 1;
   }
+  return cache_reply(app_ctx, session, stream_data, entry, entry->bodylen) == 0 ? 0 : -1;
+}
 
-  rfp = fopen(r->filename, "r");
-  if (rfp == NULL) {
-    if (r->mruby) {
-      mrb_close(mrb_inner);
-    }
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+// conditional request refreshing a stale entry in the background while it is
+// served within stale-while-revalidate
+typedef struct {
+  app_context *app_ctx;
+  mrb_http2_cache_entry *entry;
+  mrb_http2_cache_writer *writer;
+  mrb_http2_balancer_group *group;
+  mrb_http2_balancer_backend *backend;
+  double start;
+} cache_revalidation;
+
+static void cache_revalidation_drain(cache_revalidation *rv, mrb_http2_upstream_req *req)
+{
+  uint8_t buf[4096];
+  int n;
+
+  while ((n = evbuffer_remove(req->body, buf, sizeof(buf))) > 0) {
+    if (rv->writer != NULL && mrb_http2_cache_writer_write(rv->writer, buf, n) != 0) {
+      mrb_http2_cache_writer_free(rv->writer);
+      rv->writer = NULL;
     }
-    return 0;
   }
+  mrb_http2_upstream_request_consumed(req);
+}
 
-  TRACER;
-  rv = pipe(pipefd);
-  if (rv != 0) {
-    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-    mrb_http2_request_rec_free(mrb, r);
-    if (rv != 0) {
-      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-      return -1;
-    }
-    return 0;
+static void cache_revalidation_release(cache_revalidation *rv, mrb_http2_balancer_result result)
+{
+  if (rv->backend == NULL) {
+    return;
   }
+  mrb_http2_balancer_release(rv->group, rv->backend, result, mrb_http2_balancer_now() - rv->start);
+  rv->backend = NULL;
+}
 
-  r->write_large_buf = NULL;
-  r->write_fd = pipefd[1];
-  c = mrbc_context_new(mrb_inner);
-  mrbc_filename(mrb_inner, c, r->filename);
-  p = mrb_parse_file(mrb_inner, rfp, c);
-  fclose(rfp);
-  proc = mrb_generate_code(mrb_inner, p);
-  mrb_pool_close(p->pool);
-  mrb_run(mrb_inner, proc, app_ctx->self);
+static void cache_revalidation_on_header(mrb_http2_upstream_req *req, void *ud)
+{
+  cache_revalidation *rv = (cache_revalidation *)ud;
+  mrb_http2_cache_entry *entry = rv->entry;
+  time_t now = time(NULL);
 
-  if (mrb_inner->exc) {
-    mrb_print_error(mrb_inner);
-    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
-    mrb_inner->exc = 0;
-  } else {
-    set_status_record(r, HTTP_OK);
+  TRACER;
+  cache_revalidation_release(rv, (req->status == 502 || req->status == 503 || req->status == 504)
+                                     ? MRB_HTTP2_BALANCER_FAILED
+                                     : MRB_HTTP2_BALANCER_OK);
+  if (req->status == 304) {
+    mrb_http2_cache_entry_refresh(entry, req->headers, req->headerslen, now);
+    return;
   }
-  mrbc_context_free(mrb_inner, c);
 
-  // when use new mrb_state
-  if (r->mruby) {
-    mrb_close(mrb_inner);
+  // the stale entry is kept when the new response can't be stored
+  rv->writer = mrb_http2_cache_writer_new(rv->app_ctx->cache, entry->key, entry->keylen, req->reqhdrs,
+                                          req->reqhdrslen, req->status, req->headers, req->headerslen,
+                                          req->content_length, entry->unparsed_host, now);
+}
+
+static void cache_revalidation_on_body(mrb_http2_upstream_req *req, void *ud)
+{
+  cache_revalidation_drain((cache_revalidation *)ud, req);
+}
+
+static void cache_revalidation_on_done(mrb_http2_upstream_req *req, int error, void *ud)
+{
+  cache_revalidation *rv = (cache_revalidation *)ud;
+  app_context *app_ctx = rv->app_ctx;
+
+  TRACER;
+  cache_revalidation_release(rv, MRB_HTTP2_BALANCER_FAILED);
+  if (!error && !req->failed) {
+    cache_revalidation_drain(rv, req);
+    if (rv->writer != NULL) {
+      mrb_http2_cache_writer_commit(rv->writer);
+      rv->writer = NULL;
+    }
   }
+  mrb_http2_cache_writer_free(rv->writer);
+  rv->entry->revalidating = 0;
+  mrb_http2_cache_entry_unref(app_ctx->cache, rv->entry);
+  mrb_http2_upstream_request_free(req);
+  mrb_free(app_ctx->server->mrb, rv);
+}
 
-  fixup_status_header(mrb, r);
+static const mrb_http2_upstream_handler cache_revalidation_handler = {
+    cache_revalidation_on_header, cache_revalidation_on_body, cache_revalidation_on_done, NULL,
+};
 
-  // create headers for HTTP/2
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
-  r->reshdrslen += 1;
-  if (r->status >= 200 && r->status < 300) {
-    size = r->write_size;
-  } else {
-    const char *msg = mrb_http2_error_message(r->status);
-    size = strlen(msg);
-    rv = write(pipefd[1], msg, size);
+static void cache_revalidate(app_context *app_ctx, http2_stream_data *stream_data, mrb_http2_cache_entry *entry)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_upstream upstream = *r->upstream;
+  mrb_http2_upstream_req *req;
+  cache_revalidation *rv;
+  size_t i;
+
+  if (entry->revalidating) {
+    return;
   }
   TRACER;
-  close(pipefd[1]);
-  if (r->write_large_buf != NULL) {
-    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+  rv = (cache_revalidation *)mrb_calloc(mrb, 1, sizeof(cache_revalidation));
+  rv->app_ctx = app_ctx;
+  rv->entry = entry;
+
+  if (upstream.group != NULL) {
+    const uint8_t *key;
+    size_t keylen = 0;
+
+    key = upstream_balancer_key(stream_data, upstream.group, &keylen);
+    rv->group = upstream.group;
+    rv->backend = mrb_http2_balancer_select(upstream.group, key, keylen);
+    rv->start = mrb_http2_balancer_now();
+    upstream.host = rv->backend->host;
+    upstream.port = rv->backend->port;
+  }
+  if (upstream.uri == NULL) {
+    upstream.uri = (char *)"/";
+  }
+  upstream.unparsed_host = mrb_http2_upstream_authority(upstream.host, upstream.port);
+
+  req = mrb_http2_upstream_request_new(app_ctx->upstream_pool, &cache_revalidation_handler, rv);
+  upstream_add_request_headers(mrb, req, stream_data->nva, stream_data->nvlen, UPSTREAM_HEADERS_REVALIDATE);
+  for (i = 0; i < entry->headerslen; i++) {
+    nghttp2_nv *nv = &entry->headers[i];
+
+    if (nv->namelen == sizeof("etag") - 1 && memcmp("etag", nv->name, nv->namelen) == 0) {
+      mrb_http2_upstream_request_add_header(req, (uint8_t *)"if-none-match", sizeof("if-none-match") - 1,
+                                            nv->value, nv->valuelen);
+    } else if (nv->namelen == sizeof("last-modified") - 1 && memcmp("last-modified", nv->name, nv->namelen) == 0) {
+      mrb_http2_upstream_request_add_header(req, (uint8_t *)"if-modified-since", sizeof("if-modified-since") - 1,
+                                            nv->value, nv->valuelen);
+    }
   }
-  stream_data->fd = pipefd[0];
-  stream_data->readleft = size;
-  TRACER;
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)size);
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
-  r->reshdrslen += 1;
+  if (mrb_http2_upstream_request_send(req, &upstream, "GET") != 0) {
+    cache_revalidation_release(rv, MRB_HTTP2_BALANCER_FAILED);
+    mrb_http2_upstream_request_free(req);
+    mrb_free(mrb, rv);
+    free(upstream.unparsed_host);
+    return;
+  }
+  free(upstream.unparsed_host);
+  entry->revalidating = 1;
+  mrb_http2_cache_entry_ref(entry);
+}
 
-  //
-  // "set_fixups_cb" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+// reply from the proxy cache before sending the request to upstream, returns
+// 1 when the request must go to upstream
+static int cache_lookup_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_upstream *upstream = r->upstream;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_cache_entry *entry;
+  const char *uri;
+  size_t len;
+  int lookup;
+  time_t now;
+
+  if (app_ctx->cache == NULL ||
+      mrb_http2_cache_request_cacheable(r->method, stream_data->nva, stream_data->nvlen, &lookup) != 0) {
+    return 1;
   }
 
-  if (r->write_large_buf == NULL) {
-    TRACER;
-    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      return -1;
-    }
+  // "group:name /path" or "host:port /path"
+  uri = upstream->uri != NULL ? upstream->uri : "/";
+  if (upstream->group != NULL) {
+    len = sizeof("group: ") + strlen(upstream->group->name) + strlen(uri);
+    stream_data->cache_key = mrb_malloc(mrb, len);
+    snprintf(stream_data->cache_key, len, "group:%s %s", upstream->group->name, uri);
   } else {
-    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-      close(pipefd[0]);
-      mrb_http2_large_buf_free(r->write_large_buf);
-      free(r->write_large_buf);
-      r->write_large_buf = NULL;
-      return -1;
+    len = strlen(upstream->host) + sizeof(":65535 ") + strlen(uri);
+    stream_data->cache_key = mrb_malloc(mrb, len);
+    snprintf(stream_data->cache_key, len, "%s:%d %s", upstream->host, upstream->port, uri);
+  }
+  stream_data->cache_keylen = strlen(stream_data->cache_key);
+
+  if (!lookup) {
+    return 1;
+  }
+  entry = mrb_http2_cache_lookup(app_ctx->cache, stream_data->cache_key, stream_data->cache_keylen, stream_data->nva,
+                                 stream_data->nvlen);
+  if (entry == NULL) {
+    return 1;
+  }
+  now = time(NULL);
+  if (!mrb_http2_cache_fresh(entry, now)) {
+    if (!mrb_http2_cache_stale_usable(entry, now, MRB_HTTP2_CACHE_STALE_WHILE_REVALIDATE)) {
+      return 1;
     }
+    cache_revalidate(app_ctx, stream_data, entry);
   }
-  TRACER;
-  return 0;
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "found cache: %s\n", stream_data->cache_key);
+  }
+  return cache_reply(app_ctx, session, stream_data, entry, entry->bodylen) == 0 ? 0 : -1;
 }
 
-/* Inspired by h2o header lookup.  https://github.com/h2o/h2o */
-/* Reference as nghttp2 header lookup.  https://github.com/tatsuhiro-t/nghttp2
- */
-
-static int memeq(const void *a, const void *b, size_t n)
+// the first of hedged requests answering is kept in upstream_req and the
+// other is cancelled
+static void upstream_hedge_settle(http2_stream_data *stream_data, mrb_http2_upstream_req *req)
 {
-  return memcmp(a, b, n) == 0;
-}
+  mrb_http2_upstream *upstream = stream_data->upstream;
 
-#define streq(A, B, N) ((sizeof((A)) - 1) == (N) && memeq((A), (B), (N)))
-
-typedef enum {
-  NGHTTP2_TOKEN__AUTHORITY,
-  NGHTTP2_TOKEN__METHOD,
-  NGHTTP2_TOKEN__PATH,
-  NGHTTP2_TOKEN__SCHEME,
-  NGHTTP2_TOKEN_HOST,
-} nghttp2_token;
+  if (req != stream_data->hedge_req) {
+    upstream_hedge_cancel(stream_data);
+  } else {
+    upstream_balancer_release(stream_data, MRB_HTTP2_BALANCER_CANCELLED);
+    mrb_http2_upstream_request_free(stream_data->upstream_req);
+    stream_data->upstream_req = req;
+    stream_data->upstream_backend = stream_data->hedge_backend;
+    stream_data->upstream_start = stream_data->hedge_start;
+    stream_data->hedge_req = NULL;
+    stream_data->hedge_backend = NULL;
+  }
+
+  // location is rewritten for the backend answered
+  if (upstream->port != req->port || strcmp(upstream->host, req->host) != 0) {
+    free(upstream->host);
+    upstream->host = strdup(req->host);
+    upstream->port = req->port;
+    free(upstream->unparsed_host);
+    upstream->unparsed_host = strdup(req->authority);
+  }
+}
 
-static int lookup_token(const uint8_t *name, size_t namelen)
+// returns 1 when the failed request was one of hedged requests and the other
+// is still waiting for the response
+static int upstream_hedge_fail(http2_stream_data *stream_data, mrb_http2_upstream_req *req)
 {
-  switch (namelen) {
-  case 5:
-    switch (name[namelen - 1]) {
-    case 'h':
-      if (streq(":pat", name, 4)) {
-        return NGHTTP2_TOKEN__PATH;
-      }
-      break;
-    }
-    break;
-  case 7:
-    switch (name[namelen - 1]) {
-    case 'd':
-      if (streq(":metho", name, 6)) {
-        return NGHTTP2_TOKEN__METHOD;
-      }
-      break;
-    case 'e':
-      if (streq(":schem", name, 6)) {
-        return NGHTTP2_TOKEN__SCHEME;
-      }
-      break;
-    }
-    break;
-  case 10:
-    switch (name[namelen - 1]) {
-    case 'y':
-      if (streq(":authorit", name, 9)) {
-        return NGHTTP2_TOKEN__AUTHORITY;
-      }
-      break;
-    }
-    break;
+  if (stream_data->hedge_req == NULL) {
+    return 0;
   }
-  return -1;
+  if (req == stream_data->hedge_req) {
+    mrb_http2_balancer_release(stream_data->upstream_group, stream_data->hedge_backend, MRB_HTTP2_BALANCER_FAILED,
+                               mrb_http2_balancer_now() - stream_data->hedge_start);
+    stream_data->hedge_backend = NULL;
+    upstream_hedge_cancel(stream_data);
+    return 1;
+  }
+
+  upstream_balancer_release(stream_data, MRB_HTTP2_BALANCER_FAILED);
+  mrb_http2_upstream_request_free(stream_data->upstream_req);
+  stream_data->upstream_req = stream_data->hedge_req;
+  stream_data->upstream_backend = stream_data->hedge_backend;
+  stream_data->upstream_start = stream_data->hedge_start;
+  stream_data->hedge_req = NULL;
+  stream_data->hedge_backend = NULL;
+  return 1;
 }
 
-static int server_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
-                                     size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
-                                     void *user_data)
+static void upstream_on_header(mrb_http2_upstream_req *req, void *ud)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  http2_stream_data *stream_data = (http2_stream_data *)ud;
+  http2_session_data *session_data = stream_data->session_data;
+  app_context *app_ctx = session_data->app_ctx;
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  int rv;
 
-  http2_stream_data *stream_data;
-  nghttp2_nv nv;
+  TRACER;
+  // a gateway error doesn't win over the other of hedged requests
+  if ((req->status == 502 || req->status == 503 || req->status == 504) && upstream_hedge_fail(stream_data, req)) {
+    return;
+  }
+  upstream_hedge_settle(stream_data, req);
+  upstream_balancer_release(stream_data, (req->status == 502 || req->status == 503 || req->status == 504)
+                                             ? MRB_HTTP2_BALANCER_FAILED
+                                             : MRB_HTTP2_BALANCER_OK);
+  restore_upstream_request_rec(stream_data);
 
-  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-    return 0;
+  // serve a stale response instead of the upstream error
+  if (req->status >= 500 && (rv = cache_stale_if_error_reply(app_ctx, session_data->session, stream_data)) != 1) {
+    if (rv != 0) {
+      nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                NGHTTP2_INTERNAL_ERROR);
+    }
+    upstream_collapse_leave(stream_data);
+    mrb_http2_upstream_request_free(req);
+    stream_data->upstream_req = NULL;
+    upstream_session_send(session_data);
+    return;
+  }
+  if (stream_data->cache_key != NULL) {
+    stream_data->cache_writer = mrb_http2_cache_writer_new(
+        app_ctx->cache, stream_data->cache_key, stream_data->cache_keylen, stream_data->nva, stream_data->nvlen,
+        req->status, req->headers, req->headerslen, req->content_length, r->upstream->unparsed_host, time(NULL));
   }
+  if (stream_data->collapse != NULL) {
+    if (stream_data->cache_writer != NULL) {
+      upstream_collapse *c = stream_data->collapse;
 
-  stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
-  if (!stream_data) {
-    return 0;
+      c->entry = mrb_http2_cache_writer_entry(stream_data->cache_writer);
+      mrb_http2_cache_entry_ref(c->entry);
+      c->content_length = req->content_length;
+      c->headers = 1;
+      upstream_collapse_notify(c);
+    } else {
+      // not cacheable, so the waiters send their own requests
+      upstream_collapse_leave(stream_data);
+    }
   }
 
-  if (session_data->app_ctx->server->config->debug) {
-    debug_header(__func__, name, namelen, value, valuelen);
+  set_status_record(r, req->status);
+  fixup_status_header(mrb, r);
+  upstream_set_response_headers(app_ctx, req->headers, req->headerslen, r->upstream->unparsed_host, 0);
+
+  if (req->content_length >= 0) {
+    snprintf(r->content_length, 64, "%ld", (long)req->content_length);
+  } else {
+    r->content_length[0] = '\0';
   }
 
-  switch (lookup_token(name, namelen)) {
-    size_t j;
-  case NGHTTP2_TOKEN__AUTHORITY:
-    memcpy(stream_data->authority, value, valuelen);
-    stream_data->authority[valuelen] = '\0';
-    return 0;
+  if (upstream_reply(app_ctx, session_data->session, stream_data) != 0) {
+    nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                              NGHTTP2_INTERNAL_ERROR);
+  }
+  upstream_session_send(session_data);
+  TRACER;
+}
 
-  case NGHTTP2_TOKEN__METHOD:
-    memcpy(stream_data->method, value, valuelen);
-    stream_data->method[valuelen] = '\0';
-    return 0;
+static void upstream_on_body(mrb_http2_upstream_req *req, void *ud)
+{
+  TRACER;
+  upstream_resume_stream((http2_stream_data *)ud);
+}
 
-  case NGHTTP2_TOKEN__SCHEME:
-    memcpy(stream_data->scheme, value, valuelen);
-    stream_data->scheme[valuelen] = '\0';
-    return 0;
+static void upstream_on_done(mrb_http2_upstream_req *req, int error, void *ud)
+{
+  http2_stream_data *stream_data = (http2_stream_data *)ud;
+  http2_session_data *session_data = stream_data->session_data;
+  app_context *app_ctx = session_data->app_ctx;
+  int rv;
 
-  case NGHTTP2_TOKEN__PATH:
-    if (config->upstream) {
-      stream_data->percent_encode_uri = mrb_http2_strcopy(mrb, (const char *)value, valuelen);
+  TRACER;
+  if (error && stream_data->upstream != NULL && upstream_hedge_fail(stream_data, req)) {
+    // the other of hedged requests may still answer
+    return;
+  }
+  if (error && stream_data->upstream != NULL) {
+    // response headers were not sent yet, so reply 502
+    upstream_balancer_release(stream_data, MRB_HTTP2_BALANCER_FAILED);
+    mrb_http2_upstream_request_free(req);
+    stream_data->upstream_req = NULL;
+    restore_upstream_request_rec(stream_data);
+    rv = cache_stale_if_error_reply(app_ctx, session_data->session, stream_data);
+    upstream_collapse_leave(stream_data);
+    if (rv == 1) {
+      set_status_record(app_ctx->r, HTTP_BAD_GATEWAY);
+      rv = error_reply(app_ctx, session_data->session, stream_data);
     }
-    stream_data->unparsed_uri = percent_decode(mrb, value, valuelen);
-    for (j = 0; j < valuelen && value[j] != '?'; ++j)
-      ;
-    if (j == valuelen) {
-      stream_data->request_args = NULL;
-      stream_data->request_path = stream_data->unparsed_uri;
-    } else {
-      stream_data->request_path = percent_decode(mrb, value, j);
-      stream_data->request_args = percent_decode(mrb, value + j, valuelen - j);
+    if (rv != 0) {
+      nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                NGHTTP2_INTERNAL_ERROR);
     }
-    return 0;
-
-  default:
-    break;
+    upstream_session_send(session_data);
+    return;
   }
 
-  // create nv and add stream_data->nva except for HTTP/2 specified headers
-  mrb_http2_create_nv(mrb, &nv, name, namelen, value, valuelen);
-  stream_data->nvlen = mrb_http2_add_nv(stream_data->nva, stream_data->nvlen, &nv);
+  // the request body isn't sent any more
+  upstream_request_body_consume(stream_data);
 
-  return 0;
+  // EOF or stream reset in upstream_read_callback
+  upstream_resume_stream(stream_data);
 }
 
-static int server_on_begin_headers_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+static void upstream_on_drain(mrb_http2_upstream_req *req, void *ud)
 {
-  http2_session_data *session_data = (http2_session_data *)user_data;
+  http2_stream_data *stream_data = (http2_stream_data *)ud;
 
-  http2_stream_data *stream_data;
+  TRACER;
+  upstream_request_body_consume(stream_data);
+  upstream_session_send(stream_data->session_data);
+}
+
+static const mrb_http2_upstream_handler upstream_handler = {
+    upstream_on_header, upstream_on_body, upstream_on_done, upstream_on_drain,
+};
+
+// send the request again to another backend when the first hasn't answered
+// within the hedge delay
+static void upstream_hedge_cb(evutil_socket_t fd, short what, void *arg)
+{
+  http2_stream_data *stream_data = (http2_stream_data *)arg;
+  app_context *app_ctx = stream_data->session_data->app_ctx;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_balancer_group *group = stream_data->upstream_group;
+  mrb_http2_balancer_backend *backend;
+  mrb_http2_upstream upstream;
+  mrb_http2_upstream_req *req;
+  const uint8_t *key;
+  size_t keylen = 0;
 
   TRACER;
-  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-    return 0;
+  if (stream_data->upstream == NULL || stream_data->upstream_req == NULL || stream_data->upstream_backend == NULL) {
+    return;
+  }
+  key = upstream_balancer_key(stream_data, group, &keylen);
+  backend = mrb_http2_balancer_select_hedge(group, key, keylen, stream_data->upstream_backend);
+  if (backend == NULL) {
+    return;
   }
-  stream_data = create_http2_stream_data(session_data->app_ctx->server->mrb, session_data, frame->hd.stream_id);
-  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream_data);
 
-  TRACER;
-  return 0;
-}
+  upstream = *stream_data->upstream;
+  upstream.host = backend->host;
+  upstream.port = backend->port;
+  upstream.unparsed_host = mrb_http2_upstream_authority(upstream.host, upstream.port);
 
-/* Minimum check for directory traversal. Returns nonzero if it is
-   safe. */
-static int check_path(const char *path)
-{
-  size_t len = strlen(path);
-  return path[0] == '/' && strchr(path, '\\') == NULL && strstr(path, "/../") == NULL && strstr(path, "/./") == NULL &&
-         (len < 3 || memcmp(path + len - 3, "/..", 3) != 0) && (len < 2 || memcmp(path + len - 2, "/.", 2) != 0);
+  req = mrb_http2_upstream_request_new(app_ctx->upstream_pool, &upstream_handler, stream_data);
+  upstream_add_request_headers(mrb, req, stream_data->nva, stream_data->nvlen, 0);
+  if (mrb_http2_upstream_request_send(req, &upstream, stream_data->method) != 0) {
+    mrb_http2_balancer_release(group, backend, MRB_HTTP2_BALANCER_FAILED, 0);
+    mrb_http2_upstream_request_free(req);
+  } else {
+    stream_data->hedge_req = req;
+    stream_data->hedge_backend = backend;
+    stream_data->hedge_start = mrb_http2_balancer_now();
+  }
+  free(upstream.unparsed_host);
 }
 
-static void fixup_status_header(mrb_state *mrb, mrb_http2_request_rec *r)
+// only idempotent requests without body are hedged
+static void upstream_hedge_schedule(app_context *app_ctx, http2_stream_data *stream_data)
 {
-  int i = mrb_http2_get_nv_id(r->reshdrs, r->reshdrslen, ":status");
+  struct timeval tv;
+  double delay;
 
-  if (r->reshdrslen == 0) {
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], ":status", r->status_line);
-    r->reshdrslen += 1;
+  if (stream_data->upstream_group == NULL || stream_data->request_streaming || stream_data->request_body != NULL ||
+      (strcmp(stream_data->method, "GET") != 0 && strcmp(stream_data->method, "HEAD") != 0)) {
+    return;
+  }
+  delay = mrb_http2_balancer_hedge_delay(stream_data->upstream_group);
+  if (delay < 0) {
     return;
   }
+  tv.tv_sec = (long)delay;
+  tv.tv_usec = (long)((delay - tv.tv_sec) * 1000000);
+  stream_data->hedge_ev = evtimer_new(app_ctx->evbase, upstream_hedge_cb, stream_data);
+  evtimer_add(stream_data->hedge_ev, &tv);
+}
 
-  if (i == MRB_HTTP2_HEADER_NOT_FOUND && r->reshdrslen > 0) {
-    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
-                        r->reshdrs[0].valuelen);
-    r->reshdrslen += 1;
-    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[0], ":status", r->status_line);
-  } else if (i > 0) {
-    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
-                        r->reshdrs[0].valuelen);
-    r->reshdrslen += 1;
-    mrb_http2_create_nv(mrb, &r->reshdrs[0], r->reshdrs[i].name, r->reshdrs[i].namelen, r->reshdrs[i].value,
-                        r->reshdrs[i].valuelen);
+// copy of a request sent to the mirror group, its response is read and
+// dropped
+typedef struct {
+  app_context *app_ctx;
+  mrb_http2_balancer_group *group;
+  mrb_http2_balancer_backend *backend;
+  double start;
+} upstream_mirror;
+
+static void upstream_mirror_release(upstream_mirror *m, mrb_http2_balancer_result result)
+{
+  if (m->backend == NULL) {
+    return;
   }
+  mrb_http2_balancer_release(m->group, m->backend, result, mrb_http2_balancer_now() - m->start);
+  m->backend = NULL;
 }
 
-static int mrb_http2_send_custom_response(app_context *app_ctx, nghttp2_session *session,
-                                          http2_stream_data *stream_data)
+static void upstream_mirror_on_header(mrb_http2_upstream_req *req, void *ud)
 {
+  upstream_mirror_release((upstream_mirror *)ud, (req->status == 502 || req->status == 503 || req->status == 504)
+                                                     ? MRB_HTTP2_BALANCER_FAILED
+                                                     : MRB_HTTP2_BALANCER_OK);
+}
 
-  mrb_http2_request_rec *r = app_ctx->r;
-  mrb_http2_config_t *config = app_ctx->server->config;
-  mrb_state *mrb = app_ctx->server->mrb;
+static void upstream_mirror_on_body(mrb_http2_upstream_req *req, void *ud)
+{
+  evbuffer_drain(req->body, evbuffer_get_length(req->body));
+  mrb_http2_upstream_request_consumed(req);
+}
 
-  if (r->status == 0) {
-    set_status_record(r, HTTP_OK);
-  }
+static void upstream_mirror_on_done(mrb_http2_upstream_req *req, int error, void *ud)
+{
+  upstream_mirror *m = (upstream_mirror *)ud;
+  app_context *app_ctx = m->app_ctx;
 
-  fixup_status_header(mrb, r);
+  TRACER;
+  upstream_mirror_release(m, MRB_HTTP2_BALANCER_FAILED);
+  app_ctx->mirrors--;
+  mrb_http2_upstream_request_free(req);
+  mrb_free(app_ctx->server->mrb, m);
+}
 
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", app_ctx->server->config->server_name);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
-  r->reshdrslen += 1;
-  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
-  r->reshdrslen += 1;
+static const mrb_http2_upstream_handler upstream_mirror_handler = {
+    upstream_mirror_on_header, upstream_mirror_on_body, upstream_mirror_on_done, NULL,
+};
 
-  //
-  // "set_fixups_cb" callback ruby block
-  //
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_FIXUPS;
-    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+// send a sampled copy of the request to the mirror group. the client never
+// waits on it, and streamed bodies are not mirrored since they are not kept
+static void upstream_mirror_send(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  mrb_http2_upstream upstream = *r->upstream;
+  mrb_http2_upstream_req *req;
+  upstream_mirror *m;
+  const uint8_t *key;
+  size_t keylen = 0;
+  int has_content_length;
+  char content_length[32];
+
+  if (upstream.mirror == NULL || stream_data->request_streaming || app_ctx->mirrors >= MRB_HTTP2_UPSTREAM_MIRROR_MAX ||
+      (upstream.mirror_ratio < 1 && rand() >= upstream.mirror_ratio * RAND_MAX)) {
+    return;
+  }
+  TRACER;
+  m = (upstream_mirror *)mrb_calloc(mrb, 1, sizeof(upstream_mirror));
+  m->app_ctx = app_ctx;
+  m->group = upstream.mirror;
+
+  key = upstream_balancer_key(stream_data, upstream.mirror, &keylen);
+  m->backend = mrb_http2_balancer_select(upstream.mirror, key, keylen);
+  m->start = mrb_http2_balancer_now();
+  upstream.group = NULL;
+  upstream.host = m->backend->host;
+  upstream.port = m->backend->port;
+  upstream.unparsed_host = mrb_http2_upstream_authority(upstream.host, upstream.port);
+
+  req = mrb_http2_upstream_request_new(app_ctx->upstream_pool, &upstream_mirror_handler, m);
+  has_content_length = upstream_add_request_headers(mrb, req, r->reqhdr, r->reqhdrlen, UPSTREAM_HEADERS_COPY);
+  if (stream_data->request_body != NULL) {
+    if (!has_content_length) {
+      snprintf(content_length, sizeof(content_length), "%ld",
+               (long)mrb_http2_body_length(stream_data->request_body));
+      mrb_http2_upstream_request_add_header(req, (uint8_t *)"content-length", sizeof("content-length") - 1,
+                                            (uint8_t *)content_length, strlen(content_length));
+    }
+    mrb_http2_body_add_evbuffer(stream_data->request_body, req->reqbody);
   }
 
-  if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
-    close(stream_data->fd);
-    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  if (mrb_http2_upstream_request_send(req, &upstream, r->method) != 0) {
+    upstream_mirror_release(m, MRB_HTTP2_BALANCER_FAILED);
+    mrb_http2_upstream_request_free(req);
+    mrb_free(mrb, m);
+  } else {
+    app_ctx->mirrors++;
   }
-  return 0;
+  free(upstream.unparsed_host);
 }
 
-static int mrb_http2_send_200_response(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+// send the request to upstream without waiting for the response, the
+// response is sent to the client from upstream_handler as it arrives
+static int read_upstream_response(http2_session_data *session_data, app_context *app_ctx, nghttp2_session *session,
+                                  http2_stream_data *stream_data)
 {
-
+  mrb_http2_upstream_req *req;
   mrb_http2_request_rec *r = app_ctx->r;
-  nghttp2_nv hdrs[] = {MAKE_NV(":status", "200"), MAKE_NV_CS("server", app_ctx->server->config->server_name),
-                       MAKE_NV_CS("date", r->date), MAKE_NV_CS("content-length", r->content_length),
-                       MAKE_NV_CS("last-modified", r->last_modified)};
+  mrb_state *mrb = app_ctx->server->mrb;
+  int i;
+  int has_content_length;
+  char content_length[32];
 
-  r->status = 200;
+  TRACER;
+  if (r->upstream->uri == NULL) {
+    r->upstream->uri = strdup("/");
+  }
 
-  if (send_response(app_ctx, session, hdrs, ARRLEN(hdrs), stream_data) != 0) {
-    close(stream_data->fd);
-    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  if (r->upstream->group != NULL) {
+    const uint8_t *key;
+    size_t keylen = 0;
+
+    key = upstream_balancer_key(stream_data, r->upstream->group, &keylen);
+    stream_data->upstream_group = r->upstream->group;
+    stream_data->upstream_backend = mrb_http2_balancer_select(r->upstream->group, key, keylen);
+    stream_data->upstream_start = mrb_http2_balancer_now();
+    free(r->upstream->host);
+    r->upstream->host = strdup(stream_data->upstream_backend->host);
+    r->upstream->port = stream_data->upstream_backend->port;
   }
-  return 0;
-}
 
-static int mrb_http2_process_request(nghttp2_session *session, http2_session_data *session_data,
-                                     http2_stream_data *stream_data)
-{
-  int fd;
-  struct stat finfo;
-  time_t now = time(NULL);
-  mrb_http2_request_rec *r = session_data->app_ctx->r;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
-  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  free(r->upstream->unparsed_host);
+  r->upstream->unparsed_host = mrb_http2_upstream_authority(r->upstream->host, r->upstream->port);
 
-  //
-  // Request process phase
-  //
+  req = mrb_http2_upstream_request_new(app_ctx->upstream_pool, &upstream_handler, stream_data);
 
-  // cached time string created strftime()
-  // create r->date for error_reply
-  if (config->callback) {
-    r->phase = MRB_HTTP2_SERVER_READ_REQUEST;
+  // r->reqhdr don't include HTTP/2 specified headders
+  has_content_length = upstream_add_request_headers(mrb, req, r->reqhdr, r->reqhdrlen, 0);
+
+  if (stream_data->request_streaming) {
+    // DATA is written from server_on_data_chunk_recv_callback as it arrives
+    mrb_http2_upstream_request_stream_body(req);
+  } else if (stream_data->request_body != NULL) {
+    if (!has_content_length) {
+      snprintf(content_length, sizeof(content_length), "%ld",
+               (long)mrb_http2_body_length(stream_data->request_body));
+      mrb_http2_upstream_request_add_header(req, (uint8_t *)"content-length", sizeof("content-length") - 1,
+                                            (uint8_t *)content_length, strlen(content_length));
+    }
+    mrb_http2_body_add_evbuffer(stream_data->request_body, req->reqbody);
+  }
+
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "== DBUEG: request header at proxy START\n");
+    fprintf(stderr, "%s %s HTTP/%d.%d\n", r->method, r->upstream->uri, r->upstream->proto_major,
+            r->upstream->proto_major == 2 ? 0 : r->upstream->proto_minor);
+    for (i = 0; i < req->reqhdrslen; i++) {
+      debug_header(__func__, req->reqhdrs[i].name, req->reqhdrs[i].namelen, req->reqhdrs[i].value,
+                   req->reqhdrs[i].valuelen);
+    }
+    fprintf(stderr, "== DBUEG: request header at proxy END\n");
+    if (stream_data->request_body != NULL) {
+      fprintf(stderr, "== DEBUG: send request body(%ld bytes) to upstream server\n",
+              (long)mrb_http2_body_length(stream_data->request_body));
+    }
+  }
+
+  if (mrb_http2_upstream_request_send(req, r->upstream, r->method) != 0) {
+    upstream_balancer_release(stream_data, MRB_HTTP2_BALANCER_FAILED);
+    mrb_http2_upstream_request_free(req);
+    return -1;
+  }
+  stream_data->upstream_req = req;
+  upstream_hedge_schedule(app_ctx, stream_data);
+  upstream_mirror_send(app_ctx, stream_data);
+
+  // the stream owns upstream and request headers until upstream_on_header
+  stream_data->upstream = r->upstream;
+  r->upstream = NULL;
+  r->reqhdr = NULL;
+  r->reqhdrlen = 0;
+  mrb_http2_request_rec_free(mrb, r);
+  TRACER;
+
+  return 0;
+}
+
+// the leader of in-flight request other streams may still join
+static upstream_collapse *upstream_collapse_find(app_context *app_ctx, const char *key, size_t keylen)
+{
+  upstream_collapse *c;
+
+  for (c = app_ctx->collapses; c != NULL; c = c->next) {
+    if (c->leader == NULL || c->failed || c->finished || (c->headers && c->entry == NULL)) {
+      continue;
+    }
+    if (c->keylen == keylen && memcmp(c->key, key, keylen) == 0) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+static void upstream_collapse_lead(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_state *mrb = app_ctx->server->mrb;
+  upstream_collapse *c;
+
+  c = (upstream_collapse *)mrb_malloc(mrb, sizeof(upstream_collapse));
+  memset(c, 0, sizeof(upstream_collapse));
+  c->app_ctx = app_ctx;
+  c->key = mrb_malloc(mrb, stream_data->cache_keylen);
+  memcpy(c->key, stream_data->cache_key, stream_data->cache_keylen);
+  c->keylen = stream_data->cache_keylen;
+  c->leader = stream_data;
+  c->content_length = -1;
+
+  c->next = app_ctx->collapses;
+  if (app_ctx->collapses != NULL) {
+    app_ctx->collapses->prev = c;
+  }
+  app_ctx->collapses = c;
+  stream_data->collapse = c;
+}
+
+static void upstream_collapse_dispatch_cb(evutil_socket_t fd, short events, void *arg)
+{
+  upstream_collapse *c = (upstream_collapse *)arg;
+  app_context *app_ctx = c->app_ctx;
+  http2_session_data *session_data;
+  http2_stream_data *stream_data;
+  http2_stream_data *pending = NULL;
+  int rv;
+
+  TRACER;
+  // streams are deleted while sending, they leave the lists but c stays
+  c->dispatching = 1;
+
+  // answer the waiters once the response headers arrived or the leader is gone
+  while ((c->headers || c->leader == NULL) && (stream_data = c->waiters) != NULL) {
+    collapse_list_remove(stream_data);
+    session_data = stream_data->session_data;
+    restore_upstream_request_rec(stream_data);
+    if (c->entry != NULL && !c->failed && mrb_http2_cache_entry_match(c->entry, stream_data->nva, stream_data->nvlen)) {
+      collapse_list_add(&c->readers, stream_data);
+      rv = cache_reply(app_ctx, session_data->session, stream_data, c->entry, c->content_length);
+    } else {
+      // the response can't be shared, so send the request on its own
+      stream_data->collapse = NULL;
+      rv = read_upstream_response(session_data, app_ctx, session_data->session, stream_data);
+      if (rv != 0) {
+        set_status_record(app_ctx->r, HTTP_BAD_GATEWAY);
+        rv = error_reply(app_ctx, session_data->session, stream_data);
+      }
+    }
+    if (rv != 0) {
+      nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                                NGHTTP2_INTERNAL_ERROR);
+    }
+    upstream_session_send(session_data);
+  }
+
+  // resume the readers waiting for more of the body
+  while ((stream_data = c->readers) != NULL) {
+    collapse_list_remove(stream_data);
+    collapse_list_add(&pending, stream_data);
+  }
+  while ((stream_data = pending) != NULL) {
+    collapse_list_remove(stream_data);
+    collapse_list_add(&c->readers, stream_data);
+    upstream_resume_stream(stream_data);
+  }
+
+  c->dispatching = 0;
+  upstream_collapse_free_if_unused(c);
+}
+
+// wait on a request in flight for the same response instead of sending
+// another one, returns 0 when the stream joined
+static int upstream_collapse_join(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  upstream_collapse *c;
+
+  if (stream_data->cache_key == NULL) {
+    return 1;
+  }
+  c = upstream_collapse_find(app_ctx, stream_data->cache_key, stream_data->cache_keylen);
+  if (c == NULL) {
+    return 1;
+  }
+  if (app_ctx->server->config->debug) {
+    fprintf(stderr, "collapse upstream request: %s\n", stream_data->cache_key);
+  }
+  if (c->ev == NULL) {
+    c->ev = event_new(app_ctx->evbase, -1, 0, upstream_collapse_dispatch_cb, c);
+  }
+  stream_data->collapse = c;
+  collapse_list_add(&c->waiters, stream_data);
+  if (c->headers) {
+    upstream_collapse_notify(c);
+  }
+
+  // the stream owns upstream and request headers while waiting
+  stream_data->upstream = r->upstream;
+  r->upstream = NULL;
+  r->reqhdr = NULL;
+  r->reqhdrlen = 0;
+  mrb_http2_request_rec_free(mrb, r);
+
+  return 0;
+}
+
+static int content_cb_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  int rv;
+  int pipefd[2];
+  int64_t size;
+
+  TRACER;
+  rv = pipe(pipefd);
+  if (rv != 0) {
+    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+    mrb_http2_request_rec_free(mrb, r);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
+    }
+    return 0;
+  }
+  r->write_large_buf = NULL;
+  r->write_fd = pipefd[1];
+
+  //
+  // "set_content" callback ruby block
+  //
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_CONTENT;
+    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->content_cb, config->cb_list);
+  }
+
+  fixup_status_header(mrb, r);
+
+  // create headers for HTTP/2
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+
+  if (r->status >= 200 && r->status < 300) {
+    size = r->write_size;
+  } else {
+    const char *msg = mrb_http2_error_message(r->status);
+    size = strlen(msg);
+    rv = write(pipefd[1], msg, size);
+  }
+
+  close(pipefd[1]);
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+  }
+  stream_data->fd = pipefd[0];
+  stream_data->readleft = size;
+  TRACER;
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)size);
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_FIXUPS;
+    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  }
+  if (r->write_large_buf == NULL) {
+    TRACER;
+    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      return -1;
+    }
+  } else {
+    TRACER;
+    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      mrb_http2_large_buf_free(r->write_large_buf);
+      free(r->write_large_buf);
+      r->write_large_buf = NULL;
+      return -1;
+    }
+  }
+  TRACER;
+  return 0;
+}
+
+typedef struct mrb_http2_handler {
+  struct mrb_http2_handler *next;
+  char *filename;
+  time_t mtime;
+  struct RProc *proc;
+} mrb_http2_handler;
+
+// procs are kept alive by a hash of the server object
+static void handler_set(mrb_state *mrb, mrb_value self, const char *filename, struct RProc *proc)
+{
+  mrb_sym sym = mrb_intern_lit(mrb, "__mrb_http2_handlers__");
+  mrb_value hash = mrb_iv_get(mrb, self, sym);
+
+  if (mrb_nil_p(hash)) {
+    hash = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, sym, hash);
+  }
+  mrb_hash_set(mrb, hash, mrb_str_new_cstr(mrb, filename), mrb_obj_value(proc));
+}
+
+// the compiled handler script, recompiled when the file changes. NULL with
+// errno ENOENT when it can't be read, or EINVAL when it doesn't compile
+static struct RProc *handler_get(mrb_state *mrb, mrb_value self, mrb_http2_handler **handlers, const char *filename)
+{
+  mrb_http2_handler *h;
+  struct mrb_parser_state *p;
+  struct RProc *proc;
+  struct stat st;
+  mrbc_context *c;
+  FILE *fp;
+  int ai;
+
+  if (stat(filename, &st) != 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+  for (h = *handlers; h; h = h->next) {
+    if (strcmp(h->filename, filename) == 0) {
+      break;
+    }
+  }
+  if (h != NULL && h->mtime == st.st_mtime) {
+    return h->proc;
+  }
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+  ai = mrb_gc_arena_save(mrb);
+  c = mrbc_context_new(mrb);
+  mrbc_filename(mrb, c, filename);
+  p = mrb_parse_file(mrb, fp, c);
+  fclose(fp);
+  proc = p != NULL && p->nerr == 0 ? mrb_generate_code(mrb, p) : NULL;
+  if (p != NULL) {
+    mrb_parser_free(p);
+  }
+  mrbc_context_free(mrb, c);
+  if (proc == NULL) {
+    mrb_gc_arena_restore(mrb, ai);
+    fprintf(stderr, "handler %s: compile failed\n", filename);
+    errno = EINVAL;
+    return NULL;
+  }
+  handler_set(mrb, self, filename, proc);
+  mrb_gc_arena_restore(mrb, ai);
+
+  if (h == NULL) {
+    h = (mrb_http2_handler *)mrb_malloc(mrb, sizeof(mrb_http2_handler));
+    h->filename = strdup(filename);
+    h->next = *handlers;
+    *handlers = h;
+  }
+  h->mtime = st.st_mtime;
+  h->proc = proc;
+
+  return proc;
+}
+
+// run libraries into the mrb_state and compile handlers before forking, so
+// that workers start warm and share the code pages
+static void preload(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server, mrb_http2_request_rec *r)
+{
+  mrb_http2_config_t *config = server->config;
+  mrbc_context *c;
+  unsigned int i;
+  FILE *fp;
+
+  for (i = 0; i < config->preload_librarieslen; i++) {
+    fp = fopen(config->preload_libraries[i], "r");
+    if (fp == NULL) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "could not open preload library: %S",
+                 mrb_str_new_cstr(mrb, config->preload_libraries[i]));
+    }
+    c = mrbc_context_new(mrb);
+    mrbc_filename(mrb, c, config->preload_libraries[i]);
+    mrb_load_file_cxt(mrb, fp, c);
+    fclose(fp);
+    mrbc_context_free(mrb, c);
+    if (mrb->exc) {
+      mrb_print_error(mrb);
+      mrb->exc = 0;
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "preload library failed: %S",
+                 mrb_str_new_cstr(mrb, config->preload_libraries[i]));
+    }
+  }
+
+  // a fresh mrb_state per request can't use compiled code of this one
+  if (config->preload_handlerslen > 0 && !r->shared_mruby) {
+    fprintf(stderr, "preload_handlers needs enable_shared_mruby, not preloaded\n");
+    return;
+  }
+  for (i = 0; i < config->preload_handlerslen; i++) {
+    if (handler_get(mrb, self, &server->handlers, config->preload_handlers[i]) == NULL) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "could not preload handler: %S",
+                 mrb_str_new_cstr(mrb, config->preload_handlers[i]));
+    }
+  }
+}
+
+static int mruby_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  int rv;
+  int pipefd[2];
+  mrb_state *mrb_inner;
+  struct mrb_parser_state *p = NULL;
+  struct RProc *proc = NULL;
+  FILE *rfp;
+  mrbc_context *c = NULL;
+  int64_t size;
+
+  if (r->shared_mruby) {
+    // share one mrb_state
+    mrb_inner = mrb;
+  } else if (r->mruby) {
+    // when use new mrb_state
+    mrb_inner = mrb_open();
+  } else {
+    mrb_inner = mrb_open();
+  }
+
+  // the shared mrb_state runs the script compiled once, or by preload
+  rfp = NULL;
+  if (r->shared_mruby) {
+    proc = handler_get(mrb, app_ctx->self, &app_ctx->server->handlers, r->filename);
+    if (proc == NULL && errno == EINVAL) {
+      set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+      if (error_reply(app_ctx, session, stream_data) != 0) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+      return 0;
+    }
+  } else {
+    rfp = fopen(r->filename, "r");
+  }
+  if (proc == NULL && rfp == NULL) {
+    if (r->mruby) {
+      mrb_close(mrb_inner);
+    }
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  TRACER;
+  rv = pipe(pipefd);
+  if (rv != 0) {
+    rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
+    mrb_http2_request_rec_free(mrb, r);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
+    }
+    return 0;
+  }
+
+  r->write_large_buf = NULL;
+  r->write_fd = pipefd[1];
+  if (proc == NULL) {
+    c = mrbc_context_new(mrb_inner);
+    mrbc_filename(mrb_inner, c, r->filename);
+    p = mrb_parse_file(mrb_inner, rfp, c);
+    fclose(rfp);
+    proc = mrb_generate_code(mrb_inner, p);
+    mrb_pool_close(p->pool);
+  }
+  mrb_run(mrb_inner, proc, app_ctx->self);
+
+  if (mrb_inner->exc) {
+    mrb_print_error(mrb_inner);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    mrb_inner->exc = 0;
+  } else {
+    set_status_record(r, HTTP_OK);
+  }
+  if (c != NULL) {
+    mrbc_context_free(mrb_inner, c);
+  }
+
+  // when use new mrb_state
+  if (r->mruby) {
+    mrb_close(mrb_inner);
+  }
+
+  fixup_status_header(mrb, r);
+
+  // create headers for HTTP/2
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
+  r->reshdrslen += 1;
+  if (r->status >= 200 && r->status < 300) {
+    size = r->write_size;
+  } else {
+    const char *msg = mrb_http2_error_message(r->status);
+    size = strlen(msg);
+    rv = write(pipefd[1], msg, size);
+  }
+  TRACER;
+  close(pipefd[1]);
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_close(r->write_large_buf, pipefd[0]);
+  }
+  stream_data->fd = pipefd[0];
+  stream_data->readleft = size;
+  TRACER;
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)size);
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_FIXUPS;
+    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  }
+
+  if (r->write_large_buf == NULL) {
+    TRACER;
+    if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      return -1;
+    }
+  } else {
+    if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+      close(pipefd[0]);
+      mrb_http2_large_buf_free(r->write_large_buf);
+      free(r->write_large_buf);
+      r->write_large_buf = NULL;
+      return -1;
+    }
+  }
+  TRACER;
+  return 0;
+}
+
+// per pool thread, handlers run with a Server object of the thread's
+// mrb_state. data.r is set to the request record of each job
+typedef struct {
+  mrb_value self;
+  mrb_http2_data_t data;
+  mrb_http2_handler *handlers;
+} blocking_thread;
+
+// the data belongs to the thread, not freed with the object
+static const struct mrb_data_type mrb_http2_blocking_server_type = {
+    "mrb_http2_blocking_server_t", NULL,
+};
+
+// a Server object of a pool thread's mrb_state over data
+static mrb_value blocking_server_new(mrb_state *mrb, mrb_http2_data_t *data)
+{
+  struct RClass *klass = mrb_class_get_under(mrb, mrb_module_get(mrb, "HTTP2"), "Server");
+
+  return mrb_obj_value(mrb_data_object_alloc(mrb, klass, data, &mrb_http2_blocking_server_type));
+}
+
+// Headers_in and Headers_out objects share the data of self, and their type
+// would free the server with them
+static void blocking_server_detach(mrb_state *mrb, mrb_value self)
+{
+  static const char *objs[] = {"headers_in_obj", "headers_out_obj"};
+  mrb_value obj;
+  unsigned int i;
+
+  for (i = 0; i < 2; i++) {
+    obj = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, objs[i]));
+    if (!mrb_nil_p(obj)) {
+      DATA_TYPE(obj) = NULL;
+      DATA_PTR(obj) = NULL;
+    }
+  }
+}
+
+static void *blocking_thread_init(mrb_state *mrb, void *arg)
+{
+  mrb_http2_server_t *server = (mrb_http2_server_t *)arg;
+  mrb_http2_config_t *config = server->config;
+  blocking_thread *t;
+  mrbc_context *c;
+  unsigned int i;
+  FILE *fp;
+
+  t = (blocking_thread *)mrb_malloc(mrb, sizeof(blocking_thread));
+  memset(t, 0, sizeof(blocking_thread));
+  t->data.s = server;
+  t->self = blocking_server_new(mrb, &t->data);
+  mrb_gc_register(mrb, t->self);
+
+  // the worker is serving already, so failures are only reported
+  for (i = 0; i < config->preload_librarieslen; i++) {
+    fp = fopen(config->preload_libraries[i], "r");
+    if (fp == NULL) {
+      fprintf(stderr, "blocking: could not open preload library: %s\n", config->preload_libraries[i]);
+      continue;
+    }
+    c = mrbc_context_new(mrb);
+    mrbc_filename(mrb, c, config->preload_libraries[i]);
+    mrb_load_file_cxt(mrb, fp, c);
+    fclose(fp);
+    mrbc_context_free(mrb, c);
+    if (mrb->exc) {
+      mrb_print_error(mrb);
+      mrb->exc = 0;
+    }
+  }
+  for (i = 0; i < config->preload_handlerslen; i++) {
+    if (handler_get(mrb, t->self, &t->handlers, config->preload_handlers[i]) == NULL) {
+      fprintf(stderr, "blocking: could not preload handler: %s\n", config->preload_handlers[i]);
+    }
+  }
+
+  return t;
+}
+
+static void blocking_thread_fini(mrb_state *mrb, void *thread_data)
+{
+  blocking_thread *t = (blocking_thread *)thread_data;
+  mrb_http2_handler *h, *next;
+
+  blocking_server_detach(mrb, t->self);
+  for (h = t->handlers; h;) {
+    next = h->next;
+    free(h->filename);
+    mrb_free(mrb, h);
+    h = next;
+  }
+  mrb_free(mrb, t);
+}
+
+// ruby handlers under blocking_locations run on the pool
+static int blocking_location(mrb_http2_config_t *config, const char *uri)
+{
+  unsigned int i;
+
+  if (uri == NULL) {
+    return 0;
+  }
+  for (i = 0; i < config->blocking_locationslen; i++) {
+    if (strncmp(uri, config->blocking_locations[i], strlen(config->blocking_locations[i])) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static char *blocking_strdup(const char *s)
+{
+  return s != NULL ? strdup(s) : NULL;
+}
+
+// output of the handler goes to an unlinked file, so the thread never waits
+// on the event loop to drain a pipe
+static int blocking_tmpfile(mrb_http2_config_t *config)
+{
+  const char *dir = config->request_body_dir != NULL ? config->request_body_dir : MRB_HTTP2_BODY_DIR;
+  size_t len = strlen(dir) + sizeof("/mrb_http2_blocking.XXXXXX");
+  char *path = alloca(len);
+  int fd;
+
+  snprintf(path, len, "%s/mrb_http2_blocking.XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd == -1) {
+    fprintf(stderr, "blocking: mkstemp %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  return fd;
+}
+
+static void blocking_reply_free(mrb_state *mrb, blocking_reply_job *job)
+{
+  free(job->r.uri);
+  free(job->r.args);
+  free(job->r.unparsed_uri);
+  free(job->r.percent_encode_uri);
+  free(job->r.method);
+  free(job->r.scheme);
+  free(job->r.authority);
+  free(job->conn.client_ip);
+  if (job->r.request_body != NULL) {
+    mrb_http2_body_free(job->r.request_body);
+  }
+  mrb_free(mrb, job);
+}
+
+static uint8_t *blocking_nv_move(mrb_state *mrb, uint8_t *p, size_t len, int to_loop)
+{
+  uint8_t *q = to_loop ? mrb_malloc(mrb, len) : malloc(len);
+
+  memcpy(q, p, len);
+  if (to_loop) {
+    free(p);
+  } else {
+    mrb_free(mrb, p);
+  }
+  return q;
+}
+
+// response headers the handler added or replaced are allocated by the
+// thread's mrb_state. the thread moves them to malloc, and the event loop
+// moves them to its own mrb_state
+static void blocking_reshdrs_move(mrb_state *mrb, blocking_reply_job *job, int to_loop)
+{
+  nghttp2_nv *nv, *orig;
+  size_t i;
+
+  for (i = 0; i < job->r.reshdrslen; i++) {
+    nv = &job->r.reshdrs[i];
+    orig = i < job->saved.reshdrslen ? &job->saved.reshdrs[i] : NULL;
+    if ((orig == NULL || nv->name != orig->name) && !(nv->flags & NGHTTP2_NV_FLAG_NO_COPY_NAME)) {
+      nv->name = blocking_nv_move(mrb, nv->name, nv->namelen, to_loop);
+    }
+    if ((orig == NULL || nv->value != orig->value) && !(nv->flags & NGHTTP2_NV_FLAG_NO_COPY_VALUE)) {
+      nv->value = blocking_nv_move(mrb, nv->value, nv->valuelen, to_loop);
+    }
+  }
+}
+
+// what the handler sets is freed with mrb or moved off it before return
+static void blocking_reply_exec(mrb_state *mrb, mrb_value self, struct RProc *proc, blocking_reply_job *job)
+{
+  mrb_http2_request_rec *r = &job->r;
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_run(mrb, proc, self);
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    mrb->exc = 0;
+  } else {
+    set_status_record(r, HTTP_OK);
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  blocking_reshdrs_move(mrb, job, 0);
+  if (r->upstream != NULL) {
+    mrb_http2_upstream_free(mrb, r->upstream);
+    r->upstream = NULL;
+  }
+}
+
+// enable_mruby handlers get a new mrb_state for each request like
+// mruby_reply, so their globals don't leak into other requests
+static int blocking_reply_run_once(mrb_http2_server_t *server, blocking_reply_job *job)
+{
+  mrb_http2_request_rec *r = &job->r;
+  struct mrb_parser_state *p;
+  struct RProc *proc;
+  mrb_http2_data_t data;
+  mrb_value self;
+  mrbc_context *c;
+  mrb_state *mrb;
+  FILE *fp;
+  int rv;
+
+  fp = fopen(r->filename, "r");
+  if (fp == NULL) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    return -1;
+  }
+  mrb = mrb_open();
+  if (mrb == NULL) {
+    fclose(fp);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    return -1;
+  }
+
+  memset(&data, 0, sizeof(mrb_http2_data_t));
+  data.s = server;
+  data.r = r;
+  self = blocking_server_new(mrb, &data);
+  c = mrbc_context_new(mrb);
+  mrbc_filename(mrb, c, r->filename);
+  p = mrb_parse_file(mrb, fp, c);
+  fclose(fp);
+  proc = p != NULL && p->nerr == 0 ? mrb_generate_code(mrb, p) : NULL;
+  if (p != NULL) {
+    mrb_parser_free(p);
+  }
+  mrbc_context_free(mrb, c);
+
+  if (proc == NULL) {
+    fprintf(stderr, "handler %s: compile failed\n", r->filename);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    rv = -1;
+  } else {
+    blocking_reply_exec(mrb, self, proc, job);
+    rv = 0;
+  }
+  blocking_server_detach(mrb, self);
+  mrb_close(mrb);
+  return rv;
+}
+
+// runs on a pool thread, filename of r is allocated by the thread's
+// mrb_state and freed here
+static int blocking_reply_run(mrb_state *mrb, void *thread_data, mrb_http2_blocking_job *j)
+{
+  blocking_reply_job *job = (blocking_reply_job *)j;
+  blocking_thread *t = (blocking_thread *)thread_data;
+  mrb_http2_request_rec *r = &job->r;
+  struct RProc *proc;
+  int rv;
+
+  r->filename = mrb_http2_strcopy(mrb, job->saved.filename, strlen(job->saved.filename));
+  if (r->mruby && !r->shared_mruby) {
+    rv = blocking_reply_run_once(t->data.s, job);
+  } else if ((proc = handler_get(mrb, t->self, &t->handlers, r->filename)) == NULL) {
+    set_status_record(r, errno == EINVAL ? HTTP_SERVICE_UNAVAILABLE : HTTP_NOT_FOUND);
+    rv = -1;
+  } else {
+    t->data.r = r;
+    blocking_reply_exec(mrb, t->self, proc, job);
+    t->data.r = NULL;
+    rv = 0;
+  }
+
+  mrb_free(mrb, r->filename);
+  r->filename = NULL;
+  return rv;
+}
+
+// same as the end of mruby_reply, with the output in fd
+static int blocking_reply_send(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data, int fd)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+  const char *msg;
+  int64_t size;
+
+  fixup_status_header(mrb, r);
+
+  // create headers for HTTP/2
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
+  r->reshdrslen += 1;
+  stream_data->fd = fd;
+  if (r->status >= 200 && r->status < 300) {
+    size = r->write_size;
+  } else {
+    // the error message replaces the output of the handler
+    if (r->write_large_buf != NULL) {
+      mrb_http2_large_buf_free(r->write_large_buf);
+      free(r->write_large_buf);
+      r->write_large_buf = NULL;
+    }
+    msg = mrb_http2_error_message(r->status);
+    size = strlen(msg);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, msg, size, 0) != size) {
+      mrb_http2_request_rec_free(mrb, r);
+      return -1;
+    }
+  }
+  lseek(fd, 0, SEEK_SET);
+  if (r->write_large_buf != NULL) {
+    mrb_http2_large_buf_close(r->write_large_buf, fd);
+  }
+  stream_data->readleft = size;
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)size);
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_FIXUPS;
+    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  }
+
+  if (r->write_large_buf == NULL) {
+    return send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data);
+  }
+  if (send_response_large_buf(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+    mrb_http2_large_buf_free(r->write_large_buf);
+    free(r->write_large_buf);
+    r->write_large_buf = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// called on the event loop when the pool is done with the job
+static void blocking_reply_done(mrb_http2_blocking_job *j, int result)
+{
+  blocking_reply_job *job = (blocking_reply_job *)j;
+  app_context *app_ctx = job->app_ctx;
+  http2_stream_data *stream_data = job->stream_data;
+  http2_session_data *session_data;
+  mrb_state *mrb = app_ctx->server->mrb;
+  int fd = job->saved.write_fd;
+  size_t i;
+  int rv;
+
+  // response headers the handler replaced are freed, and saved takes the
+  // ones it added
+  blocking_reshdrs_move(mrb, job, 1);
+  for (i = 0; i < job->saved.reshdrslen; i++) {
+    if (job->r.reshdrs[i].name != job->saved.reshdrs[i].name) {
+      mrb_free(mrb, job->saved.reshdrs[i].name);
+    }
+    if (job->r.reshdrs[i].value != job->saved.reshdrs[i].value) {
+      mrb_free(mrb, job->saved.reshdrs[i].value);
+    }
+  }
+  memcpy(job->saved.reshdrs, job->r.reshdrs, sizeof(nghttp2_nv) * job->r.reshdrslen);
+  job->saved.reshdrslen = job->r.reshdrslen;
+  job->saved.write_size = job->r.write_size;
+  job->saved.write_large_buf = job->r.write_large_buf;
+  if (result != 0 && job->r.status == HTTP_OK) {
+    // the job wasn't run
+    set_status_record(&job->r, HTTP_SERVICE_UNAVAILABLE);
+  }
+  set_status_record(&job->saved, job->r.status);
+
+  if (stream_data == NULL) {
+    if (job->saved.write_large_buf != NULL) {
+      mrb_http2_large_buf_free(job->saved.write_large_buf);
+      free(job->saved.write_large_buf);
+    }
+    close(fd);
+    job->saved.reqhdr = job->reqhdr;
+    mrb_http2_request_rec_free(mrb, &job->saved);
+    blocking_reply_free(mrb, job);
+    return;
+  }
+  stream_data->blocking_job = NULL;
+  stream_data->request_body = job->r.request_body;
+  job->r.request_body = NULL;
+  session_data = stream_data->session_data;
+  *app_ctx->r = job->saved;
+
+  if (result != 0) {
+    close(fd);
+    rv = error_reply(app_ctx, session_data->session, stream_data);
+  } else {
+    rv = blocking_reply_send(app_ctx, session_data->session, stream_data, fd);
+  }
+  blocking_reply_free(mrb, job);
+  if (rv != 0) {
+    nghttp2_submit_rst_stream(session_data->session, NGHTTP2_FLAG_NONE, stream_data->stream_id,
+                              NGHTTP2_INTERNAL_ERROR);
+  }
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
+}
+
+// the content phase of a ruby handler on the pool, the response is sent by
+// blocking_reply_done
+static int blocking_reply(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+  blocking_reply_job *job;
+  int fd;
+
+  fd = blocking_tmpfile(app_ctx->server->config);
+  if (fd == -1) {
+    set_status_record(r, HTTP_INTERNAL_SERVER_ERROR);
+    return error_reply(app_ctx, session, stream_data);
+  }
+
+  job = (blocking_reply_job *)mrb_malloc(mrb, sizeof(blocking_reply_job));
+  memset(job, 0, sizeof(blocking_reply_job));
+  job->job.run = blocking_reply_run;
+  job->job.done = blocking_reply_done;
+  job->app_ctx = app_ctx;
+  job->stream_data = stream_data;
+
+  // the thread reads copies of the request, and the body is kept by the
+  // job until it's done
+  job->saved = *r;
+  job->saved.write_fd = fd;
+  job->saved.write_size = 0;
+  job->saved.write_large_buf = NULL;
+  job->r = job->saved;
+  if (r->reqhdrlen > 0) {
+    memcpy(job->reqhdr, r->reqhdr, sizeof(nghttp2_nv) * r->reqhdrlen);
+  }
+  job->r.reqhdr = job->reqhdr;
+  job->r.uri = blocking_strdup(r->uri);
+  job->r.args = blocking_strdup(r->args);
+  job->r.unparsed_uri = blocking_strdup(r->unparsed_uri);
+  job->r.percent_encode_uri = blocking_strdup(r->percent_encode_uri);
+  job->r.method = blocking_strdup(r->method);
+  job->r.scheme = blocking_strdup(r->scheme);
+  job->r.authority = blocking_strdup(r->authority);
+  if (r->conn != NULL) {
+    job->conn.client_ip = blocking_strdup(r->conn->client_ip);
+    job->r.conn = &job->conn;
+  }
+  stream_data->request_body = NULL;
+
+  // the thread allocates filename and upstream of its own
+  job->r.filename = NULL;
+  job->r.upstream = NULL;
+
+  // the job owns the request from here, r is reset for other streams
+  r->filename = NULL;
+  r->reqhdr = NULL;
+  r->reqhdrlen = 0;
+  r->reshdrslen = 0;
+  r->upstream = NULL;
+  mrb_http2_request_rec_free(mrb, r);
+
+  if (mrb_http2_blocking_submit(app_ctx->blocking, &job->job) != 0) {
+    fprintf(stderr, "blocking: queue is full, %s is not run\n", job->saved.filename);
+    *r = job->saved;
+    stream_data->request_body = job->r.request_body;
+    job->r.request_body = NULL;
+    close(fd);
+    blocking_reply_free(mrb, job);
+    set_status_record(r, HTTP_SERVICE_UNAVAILABLE);
+    return error_reply(app_ctx, session, stream_data);
+  }
+  stream_data->blocking_job = job;
+
+  return 0;
+}
+
+/* Inspired by h2o header lookup.  https://github.com/h2o/h2o */
+/* Reference as nghttp2 header lookup.  https://github.com/tatsuhiro-t/nghttp2
+ */
+
+static int memeq(const void *a, const void *b, size_t n)
+{
+  return memcmp(a, b, n) == 0;
+}
+
+#define streq(A, B, N) ((sizeof((A)) - 1) == (N) && memeq((A), (B), (N)))
+
+typedef enum {
+  NGHTTP2_TOKEN__AUTHORITY,
+  NGHTTP2_TOKEN__METHOD,
+  NGHTTP2_TOKEN__PATH,
+  NGHTTP2_TOKEN__SCHEME,
+  NGHTTP2_TOKEN_HOST,
+} nghttp2_token;
+
+static int lookup_token(const uint8_t *name, size_t namelen)
+{
+  switch (namelen) {
+  case 5:
+    switch (name[namelen - 1]) {
+    case 'h':
+      if (streq(":pat", name, 4)) {
+        return NGHTTP2_TOKEN__PATH;
+      }
+      break;
+    }
+    break;
+  case 7:
+    switch (name[namelen - 1]) {
+    case 'd':
+      if (streq(":metho", name, 6)) {
+        return NGHTTP2_TOKEN__METHOD;
+      }
+      break;
+    case 'e':
+      if (streq(":schem", name, 6)) {
+        return NGHTTP2_TOKEN__SCHEME;
+      }
+      break;
+    }
+    break;
+  case 10:
+    switch (name[namelen - 1]) {
+    case 'y':
+      if (streq(":authorit", name, 9)) {
+        return NGHTTP2_TOKEN__AUTHORITY;
+      }
+      break;
+    }
+    break;
+  }
+  return -1;
+}
+
+static int server_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                     size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
+                                     void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+  mrb_state *mrb = session_data->app_ctx->server->mrb;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+
+  http2_stream_data *stream_data;
+  nghttp2_nv nv;
+
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+
+  stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!stream_data) {
+    return 0;
+  }
+
+  if (session_data->app_ctx->server->config->debug) {
+    debug_header(__func__, name, namelen, value, valuelen);
+  }
+
+  switch (lookup_token(name, namelen)) {
+    size_t j;
+  case NGHTTP2_TOKEN__AUTHORITY:
+    memcpy(stream_data->authority, value, valuelen);
+    stream_data->authority[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__METHOD:
+    memcpy(stream_data->method, value, valuelen);
+    stream_data->method[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__SCHEME:
+    memcpy(stream_data->scheme, value, valuelen);
+    stream_data->scheme[valuelen] = '\0';
+    return 0;
+
+  case NGHTTP2_TOKEN__PATH:
+    if (config->upstream) {
+      stream_data->percent_encode_uri = mrb_http2_strcopy(mrb, (const char *)value, valuelen);
+    }
+    stream_data->unparsed_uri = percent_decode(mrb, value, valuelen);
+    for (j = 0; j < valuelen && value[j] != '?'; ++j)
+      ;
+    if (j == valuelen) {
+      stream_data->request_args = NULL;
+      stream_data->request_path = stream_data->unparsed_uri;
+    } else {
+      stream_data->request_path = percent_decode(mrb, value, j);
+      stream_data->request_args = percent_decode(mrb, value + j, valuelen - j);
+    }
+    return 0;
+
+  default:
+    break;
+  }
+
+  // create nv and add stream_data->nva except for HTTP/2 specified headers
+  mrb_http2_create_nv(mrb, &nv, name, namelen, value, valuelen);
+  stream_data->nvlen = mrb_http2_add_nv(stream_data->nva, stream_data->nvlen, &nv);
+
+  return 0;
+}
+
+static int server_on_begin_headers_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+  http2_session_data *session_data = (http2_session_data *)user_data;
+
+  http2_stream_data *stream_data;
+
+  TRACER;
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  stream_data = create_http2_stream_data(session_data->app_ctx->server->mrb, session_data, frame->hd.stream_id);
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream_data);
+
+  TRACER;
+  return 0;
+}
+
+/* Minimum check for directory traversal. Returns nonzero if it is
+   safe. */
+static int check_path(const char *path)
+{
+  size_t len = strlen(path);
+  return path[0] == '/' && strchr(path, '\\') == NULL && strstr(path, "/../") == NULL && strstr(path, "/./") == NULL &&
+         (len < 3 || memcmp(path + len - 3, "/..", 3) != 0) && (len < 2 || memcmp(path + len - 2, "/.", 2) != 0);
+}
+
+static void fixup_status_header(mrb_state *mrb, mrb_http2_request_rec *r)
+{
+  int i = mrb_http2_get_nv_id(r->reshdrs, r->reshdrslen, ":status");
+
+  if (r->reshdrslen == 0) {
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], ":status", r->status_line);
+    r->reshdrslen += 1;
+    return;
+  }
+
+  if (i == MRB_HTTP2_HEADER_NOT_FOUND && r->reshdrslen > 0) {
+    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
+                        r->reshdrs[0].valuelen);
+    r->reshdrslen += 1;
+    MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[0], ":status", r->status_line);
+  } else if (i > 0) {
+    mrb_http2_create_nv(mrb, &r->reshdrs[r->reshdrslen], r->reshdrs[0].name, r->reshdrs[0].namelen, r->reshdrs[0].value,
+                        r->reshdrs[0].valuelen);
+    r->reshdrslen += 1;
+    mrb_http2_create_nv(mrb, &r->reshdrs[0], r->reshdrs[i].name, r->reshdrs[i].namelen, r->reshdrs[i].value,
+                        r->reshdrs[i].valuelen);
+  }
+}
+
+static int mrb_http2_send_custom_response(app_context *app_ctx, nghttp2_session *session,
+                                          http2_stream_data *stream_data)
+{
+
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  if (r->status == 0) {
+    set_status_record(r, HTTP_OK);
+  }
+
+  fixup_status_header(mrb, r);
+
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "server", app_ctx->server->config->server_name);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "date", r->date);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "content-length", r->content_length);
+  r->reshdrslen += 1;
+  MRB_HTTP2_CREATE_NV_LIT_CS(mrb, &r->reshdrs[r->reshdrslen], "last-modified", r->last_modified);
+  r->reshdrslen += 1;
+
+  //
+  // "set_fixups_cb" callback ruby block
+  //
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_FIXUPS;
+    callback_ruby_block(mrb, app_ctx->self, config->callback, config->cb_list->fixups_cb, config->cb_list);
+  }
+
+  if (send_response(app_ctx, session, r->reshdrs, r->reshdrslen, stream_data) != 0) {
+    close(stream_data->fd);
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return 0;
+}
+
+static int mrb_http2_send_200_response(app_context *app_ctx, nghttp2_session *session, http2_stream_data *stream_data)
+{
+
+  mrb_http2_request_rec *r = app_ctx->r;
+  nghttp2_nv hdrs[] = {MAKE_NV(":status", "200"), MAKE_NV_CS("server", app_ctx->server->config->server_name),
+                       MAKE_NV_CS("date", r->date), MAKE_NV_CS("content-length", r->content_length),
+                       MAKE_NV_CS("last-modified", r->last_modified)};
+
+  r->status = 200;
+
+  if (send_response(app_ctx, session, hdrs, ARRLEN(hdrs), stream_data) != 0) {
+    close(stream_data->fd);
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return 0;
+}
+
+// a request not going upstream is kept mapped in the stream while its body is
+// buffered, since r is shared by all streams
+static void process_content_defer(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  mrb_state *mrb = app_ctx->server->mrb;
+
+  stream_data->processed = 0;
+  stream_data->request_streaming = 0;
+  stream_data->content_rec = (mrb_http2_request_rec *)mrb_malloc(mrb, sizeof(mrb_http2_request_rec));
+  *stream_data->content_rec = *r;
+
+  // the stream owns filename, upstream and headers from here
+  r->filename = NULL;
+  r->reqhdr = NULL;
+  r->reqhdrlen = 0;
+  r->reshdrslen = 0;
+  r->upstream = NULL;
+  r->write_large_buf = NULL;
+  mrb_http2_request_rec_free(mrb, r);
+}
+
+static void process_content_resume(app_context *app_ctx, http2_stream_data *stream_data)
+{
+  mrb_http2_request_rec *r = app_ctx->r;
+  time_t prev_req_time = r->prev_req_time;
+  time_t prev_last_modified = r->prev_last_modified;
+  char date[64], last_modified[64];
+
+  // keep the date caches of r, they may be newer than the stream's
+  memcpy(date, r->date, sizeof(date));
+  memcpy(last_modified, r->last_modified, sizeof(last_modified));
+  *r = *stream_data->content_rec;
+  r->prev_req_time = prev_req_time;
+  r->prev_last_modified = prev_last_modified;
+  memcpy(r->date, date, sizeof(date));
+  memcpy(r->last_modified, last_modified, sizeof(last_modified));
+  r->request_body = stream_data->request_body;
+  r->conn = stream_data->session_data->conn;
+
+  mrb_free(app_ctx->server->mrb, stream_data->content_rec);
+  stream_data->content_rec = NULL;
+}
+
+// content phase of a request not going upstream, r holds the mapped request
+static int mrb_http2_process_content(nghttp2_session *session, http2_session_data *session_data,
+                                     http2_stream_data *stream_data)
+{
+  int fd;
+  struct stat finfo;
+  mrb_http2_request_rec *r = session_data->app_ctx->r;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+
+  // run mruby script
+  if (r->mruby || r->shared_mruby) {
+    set_status_record(r, HTTP_OK);
+    if (session_data->app_ctx->blocking != NULL && blocking_location(config, r->uri)) {
+      if (blocking_reply(session_data->app_ctx, session, stream_data) != 0) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+      return 0;
+    }
+    if (mruby_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  // hook content_cb
+  if (config->callback && config->cb_list->content_cb) {
+    set_status_record(r, HTTP_OK);
+    if (content_cb_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  // static contents response
+  fd = open(r->filename, O_RDONLY);
+
+  TRACER;
+  if (fd == -1) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  stream_data->fd = fd;
+  // set_status_record(r, HTTP_OK);
+
+  TRACER;
+  if (fstat(fd, &finfo) != 0) {
+    set_status_record(r, HTTP_NOT_FOUND);
+    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+  r->finfo = &finfo;
+
+  // cached time string created strftime()
+  if (r->finfo->st_mtime != r->prev_last_modified) {
+    r->prev_last_modified = r->finfo->st_mtime;
+    set_http_date_str(&r->finfo->st_mtime, r->last_modified);
+  }
+
+  // set content-length: max 10^64
+  snprintf(r->content_length, 64, "%ld", (long)r->finfo->st_size);
+  stream_data->readleft = r->finfo->st_size;
+
+  TRACER;
+  if (!config->callback && r->reshdrslen == 0) {
+    r->response_type = MRB_HTTP2_RESPONSE_STATIC;
+    return mrb_http2_send_200_response(session_data->app_ctx, session, stream_data);
+  } else {
+    return mrb_http2_send_custom_response(session_data->app_ctx, session, stream_data);
+  }
+}
+
+static int mrb_http2_process_request(nghttp2_session *session, http2_session_data *session_data,
+                                     http2_stream_data *stream_data)
+{
+  time_t now = time(NULL);
+  mrb_http2_request_rec *r = session_data->app_ctx->r;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  mrb_state *mrb = session_data->app_ctx->server->mrb;
+
+  //
+  // Request process phase
+  //
+
+  // cached time string created strftime()
+  // create r->date for error_reply
+  if (config->callback) {
+    r->phase = MRB_HTTP2_SERVER_READ_REQUEST;
   }
   if (now != r->prev_req_time) {
     r->prev_req_time = now;
@@ -1482,30 +3494,14 @@ static int mrb_http2_process_request(nghttp2_session *session, http2_session_dat
     return 0;
   }
 
-  // r-> will free at request_rec_free
-  r->filename = mrb_http2_strcat(mrb, config->document_root, stream_data->request_path);
-
-  r->authority = stream_data->authority;
-  r->scheme = stream_data->scheme;
-  r->method = stream_data->method;
-  r->unparsed_uri = stream_data->unparsed_uri;
-  r->percent_encode_uri = stream_data->percent_encode_uri;
-  r->uri = stream_data->request_path;
-  r->args = stream_data->request_args;
-  r->response_type = MRB_HTTP2_RESPONSE_TYPE_NONE;
-
-  if (stream_data->request_body != NULL) {
-    r->request_body = stream_data->request_body->data;
-  } else {
-    r->request_body = NULL;
-  }
+  set_request_rec_from_stream(session_data->app_ctx, stream_data);
 
   if (config->debug) {
     fprintf(stderr, "=== process request information start ===\n");
     fprintf(stderr, "percent_encode_uri: %s\n", r->percent_encode_uri);
     fprintf(stderr, "unparsed_uri: %s\n", r->unparsed_uri);
     fprintf(stderr, "uri: %s\n", r->uri);
-    fprintf(stderr, "request_body: %s\n", r->request_body);
+    fprintf(stderr, "request_body: %ld bytes\n", r->request_body ? (long)mrb_http2_body_length(r->request_body) : 0L);
     fprintf(stderr, "args: %s\n", r->args);
     fprintf(stderr, "filename: %s\n", r->filename);
     fprintf(stderr, "hostname: %s\n", r->authority);
@@ -1547,80 +3543,39 @@ static int mrb_http2_process_request(nghttp2_session *session, http2_session_dat
   }
 
   // check proxy config
-  if (config->upstream && r->upstream && r->upstream->host) {
+  if (config->upstream && r->upstream && (r->upstream->host || r->upstream->group)) {
     if (config->debug) {
-      fprintf(stderr, "found upstream: server:%s:%d uri:%s\n", r->upstream->host, r->upstream->port, r->upstream->uri);
-    }
-    if (read_upstream_response(session_data, session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
-
-    if (upstream_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+      fprintf(stderr, "found upstream: server:%s:%d group:%s uri:%s\n", r->upstream->host ? r->upstream->host : "",
+            r->upstream->port, r->upstream->group ? r->upstream->group->name : "", r->upstream->uri);
     }
-    return 0;
-  }
-
-  // run mruby script
-  if (r->mruby || r->shared_mruby) {
-    set_status_record(r, HTTP_OK);
-    if (mruby_reply(session_data->app_ctx, session, stream_data) != 0) {
+    switch (cache_lookup_reply(session_data->app_ctx, session, stream_data)) {
+    case 0:
+      return 0;
+    case -1:
       return NGHTTP2_ERR_CALLBACK_FAILURE;
     }
-    return 0;
-  }
-
-  // hook content_cb
-  if (config->callback && config->cb_list->content_cb) {
-    set_status_record(r, HTTP_OK);
-    if (content_cb_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    if (upstream_collapse_join(session_data->app_ctx, stream_data) == 0) {
+      return 0;
     }
-    return 0;
-  }
-
-  // static contents response
-  fd = open(r->filename, O_RDONLY);
-
-  TRACER;
-  if (fd == -1) {
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    if (read_upstream_response(session_data, session_data->app_ctx, session, stream_data) != 0) {
+      set_status_record(r, HTTP_BAD_GATEWAY);
+      if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+    } else if (stream_data->cache_key != NULL) {
+      upstream_collapse_lead(session_data->app_ctx, stream_data);
     }
     return 0;
   }
 
-  stream_data->fd = fd;
-  // set_status_record(r, HTTP_OK);
-
-  TRACER;
-  if (fstat(fd, &finfo) != 0) {
-    set_status_record(r, HTTP_NOT_FOUND);
-    if (error_reply(session_data->app_ctx, session, stream_data) != 0) {
-      return NGHTTP2_ERR_CALLBACK_FAILURE;
-    }
+  // the body isn't streamed without upstream, so it's buffered and the
+  // content phase runs at END_STREAM
+  if (stream_data->request_streaming) {
+    process_content_defer(session_data->app_ctx, stream_data);
     return 0;
   }
-  r->finfo = &finfo;
-
-  // cached time string created strftime()
-  if (r->finfo->st_mtime != r->prev_last_modified) {
-    r->prev_last_modified = r->finfo->st_mtime;
-    set_http_date_str(&r->finfo->st_mtime, r->last_modified);
-  }
 
-  // set content-length: max 10^64
-  snprintf(r->content_length, 64, "%ld", (long)r->finfo->st_size);
-  stream_data->readleft = r->finfo->st_size;
-
-  TRACER;
-  if (!config->callback && r->reshdrslen == 0) {
-    r->response_type = MRB_HTTP2_RESPONSE_STATIC;
-    return mrb_http2_send_200_response(session_data->app_ctx, session, stream_data);
-  } else {
-    return mrb_http2_send_custom_response(session_data->app_ctx, session, stream_data);
-  }
+  return mrb_http2_process_content(session, session_data, stream_data);
 }
 
 static int server_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
@@ -1641,6 +3596,35 @@ static int server_on_frame_recv_callback(nghttp2_session *session, const nghttp2
         return 0;
       }
 
+      // the request body was streamed, finish it on upstream
+      if (stream_data->processed) {
+        if (stream_data->upstream_req != NULL) {
+          mrb_http2_upstream_request_end_body(stream_data->upstream_req);
+        }
+        return 0;
+      }
+      stream_data->processed = 1;
+
+      // mapped when the headers arrived, its body is complete now
+      if (stream_data->content_rec != NULL) {
+        process_content_resume(session_data->app_ctx, stream_data);
+        return mrb_http2_process_content(session, session_data, stream_data);
+      }
+
+      return mrb_http2_process_request(session, session_data, stream_data);
+    }
+
+    // process a request with body as soon as its headers arrive, one not going
+    // upstream is put back to buffering by mrb_http2_process_request
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST &&
+        session_data->app_ctx->server->config->upstream_request_streaming) {
+      stream_data = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+      if (!stream_data) {
+        return 0;
+      }
+      stream_data->processed = 1;
+      stream_data->request_streaming = 1;
+
       return mrb_http2_process_request(session, session_data, stream_data);
     }
     break;
@@ -1659,50 +3643,49 @@ static int server_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t
   http2_session_data *session_data = (http2_session_data *)user_data;
   http2_stream_data *stream_data = nghttp2_session_get_stream_user_data(session, stream_id);
   mrb_state *mrb = session_data->app_ctx->server->mrb;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
   int rv;
 
-  if (session_data->app_ctx->server->config->debug) {
+  if (config->debug) {
     fprintf(stderr, "%s: datalen = %ld\n", __func__, len);
   }
 
-  // TODO: buffering and stored file or memory, currently store len byte
-  // when callback only once
+  if (stream_data->processed) {
+    // written to upstream, or dropped when the response doesn't need it
+    if (stream_data->upstream_req != NULL &&
+        mrb_http2_upstream_request_write_body(stream_data->upstream_req, data, len) == 0) {
+      stream_data->request_unconsumed += len;
+      upstream_request_body_consume(stream_data);
+    } else {
+      nghttp2_session_consume(session, stream_id, len);
+    }
+    return 0;
+  }
+
+  // the body is stored in memory up to request_body_buffer_size or in the
+  // spill file before the window opens again
+  if (stream_data->request_body_rejected) {
+    nghttp2_session_consume(session, stream_id, len);
+    return 0;
+  }
   if (stream_data->request_body == NULL) {
-    stream_data->request_body = mrb_malloc(mrb, sizeof(mrb_http2_request_body));
-    memset(stream_data->request_body, 0, sizeof(mrb_http2_request_body));
+    stream_data->request_body = mrb_http2_body_new(mrb, config->request_body_buffer_size, config->request_body_dir);
   }
-  if (stream_data->request_body->last) {
-    fprintf(stderr, "request_body length reached MRB_HTTP2_MAX_POST_DATA_SIZE");
+
+  // chunks in memory up to request_body_buffer_size, and a temporary file
+  // after that
+  if (mrb_http2_body_length(stream_data->request_body) + len > MRB_HTTP2_MAX_POST_DATA_SIZE ||
+      mrb_http2_body_append(stream_data->request_body, data, len) != 0) {
+    fprintf(stderr, "request body of stream %d exceeds MRB_HTTP2_MAX_POST_DATA_SIZE(%d) or can't be stored\n",
+            stream_id, MRB_HTTP2_MAX_POST_DATA_SIZE);
+    stream_data->request_body_rejected = 1;
     rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
     if (rv != 0) {
       fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
       return NGHTTP2_ERR_CALLBACK_FAILURE;
     }
-    return 0;
-  } else {
-    char *pos;
-    stream_data->request_body->len += len;
-    if (stream_data->request_body->len >= MRB_HTTP2_MAX_POST_DATA_SIZE) {
-      fprintf(stderr, "post data length(%ld) exceed "
-                      "MRB_HTTP2_MAX_POST_DATA_SIZE(%d)\n",
-              (long)stream_data->request_body->len, MRB_HTTP2_MAX_POST_DATA_SIZE);
-      stream_data->request_body->len = MRB_HTTP2_MAX_POST_DATA_SIZE;
-      stream_data->request_body->last = 1;
-      rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_data->stream_id, NGHTTP2_INTERNAL_ERROR);
-      if (rv != 0) {
-        fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
-        return NGHTTP2_ERR_CALLBACK_FAILURE;
-      }
-      return 0;
-    }
-    stream_data->request_body->data =
-        mrb_realloc(mrb, stream_data->request_body->data, stream_data->request_body->len + 1);
-    pos = stream_data->request_body->data;
-    pos += stream_data->request_body->pos;
-    memcpy(pos, data, stream_data->request_body->len - stream_data->request_body->pos);
-    stream_data->request_body->pos += len;
-    stream_data->request_body->data[stream_data->request_body->len] = '\0';
   }
+  nghttp2_session_consume(session, stream_id, len);
 
   return 0;
 }
@@ -1719,6 +3702,11 @@ static int server_on_stream_close_callback(nghttp2_session *session, int32_t str
   if (!stream_data) {
     return 0;
   }
+  // give back the connection window still held by the stream
+  if (stream_data->request_unconsumed > 0) {
+    nghttp2_session_consume(session, stream_id, stream_data->request_unconsumed);
+    stream_data->request_unconsumed = 0;
+  }
   remove_stream(session_data, stream_data);
   delete_http2_stream_data(mrb, session_data, stream_data);
   TRACER;
@@ -1735,6 +3723,7 @@ static ssize_t fixed_data_source_length_callback(nghttp2_session *session, uint8
 static void mrb_http2_server_session_init(http2_session_data *session_data)
 {
   nghttp2_session_callbacks *callbacks;
+  nghttp2_option *option;
 
   TRACER;
 
@@ -1748,7 +3737,13 @@ static void mrb_http2_server_session_init(http2_session_data *session_data)
   nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, server_on_begin_headers_callback);
   nghttp2_session_callbacks_set_data_source_read_length_callback(callbacks, fixed_data_source_length_callback);
 
-  nghttp2_session_server_new(&session_data->session, callbacks, session_data);
+  // windows are opened by nghttp2_session_consume once request body is
+  // stored or written to upstream, so that clients can't send faster than
+  // that
+  nghttp2_option_new(&option);
+  nghttp2_option_set_no_auto_window_update(option, 1);
+  nghttp2_session_server_new2(&session_data->session, callbacks, session_data, option);
+  nghttp2_option_del(option);
   nghttp2_session_callbacks_del(callbacks);
 }
 
@@ -1756,16 +3751,35 @@ static void mrb_http2_server_session_init(http2_session_data *session_data)
    magic octets and SETTINGS frame */
 static int send_server_connection_header(http2_session_data *session_data)
 {
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
   nghttp2_settings_entry iv[2] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100},
-                                  {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, ((1 << 18) - 1)}};
+                                  {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, MRB_HTTP2_INITIAL_WINDOW_SIZE}};
+  int32_t connection_window_size = MRB_HTTP2_CONNECTION_WINDOW_SIZE;
   int rv;
 
+  if (config->http2_initial_window_size > 0) {
+    iv[1].value = config->http2_initial_window_size;
+  }
+  if (config->http2_connection_window_size > 0) {
+    connection_window_size = config->http2_connection_window_size;
+  }
+
   rv = nghttp2_submit_settings(session_data->session, NGHTTP2_FLAG_NONE, iv, ARRLEN(iv));
   TRACER;
   if (rv != 0) {
     fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
     return -1;
   }
+
+  // the connection window isn't a setting, open it over the default 65535
+  if (connection_window_size > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE) {
+    rv = nghttp2_submit_window_update(session_data->session, NGHTTP2_FLAG_NONE, 0,
+                                      connection_window_size - NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE);
+    if (rv != 0) {
+      fprintf(stderr, "Fatal error: %s", nghttp2_strerror(rv));
+      return -1;
+    }
+  }
   TRACER;
   return 0;
 }
@@ -1786,507 +3800,1304 @@ static SSL *mrb_http2_create_ssl(mrb_state *mrb, SSL_CTX *ssl_ctx)
     mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS session object: %S",
                mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
   }
-
+
+  TRACER;
+  return ssl;
+}
+
+static mrb_http2_conn_rec *mrb_http2_conn_rec_init(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  mrb_http2_conn_rec *conn;
+
+  if (!config->connection_record) {
+    return NULL;
+  }
+  conn = (mrb_http2_conn_rec *)mrb_malloc(mrb, sizeof(mrb_http2_conn_rec));
+  memset(conn, 0, sizeof(mrb_http2_conn_rec));
+
+  conn->client_ip = NULL;
+
+  return conn;
+}
+
+static void tune_packet_buffer(struct bufferevent *bev, mrb_http2_config_t *config)
+{
+  if (config->write_packet_buffer_limit_size > 0) {
+    bufferevent_setwatermark(bev, EV_WRITE, 0, config->write_packet_buffer_limit_size);
+  }
+
+  if (config->write_packet_buffer_expand_size > 0) {
+    evbuffer_expand(bev->output, config->write_packet_buffer_expand_size);
+  }
+
+  // TODO: need read_packet_buffer_expand_size ?
+  // evbuffer_expand(session_data->bev->input, 4096);
+}
+
+#if MRB_HTTP2_USE_ALPN
+static bool check_selected_proto(const unsigned char *proto, unsigned int len)
+{
+  if (sizeof(MRB_HTTP2_H2_PROTO) == len && memcmp(MRB_HTTP2_H2_PROTO, proto, len) == 0)
+    return true;
+  if (sizeof(MRB_HTTP2_H2_16_PROTO) == len && memcmp(MRB_HTTP2_H2_16_PROTO, proto, len) == 0)
+    return true;
+  if (sizeof(MRB_HTTP2_H2_14_PROTO) == len && memcmp(MRB_HTTP2_H2_14_PROTO, proto, len) == 0)
+    return true;
+
+  return false;
+}
+#endif
+
+#if MRB_HTTP2_USE_ALPN
+static bool check_http2_npn_or_alpn(SSL *ssl)
+{
+  const unsigned char *next_proto = NULL;
+  unsigned int next_proto_len = 0;
+
+  SSL_get0_next_proto_negotiated(ssl, &next_proto, &next_proto_len);
+
+  if (next_proto == NULL)
+    SSL_get0_alpn_selected(ssl, &next_proto, &next_proto_len);
+
+  if (next_proto == NULL || !check_selected_proto(next_proto, next_proto_len))
+    return true;
+
+  /* one more check */
+  if (!check_http2_npn_or_alpn(ssl))
+    return false;
+
+  return true;
+}
+#endif
+
+static http2_session_data *create_http2_session_data(mrb_state *mrb, app_context *app_ctx, int fd,
+                                                     struct sockaddr *addr, int addrlen)
+{
+  int rv;
+  http2_session_data *session_data;
+  SSL *ssl;
+  // char host[NI_MAXHOST];
+  int val = 1;
+  mrb_http2_server_t *server = app_ctx->server;
+  mrb_http2_config_t *config = app_ctx->server->config;
+
+  TRACER;
+  ssl = mrb_http2_create_ssl(mrb, app_ctx->ssl_ctx);
+
+  session_data = (http2_session_data *)mrb_malloc(mrb, sizeof(http2_session_data));
+  memset(session_data, 0, sizeof(http2_session_data));
+
+  session_data->app_ctx = app_ctx;
+  session_data->accepted = time(NULL);
+  session_data->next = app_ctx->sessions;
+  if (app_ctx->sessions != NULL) {
+    app_ctx->sessions->prev = session_data;
+  }
+  app_ctx->sessions = session_data;
+  // return NULL when connection_record option diabled
+  session_data->conn = mrb_http2_conn_rec_init(mrb, config);
+
+  if (config->tcp_nopush) {
+#ifdef TCP_CORK
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *)&val, sizeof(val));
+#endif
+
+#ifdef TCP_NOPUSH
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (char *)&val, sizeof(val));
+#endif
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+
+  TRACER;
+  session_data->bev = bufferevent_socket_new(app_ctx->evbase, fd, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+
+  tune_packet_buffer(session_data->bev, config);
+
+  if (ssl) {
+    TRACER;
+
+#if MRB_HTTP2_USE_ALPN
+    if (!check_http2_npn_or_alpn(ssl))
+      return NULL;
+#endif
+
+    session_data->bev =
+        bufferevent_openssl_filter_new(app_ctx->evbase, session_data->bev, ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  }
+
+  bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+
+  rv =
+      getnameinfo(addr, addrlen, session_data->client_addr, sizeof(session_data->client_addr), NULL, 0, NI_NUMERICHOST);
+  if (rv != 0) {
+    memcpy(session_data->client_addr, "(unknown)", sizeof("(unknown)"));
+  }
+  if (session_data->conn) {
+    session_data->conn->client_ip = session_data->client_addr;
+  }
+
+  if (config->server_status) {
+    MRB_HTTP2_WORKER_INC(server->worker, session_requests_per_worker);
+    MRB_HTTP2_WORKER_INC(server->worker, connected_sessions);
+  }
+
+  return session_data;
+}
+
+/* readcb for bufferevent after client connection header was
+   checked. */
+static void mrb_http2_server_readcb(struct bufferevent *bev, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+
+  TRACER;
+  if (session_data->app_ctx->server->config->tls) {
+    // if tls, use session_recv2 and tls_session_send
+    if (session_recv(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  } else {
+    if (session_recv(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+}
+
+static void mrb_http2_server_writecb(struct bufferevent *bev, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+
+  TRACER;
+  if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
+    return;
+  }
+  TRACER;
+  if (nghttp2_session_want_read(session_data->session) == 0 && nghttp2_session_want_write(session_data->session) == 0) {
+    delete_http2_session_data(session_data);
+    return;
+  }
+  TRACER;
+  if (session_data->app_ctx->server->config->tls) {
+    if (session_send(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  } else {
+    if (session_send(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+  TRACER;
+}
+
+// let the client open no more streams, the session is closed by writecb
+// when the streams in flight are done. a shutdown notice goes first so that
+// streams crossing the final GOAWAY on the wire are not refused
+static void session_goaway(http2_session_data *session_data, int notice)
+{
+  nghttp2_session *session = session_data->session;
+
+  if (session == NULL) {
+    // TLS handshake in progress, GOAWAY is sent when it completes
+    return;
+  }
+  if (notice) {
+    nghttp2_submit_shutdown_notice(session);
+  } else {
+    nghttp2_submit_goaway(session, NGHTTP2_FLAG_NONE, nghttp2_session_get_last_proc_stream_id(session),
+                          NGHTTP2_NO_ERROR, NULL, 0);
+  }
+  if (session_send(session_data) != 0) {
+    delete_http2_session_data(session_data);
+  }
+}
+
+/* eventcb for bufferevent */
+static void mrb_http2_server_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  http2_session_data *session_data = (http2_session_data *)ptr;
+  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+
+  TRACER;
+  if (events & BEV_EVENT_CONNECTED) {
+    if (config->debug) {
+      fprintf(stderr, "%s connected\n", session_data->client_addr);
+    }
+    if (config->tls) {
+      mrb_http2_server_session_init(session_data);
+      if (send_server_connection_header(session_data) != 0) {
+        delete_http2_session_data(session_data);
+        return;
+      }
+      if (session_data->app_ctx->draining) {
+        session_goaway(session_data, 0);
+      }
+    }
+    return;
+  }
+  if (config->debug) {
+    if (events & BEV_EVENT_EOF) {
+      fprintf(stderr, "%s EOF\n", session_data->client_addr);
+    } else if (events & BEV_EVENT_ERROR) {
+      fprintf(stderr, "%s network error\n", session_data->client_addr);
+    } else if (events & BEV_EVENT_TIMEOUT) {
+      fprintf(stderr, "%s timeout\n", session_data->client_addr);
+    }
+  }
   TRACER;
-  return ssl;
+  delete_http2_session_data(session_data);
 }
 
-static mrb_http2_conn_rec *mrb_http2_conn_rec_init(mrb_state *mrb, mrb_http2_config_t *config)
+static void mrb_http2_acceptcb(struct evconnlistener *listener, int fd, struct sockaddr *addr, int addrlen, void *ptr)
 {
-  mrb_http2_conn_rec *conn;
+  app_context *app_ctx = (app_context *)ptr;
+  http2_session_data *session_data;
+  mrb_state *mrb = app_ctx->server->mrb;
 
-  if (!config->connection_record) {
-    return NULL;
+  TRACER;
+  session_data = create_http2_session_data(mrb, app_ctx, fd, addr, addrlen);
+  if (session_data->bev == NULL) {
+    // accept socket failed
+    delete_http2_session_data(session_data);
+    return;
   }
-  conn = (mrb_http2_conn_rec *)mrb_malloc(mrb, sizeof(mrb_http2_conn_rec));
-  memset(conn, 0, sizeof(mrb_http2_conn_rec));
-
-  conn->client_ip = NULL;
-
-  return conn;
+  bufferevent_setcb(session_data->bev, mrb_http2_server_readcb, mrb_http2_server_writecb, mrb_http2_server_eventcb,
+                    session_data);
+  if (!app_ctx->server->config->tls) {
+    bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+    mrb_http2_server_session_init(session_data);
+    if (send_server_connection_header(session_data) != 0) {
+      delete_http2_session_data(session_data);
+      return;
+    }
+  }
+  // don't call eventcb when createing bufferevent_socket_new, not tls
+  // bufferevent_socket_connect(session_data->bev, NULL, 0);
 }
 
-static void tune_packet_buffer(struct bufferevent *bev, mrb_http2_config_t *config)
+static void set_dhparams(mrb_state *mrb, mrb_http2_config_t *config, SSL_CTX *ssl_ctx)
 {
-  if (config->write_packet_buffer_limit_size > 0) {
-    bufferevent_setwatermark(bev, EV_WRITE, 0, config->write_packet_buffer_limit_size);
+  DH *dh;
+  BIO *bio = BIO_new_file(config->dh_params_file, "r");
+
+  if (bio == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file open failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
   }
 
-  if (config->write_packet_buffer_expand_size > 0) {
-    evbuffer_expand(bev->output, config->write_packet_buffer_expand_size);
+  dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+
+  if (dh == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file read failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
   }
 
-  // TODO: need read_packet_buffer_expand_size ?
-  // evbuffer_expand(session_data->bev->input, 4096);
+  SSL_CTX_set_tmp_dh(ssl_ctx, dh);
+  DH_free(dh);
+}
+
+static int npn_advertise_cb(SSL *s, const unsigned char **data, unsigned int *len, void *proto)
+{
+  *data = proto;
+  *len = (unsigned int)strlen(proto);
+  return SSL_TLSEXT_ERR_OK;
 }
 
+/* ref: h2o/lib/common/socket.c */
 #if MRB_HTTP2_USE_ALPN
-static bool check_selected_proto(const unsigned char *proto, unsigned int len)
+static int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *_in,
+                          unsigned int inlen, void *_protos)
 {
-  if (sizeof(MRB_HTTP2_H2_PROTO) == len && memcmp(MRB_HTTP2_H2_PROTO, proto, len) == 0)
-    return true;
-  if (sizeof(MRB_HTTP2_H2_16_PROTO) == len && memcmp(MRB_HTTP2_H2_16_PROTO, proto, len) == 0)
-    return true;
-  if (sizeof(MRB_HTTP2_H2_14_PROTO) == len && memcmp(MRB_HTTP2_H2_14_PROTO, proto, len) == 0)
-    return true;
+  const mrb_http2_iovec_t *protos = _protos;
+  size_t i;
 
-  return false;
+  for (i = 0; protos[i].len != 0; ++i) {
+    const unsigned char *in = _in, *in_end = in + inlen;
+    while (in != in_end) {
+      size_t cand_len = *in++;
+      if (in_end - in < cand_len) {
+        return SSL_TLSEXT_ERR_NOACK;
+      }
+      if (cand_len == protos[i].len && memcmp(in, protos[i].base, cand_len) == 0) {
+        *out = (const unsigned char *)protos[i].base;
+        *outlen = (unsigned char)protos[i].len;
+
+        return SSL_TLSEXT_ERR_OK;
+      }
+      in += cand_len;
+    }
+  }
+
+  return SSL_TLSEXT_ERR_NOACK;
 }
 #endif
 
-#if MRB_HTTP2_USE_ALPN
-static bool check_http2_npn_or_alpn(SSL *ssl)
+static SSL_CTX *mrb_http2_create_ssl_ctx(mrb_state *mrb, mrb_http2_config_t *config, const char *key_file,
+                                         const char *cert_file)
 {
-  const unsigned char *next_proto = NULL;
-  unsigned int next_proto_len = 0;
+  const unsigned char sid_ctx[] = "mruby-http2";
+  SSL_CTX *ssl_ctx;
+  EC_KEY *ecdh;
 
-  SSL_get0_next_proto_negotiated(ssl, &next_proto, &next_proto_len);
+  SSL_load_error_strings();
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
 
-  if (next_proto == NULL)
-    SSL_get0_alpn_selected(ssl, &next_proto, &next_proto_len);
+  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  TRACER;
+  if (!ssl_ctx) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS context: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
-  if (next_proto == NULL || !check_selected_proto(next_proto, next_proto_len))
-    return true;
+  // in reference to nghttp2
+  if (SSL_CTX_set_cipher_list(ssl_ctx, DEFAULT_CIPHER_LIST) == 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "SSL_CTX_set_cipher_list failed: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
 
-  /* one more check */
-  if (!check_http2_npn_or_alpn(ssl))
-    return false;
+  ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (!ecdh) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "EC_KEY_new_by_curv_name failed: %S",
+               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  }
+  SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
+  EC_KEY_free(ecdh);
 
-  return true;
-}
+  if (config->dh_params_file) {
+    set_dhparams(mrb, config, ssl_ctx);
+  }
+
+  if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read private key file %S", mrb_str_new_cstr(mrb, key_file));
+  }
+  if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read certificate file %S", mrb_str_new_cstr(mrb, cert_file));
+  }
+  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, npn_advertise_cb, (void *)npn_proto);
+#if MRB_HTTP2_USE_ALPN
+  SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_cb, (void *)alpn_proto);
 #endif
+  TRACER;
+  return ssl_ctx;
+}
 
-static http2_session_data *create_http2_session_data(mrb_state *mrb, app_context *app_ctx, int fd,
-                                                     struct sockaddr *addr, int addrlen)
+static void init_app_context(app_context *actx, SSL_CTX *ssl_ctx, struct event_base *evbase)
 {
-  int rv;
-  http2_session_data *session_data;
-  SSL *ssl;
-  // char host[NI_MAXHOST];
-  int val = 1;
-  mrb_http2_server_t *server = app_ctx->server;
-  mrb_http2_config_t *config = app_ctx->server->config;
+  memset(actx, 0, sizeof(app_context));
+  actx->ssl_ctx = ssl_ctx;
+  actx->evbase = evbase;
+}
 
-  TRACER;
-  ssl = mrb_http2_create_ssl(mrb, app_ctx->ssl_ctx);
+static void set_run_user(mrb_state *mrb, mrb_http2_config_t *config)
+{
+  uid_t cur_uid = getuid();
 
-  session_data = (http2_session_data *)mrb_malloc(mrb, sizeof(http2_session_data));
-  memset(session_data, 0, sizeof(http2_session_data));
+  if (config->run_user == NULL && cur_uid != 0) {
+    mrb_warn(mrb, "don't set run_user, so run with uid=%S\n", mrb_fixnum_value(cur_uid));
+    return;
+  } else if (config->run_user == NULL && cur_uid == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
+                                    " Set 'run_user => user_name' instead of root in config");
+  }
 
-  session_data->app_ctx = app_ctx;
-  // return NULL when connection_record option diabled
-  session_data->conn = mrb_http2_conn_rec_init(mrb, config);
+  config->run_uid = mrb_http2_get_uid(mrb, config->run_user);
 
-  if (config->tcp_nopush) {
-#ifdef TCP_CORK
-    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *)&val, sizeof(val));
-#endif
+  if (config->run_uid == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
+                                    " Set 'run_user => user_name' instead of root in config");
+  }
 
-#ifdef TCP_NOPUSH
-    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (char *)&val, sizeof(val));
-#endif
+  // TODO: add config->run_gid
+  // setgid :run_user for now
+  if (setgid(config->run_uid)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set gid: %S", mrb_fixnum_value(config->run_uid));
   }
 
-  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+  if (setuid(config->run_uid)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set user: %S"
+                                     " If running server with specific user, "
+                                     "run server with root at first",
+               mrb_str_new_cstr(mrb, config->run_user));
+  }
+}
 
-  TRACER;
-  session_data->bev = bufferevent_socket_new(app_ctx->evbase, fd, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+// threaded worker mode, each thread loads the server script into an
+// mrb_state of its own and runs its own event loop on its own
+// SO_REUSEPORT listeners. TLS sessions and upstream health are shared
+typedef struct {
+  char *script;
+  char **argv;
+  unsigned int argc;
+  SSL_CTX *ssl_ctx;
+  mrb_http2_balancer *upstreams;
+  mrb_http2_scoreboard *scoreboard;
+  evutil_socket_t fds[MRB_HTTP2_WORKER_MAX][MRB_HTTP2_LISTENER_MAX];
 
-  tune_packet_buffer(session_data->bev, config);
+  // written by the main thread on SIGTERM or SIGQUIT to drain each thread
+  int drain_fds[MRB_HTTP2_WORKER_MAX][2];
+  unsigned int running;
+} mrb_http2_threads_t;
 
-  if (ssl) {
-    TRACER;
+static mrb_http2_threads_t *threads = NULL;
 
-#if MRB_HTTP2_USE_ALPN
-    if (!check_http2_npn_or_alpn(ssl))
-      return NULL;
-#endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1 takes the locks of the application to share the SSL_CTX
+// and its session cache between threads
+static pthread_mutex_t *ssl_locks = NULL;
 
-    session_data->bev =
-        bufferevent_openssl_filter_new(app_ctx->evbase, session_data->bev, ssl, BUFFEREVENT_SSL_ACCEPTING,
-                                       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+static void ssl_locking_cb(int mode, int n, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK) {
+    pthread_mutex_lock(&ssl_locks[n]);
+  } else {
+    pthread_mutex_unlock(&ssl_locks[n]);
   }
+}
 
-  bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
+static void ssl_threadid_cb(CRYPTO_THREADID *id)
+{
+  CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
 
-  rv =
-      getnameinfo(addr, addrlen, session_data->client_addr, sizeof(session_data->client_addr), NULL, 0, NI_NUMERICHOST);
-  if (rv != 0) {
-    memcpy(session_data->client_addr, "(unknown)", sizeof("(unknown)"));
-  }
-  if (session_data->conn) {
-    session_data->conn->client_ip = session_data->client_addr;
-  }
-  session_data->upstream_base = NULL;
-  session_data->upstream_conn = NULL;
+static void ssl_locks_init(void)
+{
+  int i;
 
-  if (config->server_status) {
-    server->worker->session_requests_per_worker++;
-    server->worker->connected_sessions++;
+  if (ssl_locks != NULL) {
+    return;
   }
-
-  return session_data;
+  ssl_locks = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t) * CRYPTO_num_locks());
+  for (i = 0; i < CRYPTO_num_locks(); i++) {
+    pthread_mutex_init(&ssl_locks[i], NULL);
+  }
+  CRYPTO_THREADID_set_callback(ssl_threadid_cb);
+  CRYPTO_set_locking_callback(ssl_locking_cb);
 }
+#endif
 
-/* readcb for bufferevent after client connection header was
-   checked. */
-static void mrb_http2_server_readcb(struct bufferevent *bev, void *ptr)
+// listeners bound by the main thread for this worker thread, NULL out of
+// threaded mode
+static __thread evutil_socket_t *thread_listen_fds = NULL;
+
+// listeners bound by the master, inherited by forked workers and by the
+// master re-executed on reload. a row per worker, a column per address
+static evutil_socket_t listen_fds[MRB_HTTP2_WORKER_MAX][MRB_HTTP2_LISTENER_MAX];
+static unsigned int listen_fdslen = 0;
+static evutil_socket_t *worker_listen_fds = NULL;
+static __thread unsigned int thread_worker_id = 0;
+
+// listen addresses of the config, server_host and port by default
+static unsigned int resolve_listeners(mrb_state *mrb, mrb_http2_config_t *config, mrb_http2_listener_addr *addrs)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
+  unsigned int i;
+  int n = 0;
 
-  TRACER;
-  if (session_data->app_ctx->server->config->tls) {
-    // if tls, use session_recv2 and tls_session_send
-    if (session_recv(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+  if (config->listenlen == 0) {
+    n = mrb_http2_listener_resolve(config->server_host, config->service, addrs, 0, MRB_HTTP2_LISTENER_MAX);
+    if (n < 0) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "getaddrinfo failed");
     }
-  } else {
-    if (session_recv(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+    return n;
+  }
+  for (i = 0; i < config->listenlen; i++) {
+    n = mrb_http2_listener_resolve(config->listen[i], config->service, addrs, n, MRB_HTTP2_LISTENER_MAX);
+    if (n < 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "could not resolve listen address: %S",
+                 mrb_str_new_cstr(mrb, config->listen[i]));
     }
   }
+  return n;
 }
 
-static void mrb_http2_server_writecb(struct bufferevent *bev, void *ptr)
+// listeners left by the master before it re-executed itself go to the
+// first free slot of their address, the ones bound to an address no longer
+// in the config are closed
+static void inherit_listeners(mrb_http2_listener_addr *addrs, unsigned int addrslen,
+                              evutil_socket_t (*fds)[MRB_HTTP2_LISTENER_MAX], unsigned int n)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
+  const char *env = getenv(MRB_HTTP2_LISTEN_FDS_ENV);
+  unsigned int i, j;
+  char *end;
+  long fd;
 
-  TRACER;
-  if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
+  if (env == NULL) {
     return;
   }
-  TRACER;
-  if (nghttp2_session_want_read(session_data->session) == 0 && nghttp2_session_want_write(session_data->session) == 0) {
-    delete_http2_session_data(session_data);
-    return;
+  while (*env != '\0') {
+    fd = strtol(env, &end, 10);
+    if (end == env) {
+      break;
+    }
+    for (j = 0; j < addrslen && !mrb_http2_listener_match(fd, &addrs[j]); j++)
+      ;
+    for (i = 0; j < addrslen && i < n && fds[i][j] != -1; i++)
+      ;
+    if (j < addrslen && i < n) {
+      fds[i][j] = fd;
+    } else {
+      close(fd);
+    }
+    env = *end == ',' ? end + 1 : end;
   }
-  TRACER;
-  if (session_data->app_ctx->server->config->tls) {
-    if (session_send(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+  unsetenv(MRB_HTTP2_LISTEN_FDS_ENV);
+}
+
+static mrb_http2_listener_addr listen_addrs[MRB_HTTP2_LISTENER_MAX];
+
+// listeners of worker i, joining the SO_REUSEPORT group of each TCP address
+// after the ones of workers before it. unix sockets of worker 0 are shared
+static int bind_worker_listeners(mrb_http2_config_t *config, evutil_socket_t (*fds)[MRB_HTTP2_LISTENER_MAX],
+                                 unsigned int i)
+{
+  int backlog = config->listen_backlog > 0 ? config->listen_backlog : SOMAXCONN;
+  // a single process binds alone, and doesn't share the port by accident
+  int reuseport = config->worker > 1 || config->worker_max > 1 || config->worker_threads > 1;
+  unsigned int j;
+
+  for (j = 0; j < listen_fdslen; j++) {
+    if (fds[i][j] == -1) {
+      if (i > 0 && mrb_http2_listener_is_unix(&listen_addrs[j])) {
+        fds[i][j] = dup(fds[0][j]);
+      } else {
+        fds[i][j] =
+            mrb_http2_listener_bind(&listen_addrs[j], reuseport, config->tcp_fastopen, config->tcp_defer_accept);
+      }
+      if (fds[i][j] == -1) {
+        return -1;
+      }
     }
-  } else {
-    if (session_send(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+    // the reuseport group is ordered by listen(), so listener i is at index i
+    if ((i == 0 || !mrb_http2_listener_is_unix(&listen_addrs[j])) && listen(fds[i][j], backlog) != 0) {
+      return -1;
     }
   }
-  TRACER;
+  return 0;
 }
 
-/* eventcb for bufferevent */
-static void mrb_http2_server_eventcb(struct bufferevent *bev, short events, void *ptr)
+// a listener per worker and address bound before forking or dropping
+// privileges. TCP workers get a socket each in the SO_REUSEPORT group, unix
+// sockets are shared
+static void bind_listeners(mrb_state *mrb, mrb_http2_config_t *config, evutil_socket_t (*fds)[MRB_HTTP2_LISTENER_MAX],
+                           unsigned int n)
 {
-  http2_session_data *session_data = (http2_session_data *)ptr;
-  mrb_http2_config_t *config = session_data->app_ctx->server->config;
+  unsigned int i, j;
 
-  TRACER;
-  if (events & BEV_EVENT_CONNECTED) {
-    if (config->debug) {
-      fprintf(stderr, "%s connected\n", session_data->client_addr);
+  listen_fdslen = resolve_listeners(mrb, config, listen_addrs);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < listen_fdslen; j++) {
+      fds[i][j] = -1;
     }
-    if (config->tls) {
-      mrb_http2_server_session_init(session_data);
-      if (send_server_connection_header(session_data) != 0) {
-        delete_http2_session_data(session_data);
-        return;
-      }
+  }
+  inherit_listeners(listen_addrs, listen_fdslen, fds, n);
+
+  for (i = 0; i < n; i++) {
+    if (bind_worker_listeners(config, fds, i) != 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not bind listener: %S", mrb_str_new_cstr(mrb, strerror(errno)));
     }
-    return;
   }
-  if (config->debug) {
-    if (events & BEV_EVENT_EOF) {
-      fprintf(stderr, "%s EOF\n", session_data->client_addr);
-    } else if (events & BEV_EVENT_ERROR) {
-      fprintf(stderr, "%s network error\n", session_data->client_addr);
-    } else if (events & BEV_EVENT_TIMEOUT) {
-      fprintf(stderr, "%s timeout\n", session_data->client_addr);
+  // autoscaling leaves holes in the group, which breaks the steering
+  if (config->worker_cpu_affinity == MRB_HTTP2_AFFINITY_CPU && n > 1 && config->worker_max == 0) {
+    for (j = 0; j < listen_fdslen; j++) {
+      if (!mrb_http2_listener_is_unix(&listen_addrs[j])) {
+        mrb_http2_affinity_steer(fds[0][j], n);
+      }
     }
   }
-  TRACER;
-  delete_http2_session_data(session_data);
 }
 
-static void mrb_http2_acceptcb(struct evconnlistener *listener, int fd, struct sockaddr *addr, int addrlen, void *ptr)
+static void mrb_start_listen(struct event_base *evbase, mrb_http2_config_t *config, app_context *app_ctx)
 {
-  app_context *app_ctx = (app_context *)ptr;
-  http2_session_data *session_data;
+  evutil_socket_t single_fds[1][MRB_HTTP2_LISTENER_MAX];
+  evutil_socket_t *fds = thread_listen_fds != NULL ? thread_listen_fds : worker_listen_fds;
   mrb_state *mrb = app_ctx->server->mrb;
+  unsigned int i;
 
   TRACER;
-  session_data = create_http2_session_data(mrb, app_ctx, fd, addr, addrlen);
-  if (session_data->bev == NULL) {
-    // accept socket failed
-    delete_http2_session_data(session_data);
-    return;
+  if (fds == NULL) {
+    bind_listeners(mrb, config, single_fds, 1);
+    fds = single_fds[0];
   }
-  bufferevent_setcb(session_data->bev, mrb_http2_server_readcb, mrb_http2_server_writecb, mrb_http2_server_eventcb,
-                    session_data);
-  if (!app_ctx->server->config->tls) {
-    bufferevent_enable(session_data->bev, EV_READ | EV_WRITE);
-    mrb_http2_server_session_init(session_data);
-    if (send_server_connection_header(session_data) != 0) {
-      delete_http2_session_data(session_data);
-      return;
+
+  // the sockets are listening already, backlog 0 skips listen()
+  for (i = 0; i < listen_fdslen; i++) {
+    app_ctx->listeners[i] =
+        evconnlistener_new(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 0, fds[i]);
+    if (app_ctx->listeners[i] == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Could not start listener");
     }
+    app_ctx->listenerslen++;
+  }
+  // privileges of worker threads were dropped by the main thread
+  if (thread_listen_fds == NULL) {
+    set_run_user(mrb, config);
   }
-  // don't call eventcb when createing bufferevent_socket_new, not tls
-  // bufferevent_socket_connect(session_data->bev, NULL, 0);
 }
 
-static void set_dhparams(mrb_state *mrb, mrb_http2_config_t *config, SSL_CTX *ssl_ctx)
+static void free_listeners(app_context *app_ctx)
 {
-  DH *dh;
-  BIO *bio = BIO_new_file(config->dh_params_file, "r");
+  unsigned int i;
 
-  if (bio == NULL) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file open failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  for (i = 0; i < app_ctx->listenerslen; i++) {
+    evconnlistener_free(app_ctx->listeners[i]);
   }
+  app_ctx->listenerslen = 0;
+}
 
-  dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-  BIO_free(bio);
+static void worker_goaway_cb(evutil_socket_t fd, short events, void *arg)
+{
+  app_context *app_ctx = (app_context *)arg;
+  http2_session_data *session_data, *next;
 
-  if (dh == NULL) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "dh_params_file read failed: %S", mrb_str_new_cstr(mrb, config->dh_params_file));
+  for (session_data = app_ctx->sessions; session_data; session_data = next) {
+    next = session_data->next;
+    session_goaway(session_data, 0);
   }
+}
 
-  SSL_CTX_set_tmp_dh(ssl_ctx, dh);
-  DH_free(dh);
+// stop accepting and close every session once its streams are done, the
+// worker exits when no session is left or after graceful_timeout
+static void worker_drain_cb(evutil_socket_t sig, short events, void *arg)
+{
+  app_context *app_ctx = (app_context *)arg;
+  mrb_http2_config_t *config = app_ctx->server->config;
+  http2_session_data *session_data, *next;
+  struct timeval tv;
+
+  if (app_ctx->draining) {
+    return;
+  }
+  if (config->debug) {
+    fprintf(stderr, "worker(%d) is draining\n", getpid());
+  }
+  app_ctx->draining = 1;
+  free_listeners(app_ctx);
+  tv.tv_sec = config->graceful_timeout > 0 ? config->graceful_timeout : MRB_HTTP2_GRACEFUL_TIMEOUT;
+  tv.tv_usec = 0;
+  event_base_loopexit(app_ctx->evbase, &tv);
+
+  for (session_data = app_ctx->sessions; session_data; session_data = next) {
+    next = session_data->next;
+    session_goaway(session_data, 1);
+  }
+  if (app_ctx->sessions == NULL) {
+    event_base_loopexit(app_ctx->evbase, NULL);
+    return;
+  }
+  tv.tv_sec = MRB_HTTP2_SHUTDOWN_NOTICE_DELAY;
+  app_ctx->goaway_ev = evtimer_new(app_ctx->evbase, worker_goaway_cb, app_ctx);
+  evtimer_add(app_ctx->goaway_ev, &tv);
 }
 
-static int npn_advertise_cb(SSL *s, const unsigned char **data, unsigned int *len, void *proto)
+static void worker_lag_cb(evutil_socket_t fd, short events, void *arg)
 {
-  *data = proto;
-  *len = (unsigned int)strlen(proto);
-  return SSL_TLSEXT_ERR_OK;
+  app_context *app_ctx = (app_context *)arg;
+  mrb_http2_worker_t *worker = app_ctx->server->worker;
+  struct timeval now, tv;
+  uint64_t lag = 0;
+
+  evutil_gettimeofday(&now, NULL);
+  if (evutil_timercmp(&now, &app_ctx->lag_expected, >)) {
+    evutil_timersub(&now, &app_ctx->lag_expected, &tv);
+    lag = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+  // a slow request shows up for a few samples, not for a single one
+  __atomic_store_n(&worker->loop_lag, (MRB_HTTP2_WORKER_GET(worker, loop_lag) * 3 + lag) / 4, __ATOMIC_RELAXED);
+
+  tv.tv_sec = 0;
+  tv.tv_usec = MRB_HTTP2_LOOP_LAG_INTERVAL * 1000;
+  evutil_timeradd(&now, &tv, &app_ctx->lag_expected);
+  evtimer_add(app_ctx->lag_ev, &tv);
 }
 
-/* ref: h2o/lib/common/socket.c */
-#if MRB_HTTP2_USE_ALPN
-static int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *_in,
-                          unsigned int inlen, void *_protos)
+static void connection_goaway(http2_session_data *session_data)
 {
-  const mrb_http2_iovec_t *protos = _protos;
-  size_t i;
+  session_data->goaway = 1;
+  session_goaway(session_data, 0);
+}
 
-  for (i = 0; protos[i].len != 0; ++i) {
-    const unsigned char *in = _in, *in_end = in + inlen;
-    while (in != in_end) {
-      size_t cand_len = *in++;
-      if (in_end - in < cand_len) {
-        return SSL_TLSEXT_ERR_NOACK;
-      }
-      if (cand_len == protos[i].len && memcmp(in, protos[i].base, cand_len) == 0) {
-        *out = (const unsigned char *)protos[i].base;
-        *outlen = (unsigned char)protos[i].len;
+// GOAWAY connections past connection_max_age, and the one with the most open
+// streams when this worker is busier than the others
+static void worker_rebalance_cb(evutil_socket_t fd, short events, void *arg)
+{
+  app_context *app_ctx = (app_context *)arg;
+  mrb_http2_server_t *server = app_ctx->server;
+  mrb_http2_config_t *config = server->config;
+  http2_session_data *session_data, *next, *busiest = NULL;
+  http2_stream_data *stream_data;
+  mrb_http2_worker_t total;
+  unsigned int streams, busiest_streams = 0;
+  time_t now = time(NULL);
+  struct timeval tv;
 
-        return SSL_TLSEXT_ERR_OK;
+  // every connection gets GOAWAY anyway
+  if (app_ctx->draining) {
+    return;
+  }
+  for (session_data = app_ctx->sessions; session_data; session_data = next) {
+    next = session_data->next;
+    if (session_data->goaway || session_data->session == NULL) {
+      continue;
+    }
+    if (config->connection_max_age > 0 && now - session_data->accepted >= config->connection_max_age) {
+      connection_goaway(session_data);
+      continue;
+    }
+    streams = 0;
+    for (stream_data = session_data->root.next; stream_data; stream_data = stream_data->next) {
+      streams++;
+    }
+    if (streams > busiest_streams) {
+      busiest = session_data;
+      busiest_streams = streams;
+    }
+  }
+
+  if (config->connection_rebalance && busiest != NULL) {
+    mrb_http2_scoreboard_total(server->scoreboard, &total);
+    if (total.pid > 1 && MRB_HTTP2_WORKER_GET(server->worker, active_stream) >
+                             (double)total.active_stream / total.pid * MRB_HTTP2_REBALANCE_RATIO) {
+      if (config->debug) {
+        fprintf(stderr, "rebalance: GOAWAY %s with %u streams\n", busiest->client_addr, busiest_streams);
       }
-      in += cand_len;
+      connection_goaway(busiest);
     }
   }
 
-  return SSL_TLSEXT_ERR_NOACK;
+  tv.tv_sec = MRB_HTTP2_REBALANCE_INTERVAL;
+  tv.tv_usec = 0;
+  evtimer_add(app_ctx->rebalance_ev, &tv);
 }
-#endif
 
-static SSL_CTX *mrb_http2_create_ssl_ctx(mrb_state *mrb, mrb_http2_config_t *config, const char *key_file,
-                                         const char *cert_file)
+static void mrb_http2_worker_run(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server, mrb_http2_request_rec *r,
+                                 app_context *app_ctx, unsigned int id)
 {
-  const unsigned char sid_ctx[] = "mruby-http2";
-  SSL_CTX *ssl_ctx;
-  EC_KEY *ecdh;
 
-  SSL_load_error_strings();
-  SSL_library_init();
-  OpenSSL_add_all_algorithms();
+  SSL_CTX *ssl_ctx = NULL;
+  struct event_base *evbase;
+  mrb_http2_config_t *config = server->config;
+  unsigned int workers = config->worker_threads > 0 ? config->worker_threads
+                                                    : (config->worker_max > 0 ? config->worker_max : config->worker);
+
+  if (workers > 0) {
+    mrb_http2_affinity_set(server->config->worker_cpu_affinity, id, workers);
+  }
+
+  // forked workers would draw the same random choices of the balancer
+  srand((unsigned int)(time(NULL) ^ getpid() ^ (id << 16)));
+
+  if (thread_listen_fds != NULL) {
+    // worker threads share the TLS session cache and upstream health
+    ssl_ctx = threads->ssl_ctx;
+    if (threads->upstreams != NULL && server->config->upstreams != threads->upstreams) {
+      // the groups built from the config of this thread are not used
+      mrb_http2_balancer_free(mrb, server->config->upstreams);
+      server->config->upstreams = threads->upstreams;
+    }
+  } else if (server->ssl_ctx != NULL) {
+    ssl_ctx = server->ssl_ctx;
+  } else if (server->config->tls) {
+    ssl_ctx = mrb_http2_create_ssl_ctx(mrb, server->config, server->config->key, server->config->cert);
+  }
+
+  server->worker = mrb_http2_worker_init(server->scoreboard, id);
+
+  evbase = event_base_new();
+
+  init_app_context(app_ctx, ssl_ctx, evbase);
+  app_ctx->server = server;
+  app_ctx->r = r;
+  app_ctx->self = self;
+  if (server->config->upstream) {
+    app_ctx->resolver = mrb_http2_resolver_new(mrb, evbase, server->config->upstream_dns_ttl,
+                                               server->config->upstream_dns_negative_ttl);
+    app_ctx->upstream_pool =
+        mrb_http2_upstream_pool_new(mrb, evbase, server->config->upstream_buffer_size, app_ctx->resolver);
+    if (server->config->upstream_cache_size > 0) {
+      app_ctx->cache =
+          mrb_http2_cache_new(mrb, server->config->upstream_cache_size, server->config->upstream_cache_max_object,
+                              server->config->upstream_cache_dir, server->config->upstream_cache_disk_size);
+    }
+  }
+  if (config->blocking_locationslen > 0) {
+    // handlers run on the event loop when the pool can't be started
+    app_ctx->blocking = mrb_http2_blocking_new(mrb, evbase, config->blocking_threads, blocking_thread_init,
+                                               blocking_thread_fini, server);
+  }
 
-  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
   TRACER;
-  if (!ssl_ctx) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not create SSL/TLS context: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+  mrb_start_listen(evbase, server->config, app_ctx);
+
+  // SIGQUIT and SIGTERM drain the worker. in threaded mode the main thread
+  // takes the signals and writes to the drain pipe of each thread
+  if (thread_listen_fds != NULL) {
+    app_ctx->drain_ev = event_new(evbase, threads->drain_fds[id][0], EV_READ, worker_drain_cb, app_ctx);
+    event_add(app_ctx->drain_ev, NULL);
+  } else {
+    app_ctx->drain_ev = evsignal_new(evbase, SIGQUIT, worker_drain_cb, app_ctx);
+    event_add(app_ctx->drain_ev, NULL);
+    app_ctx->term_ev = evsignal_new(evbase, SIGTERM, worker_drain_cb, app_ctx);
+    event_add(app_ctx->term_ev, NULL);
   }
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_COMPRESSION);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  if (server->config->worker_max > 0) {
+    app_ctx->lag_ev = evtimer_new(evbase, worker_lag_cb, app_ctx);
+    evutil_gettimeofday(&app_ctx->lag_expected, NULL);
+    worker_lag_cb(-1, 0, app_ctx);
+  }
+  if (config->connection_max_age > 0 || config->connection_rebalance) {
+    app_ctx->rebalance_ev = evtimer_new(evbase, worker_rebalance_cb, app_ctx);
+    worker_rebalance_cb(-1, 0, app_ctx);
+  }
+  event_base_loop(app_ctx->evbase, 0);
+  if (app_ctx->lag_ev != NULL) {
+    event_free(app_ctx->lag_ev);
+  }
+  if (app_ctx->rebalance_ev != NULL) {
+    event_free(app_ctx->rebalance_ev);
+  }
+  if (app_ctx->drain_ev != NULL) {
+    event_free(app_ctx->drain_ev);
+  }
+  if (app_ctx->term_ev != NULL) {
+    event_free(app_ctx->term_ev);
+  }
+  if (app_ctx->goaway_ev != NULL) {
+    event_free(app_ctx->goaway_ev);
+  }
+  free_listeners(app_ctx);
+  if (app_ctx->blocking != NULL) {
+    mrb_http2_blocking_free(app_ctx->blocking);
+  }
+  if (app_ctx->upstream_pool != NULL) {
+    mrb_http2_upstream_pool_free(app_ctx->upstream_pool);
+  }
+  if (app_ctx->cache != NULL) {
+    mrb_http2_cache_free(app_ctx->cache);
+  }
+  if (app_ctx->resolver != NULL) {
+    mrb_http2_resolver_free(app_ctx->resolver);
+  }
+  event_base_free(app_ctx->evbase);
+  if (server->config->tls && thread_listen_fds == NULL && server->ssl_ctx == NULL) {
+    SSL_CTX_free(app_ctx->ssl_ctx);
+  }
+  TRACER;
+}
 
-  // in reference to nghttp2
-  if (SSL_CTX_set_cipher_list(ssl_ctx, DEFAULT_CIPHER_LIST) == 0) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "SSL_CTX_set_cipher_list failed: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+static int pid[MRB_HTTP2_WORKER_MAX + 1];
+static int prepare_kill = 0;
+static volatile sig_atomic_t prepare_reload = 0;
+
+static void killall_worker(int flags)
+{
+  int i;
+  prepare_kill = 1;
+  for (i = 0; pid[i] != -1; i++) {
+    kill(pid[i], SIGTERM);
   }
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-  SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
-  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+}
 
-  ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-  if (!ecdh) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "EC_KEY_new_by_curv_name failed: %S",
-               mrb_str_new_cstr(mrb, ERR_error_string(ERR_get_error(), NULL)));
+static void *mrb_http2_thread_main(void *arg)
+{
+  int id = (int)(intptr_t)arg;
+  mrb_state *mrb;
+  mrbc_context *cxt;
+  mrb_value argv;
+  FILE *fp;
+  unsigned int i;
+
+  thread_listen_fds = threads->fds[id];
+  thread_worker_id = id;
+  mrb = mrb_open();
+  if (mrb == NULL) {
+    fprintf(stderr, "worker thread[%d]: mrb_open failed\n", id);
+    __atomic_fetch_sub(&threads->running, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  argv = mrb_ary_new_capa(mrb, threads->argc);
+  for (i = 0; i < threads->argc; i++) {
+    mrb_ary_push(mrb, argv, mrb_str_new_cstr(mrb, threads->argv[i]));
+  }
+  mrb_define_global_const(mrb, "ARGV", argv);
+  mrb_gv_set(mrb, mrb_intern_lit(mrb, "$0"), mrb_str_new_cstr(mrb, threads->script));
+
+  fp = fopen(threads->script, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "worker thread[%d]: could not open %s: %s\n", id, threads->script, strerror(errno));
+    mrb_close(mrb);
+    __atomic_fetch_sub(&threads->running, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  // Server#run of the script runs the worker loop of this thread
+  cxt = mrbc_context_new(mrb);
+  mrbc_filename(mrb, cxt, threads->script);
+  mrb_load_file_cxt(mrb, fp, cxt);
+  fclose(fp);
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+  }
+  mrbc_context_free(mrb, cxt);
+  mrb_close(mrb);
+  __atomic_fetch_sub(&threads->running, 1, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+static void mrb_http2_threads_run(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server)
+{
+  mrb_http2_config_t *config = server->config;
+  pthread_t tids[MRB_HTTP2_WORKER_MAX];
+  sigset_t sigs;
+  struct timespec timeout;
+  mrb_value script, argv;
+  unsigned int i, n;
+  int rv;
+
+  if (config->worker_script != NULL) {
+    script = mrb_str_new_cstr(mrb, config->worker_script);
+  } else {
+    script = mrb_gv_get(mrb, mrb_intern_lit(mrb, "$0"));
+  }
+  if (!mrb_string_p(script)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "worker_threads needs worker_script to load in each thread");
+  }
+
+  threads = (mrb_http2_threads_t *)mrb_malloc(mrb, sizeof(mrb_http2_threads_t));
+  memset(threads, 0, sizeof(mrb_http2_threads_t));
+  threads->script = strdup(mrb_str_to_cstr(mrb, script));
+  if (mrb_const_defined(mrb, mrb_obj_value(mrb->object_class), mrb_intern_lit(mrb, "ARGV"))) {
+    argv = mrb_const_get(mrb, mrb_obj_value(mrb->object_class), mrb_intern_lit(mrb, "ARGV"));
+    if (mrb_array_p(argv)) {
+      threads->argc = RARRAY_LEN(argv);
+      threads->argv = (char **)mrb_malloc(mrb, sizeof(char *) * (threads->argc + 1));
+      for (i = 0; i < threads->argc; i++) {
+        threads->argv[i] = strdup(mrb_str_to_cstr(mrb, mrb_obj_as_string(mrb, mrb_ary_ref(mrb, argv, i))));
+      }
+    }
+  }
+
+  // all listeners are bound before dropping privileges
+  bind_listeners(mrb, config, threads->fds, config->worker_threads);
+
+  if (config->tls) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    ssl_locks_init();
+#endif
+    threads->ssl_ctx = mrb_http2_create_ssl_ctx(mrb, config, config->key, config->cert);
   }
-  SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
-  EC_KEY_free(ecdh);
+  threads->upstreams = config->upstreams;
+  threads->scoreboard = server->scoreboard;
+  set_run_user(mrb, config);
 
-  if (config->dh_params_file) {
-    set_dhparams(mrb, config, ssl_ctx);
+  // worker threads inherit the mask, and the signals are taken here
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGQUIT);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  for (n = 0; n < config->worker_threads; n++) {
+    if (pipe(threads->drain_fds[n]) != 0) {
+      fprintf(stderr, "worker thread[%u]: pipe failed: %s\n", n, strerror(errno));
+      break;
+    }
+    __atomic_fetch_add(&threads->running, 1, __ATOMIC_RELAXED);
+    if ((rv = pthread_create(&tids[n], NULL, mrb_http2_thread_main, (void *)(intptr_t)n)) != 0) {
+      fprintf(stderr, "worker thread[%u]: pthread_create failed: %s\n", n, strerror(rv));
+      __atomic_fetch_sub(&threads->running, 1, __ATOMIC_RELAXED);
+      for (i = 0; i < listen_fdslen; i++) {
+        evutil_closesocket(threads->fds[n][i]);
+      }
+      break;
+    }
+    if (config->debug) {
+      fprintf(stderr, "worker thread[%u] start\n", n);
+    }
   }
 
-  if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read private key file %S", mrb_str_new_cstr(mrb, key_file));
+  // threads exit after draining, or when their script fails
+  timeout.tv_sec = 1;
+  timeout.tv_nsec = 0;
+  while (__atomic_load_n(&threads->running, __ATOMIC_RELAXED) > 0) {
+    if (sigtimedwait(&sigs, NULL, &timeout) > 0) {
+      for (i = 0; i < n; i++) {
+        if (write(threads->drain_fds[i][1], "", 1) != 1) {
+          fprintf(stderr, "worker thread[%u]: drain failed: %s\n", i, strerror(errno));
+        }
+      }
+    }
   }
-  if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not read certificate file %S", mrb_str_new_cstr(mrb, cert_file));
+  for (i = 0; i < n; i++) {
+    pthread_join(tids[i], NULL);
   }
-  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, npn_advertise_cb, (void *)npn_proto);
-#if MRB_HTTP2_USE_ALPN
-  SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_cb, (void *)alpn_proto);
-#endif
-  TRACER;
-  return ssl_ctx;
 }
 
-static void init_app_context(app_context *actx, SSL_CTX *ssl_ctx, struct event_base *evbase)
+static void reload_worker(int flags)
 {
-  memset(actx, 0, sizeof(app_context));
-  actx->ssl_ctx = ssl_ctx;
-  actx->evbase = evbase;
+  prepare_reload = 1;
 }
 
-static void set_run_user(mrb_state *mrb, mrb_http2_config_t *config)
+static void worker_signals(void)
 {
-  uid_t cur_uid = getuid();
+  struct sigaction act;
 
-  if (config->run_user == NULL && cur_uid != 0) {
-    mrb_warn(mrb, "don't set run_user, so run with uid=%S\n", mrb_fixnum_value(cur_uid));
-    return;
-  } else if (config->run_user == NULL && cur_uid == 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
-                                    " Set 'run_user => user_name' instead of root in config");
-  }
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = SIG_DFL;
+  sigaction(SIGTERM, &act, NULL);
 
-  config->run_uid = mrb_http2_get_uid(mrb, config->run_user);
+  // reload is done by the master
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGHUP, &act, NULL);
+  sigaction(SIGUSR2, &act, NULL);
+}
 
-  if (config->run_uid == 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not run with root,"
-                                    " Set 'run_user => user_name' instead of root in config");
-  }
+// "3,4,5" of the first n fds or pids
+static char *join_ids(const int *ids, unsigned int n)
+{
+  char *buf = malloc(n * 12 + 1);
+  char *p = buf;
+  unsigned int i;
 
-  // TODO: add config->run_gid
-  // setgid :run_user for now
-  if (setgid(config->run_uid)) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set gid: %S", mrb_fixnum_value(config->run_uid));
+  *p = '\0';
+  for (i = 0; i < n; i++) {
+    p += sprintf(p, i == 0 ? "%d" : ",%d", ids[i]);
   }
+  return buf;
+}
 
-  if (setuid(config->run_uid)) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not set user: %S"
-                                     " If running server with specific user, "
-                                     "run server with root at first",
-               mrb_str_new_cstr(mrb, config->run_user));
-  }
+// workers run by the master are the first worker_num slots. a retired slot
+// is reused after its draining worker exits, so that gauges of the slot are
+// not reset under it
+static unsigned int worker_num = 0;
+static int retired[MRB_HTTP2_WORKER_MAX];
+static volatile sig_atomic_t autoscale_tick = 0;
+
+static void autoscale_alarm(int sig)
+{
+  autoscale_tick = 1;
 }
 
-static void mrb_start_listen(struct event_base *evbase, mrb_http2_config_t *config, app_context *app_ctx)
+// SIGALRM interrupts wait() of the master every interval
+static void autoscale_start(void)
 {
-  int rv;
-  struct addrinfo hints;
-  struct addrinfo *res, *rp;
-  mrb_state *mrb = app_ctx->server->mrb;
+  struct sigaction act;
+  struct itimerval itv;
 
-  TRACER;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-#ifdef AI_ADDRCONFIG
-  hints.ai_flags |= AI_ADDRCONFIG;
-#endif
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = autoscale_alarm;
+  sigaction(SIGALRM, &act, NULL);
 
-  rv = getaddrinfo(config->server_host, config->service, &hints, &res);
-  if (rv != 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "getaddrinfo failed");
-  }
-  TRACER;
-  for (rp = res; rp; rp = rp->ai_next) {
-    struct evconnlistener *listener;
-    if (config->worker > 0) {
-      evutil_socket_t fd;
-      int on = 1;
-      fd = socket(rp->ai_family, SOCK_STREAM, IPPROTO_TCP);
-      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
-      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
-#if defined(__linux__) && defined(SO_REUSEPORT)
-      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
-#endif
-      evutil_make_socket_nonblocking(fd);
+  itv.it_interval.tv_sec = MRB_HTTP2_AUTOSCALE_INTERVAL;
+  itv.it_interval.tv_usec = 0;
+  itv.it_value = itv.it_interval;
+  setitimer(ITIMER_REAL, &itv, NULL);
+}
 
-      if (bind(fd, (struct sockaddr *)rp->ai_addr, rp->ai_addrlen) < 0) {
-        mrb_raise(mrb, E_RUNTIME_ERROR, "Could not bind, "
-                                        "don't support SO_REUSEPORT? So, can't use worker mode");
-      }
-      listener =
-          evconnlistener_new(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, fd);
-    } else {
-      listener = evconnlistener_new_bind(evbase, mrb_http2_acceptcb, app_ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
-                                         -1, rp->ai_addr, rp->ai_addrlen);
+static void autoscale_stop(void)
+{
+  struct itimerval itv;
+
+  memset(&itv, 0, sizeof(struct itimerval));
+  setitimer(ITIMER_REAL, &itv, NULL);
+}
+
+static void close_worker_listeners(unsigned int i)
+{
+  unsigned int j;
+
+  for (j = 0; j < listen_fdslen; j++) {
+    if (listen_fds[i][j] != -1) {
+      evutil_closesocket(listen_fds[i][j]);
+      listen_fds[i][j] = -1;
     }
+  }
+}
 
-    if (listener) {
-      freeaddrinfo(res);
-      set_run_user(mrb, config);
-      return;
+// a forked worker keeps the listeners of its slot only. sockets of other
+// slots left open would stay in their reuseport group after those workers
+// are retired, and connections hashed to them would never be accepted
+static void worker_keep_listeners(unsigned int i)
+{
+  unsigned int k;
+
+  for (k = 0; k < MRB_HTTP2_WORKER_MAX; k++) {
+    if (k != i) {
+      close_worker_listeners(k);
     }
   }
-  mrb_raise(mrb, E_RUNTIME_ERROR, "Could not start listener");
+  worker_listen_fds = listen_fds[i];
 }
 
-static void mrb_http2_worker_run(mrb_state *mrb, mrb_value self, mrb_http2_server_t *server, mrb_http2_request_rec *r,
-                                 app_context *app_ctx)
+// fork or retire a worker when the load stays out of the band for a few
+// checks. returns the slot of the new worker in the child, -1 otherwise
+static int autoscale_workers(mrb_http2_config_t *config, mrb_http2_scoreboard *scoreboard)
 {
+  static unsigned int up_ticks = 0, down_ticks = 0;
+  uint64_t target = config->worker_scale_streams > 0 ? config->worker_scale_streams : MRB_HTTP2_AUTOSCALE_STREAMS;
+  uint64_t streams = 0, lag = 0;
+  unsigned int i, j;
+
+  // draining workers are not counted
+  for (i = 0; i < worker_num; i++) {
+    streams += MRB_HTTP2_WORKER_GET(&scoreboard->slots[i], active_stream);
+    if (MRB_HTTP2_WORKER_GET(&scoreboard->slots[i], loop_lag) > lag) {
+      lag = MRB_HTTP2_WORKER_GET(&scoreboard->slots[i], loop_lag);
+    }
+  }
+  if (streams > target * worker_num || lag > MRB_HTTP2_AUTOSCALE_LAG) {
+    up_ticks++;
+    down_ticks = 0;
+  } else if (worker_num > config->worker_min && streams * 2 < target * (worker_num - 1) &&
+             lag < MRB_HTTP2_AUTOSCALE_LAG / 4) {
+    down_ticks++;
+    up_ticks = 0;
+  } else {
+    up_ticks = down_ticks = 0;
+  }
 
-  SSL_CTX *ssl_ctx = NULL;
-  struct event_base *evbase;
+  if (up_ticks >= MRB_HTTP2_AUTOSCALE_UP_TICKS && worker_num < config->worker_max && retired[worker_num] == 0) {
+    up_ticks = 0;
+    i = worker_num;
+    for (j = 0; j < listen_fdslen; j++) {
+      listen_fds[i][j] = -1;
+    }
+    if (bind_worker_listeners(config, listen_fds, i) != 0) {
+      fprintf(stderr, "autoscale: could not bind listeners of worker[%u]: %s\n", i, strerror(errno));
+      close_worker_listeners(i);
+      return -1;
+    }
+    pid[i] = fork();
+    if (pid[i] == 0) {
+      return i;
+    }
+    if (pid[i] == -1) {
+      fprintf(stderr, "autoscale: fork failed: %s\n", strerror(errno));
+      close_worker_listeners(i);
+      return -1;
+    }
+    pid[++worker_num] = -1;
+    if (config->debug) {
+      fprintf(stderr, "autoscale: worker[%u](%d) start, %u workers\n", i, pid[i], worker_num);
+    }
+  } else if (down_ticks >= MRB_HTTP2_AUTOSCALE_DOWN_TICKS) {
+    down_ticks = 0;
+    i = --worker_num;
+    // the sockets of the slot leave the reuseport group once the worker
+    // closes its copies as well
+    kill(pid[i], SIGQUIT);
+    retired[i] = pid[i];
+    pid[i] = -1;
+    close_worker_listeners(i);
+    if (config->debug) {
+      fprintf(stderr, "autoscale: worker[%u](%d) retire, %u workers\n", i, retired[i], worker_num);
+    }
+  }
+  return -1;
+}
 
-  if (server->config->tls) {
-    ssl_ctx = mrb_http2_create_ssl_ctx(mrb, server->config, server->config->key, server->config->cert);
+// re-execute the master with the same command line to load the new config
+// and ruby code. the listeners stay open across exec, and the new master
+// drains the current workers once its own workers are up. returns only on
+// failure, and the current workers keep serving then
+static void reload_master(mrb_http2_config_t *config)
+{
+  char *cmdline, *fds, *pids;
+  char **argv;
+  size_t len = 0, cap = 4096, off;
+  ssize_t n;
+  unsigned int i, j, k;
+  int fd, argc, *ids;
+
+  fd = open("/proc/self/cmdline", O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "reload failed: open /proc/self/cmdline: %s\n", strerror(errno));
+    return;
+  }
+  cmdline = malloc(cap);
+  while ((n = read(fd, cmdline + len, cap - len - 1)) > 0) {
+    len += n;
+    if (len == cap - 1) {
+      cap *= 2;
+      cmdline = realloc(cmdline, cap);
+    }
   }
+  close(fd);
+  cmdline[len] = '\0';
 
-  server->worker = mrb_http2_worker_init(mrb);
+  argv = malloc(sizeof(char *) * (len + 1));
+  for (argc = 0, off = 0; off < len; off += strlen(cmdline + off) + 1) {
+    argv[argc++] = cmdline + off;
+  }
+  argv[argc] = NULL;
 
-  evbase = event_base_new();
+  ids = malloc(sizeof(int) * (worker_num * listen_fdslen + 1));
+  for (i = 0, k = 0; i < worker_num; i++) {
+    for (j = 0; j < listen_fdslen; j++) {
+      ids[k++] = listen_fds[i][j];
+    }
+  }
+  fds = join_ids(ids, k);
+  free(ids);
+  pids = join_ids(pid, worker_num);
+  setenv(MRB_HTTP2_LISTEN_FDS_ENV, fds, 1);
+  setenv(MRB_HTTP2_DRAIN_PIDS_ENV, pids, 1);
+  if (config->debug) {
+    fprintf(stderr, "reload master(%d): listeners %s, drain workers %s\n", getpid(), fds, pids);
+  }
 
-  init_app_context(app_ctx, ssl_ctx, evbase);
-  app_ctx->server = server;
-  app_ctx->r = r;
-  app_ctx->self = self;
+  // the timer survives exec and SIGALRM would kill the new master
+  autoscale_stop();
+  execv("/proc/self/exe", argv);
 
-  TRACER;
-  mrb_start_listen(evbase, server->config, app_ctx);
-  event_base_loop(app_ctx->evbase, 0);
-  event_base_free(app_ctx->evbase);
-  if (server->config->tls) {
-    SSL_CTX_free(app_ctx->ssl_ctx);
+  fprintf(stderr, "reload failed: exec: %s\n", strerror(errno));
+  if (config->worker_max > 0) {
+    autoscale_start();
   }
-  TRACER;
+  unsetenv(MRB_HTTP2_LISTEN_FDS_ENV);
+  unsetenv(MRB_HTTP2_DRAIN_PIDS_ENV);
+  free(fds);
+  free(pids);
+  free(argv);
+  free(cmdline);
 }
 
-static int pid[MRB_HTTP2_WORKER_MAX];
-static int prepare_kill = 0;
-
-static void killall_worker(int flags)
+// workers of the master before reload finish their streams and exit
+static void drain_old_workers(mrb_http2_config_t *config)
 {
-  int i;
-  prepare_kill = 1;
-  for (i = 0; pid[i] != -1; i++) {
-    kill(pid[i], SIGTERM);
+  const char *env = getenv(MRB_HTTP2_DRAIN_PIDS_ENV);
+  char *end;
+  long wpid;
+
+  if (env == NULL) {
+    return;
+  }
+  while (*env != '\0') {
+    wpid = strtol(env, &end, 10);
+    if (end == env) {
+      break;
+    }
+    if (wpid > 0) {
+      if (config->debug) {
+        fprintf(stderr, "drain worker(%ld)\n", wpid);
+      }
+      kill(wpid, SIGQUIT);
+    }
+    env = *end == ',' ? end + 1 : end;
   }
+  unsetenv(MRB_HTTP2_DRAIN_PIDS_ENV);
 }
 
 static mrb_value mrb_http2_server_run(mrb_state *mrb, mrb_value self)
@@ -2297,49 +5108,114 @@ static mrb_value mrb_http2_server_run(mrb_state *mrb, mrb_value self)
   mrb_http2_config_t *config = data->s->config;
   memset(&act, 0, sizeof(struct sigaction));
 
-  if (config->worker > 0) {
+  if (thread_listen_fds != NULL) {
+    data->s->scoreboard = threads->scoreboard;
+    preload(mrb, self, data->s, data->r);
+    mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx, thread_worker_id);
+    return self;
+  }
+
+  // counters of every worker are visible from any of them
+  data->s->scoreboard = mrb_http2_scoreboard_new(
+      mrb, config->worker_threads > 0 ? config->worker_threads
+                                      : (config->worker_max > 0 ? config->worker_max : config->worker));
+
+  if (config->worker_threads > 0) {
+    mrb_http2_threads_run(mrb, self, data->s);
+  } else if (config->worker > 0) {
     int i, status;
-    for (i = 0; i < config->worker && (pid[i] = fork()) > 0; i++)
+
+    // certificates are parsed once for all workers, respawned ones too
+    preload(mrb, self, data->s, data->r);
+    if (config->tls) {
+      data->s->ssl_ctx = mrb_http2_create_ssl_ctx(mrb, config, config->key, config->cert);
+    }
+    // slots of workers not forked yet are never taken for sockets
+    memset(listen_fds, -1, sizeof(listen_fds));
+    bind_listeners(mrb, config, listen_fds, config->worker);
+    worker_num = config->worker;
+    for (i = 0; i < (int)worker_num && (pid[i] = fork()) > 0; i++)
       ;
 
-    if (i == config->worker) {
+    if (i == (int)worker_num) {
       pid[i] = -1;
+      drain_old_workers(config);
+      if (config->worker_max > 0) {
+        autoscale_start();
+      }
+      act.sa_handler = killall_worker;
+      sigaction(SIGTERM, &act, NULL);
+      // SIGHUP and SIGUSR2 reload config, ruby code and the binary
+      act.sa_handler = reload_worker;
+      sigaction(SIGHUP, &act, NULL);
+      sigaction(SIGUSR2, &act, NULL);
       while (1) {
         int wpid;
-        act.sa_handler = killall_worker;
-        sigaction(SIGTERM, &act, NULL);
         wpid = wait(&status);
         // monitoring workers
         if (prepare_kill) {
-          // send term signal to master process
-          // preparing killall worker
+          // workers drain on SIGTERM, wait for them and the ones of the
+          // master before reload
+          while (wait(&status) > 0 || errno == EINTR)
+            ;
           return self;
-        } else {
-          if (config->debug) {
-            fprintf(stderr, "worker(%d) is down\n", wpid);
+        }
+        if (prepare_reload) {
+          prepare_reload = 0;
+          reload_master(config);
+          continue;
+        }
+        if (autoscale_tick) {
+          autoscale_tick = 0;
+          if ((i = autoscale_workers(config, data->s->scoreboard)) >= 0) {
+            worker_signals();
+            worker_keep_listeners(i);
+            mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx, i);
+            return self;
+          }
+        }
+        if (wpid == -1) {
+          continue;
+        }
+        for (i = 0; i < (int)worker_num; i++) {
+          if (wpid == pid[i]) {
+            break;
           }
-          for (i = 0; i < config->worker; i++) {
-            if (wpid == pid[i]) {
-              pid[i] = fork();
-              break;
-            }
+        }
+        if (i == (int)worker_num) {
+          // drained worker of the master before reload, or retired one
+          for (i = 0; i < MRB_HTTP2_WORKER_MAX && retired[i] != wpid; i++)
+            ;
+          if (i < MRB_HTTP2_WORKER_MAX) {
+            retired[i] = 0;
+            data->s->scoreboard->slots[i].pid = 0;
           }
-          if (pid[i] == 0) {
-            act.sa_handler = SIG_DFL;
-            sigaction(SIGTERM, &act, NULL);
-            mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
-          } else {
-            if (config->debug) {
-              fprintf(stderr, "worker[%d](%d) restart\n", i, pid[i]);
-            }
+          continue;
+        }
+        if (config->debug) {
+          fprintf(stderr, "worker(%d) is down\n", wpid);
+        }
+        data->s->scoreboard->slots[i].pid = 0;
+        pid[i] = fork();
+        if (pid[i] == 0) {
+          worker_signals();
+          worker_keep_listeners(i);
+          mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx, i);
+          return self;
+        } else {
+          if (config->debug) {
+            fprintf(stderr, "worker[%d](%d) restart\n", i, pid[i]);
           }
         }
       }
     } else if (pid[i] == 0) {
-      mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+      worker_signals();
+      worker_keep_listeners(i);
+      mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx, i);
     }
   } else {
-    mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx);
+    preload(mrb, self, data->s, data->r);
+    mrb_http2_worker_run(mrb, self, data->s, data->r, &app_ctx, 0);
   }
 
   return self;
@@ -2476,13 +5352,19 @@ static mrb_value mrb_http2_server_init(mrb_state *mrb, mrb_value self)
   data->s = server;
   data->r = mrb_http2_request_rec_init(mrb);
 
-  tune_rlimit(mrb, server->config);
-
   DATA_TYPE(self) = &mrb_http2_server_type;
   DATA_PTR(self) = data;
   TRACER;
 
-  if (server->config->daemon) {
+  // the process was set up by the main thread in threaded worker mode
+  if (thread_listen_fds != NULL) {
+    return self;
+  }
+
+  tune_rlimit(mrb, server->config);
+
+  // a master re-executed on reload is already detached
+  if (server->config->daemon && getenv(MRB_HTTP2_LISTEN_FDS_ENV) == NULL) {
     if (daemon(0, 0) == -1) {
       mrb_raise(mrb, E_RUNTIME_ERROR, "daemonize failed");
     }
@@ -2586,11 +5468,71 @@ static mrb_value mrb_http2_server_body(mrb_state *mrb, mrb_value self)
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_request_rec *r = data->r;
 
+  mrb_value str;
+  ssize_t n;
+
   if (r->request_body == NULL) {
     return mrb_nil_value();
-  } else {
-    return mrb_str_new_cstr(mrb, r->request_body);
   }
+  str = mrb_str_new(mrb, NULL, mrb_http2_body_length(r->request_body));
+  n = mrb_http2_body_read(r->request_body, 0, (uint8_t *)RSTRING_PTR(str), RSTRING_LEN(str));
+  if (n != RSTRING_LEN(str)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "request body read failed");
+  }
+  return str;
+}
+
+static mrb_value mrb_http2_server_body_length(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  if (r->request_body == NULL) {
+    return mrb_fixnum_value(0);
+  }
+  return mrb_fixnum_value(mrb_http2_body_length(r->request_body));
+}
+
+// read the body sequentially without holding all of it in a string, nil at
+// the end
+static mrb_value mrb_http2_server_read_body(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_int len = MRB_HTTP2_BODY_CHUNK_MIN * 4;
+  mrb_value str;
+  size_t pos;
+  ssize_t n;
+
+  mrb_get_args(mrb, "|i", &len);
+  if (r->request_body == NULL || len <= 0) {
+    return mrb_nil_value();
+  }
+  pos = mrb_http2_body_pos(r->request_body);
+  if (pos >= mrb_http2_body_length(r->request_body)) {
+    return mrb_nil_value();
+  }
+  if ((size_t)len > mrb_http2_body_length(r->request_body) - pos) {
+    len = mrb_http2_body_length(r->request_body) - pos;
+  }
+  str = mrb_str_new(mrb, NULL, len);
+  n = mrb_http2_body_read(r->request_body, pos, (uint8_t *)RSTRING_PTR(str), len);
+  if (n != len) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "request body read failed");
+  }
+  mrb_http2_body_seek(r->request_body, pos + n);
+  return str;
+}
+
+static mrb_value mrb_http2_server_rewind_body(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+
+  if (r->request_body != NULL) {
+    mrb_http2_body_seek(r->request_body, 0);
+  }
+  return self;
 }
 
 static mrb_value mrb_http2_server_document_root(mrb_state *mrb, mrb_value self)
@@ -2666,6 +5608,66 @@ static void mrb_http2_upstream_init(mrb_state *mrb, mrb_value self)
   r->upstream->proto_major = 1;
   r->upstream->proto_minor = 1;
   r->upstream->keepalive = 1;
+  r->upstream->mirror_ratio = 1.0;
+}
+
+static mrb_value mrb_http2_server_set_upstream_group(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_http2_balancer_group *group;
+  char *name;
+
+  mrb_get_args(mrb, "z", &name);
+  group = mrb_http2_balancer_find(data->s->config->upstreams, name);
+  if (group == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream group not found: %S", mrb_str_new_cstr(mrb, name));
+  }
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  r->upstream->group = group;
+
+  return mrb_str_new_cstr(mrb, group->name);
+}
+
+static mrb_value mrb_http2_server_set_upstream_mirror(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_http2_balancer_group *group;
+  char *name;
+
+  mrb_get_args(mrb, "z", &name);
+  group = mrb_http2_balancer_find(data->s->config->upstreams, name);
+  if (group == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream group not found: %S", mrb_str_new_cstr(mrb, name));
+  }
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  r->upstream->mirror = group;
+
+  return mrb_str_new_cstr(mrb, group->name);
+}
+
+// fraction of requests mirrored, 0.0 to 1.0
+static mrb_value mrb_http2_server_set_upstream_mirror_ratio(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_request_rec *r = data->r;
+  mrb_float ratio;
+
+  mrb_get_args(mrb, "f", &ratio);
+  if (ratio < 0 || ratio > 1) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream_mirror_ratio must be 0.0 to 1.0: %S", mrb_float_value(mrb, ratio));
+  }
+  if (!r->upstream) {
+    mrb_http2_upstream_init(mrb, self);
+  }
+  r->upstream->mirror_ratio = ratio;
+
+  return mrb_float_value(mrb, ratio);
 }
 
 static mrb_value mrb_http2_server_set_upstream_proto_major(mrb_state *mrb, mrb_value self)
@@ -2678,10 +5680,12 @@ static mrb_value mrb_http2_server_set_upstream_proto_major(mrb_state *mrb, mrb_v
   if (!r->upstream) {
     mrb_http2_upstream_init(mrb, self);
   }
-  // Now support HTTP/1.x only
-  // TODO: support HTTP/2
-  // r->upstream->proto_major = (int)major;
-  r->upstream->proto_major = 1;
+  // HTTP/1.x or HTTP/2 over cleartext (h2c) with prior knowledge
+  if (major != 1 && major != 2) {
+    // defulat HTTP/1.x
+    major = 1;
+  }
+  r->upstream->proto_major = (int)major;
 
   return mrb_fixnum_value(r->upstream->proto_major);
 }
@@ -2696,8 +5700,7 @@ static mrb_value mrb_http2_server_set_upstream_proto_minor(mrb_state *mrb, mrb_v
   if (!r->upstream) {
     mrb_http2_upstream_init(mrb, self);
   }
-  // Now support HTTP/1.0 or HTTP/1.1
-  // TODO: support HTTP/2
+  // HTTP/1.0 or HTTP/1.1, ignored on HTTP/2
   if (minor != 0 && minor != 1) {
     // defulat HTTP/1.1
     minor = 1;
@@ -2786,6 +5789,7 @@ static mrb_value mrb_http2_server_set_upstream_host(mrb_state *mrb, mrb_value se
 
   mrb_get_args(mrb, "z", &host);
   // r->upstream->host = mrb_http2_strcopy(mrb, host, len);
+  free(r->upstream->host);
   r->upstream->host = strdup(host);
 
   return self;
@@ -2812,17 +5816,35 @@ static mrb_value mrb_http2_server_set_upstream_uri(mrb_state *mrb, mrb_value sel
   if (!r->upstream) {
     mrb_http2_upstream_init(mrb, self);
   }
-  r->upstream->uri = uri;
+  free(r->upstream->uri);
+  r->upstream->uri = strdup(uri);
 
   return self;
 }
 
+// run upstream requests concurrently from a ruby block and wait for all of
+// them, see mrb_http2_subrequest.h for the arguments and results. waiting on
+// the event loop thread would stall every stream of the worker, so only
+// handlers of blocking_locations may call it
+static mrb_value mrb_http2_server_subrequests(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_value reqs;
+
+  mrb_get_args(mrb, "A", &reqs);
+  if (DATA_TYPE(self) != &mrb_http2_blocking_server_type) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "subrequests can be called only from handlers of blocking_locations");
+  }
+
+  return mrb_http2_subrequests(mrb, data->s->config->upstreams, data->s->config->upstream_buffer_size, reqs);
+}
+
 static mrb_value mrb_http2_server_total_stream_requests(mrb_state *mrb, mrb_value self)
 {
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->stream_requests_per_worker);
+  return mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, stream_requests_per_worker));
 }
 
 static mrb_value mrb_http2_server_total_session_requests(mrb_state *mrb, mrb_value self)
@@ -2830,7 +5852,7 @@ static mrb_value mrb_http2_server_total_session_requests(mrb_state *mrb, mrb_val
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->session_requests_per_worker);
+  return mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, session_requests_per_worker));
 }
 
 static mrb_value mrb_http2_server_connected_sessions(mrb_state *mrb, mrb_value self)
@@ -2838,7 +5860,7 @@ static mrb_value mrb_http2_server_connected_sessions(mrb_state *mrb, mrb_value s
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->connected_sessions);
+  return mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, connected_sessions));
 }
 
 static mrb_value mrb_http2_server_active_stream(mrb_state *mrb, mrb_value self)
@@ -2846,7 +5868,51 @@ static mrb_value mrb_http2_server_active_stream(mrb_state *mrb, mrb_value self)
   mrb_http2_data_t *data = DATA_PTR(self);
   mrb_http2_worker_t *worker = data->s->worker;
 
-  return mrb_fixnum_value(worker->active_stream);
+  return mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, active_stream));
+}
+
+static void scoreboard_set(mrb_state *mrb, mrb_value hash, mrb_http2_worker_t *worker)
+{
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "total_stream_requests")),
+               mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, stream_requests_per_worker)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "total_session_requests")),
+               mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, session_requests_per_worker)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "connected_sessions")),
+               mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, connected_sessions)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "active_stream")),
+               mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, active_stream)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "loop_lag")),
+               mrb_fixnum_value(MRB_HTTP2_WORKER_GET(worker, loop_lag)));
+}
+
+// counters of all workers and their sum, for a status endpoint
+static mrb_value mrb_http2_server_scoreboard(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_data_t *data = DATA_PTR(self);
+  mrb_http2_scoreboard *scoreboard = data->s->scoreboard;
+  mrb_http2_worker_t total;
+  mrb_value hash, workers, worker;
+  unsigned int i;
+
+  if (scoreboard == NULL) {
+    return mrb_nil_value();
+  }
+  mrb_http2_scoreboard_total(scoreboard, &total);
+  hash = mrb_hash_new(mrb);
+  scoreboard_set(mrb, hash, &total);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "running_workers")), mrb_fixnum_value(total.pid));
+
+  workers = mrb_ary_new_capa(mrb, scoreboard->slotslen);
+  for (i = 0; i < scoreboard->slotslen; i++) {
+    worker = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, worker, mrb_symbol_value(mrb_intern_lit(mrb, "pid")),
+                 mrb_fixnum_value(MRB_HTTP2_WORKER_GET(&scoreboard->slots[i], pid)));
+    scoreboard_set(mrb, worker, &scoreboard->slots[i]);
+    mrb_ary_push(mrb, workers, worker);
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "workers")), workers);
+
+  return hash;
 }
 
 static mrb_value mrb_http2_server_enable_mruby(mrb_state *mrb, mrb_value self)
@@ -3086,6 +6152,9 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
   mrb_define_method(mrb, server, "host", mrb_http2_server_authority, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "hostname", mrb_http2_server_authority, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "body", mrb_http2_server_body, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "body_length", mrb_http2_server_body_length, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "read_body", mrb_http2_server_read_body, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, server, "rewind_body", mrb_http2_server_rewind_body, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "document_root", mrb_http2_server_document_root, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "client_ip", mrb_http2_server_client_ip, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "user_agent", mrb_http2_server_user_agent, MRB_ARGS_NONE());
@@ -3102,6 +6171,10 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
 
   // upstream methods
   mrb_define_method(mrb, server, "upstream_keepalive=", mrb_http2_server_set_upstream_keepalive, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_group=", mrb_http2_server_set_upstream_group, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_mirror=", mrb_http2_server_set_upstream_mirror, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "upstream_mirror_ratio=", mrb_http2_server_set_upstream_mirror_ratio,
+                    MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_proto_major=", mrb_http2_server_set_upstream_proto_major, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_proto_minor=", mrb_http2_server_set_upstream_proto_minor, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_timeout=", mrb_http2_server_set_upstream_timeout, MRB_ARGS_REQ(1));
@@ -3111,11 +6184,13 @@ void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2)
   mrb_define_method(mrb, server, "upstream_port=", mrb_http2_server_set_upstream_port, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, server, "upstream_uri", mrb_http2_server_upstream_uri, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "upstream_uri=", mrb_http2_server_set_upstream_uri, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, server, "subrequests", mrb_http2_server_subrequests, MRB_ARGS_REQ(1));
 
   // worke status method
   mrb_define_method(mrb, server, "total_stream_requests", mrb_http2_server_total_stream_requests, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "total_session_requests", mrb_http2_server_total_session_requests, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "connected_sessions", mrb_http2_server_connected_sessions, MRB_ARGS_NONE());
+  mrb_define_method(mrb, server, "scoreboard", mrb_http2_server_scoreboard, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "active_session", mrb_http2_server_connected_sessions, MRB_ARGS_NONE());
   mrb_define_method(mrb, server, "active_stream", mrb_http2_server_active_stream, MRB_ARGS_NONE());
 
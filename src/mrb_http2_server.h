@@ -13,6 +13,43 @@
 
 #define MRB_HTTP2_READ_LENGTH_MAX ((1 << 16) - 1)
 
+// default flow-control windows for request bodies, a stream and all streams
+// of a connection can have this many bytes unconsumed
+#define MRB_HTTP2_INITIAL_WINDOW_SIZE ((1 << 18) - 1)
+#define MRB_HTTP2_CONNECTION_WINDOW_SIZE (1 << 20)
+
+// seconds a draining worker waits for streams in flight before exiting
+#define MRB_HTTP2_GRACEFUL_TIMEOUT 30
+
+// seconds from the shutdown notice to the final GOAWAY, streams the client
+// opened meanwhile are still served
+#define MRB_HTTP2_SHUTDOWN_NOTICE_DELAY 1
+
+// worker autoscaling. the master checks the scoreboard every interval
+// seconds, and adds a worker when the active streams per worker exceed the
+// target or event loops lag by more than the usec for UP_TICKS checks in a
+// row. a worker is retired after DOWN_TICKS quiet checks, when the rest of
+// them would be at half the target
+#define MRB_HTTP2_AUTOSCALE_INTERVAL 1
+#define MRB_HTTP2_AUTOSCALE_STREAMS 64
+#define MRB_HTTP2_AUTOSCALE_LAG 50000
+#define MRB_HTTP2_AUTOSCALE_UP_TICKS 3
+#define MRB_HTTP2_AUTOSCALE_DOWN_TICKS 30
+
+// seconds between checks of connection_max_age and connection_rebalance.
+// a worker over the average by the ratio sends GOAWAY to its busiest
+// connection at each check
+#define MRB_HTTP2_REBALANCE_INTERVAL 1
+#define MRB_HTTP2_REBALANCE_RATIO 1.5
+
+// msec between event loop lag samples of a worker
+#define MRB_HTTP2_LOOP_LAG_INTERVAL 100
+
+// passed to the master re-executed on reload, listeners to keep and old
+// workers to drain
+#define MRB_HTTP2_LISTEN_FDS_ENV "MRB_HTTP2_LISTEN_FDS"
+#define MRB_HTTP2_DRAIN_PIDS_ENV "MRB_HTTP2_DRAIN_PIDS"
+
 typedef struct {
   const char *service;
   mrb_value args;
@@ -22,7 +59,15 @@ typedef struct {
   // callback Ruby block hash table
   mrb_value cb_hash;
 
+  // slot of this worker in the scoreboard shared by all workers
+  mrb_http2_scoreboard *scoreboard;
   mrb_http2_worker_t *worker;
+
+  // built by the master before forking, workers share it copy-on-write
+  SSL_CTX *ssl_ctx;
+
+  // compiled handler scripts of the shared mrb_state
+  struct mrb_http2_handler *handlers;
 } mrb_http2_server_t;
 
 void mrb_http2_server_class_init(mrb_state *mrb, struct RClass *http2);
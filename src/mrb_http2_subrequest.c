@@ -0,0 +1,330 @@
+/*
+// mrb_http2_subrequest.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_subrequest.h"
+#include "mrb_http2_upstream.h"
+#include "mrb_http2_resolver.h"
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#define mrb_http2_subrequest_get_obj(mrb, hash, lit) mrb_hash_get(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, lit)))
+
+typedef struct mrb_http2_subrequest_ctx mrb_http2_subrequest_ctx;
+
+typedef struct {
+  mrb_http2_subrequest_ctx *ctx;
+
+  // arguments, strings are owned by the ruby request
+  mrb_http2_upstream upstream;
+  const char *method;
+  mrb_value headers;
+  mrb_value body;
+  double timeout;
+
+  mrb_http2_balancer_backend *backend;
+  double start;
+
+  mrb_http2_upstream_req *req;
+  struct event *timer;
+  struct evbuffer *resbody;
+  const char *error;
+  unsigned int done : 1;
+} mrb_http2_subrequest;
+
+struct mrb_http2_subrequest_ctx {
+  struct event_base *evbase;
+  mrb_http2_balancer_group *group;
+  unsigned int pending;
+};
+
+static const char *subrequest_get_cstr(mrb_state *mrb, mrb_value req, mrb_value val, const char *def)
+{
+  if (mrb_nil_p(val)) {
+    return def;
+  }
+  if (!mrb_string_p(val)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid subrequest: %S", req);
+  }
+  return mrb_str_to_cstr(mrb, val);
+}
+
+// raises before anything is allocated
+static void subrequest_parse(mrb_state *mrb, mrb_http2_balancer *balancer, mrb_value req,
+                             mrb_http2_subrequest *sub)
+{
+  mrb_value val;
+
+  if (!mrb_hash_p(req)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "subrequest must be Hash: %S", req);
+  }
+  memset(sub, 0, sizeof(mrb_http2_subrequest));
+  sub->upstream.port = 80;
+  sub->upstream.proto_major = 1;
+  sub->upstream.proto_minor = 1;
+
+  val = mrb_http2_subrequest_get_obj(mrb, req, "group");
+  if (!mrb_nil_p(val)) {
+    sub->upstream.group = mrb_http2_balancer_find(balancer, subrequest_get_cstr(mrb, req, val, NULL));
+    if (sub->upstream.group == NULL) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "upstream group not found: %S", val);
+    }
+  } else {
+    sub->upstream.host = (char *)subrequest_get_cstr(mrb, req, mrb_http2_subrequest_get_obj(mrb, req, "host"), NULL);
+    if (sub->upstream.host == NULL) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "subrequest needs :host or :group: %S", req);
+    }
+    val = mrb_http2_subrequest_get_obj(mrb, req, "port");
+    if (!mrb_nil_p(val)) {
+      if (!mrb_fixnum_p(val) || mrb_fixnum(val) < 0 || mrb_fixnum(val) > 65535) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid subrequest port: %S", val);
+      }
+      sub->upstream.port = mrb_fixnum(val);
+    }
+  }
+
+  sub->upstream.uri = (char *)subrequest_get_cstr(mrb, req, mrb_http2_subrequest_get_obj(mrb, req, "path"), "/");
+  sub->method = subrequest_get_cstr(mrb, req, mrb_http2_subrequest_get_obj(mrb, req, "method"), "GET");
+
+  val = mrb_http2_subrequest_get_obj(mrb, req, "proto_major");
+  if (mrb_fixnum_p(val) && mrb_fixnum(val) == 2) {
+    sub->upstream.proto_major = 2;
+    sub->upstream.proto_minor = 0;
+  }
+
+  sub->headers = mrb_http2_subrequest_get_obj(mrb, req, "headers");
+  if (!mrb_nil_p(sub->headers) && !mrb_hash_p(sub->headers)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "subrequest headers must be Hash: %S", sub->headers);
+  }
+  sub->body = mrb_http2_subrequest_get_obj(mrb, req, "body");
+  if (!mrb_nil_p(sub->body) && !mrb_string_p(sub->body)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "subrequest body must be String: %S", sub->body);
+  }
+
+  val = mrb_http2_subrequest_get_obj(mrb, req, "timeout");
+  if (mrb_nil_p(val)) {
+    sub->timeout = MRB_HTTP2_SUBREQUEST_TIMEOUT;
+  } else if (mrb_fixnum_p(val) && mrb_fixnum(val) > 0) {
+    sub->timeout = mrb_fixnum(val);
+  } else if (mrb_float_p(val) && mrb_float(val) > 0) {
+    sub->timeout = mrb_float(val);
+  } else {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "invalid subrequest timeout: %S", val);
+  }
+}
+
+static void subrequest_finish(mrb_http2_subrequest *sub, const char *error)
+{
+  if (sub->done) {
+    return;
+  }
+  sub->done = 1;
+  sub->error = error;
+  if (sub->backend != NULL) {
+    mrb_http2_balancer_release(sub->upstream.group, sub->backend,
+                               error != NULL ? MRB_HTTP2_BALANCER_FAILED : MRB_HTTP2_BALANCER_OK,
+                               mrb_http2_balancer_now() - sub->start);
+    sub->backend = NULL;
+  }
+  if (sub->timer != NULL) {
+    event_del(sub->timer);
+  }
+  if (--sub->ctx->pending == 0) {
+    event_base_loopbreak(sub->ctx->evbase);
+  }
+}
+
+static void subrequest_drain(mrb_http2_subrequest *sub, mrb_http2_upstream_req *req)
+{
+  evbuffer_add_buffer(sub->resbody, req->body);
+  mrb_http2_upstream_request_consumed(req);
+}
+
+static void subrequest_on_header(mrb_http2_upstream_req *req, void *ud)
+{
+  TRACER;
+}
+
+static void subrequest_on_body(mrb_http2_upstream_req *req, void *ud)
+{
+  subrequest_drain((mrb_http2_subrequest *)ud, req);
+}
+
+static void subrequest_on_done(mrb_http2_upstream_req *req, int error, void *ud)
+{
+  mrb_http2_subrequest *sub = (mrb_http2_subrequest *)ud;
+
+  TRACER;
+  if (error || req->failed) {
+    subrequest_finish(sub, "upstream error");
+    return;
+  }
+  subrequest_drain(sub, req);
+  subrequest_finish(sub, NULL);
+}
+
+static const mrb_http2_upstream_handler subrequest_handler = {
+    subrequest_on_header, subrequest_on_body, subrequest_on_done, NULL,
+};
+
+static void subrequest_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+  mrb_http2_subrequest *sub = (mrb_http2_subrequest *)arg;
+
+  TRACER;
+  mrb_http2_upstream_request_free(sub->req);
+  sub->req = NULL;
+  subrequest_finish(sub, "timeout");
+}
+
+static void subrequest_add_headers(mrb_state *mrb, mrb_http2_subrequest *sub)
+{
+  mrb_value keys, key, val;
+  mrb_int i;
+  char *name;
+  size_t j, namelen;
+  char content_length[32];
+
+  if (mrb_hash_p(sub->headers)) {
+    keys = mrb_hash_keys(mrb, sub->headers);
+    for (i = 0; i < RARRAY_LEN(keys); i++) {
+      key = mrb_obj_as_string(mrb, mrb_ary_ref(mrb, keys, i));
+      val = mrb_obj_as_string(mrb, mrb_hash_get(mrb, sub->headers, mrb_ary_ref(mrb, keys, i)));
+
+      // HTTP/2 upstreams need lower case names
+      namelen = RSTRING_LEN(key);
+      name = alloca(namelen);
+      for (j = 0; j < namelen; j++) {
+        name[j] = tolower((unsigned char)RSTRING_PTR(key)[j]);
+      }
+      mrb_http2_upstream_request_add_header(sub->req, (uint8_t *)name, namelen, (uint8_t *)RSTRING_PTR(val),
+                                            RSTRING_LEN(val));
+    }
+  }
+  if (mrb_string_p(sub->body)) {
+    snprintf(content_length, sizeof(content_length), "%ld", (long)RSTRING_LEN(sub->body));
+    mrb_http2_upstream_request_add_header(sub->req, (uint8_t *)"content-length", sizeof("content-length") - 1,
+                                          (uint8_t *)content_length, strlen(content_length));
+    evbuffer_add(sub->req->reqbody, RSTRING_PTR(sub->body), RSTRING_LEN(sub->body));
+  }
+}
+
+static void subrequest_start(mrb_state *mrb, mrb_http2_upstream_pool *pool, mrb_http2_subrequest *sub)
+{
+  mrb_http2_upstream upstream = sub->upstream;
+  struct timeval tv;
+
+  if (upstream.group != NULL) {
+    sub->backend = mrb_http2_balancer_select(upstream.group, NULL, 0);
+    sub->start = mrb_http2_balancer_now();
+    upstream.host = sub->backend->host;
+    upstream.port = sub->backend->port;
+  }
+  upstream.unparsed_host = mrb_http2_upstream_authority(upstream.host, upstream.port);
+  upstream.timeout = (unsigned int)sub->timeout + 1;
+
+  sub->resbody = evbuffer_new();
+  sub->req = mrb_http2_upstream_request_new(pool, &subrequest_handler, sub);
+  subrequest_add_headers(mrb, sub);
+  sub->ctx->pending++;
+
+  if (mrb_http2_upstream_request_send(sub->req, &upstream, sub->method) != 0) {
+    mrb_http2_upstream_request_free(sub->req);
+    sub->req = NULL;
+    subrequest_finish(sub, "upstream error");
+  } else {
+    tv.tv_sec = (long)sub->timeout;
+    tv.tv_usec = (long)((sub->timeout - tv.tv_sec) * 1000000);
+    sub->timer = evtimer_new(sub->ctx->evbase, subrequest_timeout_cb, sub);
+    evtimer_add(sub->timer, &tv);
+  }
+  free(upstream.unparsed_host);
+}
+
+static mrb_value subrequest_response(mrb_state *mrb, mrb_http2_subrequest *sub)
+{
+  mrb_value res = mrb_hash_new(mrb);
+  mrb_value headers;
+  mrb_value body;
+  size_t i;
+
+  if (sub->error != NULL) {
+    mrb_hash_set(mrb, res, mrb_symbol_value(mrb_intern_lit(mrb, "error")), mrb_str_new_cstr(mrb, sub->error));
+    return res;
+  }
+
+  headers = mrb_hash_new(mrb);
+  for (i = 0; i < sub->req->headerslen; i++) {
+    nghttp2_nv *nv = &sub->req->headers[i];
+    mrb_hash_set(mrb, headers, mrb_str_new(mrb, (char *)nv->name, nv->namelen),
+                 mrb_str_new(mrb, (char *)nv->value, nv->valuelen));
+  }
+  body = mrb_str_new(mrb, NULL, evbuffer_get_length(sub->resbody));
+  evbuffer_remove(sub->resbody, RSTRING_PTR(body), RSTRING_LEN(body));
+
+  mrb_hash_set(mrb, res, mrb_symbol_value(mrb_intern_lit(mrb, "status")), mrb_fixnum_value(sub->req->status));
+  mrb_hash_set(mrb, res, mrb_symbol_value(mrb_intern_lit(mrb, "headers")), headers);
+  mrb_hash_set(mrb, res, mrb_symbol_value(mrb_intern_lit(mrb, "body")), body);
+  return res;
+}
+
+// the requests run on an event base of their own, so the caller waits for
+// them. the worker loop can't be entered from a ruby block, since
+// request_rec is shared by all streams
+mrb_value mrb_http2_subrequests(mrb_state *mrb, mrb_http2_balancer *balancer, size_t buffer_size, mrb_value reqs)
+{
+  mrb_http2_subrequest subs[MRB_HTTP2_SUBREQUEST_MAX];
+  mrb_http2_subrequest_ctx ctx;
+  mrb_http2_upstream_pool *pool;
+  mrb_http2_resolver *resolver;
+  mrb_value results;
+  mrb_int i, len;
+
+  if (!mrb_array_p(reqs)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "subrequests must be Array");
+  }
+  len = RARRAY_LEN(reqs);
+  if (len > MRB_HTTP2_SUBREQUEST_MAX) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "too many subrequests: %S", mrb_fixnum_value(len));
+  }
+  for (i = 0; i < len; i++) {
+    subrequest_parse(mrb, balancer, mrb_ary_ref(mrb, reqs, i), &subs[i]);
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.evbase = event_base_new();
+  if (ctx.evbase == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "event_base_new failed");
+  }
+
+  // hostnames are resolved by blocking getaddrinfo when evdns fails
+  resolver = mrb_http2_resolver_new(mrb, ctx.evbase, 0, 0);
+  pool = mrb_http2_upstream_pool_new(mrb, ctx.evbase, buffer_size, resolver);
+  for (i = 0; i < len; i++) {
+    subs[i].ctx = &ctx;
+    subrequest_start(mrb, pool, &subs[i]);
+  }
+  if (ctx.pending > 0) {
+    event_base_dispatch(ctx.evbase);
+  }
+
+  results = mrb_ary_new_capa(mrb, len);
+  for (i = 0; i < len; i++) {
+    mrb_ary_push(mrb, results, subrequest_response(mrb, &subs[i]));
+    mrb_http2_upstream_request_free(subs[i].req);
+    if (subs[i].timer != NULL) {
+      event_free(subs[i].timer);
+    }
+    evbuffer_free(subs[i].resbody);
+  }
+  mrb_http2_upstream_pool_free(pool);
+  if (resolver != NULL) {
+    mrb_http2_resolver_free(resolver);
+  }
+  event_base_free(ctx.evbase);
+
+  return results;
+}
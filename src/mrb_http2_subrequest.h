@@ -0,0 +1,28 @@
+/*
+// mrb_http2_subrequest.h - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+
+#ifndef MRB_HTTP2_SUBREQUEST_H
+#define MRB_HTTP2_SUBREQUEST_H
+
+#include "mrb_http2.h"
+#include "mrb_http2_balancer.h"
+
+// requests issued at once by a call
+#define MRB_HTTP2_SUBREQUEST_MAX 64
+
+// default seconds to wait for a subrequest
+#define MRB_HTTP2_SUBREQUEST_TIMEOUT 10.0
+
+// send every request of reqs concurrently and return their responses in the
+// same order when all of them completed or timed out. the calling thread
+// waits for them, so it's only called from handlers on the blocking pool
+//
+//   [{:host => "127.0.0.1", :port => 8080, :path => "/a", :timeout => 0.5},
+//    {:group => "app", :path => "/b", :method => "POST", :headers => {...}, :body => "..."}]
+//   => [{:status => 200, :headers => {...}, :body => "..."}, {:error => "timeout"}]
+mrb_value mrb_http2_subrequests(mrb_state *mrb, mrb_http2_balancer *balancer, size_t buffer_size, mrb_value reqs);
+
+#endif
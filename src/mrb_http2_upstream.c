@@ -0,0 +1,1569 @@
+/*
+// mrb_http2_upstream.c - to provide http2 methods
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "mrb_http2.h"
+#include "mrb_http2_upstream.h"
+#include "mrb_http2_header.h"
+
+#include <event2/util.h>
+#include <strings.h>
+#include <sys/un.h>
+
+#define MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX (1 << 16)
+#define MRB_HTTP2_UPSTREAM_DESTROYED -2
+
+struct mrb_http2_upstream_conn {
+  // idle connection list or HTTP/2 connection list
+  mrb_http2_upstream_conn *next;
+
+  mrb_http2_upstream_pool *pool;
+
+  // request using this connection, NULL when idle
+  mrb_http2_upstream_req *req;
+
+  struct bufferevent *bev;
+  char *host;
+  int port;
+
+  // hostname lookup in flight before connecting
+  mrb_http2_resolver_query *resolving;
+
+  // HTTP/2 session and the requests multiplexed on it, NULL on HTTP/1.x
+  nghttp2_session *session;
+  mrb_http2_upstream_req *reqs;
+  size_t nreqs;
+
+  // run nghttp2_session_send() out of callbacks
+  struct event *send_ev;
+
+  unsigned int eof : 1;
+  unsigned int goaway : 1;
+};
+
+struct mrb_http2_upstream_pool {
+  mrb_state *mrb;
+  struct event_base *evbase;
+
+  // high watermark of buffered response body per request
+  size_t buffer_size;
+
+  mrb_http2_upstream_conn *idle;
+  size_t idlelen;
+
+  mrb_http2_upstream_conn *h2conns;
+
+  // NULL resolves hostnames with blocking getaddrinfo
+  mrb_http2_resolver *resolver;
+};
+
+static void upstream_conn_readcb(struct bufferevent *bev, void *ptr);
+static void upstream_conn_writecb(struct bufferevent *bev, void *ptr);
+static void upstream_conn_eventcb(struct bufferevent *bev, short events, void *ptr);
+static void upstream_process(mrb_http2_upstream_req *req);
+static void upstream_finish(mrb_http2_upstream_req *req, int error);
+static int upstream_h2_write_request(mrb_http2_upstream_req *req);
+static void upstream_h2_detach(mrb_http2_upstream_req *req);
+static void upstream_h2_eventcb(struct bufferevent *bev, short events, void *ptr);
+static void upstream_h2_schedule_send(mrb_http2_upstream_conn *conn);
+static void upstream_schedule_drain(mrb_http2_upstream_req *req);
+
+void mrb_http2_upstream_free(mrb_state *mrb, mrb_http2_upstream *upstream)
+{
+  free(upstream->host);
+  free(upstream->unparsed_host);
+  free(upstream->uri);
+  mrb_free(mrb, upstream);
+}
+
+int mrb_http2_upstream_is_unix(const char *host)
+{
+  return strncmp(host, MRB_HTTP2_UPSTREAM_UNIX_PREFIX, sizeof(MRB_HTTP2_UPSTREAM_UNIX_PREFIX) - 1) == 0;
+}
+
+char *mrb_http2_upstream_authority(const char *host, int port)
+{
+  size_t len;
+  char *authority;
+
+  if (mrb_http2_upstream_is_unix(host)) {
+    return strdup("localhost");
+  }
+  len = strlen(host) + sizeof(":65535");
+  authority = malloc(len);
+  snprintf(authority, len, "%s:%d", host, port);
+  return authority;
+}
+
+mrb_http2_upstream_pool *mrb_http2_upstream_pool_new(mrb_state *mrb, struct event_base *evbase, size_t buffer_size,
+                                                     mrb_http2_resolver *resolver)
+{
+  mrb_http2_upstream_pool *pool = (mrb_http2_upstream_pool *)mrb_malloc(mrb, sizeof(mrb_http2_upstream_pool));
+  memset(pool, 0, sizeof(mrb_http2_upstream_pool));
+
+  pool->mrb = mrb;
+  pool->evbase = evbase;
+  pool->buffer_size = buffer_size > 0 ? buffer_size : MRB_HTTP2_UPSTREAM_BUFFER_SIZE;
+  pool->idle = NULL;
+  pool->idlelen = 0;
+  pool->resolver = resolver;
+
+  return pool;
+}
+
+static void upstream_conn_free(mrb_http2_upstream_conn *conn)
+{
+  TRACER;
+  if (conn->resolving != NULL) {
+    mrb_http2_resolver_cancel(conn->resolving);
+  }
+  if (conn->session != NULL) {
+    nghttp2_session_del(conn->session);
+  }
+  if (conn->send_ev != NULL) {
+    event_free(conn->send_ev);
+  }
+  if (conn->bev != NULL) {
+    bufferevent_free(conn->bev);
+  }
+  free(conn->host);
+  mrb_free(conn->pool->mrb, conn);
+}
+
+void mrb_http2_upstream_pool_free(mrb_http2_upstream_pool *pool)
+{
+  mrb_http2_upstream_conn *conn, *next;
+
+  for (conn = pool->idle; conn;) {
+    next = conn->next;
+    upstream_conn_free(conn);
+    conn = next;
+  }
+  for (conn = pool->h2conns; conn;) {
+    next = conn->next;
+    upstream_conn_free(conn);
+    conn = next;
+  }
+  mrb_free(pool->mrb, pool);
+}
+
+static void upstream_pool_remove_idle(mrb_http2_upstream_pool *pool, mrb_http2_upstream_conn *conn)
+{
+  mrb_http2_upstream_conn **p;
+
+  for (p = &pool->idle; *p; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      conn->next = NULL;
+      pool->idlelen--;
+      return;
+    }
+  }
+}
+
+static void upstream_idle_readcb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  // upstream must not send anything on an idle connection
+  TRACER;
+  upstream_pool_remove_idle(conn->pool, conn);
+  upstream_conn_free(conn);
+}
+
+static void upstream_idle_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  TRACER;
+  upstream_pool_remove_idle(conn->pool, conn);
+  upstream_conn_free(conn);
+}
+
+static void upstream_pool_put_idle(mrb_http2_upstream_pool *pool, mrb_http2_upstream_conn *conn)
+{
+  struct timeval tv = {MRB_HTTP2_UPSTREAM_IDLE_TIMEOUT, 0};
+
+  conn->req = NULL;
+  if (pool->idlelen >= MRB_HTTP2_UPSTREAM_IDLE_MAX) {
+    upstream_conn_free(conn);
+    return;
+  }
+  bufferevent_setcb(conn->bev, upstream_idle_readcb, NULL, upstream_idle_eventcb, conn);
+  bufferevent_set_timeouts(conn->bev, &tv, NULL);
+  bufferevent_enable(conn->bev, EV_READ);
+
+  conn->next = pool->idle;
+  pool->idle = conn;
+  pool->idlelen++;
+}
+
+static mrb_http2_upstream_conn *upstream_pool_get_idle(mrb_http2_upstream_pool *pool, const char *host, int port)
+{
+  mrb_http2_upstream_conn *conn;
+
+  for (conn = pool->idle; conn; conn = conn->next) {
+    if (conn->port == port && strcmp(conn->host, host) == 0) {
+      upstream_pool_remove_idle(pool, conn);
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+static void upstream_conn_resolved(int result, const struct sockaddr *addr, int addrlen, void *arg)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)arg;
+
+  TRACER;
+  conn->resolving = NULL;
+  if (result == 0 && bufferevent_socket_connect(conn->bev, (struct sockaddr *)addr, addrlen) == 0) {
+    return;
+  }
+  fprintf(stderr, "upstream: connect to %s:%d failed\n", conn->host, conn->port);
+
+  // fail the requests on the connection as a connect error
+  if (conn->session != NULL) {
+    upstream_h2_eventcb(conn->bev, BEV_EVENT_ERROR, conn);
+  } else {
+    upstream_conn_eventcb(conn->bev, BEV_EVENT_ERROR, conn);
+  }
+}
+
+// a co-located backend is reached without TCP loopback
+static int upstream_conn_connect_unix(mrb_http2_upstream_conn *conn, const char *host)
+{
+  struct sockaddr_un sun;
+  const char *path = host + sizeof(MRB_HTTP2_UPSTREAM_UNIX_PREFIX) - 1;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "upstream: unix domain socket path is too long: %s\n", path);
+    return -1;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  return bufferevent_socket_connect(conn->bev, (struct sockaddr *)&sun, sizeof(sun));
+}
+
+static mrb_http2_upstream_conn *upstream_conn_new(mrb_http2_upstream_pool *pool, const char *host, int port)
+{
+  mrb_http2_upstream_conn *conn;
+  struct sockaddr_storage addr;
+  int addrlen;
+  int rv;
+
+  conn = (mrb_http2_upstream_conn *)mrb_malloc(pool->mrb, sizeof(mrb_http2_upstream_conn));
+  memset(conn, 0, sizeof(mrb_http2_upstream_conn));
+  conn->pool = pool;
+  conn->host = strdup(host);
+  conn->port = port;
+  conn->bev = bufferevent_socket_new(pool->evbase, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  if (conn->bev == NULL) {
+    fprintf(stderr, "upstream: bufferevent_socket_new failed\n");
+    upstream_conn_free(conn);
+    return NULL;
+  }
+  bufferevent_setcb(conn->bev, upstream_conn_readcb, NULL, upstream_conn_eventcb, conn);
+
+  if (mrb_http2_upstream_is_unix(host)) {
+    rv = upstream_conn_connect_unix(conn, host);
+  } else if (pool->resolver == NULL) {
+    rv = bufferevent_socket_connect_hostname(conn->bev, NULL, AF_UNSPEC, host, port);
+  } else {
+    // connect later from upstream_conn_resolved unless the address is cached
+    rv = mrb_http2_resolver_resolve(pool->resolver, host, port, &addr, &addrlen, upstream_conn_resolved, conn,
+                                    &conn->resolving);
+    if (rv == 0) {
+      rv = bufferevent_socket_connect(conn->bev, (struct sockaddr *)&addr, addrlen);
+    } else if (rv == 1) {
+      rv = 0;
+    }
+  }
+  if (rv != 0) {
+    fprintf(stderr, "upstream: connect to %s:%d failed\n", host, port);
+    upstream_conn_free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+static void upstream_request_destroy(mrb_http2_upstream_req *req)
+{
+  mrb_state *mrb = req->pool->mrb;
+
+  TRACER;
+  if (req->conn != NULL && req->h2) {
+    // reset the stream and keep the connection for other streams
+    upstream_h2_detach(req);
+  } else if (req->conn != NULL) {
+    // the response was not read to the end, so the connection can't be reused
+    upstream_conn_free(req->conn);
+    req->conn = NULL;
+  }
+  if (req->resume_ev != NULL) {
+    event_free(req->resume_ev);
+  }
+  if (req->drain_ev != NULL) {
+    event_free(req->drain_ev);
+  }
+  mrb_http2_free_nva(mrb, req->headers, req->headerslen);
+  mrb_http2_free_nva(mrb, req->reqhdrs, req->reqhdrslen);
+  evbuffer_free(req->body);
+  evbuffer_free(req->reqbody);
+  evbuffer_free(req->reqbody_sent);
+  evbuffer_free(req->request);
+  free(req->host);
+  free(req->method);
+  free(req->path);
+  free(req->authority);
+  mrb_free(mrb, req);
+}
+
+// invoke handler callbacks, returns MRB_HTTP2_UPSTREAM_DESTROYED when the
+// request was freed in the callback
+static int upstream_dispatch_header(mrb_http2_upstream_req *req)
+{
+  req->dispatching = 1;
+  req->handler->on_header(req, req->ud);
+  req->dispatching = 0;
+  if (req->cancelled) {
+    upstream_request_destroy(req);
+    return MRB_HTTP2_UPSTREAM_DESTROYED;
+  }
+  return 0;
+}
+
+static int upstream_dispatch_body(mrb_http2_upstream_req *req)
+{
+  req->dispatching = 1;
+  req->handler->on_body(req, req->ud);
+  req->dispatching = 0;
+  if (req->cancelled) {
+    upstream_request_destroy(req);
+    return MRB_HTTP2_UPSTREAM_DESTROYED;
+  }
+  return 0;
+}
+
+static void upstream_finish(mrb_http2_upstream_req *req, int error)
+{
+  mrb_http2_upstream_conn *conn = req->conn;
+
+  TRACER;
+  req->conn = NULL;
+  if (conn != NULL) {
+    if (!error && req->keepalive && !conn->eof && evbuffer_get_length(bufferevent_get_input(conn->bev)) == 0 &&
+        (!req->body_streaming || req->body_done)) {
+      upstream_pool_put_idle(req->pool, conn);
+    } else {
+      upstream_conn_free(conn);
+    }
+  }
+  req->finished = 1;
+  req->failed = error ? 1 : 0;
+
+  req->dispatching = 1;
+  req->handler->on_done(req, error, req->ud);
+  req->dispatching = 0;
+  if (req->cancelled) {
+    upstream_request_destroy(req);
+  }
+}
+
+static int upstream_write_request(mrb_http2_upstream_req *req)
+{
+  mrb_http2_upstream_conn *conn;
+  struct timeval tv;
+
+  if (req->h2) {
+    return upstream_h2_write_request(req);
+  }
+
+  // a streamed body can't be sent again, so don't risk a stale keepalive
+  // connection
+  conn = req->body_streaming ? NULL : upstream_pool_get_idle(req->pool, req->host, req->port);
+  if (conn != NULL && !req->retried) {
+    req->reused = 1;
+  } else {
+    if (conn != NULL) {
+      upstream_conn_free(conn);
+    }
+    req->reused = 0;
+    conn = upstream_conn_new(req->pool, req->host, req->port);
+    if (conn == NULL) {
+      return -1;
+    }
+  }
+
+  conn->req = req;
+  req->conn = conn;
+  req->state = MRB_HTTP2_UPSTREAM_STATUS_LINE;
+
+  tv.tv_sec = req->timeout;
+  tv.tv_usec = 0;
+  bufferevent_setcb(conn->bev, upstream_conn_readcb, upstream_conn_writecb, upstream_conn_eventcb, conn);
+  bufferevent_setwatermark(conn->bev, EV_WRITE, req->pool->buffer_size / 2, 0);
+  bufferevent_set_timeouts(conn->bev, &tv, &tv);
+  // the request is resent when a reused connection turns out stale, so it
+  // is kept by reference then. a file-backed body can't be referenced and
+  // is handed over without the retry, instead of being read into memory
+  if (!req->reused || evbuffer_add_buffer_reference(bufferevent_get_output(conn->bev), req->request) != 0) {
+    req->retried = 1;
+    bufferevent_write_buffer(conn->bev, req->request);
+  }
+  bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+
+  return 0;
+}
+
+static void upstream_resume_cb(evutil_socket_t fd, short what, void *ptr)
+{
+  mrb_http2_upstream_req *req = (mrb_http2_upstream_req *)ptr;
+
+  TRACER;
+  if (req->conn == NULL || req->paused) {
+    return;
+  }
+  bufferevent_enable(req->conn->bev, EV_READ);
+  upstream_process(req);
+}
+
+mrb_http2_upstream_req *mrb_http2_upstream_request_new(mrb_http2_upstream_pool *pool,
+                                                       const mrb_http2_upstream_handler *handler, void *ud)
+{
+  mrb_http2_upstream_req *req;
+
+  req = (mrb_http2_upstream_req *)mrb_malloc(pool->mrb, sizeof(mrb_http2_upstream_req));
+  memset(req, 0, sizeof(mrb_http2_upstream_req));
+  req->pool = pool;
+  req->handler = handler;
+  req->ud = ud;
+  req->conn = NULL;
+  req->host = NULL;
+  req->headerslen = 0;
+  req->content_length = -1;
+  req->remain = -1;
+  req->reqhdrslen = 0;
+  req->reqbody = evbuffer_new();
+  req->reqbody_sent = evbuffer_new();
+  req->request = evbuffer_new();
+  req->body = evbuffer_new();
+  req->resume_ev = event_new(pool->evbase, -1, 0, upstream_resume_cb, req);
+  req->state = MRB_HTTP2_UPSTREAM_CONNECTING;
+
+  return req;
+}
+
+// header names must be lower case, hop-by-hop headers and host must not be
+// added
+int mrb_http2_upstream_request_add_header(mrb_http2_upstream_req *req, const uint8_t *name, size_t namelen,
+                                          const uint8_t *value, size_t valuelen)
+{
+  if (req->reqhdrslen >= MRB_HTTP2_HEADER_MAX) {
+    return -1;
+  }
+  mrb_http2_create_nv(req->pool->mrb, &req->reqhdrs[req->reqhdrslen], name, namelen, value, valuelen);
+  req->reqhdrslen++;
+  return 0;
+}
+
+int mrb_http2_upstream_request_add_header_ref(mrb_http2_upstream_req *req, const uint8_t *name, size_t namelen,
+                                              const uint8_t *value, size_t valuelen)
+{
+  if (req->reqhdrslen >= MRB_HTTP2_HEADER_MAX) {
+    return -1;
+  }
+  mrb_http2_ref_nv(&req->reqhdrs[req->reqhdrslen], name, namelen, value, valuelen);
+  req->reqhdrslen++;
+  return 0;
+}
+
+static void upstream_h1_serialize(mrb_http2_upstream_req *req, const mrb_http2_upstream *upstream)
+{
+  struct evbuffer *out = req->request;
+  struct evbuffer_iovec v;
+  uint8_t *p;
+  size_t i, len = 0;
+  int has_content_length = 0;
+
+  evbuffer_add_printf(out, "%s %s HTTP/%d.%d\r\n", req->method, req->path, upstream->proto_major,
+                      upstream->proto_minor);
+  evbuffer_add_printf(out, "Host: %s\r\n", req->authority);
+  if (!upstream->keepalive && upstream->proto_minor == 1) {
+    evbuffer_add(out, "Connection: close\r\n", sizeof("Connection: close\r\n") - 1);
+  }
+  // header lines are written into one reserved extent of the buffer
+  for (i = 0; i < req->reqhdrslen; i++) {
+    len += req->reqhdrs[i].namelen + req->reqhdrs[i].valuelen + 4;
+    if (mrb_http2_header_lookup(req->reqhdrs[i].name, req->reqhdrs[i].namelen) ==
+        MRB_HTTP2_HEADER_TOKEN_CONTENT_LENGTH) {
+      has_content_length = 1;
+    }
+  }
+  if (len > 0 && evbuffer_reserve_space(out, len, &v, 1) == 1) {
+    p = (uint8_t *)v.iov_base;
+    for (i = 0; i < req->reqhdrslen; i++) {
+      memcpy(p, req->reqhdrs[i].name, req->reqhdrs[i].namelen);
+      p += req->reqhdrs[i].namelen;
+      *p++ = ':';
+      *p++ = ' ';
+      memcpy(p, req->reqhdrs[i].value, req->reqhdrs[i].valuelen);
+      p += req->reqhdrs[i].valuelen;
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+    v.iov_len = len;
+    evbuffer_commit_space(out, &v, 1);
+  }
+  if (req->body_streaming && !has_content_length && upstream->proto_minor == 1) {
+    evbuffer_add(out, "Transfer-Encoding: chunked\r\n", sizeof("Transfer-Encoding: chunked\r\n") - 1);
+    req->body_chunked = 1;
+  }
+  evbuffer_add(out, "\r\n", 2);
+  evbuffer_add_buffer(out, req->reqbody);
+}
+
+// send the request with req->reqhdrs and req->reqbody to upstream, HTTP/2
+// upstream is multiplexed on a shared connection
+int mrb_http2_upstream_request_send(mrb_http2_upstream_req *req, const mrb_http2_upstream *upstream,
+                                    const char *method)
+{
+  TRACER;
+  req->host = strdup(upstream->host);
+  req->port = upstream->port;
+  req->timeout = upstream->timeout;
+  req->keepalive = upstream->keepalive;
+  req->method = strdup(method);
+  req->path = strdup(upstream->uri);
+  req->authority = strdup(upstream->unparsed_host);
+  req->head = strcmp(method, "HEAD") == 0 ? 1 : 0;
+  req->h2 = upstream->proto_major == 2 ? 1 : 0;
+
+  if (!req->h2) {
+    upstream_h1_serialize(req, upstream);
+  }
+
+  return upstream_write_request(req);
+}
+
+static void upstream_drain_cb(evutil_socket_t fd, short what, void *ptr)
+{
+  mrb_http2_upstream_req *req = (mrb_http2_upstream_req *)ptr;
+
+  TRACER;
+  if (req->body_done || req->handler->on_drain == NULL ||
+      mrb_http2_upstream_request_body_pending(req) >= req->pool->buffer_size / 2) {
+    return;
+  }
+  req->dispatching = 1;
+  req->handler->on_drain(req, req->ud);
+  req->dispatching = 0;
+  if (req->cancelled) {
+    upstream_request_destroy(req);
+  }
+}
+
+static void upstream_schedule_drain(mrb_http2_upstream_req *req)
+{
+  struct timeval tv = {0, 0};
+
+  if (!req->body_done) {
+    event_add(req->drain_ev, &tv);
+  }
+}
+
+void mrb_http2_upstream_request_stream_body(mrb_http2_upstream_req *req)
+{
+  req->body_streaming = 1;
+  req->drain_ev = event_new(req->pool->evbase, -1, 0, upstream_drain_cb, req);
+}
+
+// returns -1 when the body can't be sent any more, like after the response
+// failed
+int mrb_http2_upstream_request_write_body(mrb_http2_upstream_req *req, const uint8_t *data, size_t len)
+{
+  struct evbuffer *out;
+
+  if (req->body_done || req->failed || req->conn == NULL) {
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  if (req->h2) {
+    evbuffer_add(req->reqbody, data, len);
+    if (req->body_deferred) {
+      req->body_deferred = 0;
+      nghttp2_session_resume_data(req->conn->session, req->stream_id);
+      upstream_h2_schedule_send(req->conn);
+    }
+    return 0;
+  }
+
+  out = bufferevent_get_output(req->conn->bev);
+  if (req->body_chunked) {
+    evbuffer_add_printf(out, "%lx\r\n", (unsigned long)len);
+  }
+  evbuffer_add(out, data, len);
+  if (req->body_chunked) {
+    evbuffer_add(out, "\r\n", 2);
+  }
+  return 0;
+}
+
+void mrb_http2_upstream_request_end_body(mrb_http2_upstream_req *req)
+{
+  if (req->body_done) {
+    return;
+  }
+  req->body_done = 1;
+  if (req->failed || req->conn == NULL) {
+    return;
+  }
+
+  if (req->h2) {
+    if (req->body_deferred) {
+      req->body_deferred = 0;
+      nghttp2_session_resume_data(req->conn->session, req->stream_id);
+      upstream_h2_schedule_send(req->conn);
+    }
+    return;
+  }
+  if (req->body_chunked) {
+    bufferevent_write(req->conn->bev, "0\r\n\r\n", 5);
+  }
+}
+
+size_t mrb_http2_upstream_request_body_pending(mrb_http2_upstream_req *req)
+{
+  if (req->h2) {
+    return evbuffer_get_length(req->reqbody);
+  }
+  if (req->conn == NULL) {
+    return 0;
+  }
+  return evbuffer_get_length(bufferevent_get_output(req->conn->bev));
+}
+
+// the consumer drained req->body, so reading from upstream can go on
+void mrb_http2_upstream_request_consumed(mrb_http2_upstream_req *req)
+{
+  struct timeval tv = {0, 0};
+  size_t len;
+
+  if (req->h2) {
+    // give the window back to upstream for what the consumer has drained
+    len = evbuffer_get_length(req->body);
+    if (req->conn != NULL && req->unconsumed > len) {
+      nghttp2_session_consume(req->conn->session, req->stream_id, req->unconsumed - len);
+      req->unconsumed = len;
+      event_add(req->conn->send_ev, &tv);
+    }
+    return;
+  }
+
+  if (!req->paused || evbuffer_get_length(req->body) >= req->pool->buffer_size / 2) {
+    return;
+  }
+  TRACER;
+  req->paused = 0;
+
+  // don't parse here, the consumer is usually in the middle of
+  // nghttp2_session_send()
+  event_add(req->resume_ev, &tv);
+}
+
+void mrb_http2_upstream_request_free(mrb_http2_upstream_req *req)
+{
+  if (req == NULL) {
+    return;
+  }
+  if (req->dispatching) {
+    req->cancelled = 1;
+    return;
+  }
+  upstream_request_destroy(req);
+}
+
+static int upstream_parse_status_line(mrb_http2_upstream_req *req, const char *line)
+{
+  int major, minor, status;
+
+  if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3 || status < 100 || status > 999) {
+    return -1;
+  }
+  req->status = status;
+
+  // HTTP/1.0 is not persistent by default
+  if (major == 1 && minor == 0) {
+    req->keepalive = 0;
+  }
+  return 0;
+}
+
+// case insensitive search of a token in a comma separated header value,
+// parameters after ';' are ignored
+static int upstream_value_has_token(const char *value, const char *token)
+{
+  size_t len = strlen(token), n;
+
+  while (*value != '\0') {
+    value += strspn(value, " \t,");
+    n = strcspn(value, " \t,;");
+    if (n == len && strncasecmp(value, token, len) == 0) {
+      return 1;
+    }
+    value += strcspn(value, ",");
+  }
+  return 0;
+}
+
+// digits of base 10 or 16 up to the end or a delimiter of delims, -1 when
+// empty, overflowed or followed by anything else
+static int64_t upstream_parse_size(const char *p, int base, const char *delims)
+{
+  int64_t size = 0;
+  const char *start = p;
+  int d;
+
+  for (; isxdigit((unsigned char)*p); p++) {
+    d = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+    if (d >= base || size > (INT64_MAX - d) / base) {
+      return -1;
+    }
+    size = size * base + d;
+  }
+  if (p == start) {
+    return -1;
+  }
+  p += strspn(p, " \t");
+  if (*p != '\0' && strchr(delims, *p) == NULL) {
+    return -1;
+  }
+  return size;
+}
+
+static int upstream_parse_header_line(mrb_http2_upstream_req *req, char *line, size_t len)
+{
+  mrb_state *mrb = req->pool->mrb;
+  char *value, *end;
+  size_t namelen, i;
+  nghttp2_nv *nv;
+
+  value = memchr(line, ':', len);
+  if (value == NULL || value == line) {
+    return -1;
+  }
+  namelen = value - line;
+  value++;
+  end = line + len;
+  while (value < end && (*value == ' ' || *value == '\t')) {
+    value++;
+  }
+  while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+    end--;
+  }
+  *end = '\0';
+
+  for (i = 0; i < namelen; i++) {
+    line[i] = tolower((unsigned char)line[i]);
+  }
+
+  if (namelen == sizeof("content-length") - 1 && memcmp("content-length", line, namelen) == 0) {
+    req->content_length = upstream_parse_size(value, 10, "");
+    if (req->content_length < 0) {
+      return -1;
+    }
+  } else if (namelen == sizeof("transfer-encoding") - 1 && memcmp("transfer-encoding", line, namelen) == 0) {
+    if (upstream_value_has_token(value, "chunked")) {
+      req->chunked = 1;
+    }
+  } else if (namelen == sizeof("connection") - 1 && memcmp("connection", line, namelen) == 0) {
+    if (upstream_value_has_token(value, "close")) {
+      req->keepalive = 0;
+    } else if (upstream_value_has_token(value, "keep-alive")) {
+      req->keepalive = 1;
+    }
+  }
+
+  if (req->headerslen >= MRB_HTTP2_HEADER_MAX) {
+    return 0;
+  }
+  nv = &req->headers[req->headerslen];
+  mrb_http2_create_nv(mrb, nv, (uint8_t *)line, namelen, (uint8_t *)value, end - value);
+  req->headerslen++;
+
+  return 0;
+}
+
+static void upstream_header_done(mrb_http2_upstream_req *req)
+{
+  if (req->head || req->status == 204 || req->status == 304) {
+    req->state = MRB_HTTP2_UPSTREAM_DONE;
+  } else if (req->chunked) {
+    req->content_length = -1;
+    req->state = MRB_HTTP2_UPSTREAM_CHUNK_SIZE;
+  } else if (req->content_length >= 0) {
+    req->remain = req->content_length;
+    req->state = req->remain == 0 ? MRB_HTTP2_UPSTREAM_DONE : MRB_HTTP2_UPSTREAM_BODY;
+  } else {
+    // read until upstream closes the connection
+    req->remain = -1;
+    req->keepalive = 0;
+    req->state = MRB_HTTP2_UPSTREAM_BODY;
+  }
+}
+
+static size_t upstream_read_body(mrb_http2_upstream_req *req, struct evbuffer *input)
+{
+  size_t len = evbuffer_get_length(input);
+
+  if (req->remain >= 0 && len > (size_t)req->remain) {
+    len = req->remain;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  evbuffer_remove_buffer(input, req->body, len);
+  if (req->remain >= 0) {
+    req->remain -= len;
+  }
+  return len;
+}
+
+// returns 0 when more input is needed or paused, -1 on a malformed
+// response and MRB_HTTP2_UPSTREAM_DESTROYED when req was freed
+static int upstream_parse(mrb_http2_upstream_req *req, int *body_read)
+{
+  struct evbuffer *input = bufferevent_get_input(req->conn->bev);
+  char *line;
+  size_t n;
+  int rv;
+
+  while (req->state != MRB_HTTP2_UPSTREAM_DONE) {
+    if (evbuffer_get_length(req->body) >= req->pool->buffer_size) {
+      TRACER;
+      req->paused = 1;
+      bufferevent_disable(req->conn->bev, EV_READ);
+      return 0;
+    }
+
+    switch (req->state) {
+    case MRB_HTTP2_UPSTREAM_CONNECTING:
+    case MRB_HTTP2_UPSTREAM_STATUS_LINE:
+      line = evbuffer_readln(input, &n, EVBUFFER_EOL_CRLF);
+      if (line == NULL) {
+        return evbuffer_get_length(input) > MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX ? -1 : 0;
+      }
+      rv = upstream_parse_status_line(req, line);
+      free(line);
+      if (rv != 0) {
+        return -1;
+      }
+      req->state = MRB_HTTP2_UPSTREAM_HEADERS;
+      break;
+
+    case MRB_HTTP2_UPSTREAM_HEADERS:
+      line = evbuffer_readln(input, &n, EVBUFFER_EOL_CRLF);
+      if (line == NULL) {
+        return evbuffer_get_length(input) > MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX ? -1 : 0;
+      }
+      if (n > 0) {
+        rv = upstream_parse_header_line(req, line, n);
+        free(line);
+        if (rv != 0) {
+          return -1;
+        }
+        break;
+      }
+      free(line);
+
+      // skip interim response like 100-continue
+      if (req->status < 200) {
+        mrb_http2_free_nva(req->pool->mrb, req->headers, req->headerslen);
+        req->headerslen = 0;
+        req->content_length = -1;
+        req->chunked = 0;
+        req->state = MRB_HTTP2_UPSTREAM_STATUS_LINE;
+        break;
+      }
+      upstream_header_done(req);
+      if (upstream_dispatch_header(req) != 0) {
+        return MRB_HTTP2_UPSTREAM_DESTROYED;
+      }
+      break;
+
+    case MRB_HTTP2_UPSTREAM_BODY:
+      if (upstream_read_body(req, input) == 0) {
+        return 0;
+      }
+      *body_read = 1;
+      if (req->remain == 0) {
+        req->state = MRB_HTTP2_UPSTREAM_DONE;
+      }
+      break;
+
+    case MRB_HTTP2_UPSTREAM_CHUNK_SIZE:
+      line = evbuffer_readln(input, &n, EVBUFFER_EOL_CRLF);
+      if (line == NULL) {
+        return evbuffer_get_length(input) > MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX ? -1 : 0;
+      }
+      // chunk extensions after ';' are ignored
+      req->remain = upstream_parse_size(line, 16, ";");
+      free(line);
+      if (req->remain < 0) {
+        return -1;
+      }
+      req->state = req->remain == 0 ? MRB_HTTP2_UPSTREAM_TRAILERS : MRB_HTTP2_UPSTREAM_CHUNK_DATA;
+      break;
+
+    case MRB_HTTP2_UPSTREAM_CHUNK_DATA:
+      if (upstream_read_body(req, input) == 0) {
+        return 0;
+      }
+      *body_read = 1;
+      if (req->remain == 0) {
+        req->state = MRB_HTTP2_UPSTREAM_CHUNK_CRLF;
+      }
+      break;
+
+    case MRB_HTTP2_UPSTREAM_CHUNK_CRLF:
+      // nothing but CRLF follows chunk data
+      line = evbuffer_readln(input, &n, EVBUFFER_EOL_CRLF);
+      if (line == NULL) {
+        return evbuffer_get_length(input) > 2 ? -1 : 0;
+      }
+      free(line);
+      if (n != 0) {
+        return -1;
+      }
+      req->state = MRB_HTTP2_UPSTREAM_CHUNK_SIZE;
+      break;
+
+    case MRB_HTTP2_UPSTREAM_TRAILERS:
+      line = evbuffer_readln(input, &n, EVBUFFER_EOL_CRLF);
+      if (line == NULL) {
+        return req->trailers_size + evbuffer_get_length(input) > MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX ? -1 : 0;
+      }
+      free(line);
+      req->trailers_size += n + 2;
+      if (req->trailers_size > MRB_HTTP2_UPSTREAM_HEADER_SIZE_MAX) {
+        return -1;
+      }
+      if (n == 0) {
+        req->state = MRB_HTTP2_UPSTREAM_DONE;
+      }
+      break;
+
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void upstream_process(mrb_http2_upstream_req *req)
+{
+  int body_read = 0;
+  int rv;
+
+  TRACER;
+  rv = upstream_parse(req, &body_read);
+  if (rv == MRB_HTTP2_UPSTREAM_DESTROYED) {
+    return;
+  }
+  if (rv != 0) {
+    fprintf(stderr, "upstream: malformed response from %s:%d\n", req->host, req->port);
+    upstream_finish(req, 1);
+    return;
+  }
+  if (body_read && upstream_dispatch_body(req) != 0) {
+    return;
+  }
+  if (req->state == MRB_HTTP2_UPSTREAM_DONE) {
+    upstream_finish(req, 0);
+    return;
+  }
+  if (req->conn->eof && !req->paused) {
+    if (req->state == MRB_HTTP2_UPSTREAM_BODY && req->remain == -1) {
+      // the end of response without content-length
+      req->state = MRB_HTTP2_UPSTREAM_DONE;
+      upstream_finish(req, 0);
+    } else {
+      upstream_finish(req, 1);
+    }
+  }
+}
+
+static void upstream_conn_readcb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  TRACER;
+  if (conn->req == NULL || conn->req->paused) {
+    return;
+  }
+  upstream_process(conn->req);
+}
+
+static void upstream_conn_writecb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  if (conn->req != NULL && conn->req->body_streaming) {
+    upstream_schedule_drain(conn->req);
+  }
+}
+
+static void upstream_conn_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+  mrb_http2_upstream_req *req = conn->req;
+
+  TRACER;
+  if (events & BEV_EVENT_CONNECTED) {
+    int val = 1;
+    if (!mrb_http2_upstream_is_unix(conn->host)) {
+      setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+    }
+    return;
+  }
+
+  if (req == NULL) {
+    upstream_conn_free(conn);
+    return;
+  }
+
+  // a keepalive connection was closed by upstream before our request reached
+  // it, so try once more with a new connection
+  if (req->reused && !req->retried && req->status == 0 &&
+      evbuffer_get_length(bufferevent_get_input(bev)) == 0 && (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) {
+    TRACER;
+    req->conn = NULL;
+    req->retried = 1;
+    upstream_conn_free(conn);
+    if (upstream_write_request(req) != 0) {
+      upstream_finish(req, 1);
+    }
+    return;
+  }
+
+  if (events & BEV_EVENT_EOF) {
+    conn->eof = 1;
+    if (!req->paused) {
+      upstream_process(req);
+    }
+    return;
+  }
+
+  if (events & BEV_EVENT_TIMEOUT) {
+    fprintf(stderr, "upstream: %s:%d timeout\n", req->host, req->port);
+  } else {
+    fprintf(stderr, "upstream: %s:%d network error\n", req->host, req->port);
+  }
+  upstream_finish(req, 1);
+}
+
+//
+// HTTP/2 (h2c with prior knowledge) upstream
+//
+
+static void upstream_h2_readcb(struct bufferevent *bev, void *ptr);
+static void upstream_h2_writecb(struct bufferevent *bev, void *ptr);
+static void upstream_h2_eventcb(struct bufferevent *bev, short events, void *ptr);
+
+static void upstream_h2_set_timeouts(mrb_http2_upstream_conn *conn, unsigned int timeout)
+{
+  struct timeval tv = {timeout, 0};
+
+  if (conn->nreqs == 0) {
+    tv.tv_sec = MRB_HTTP2_UPSTREAM_IDLE_TIMEOUT;
+  }
+  bufferevent_set_timeouts(conn->bev, &tv, &tv);
+}
+
+static void upstream_h2_link(mrb_http2_upstream_conn *conn, mrb_http2_upstream_req *req)
+{
+  req->conn = conn;
+  req->next = conn->reqs;
+  conn->reqs = req;
+  conn->nreqs++;
+  upstream_h2_set_timeouts(conn, req->timeout);
+}
+
+static void upstream_h2_unlink(mrb_http2_upstream_req *req)
+{
+  mrb_http2_upstream_conn *conn = req->conn;
+  mrb_http2_upstream_req **p;
+
+  for (p = &conn->reqs; *p; p = &(*p)->next) {
+    if (*p == req) {
+      *p = req->next;
+      conn->nreqs--;
+      break;
+    }
+  }
+  req->next = NULL;
+  req->conn = NULL;
+  if (conn->nreqs == 0) {
+    upstream_h2_set_timeouts(conn, 0);
+  }
+}
+
+static void upstream_h2_pool_remove(mrb_http2_upstream_pool *pool, mrb_http2_upstream_conn *conn)
+{
+  mrb_http2_upstream_conn **p;
+
+  for (p = &pool->h2conns; *p; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      conn->next = NULL;
+      return;
+    }
+  }
+}
+
+// fail all requests on the connection and close it
+static void upstream_h2_conn_close(mrb_http2_upstream_conn *conn)
+{
+  mrb_http2_upstream_req *req;
+
+  TRACER;
+  upstream_h2_pool_remove(conn->pool, conn);
+  conn->goaway = 1;
+
+  // on_done may free other requests on this connection, so take them one
+  // by one
+  while ((req = conn->reqs) != NULL) {
+    upstream_h2_unlink(req);
+    upstream_finish(req, 1);
+  }
+  upstream_conn_free(conn);
+}
+
+static int upstream_h2_send(mrb_http2_upstream_conn *conn)
+{
+  int rv;
+
+  rv = nghttp2_session_send(conn->session);
+  if (rv != 0) {
+    fprintf(stderr, "upstream: %s:%d nghttp2_session_send: %s\n", conn->host, conn->port, nghttp2_strerror(rv));
+    return -1;
+  }
+  if (nghttp2_session_want_read(conn->session) == 0 && nghttp2_session_want_write(conn->session) == 0 &&
+      evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static void upstream_h2_send_cb(evutil_socket_t fd, short what, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  if (upstream_h2_send(conn) != 0) {
+    upstream_h2_conn_close(conn);
+  }
+}
+
+static void upstream_h2_schedule_send(mrb_http2_upstream_conn *conn)
+{
+  struct timeval tv = {0, 0};
+
+  event_add(conn->send_ev, &tv);
+}
+
+// reset the stream of a request freed before the response ended
+static void upstream_h2_detach(mrb_http2_upstream_req *req)
+{
+  mrb_http2_upstream_conn *conn = req->conn;
+
+  TRACER;
+  nghttp2_session_set_stream_user_data(conn->session, req->stream_id, NULL);
+  nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, req->stream_id, NGHTTP2_CANCEL);
+  if (req->unconsumed > 0) {
+    nghttp2_session_consume_connection(conn->session, req->unconsumed);
+    req->unconsumed = 0;
+  }
+  upstream_h2_unlink(req);
+  upstream_h2_schedule_send(conn);
+}
+
+static ssize_t upstream_h2_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags,
+                                         void *user_data)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)user_data;
+
+  if (evbuffer_get_length(bufferevent_get_output(conn->bev)) >= OUTPUT_WOULDBLOCK_THRESHOLD) {
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+  bufferevent_write(conn->bev, data, length);
+  return (ssize_t)length;
+}
+
+static int upstream_h2_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                          size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
+                                          void *user_data)
+{
+  mrb_http2_upstream_req *req;
+  size_t i;
+
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE) {
+    // ignore trailers
+    return 0;
+  }
+  req = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (req == NULL) {
+    return 0;
+  }
+
+  if (namelen == sizeof(":status") - 1 && memcmp(":status", name, namelen) == 0) {
+    req->status = 0;
+    for (i = 0; i < valuelen && isdigit(value[i]); i++) {
+      req->status = req->status * 10 + (value[i] - '0');
+    }
+    return 0;
+  }
+  if (namelen > 0 && name[0] == ':') {
+    return 0;
+  }
+  if (namelen == sizeof("content-length") - 1 && memcmp("content-length", name, namelen) == 0) {
+    req->content_length = 0;
+    for (i = 0; i < valuelen && isdigit(value[i]); i++) {
+      req->content_length = req->content_length * 10 + (value[i] - '0');
+    }
+  }
+  if (req->headerslen < MRB_HTTP2_HEADER_MAX) {
+    mrb_http2_create_nv(req->pool->mrb, &req->headers[req->headerslen], name, namelen, value, valuelen);
+    req->headerslen++;
+  }
+  return 0;
+}
+
+static int upstream_h2_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)user_data;
+  mrb_http2_upstream_req *req;
+
+  switch (frame->hd.type) {
+  case NGHTTP2_HEADERS:
+    if (frame->headers.cat != NGHTTP2_HCAT_RESPONSE) {
+      break;
+    }
+    req = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (req == NULL) {
+      break;
+    }
+    // skip interim response like 100-continue
+    if (req->status < 200) {
+      mrb_http2_free_nva(req->pool->mrb, req->headers, req->headerslen);
+      req->headerslen = 0;
+      req->content_length = -1;
+      break;
+    }
+    req->state = MRB_HTTP2_UPSTREAM_BODY;
+    upstream_dispatch_header(req);
+    break;
+  case NGHTTP2_GOAWAY:
+    // don't start new streams on this connection
+    upstream_h2_pool_remove(conn->pool, conn);
+    conn->goaway = 1;
+    break;
+  }
+  return 0;
+}
+
+static int upstream_h2_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                                   const uint8_t *data, size_t len, void *user_data)
+{
+  mrb_http2_upstream_req *req;
+
+  req = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL) {
+    nghttp2_session_consume_connection(session, len);
+    return 0;
+  }
+  evbuffer_add(req->body, data, len);
+  req->unconsumed += len;
+  upstream_dispatch_body(req);
+  return 0;
+}
+
+static int upstream_h2_on_stream_close_callback(nghttp2_session *session, int32_t stream_id, uint32_t error_code,
+                                                void *user_data)
+{
+  mrb_http2_upstream_req *req;
+
+  req = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL) {
+    return 0;
+  }
+  TRACER;
+  nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+
+  // the rest of the body is buffered in req->body already, so release the
+  // connection window for other streams
+  if (req->unconsumed > 0) {
+    nghttp2_session_consume_connection(session, req->unconsumed);
+    req->unconsumed = 0;
+  }
+  upstream_h2_unlink(req);
+
+  // upstream refused the stream before processing it, try another connection
+  // with the whole body again
+  if (error_code == NGHTTP2_REFUSED_STREAM && req->status == 0 && !req->retried && !req->body_streaming) {
+    req->retried = 1;
+    evbuffer_prepend_buffer(req->reqbody, req->reqbody_sent);
+    if (upstream_h2_write_request(req) == 0) {
+      return 0;
+    }
+  }
+
+  if (error_code != NGHTTP2_NO_ERROR || req->status < 200) {
+    fprintf(stderr, "upstream: %s:%d stream %d closed with %s\n", req->host, req->port, stream_id,
+            nghttp2_http2_strerror(error_code));
+    upstream_finish(req, 1);
+    return 0;
+  }
+  req->state = MRB_HTTP2_UPSTREAM_DONE;
+  upstream_finish(req, 0);
+  return 0;
+}
+
+static ssize_t upstream_h2_body_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf,
+                                              size_t length, uint32_t *data_flags, nghttp2_data_source *source,
+                                              void *user_data)
+{
+  mrb_http2_upstream_req *req;
+  int n;
+
+  req = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  if (req->body_streaming) {
+    n = evbuffer_remove(req->reqbody, buf, length);
+  } else {
+    // the chains move to reqbody_sent without copying
+    n = evbuffer_copyout(req->reqbody, buf, length);
+    if (n > 0) {
+      evbuffer_remove_buffer(req->reqbody, req->reqbody_sent, n);
+    }
+  }
+  if (n < 0) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  if (req->body_streaming) {
+    upstream_schedule_drain(req);
+    if (n == 0 && !req->body_done) {
+      // resumed by write_body or end_body
+      req->body_deferred = 1;
+      return NGHTTP2_ERR_DEFERRED;
+    }
+    if (evbuffer_get_length(req->reqbody) == 0 && req->body_done) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+  }
+  if (evbuffer_get_length(req->reqbody) == 0) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return n;
+}
+
+static mrb_http2_upstream_conn *upstream_h2_conn_new(mrb_http2_upstream_pool *pool, const char *host, int port)
+{
+  mrb_http2_upstream_conn *conn;
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_option *option;
+  nghttp2_settings_entry iv[3];
+  int32_t window;
+  int rv;
+
+  conn = upstream_conn_new(pool, host, port);
+  if (conn == NULL) {
+    return NULL;
+  }
+  // callbacks are deferred, so nothing was called back yet
+  bufferevent_setcb(conn->bev, upstream_h2_readcb, upstream_h2_writecb, upstream_h2_eventcb, conn);
+  conn->send_ev = event_new(pool->evbase, -1, 0, upstream_h2_send_cb, conn);
+
+  nghttp2_session_callbacks_new(&callbacks);
+  nghttp2_session_callbacks_set_send_callback(callbacks, upstream_h2_send_callback);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, upstream_h2_on_header_callback);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, upstream_h2_on_frame_recv_callback);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, upstream_h2_on_data_chunk_recv_callback);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, upstream_h2_on_stream_close_callback);
+
+  // window is given back when the client consumed the body, so a slow
+  // client stops its upstream stream only
+  nghttp2_option_new(&option);
+  nghttp2_option_set_no_auto_window_update(option, 1);
+
+  rv = nghttp2_session_client_new2(&conn->session, callbacks, conn, option);
+  nghttp2_option_del(option);
+  nghttp2_session_callbacks_del(callbacks);
+  if (rv != 0) {
+    fprintf(stderr, "upstream: nghttp2_session_client_new2: %s\n", nghttp2_strerror(rv));
+    upstream_conn_free(conn);
+    return NULL;
+  }
+
+  window = pool->buffer_size > NGHTTP2_MAX_WINDOW_SIZE ? NGHTTP2_MAX_WINDOW_SIZE : (int32_t)pool->buffer_size;
+  iv[0].settings_id = NGHTTP2_SETTINGS_ENABLE_PUSH;
+  iv[0].value = 0;
+  iv[1].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  iv[1].value = MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS;
+  iv[2].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  iv[2].value = window;
+  rv = nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, iv, 3);
+  if (rv == 0 && window < NGHTTP2_MAX_WINDOW_SIZE / MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS) {
+    // enough connection window for every stream to fill its own window
+    rv = nghttp2_submit_window_update(conn->session, NGHTTP2_FLAG_NONE, 0,
+                                      window * MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS - NGHTTP2_INITIAL_WINDOW_SIZE);
+  }
+  if (rv != 0) {
+    fprintf(stderr, "upstream: nghttp2_submit_settings: %s\n", nghttp2_strerror(rv));
+    upstream_conn_free(conn);
+    return NULL;
+  }
+  upstream_h2_set_timeouts(conn, 0);
+
+  conn->next = pool->h2conns;
+  pool->h2conns = conn;
+  return conn;
+}
+
+// find a connection to the same upstream with a free stream slot
+static mrb_http2_upstream_conn *upstream_h2_get_conn(mrb_http2_upstream_pool *pool, const char *host, int port)
+{
+  mrb_http2_upstream_conn *conn;
+  uint32_t max;
+
+  for (conn = pool->h2conns; conn; conn = conn->next) {
+    if (conn->goaway || conn->port != port || strcmp(conn->host, host) != 0) {
+      continue;
+    }
+    max = nghttp2_session_get_remote_settings(conn->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    if (max > MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS) {
+      max = MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS;
+    }
+    if (conn->nreqs < max) {
+      return conn;
+    }
+  }
+  return upstream_h2_conn_new(pool, host, port);
+}
+
+static int upstream_h2_write_request(mrb_http2_upstream_req *req)
+{
+  mrb_http2_upstream_conn *conn;
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX + 4];
+  nghttp2_data_provider data_prd;
+  size_t nvlen = 0;
+  size_t i;
+  int32_t stream_id;
+
+  conn = upstream_h2_get_conn(req->pool, req->host, req->port);
+  if (conn == NULL) {
+    return -1;
+  }
+
+#define UPSTREAM_H2_NV(NAME, VALUE)                                                                                    \
+  nva[nvlen].name = (uint8_t *)NAME;                                                                                   \
+  nva[nvlen].namelen = sizeof(NAME) - 1;                                                                               \
+  nva[nvlen].value = (uint8_t *)VALUE;                                                                                 \
+  nva[nvlen].valuelen = strlen(VALUE);                                                                                 \
+  nva[nvlen].flags = NGHTTP2_NV_FLAG_NONE;                                                                             \
+  nvlen++;
+
+  UPSTREAM_H2_NV(":method", req->method);
+  UPSTREAM_H2_NV(":scheme", "http");
+  UPSTREAM_H2_NV(":authority", req->authority);
+  UPSTREAM_H2_NV(":path", req->path);
+#undef UPSTREAM_H2_NV
+
+  // nghttp2 copies them, borrowed headers may be gone before HEADERS is sent
+  for (i = 0; i < req->reqhdrslen; i++) {
+    nva[nvlen] = req->reqhdrs[i];
+    nva[nvlen++].flags = NGHTTP2_NV_FLAG_NONE;
+  }
+
+  data_prd.source.ptr = req;
+  data_prd.read_callback = upstream_h2_body_read_callback;
+
+  stream_id = nghttp2_submit_request(conn->session, NULL, nva, nvlen,
+                                     evbuffer_get_length(req->reqbody) > 0 || req->body_streaming ? &data_prd : NULL,
+                                     req);
+  if (stream_id < 0) {
+    fprintf(stderr, "upstream: nghttp2_submit_request: %s\n", nghttp2_strerror(stream_id));
+    return -1;
+  }
+  req->stream_id = stream_id;
+  req->state = MRB_HTTP2_UPSTREAM_STATUS_LINE;
+  upstream_h2_link(conn, req);
+
+  // the caller may be in the middle of nghttp2 callbacks of the frontend
+  upstream_h2_schedule_send(conn);
+  return 0;
+}
+
+static void upstream_h2_readcb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+  struct evbuffer *input = bufferevent_get_input(bev);
+  size_t datalen = evbuffer_get_length(input);
+  unsigned char *data = evbuffer_pullup(input, -1);
+  ssize_t readlen;
+
+  TRACER;
+  readlen = nghttp2_session_mem_recv(conn->session, data, datalen);
+  if (readlen < 0) {
+    fprintf(stderr, "upstream: %s:%d nghttp2_session_mem_recv: %s\n", conn->host, conn->port,
+            nghttp2_strerror((int)readlen));
+    upstream_h2_conn_close(conn);
+    return;
+  }
+  evbuffer_drain(input, readlen);
+  if (upstream_h2_send(conn) != 0) {
+    upstream_h2_conn_close(conn);
+  }
+}
+
+// output was drained, go on sending what was blocked by the threshold
+static void upstream_h2_writecb(struct bufferevent *bev, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  if (nghttp2_session_want_write(conn->session) && upstream_h2_send(conn) != 0) {
+    upstream_h2_conn_close(conn);
+  }
+}
+
+static void upstream_h2_eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  mrb_http2_upstream_conn *conn = (mrb_http2_upstream_conn *)ptr;
+
+  TRACER;
+  if (events & BEV_EVENT_CONNECTED) {
+    int val = 1;
+    if (!mrb_http2_upstream_is_unix(conn->host)) {
+      setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+    }
+    return;
+  }
+
+  if (conn->nreqs > 0) {
+    if (events & BEV_EVENT_TIMEOUT) {
+      fprintf(stderr, "upstream: %s:%d timeout\n", conn->host, conn->port);
+    } else if (events & BEV_EVENT_ERROR) {
+      fprintf(stderr, "upstream: %s:%d network error\n", conn->host, conn->port);
+    }
+  }
+  upstream_h2_conn_close(conn);
+}
@@ -7,10 +7,16 @@
 #ifndef MRB_HTTP2_UPSTREAM_H
 #define MRB_HTTP2_UPSTREAM_H
 
-#include "mruby.h"
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "mrb_http2.h"
+#include "mrb_http2_balancer.h"
+#include "mrb_http2_resolver.h"
 
 typedef struct {
-  // 127.0.0.1
+  // 127.0.0.1, or unix:/path/to.sock for a unix domain socket
   char *host;
 
   // 127.0.0.1:8080
@@ -25,11 +31,177 @@ typedef struct {
   // connection timeout
   unsigned int timeout;
 
-  // upstream protocol HTTP/1.1 or HTTP/1.0
+  // upstream protocol HTTP/1.1, HTTP/1.0 or HTTP/2 (h2c with prior knowledge)
   unsigned int proto_major;
   unsigned int proto_minor;
 
+  // host and port are picked from the group when set
+  mrb_http2_balancer_group *group;
+
+  // a copy of sampled requests is sent to the mirror group and its
+  // response is discarded
+  mrb_http2_balancer_group *mirror;
+  double mirror_ratio;
+
   unsigned int keepalive : 1;
 } mrb_http2_upstream;
 
+// the number of idle keepalive connections kept per worker
+#define MRB_HTTP2_UPSTREAM_IDLE_MAX 64
+#define MRB_HTTP2_UPSTREAM_IDLE_TIMEOUT 60
+
+// default bytes of response body buffered per stream before reading
+// from upstream is paused
+#define MRB_HTTP2_UPSTREAM_BUFFER_SIZE (1 << 18)
+
+// streams multiplexed on one HTTP/2 upstream connection at most
+#define MRB_HTTP2_UPSTREAM_H2_MAX_STREAMS 100
+
+// mirrored requests in flight per worker, more are not mirrored
+#define MRB_HTTP2_UPSTREAM_MIRROR_MAX 256
+
+typedef struct mrb_http2_upstream_pool mrb_http2_upstream_pool;
+typedef struct mrb_http2_upstream_conn mrb_http2_upstream_conn;
+typedef struct mrb_http2_upstream_req mrb_http2_upstream_req;
+
+typedef struct {
+  // response status line and headers were parsed
+  void (*on_header)(mrb_http2_upstream_req *req, void *ud);
+
+  // decoded response body was appended to req->body
+  void (*on_body)(mrb_http2_upstream_req *req, void *ud);
+
+  // response finished, error is non zero when it failed
+  void (*on_done)(mrb_http2_upstream_req *req, int error, void *ud);
+
+  // streamed request body waiting to be sent fell below the low watermark,
+  // may be NULL
+  void (*on_drain)(mrb_http2_upstream_req *req, void *ud);
+} mrb_http2_upstream_handler;
+
+typedef enum {
+  MRB_HTTP2_UPSTREAM_CONNECTING,
+  MRB_HTTP2_UPSTREAM_STATUS_LINE,
+  MRB_HTTP2_UPSTREAM_HEADERS,
+  MRB_HTTP2_UPSTREAM_BODY,
+  MRB_HTTP2_UPSTREAM_CHUNK_SIZE,
+  MRB_HTTP2_UPSTREAM_CHUNK_DATA,
+  MRB_HTTP2_UPSTREAM_CHUNK_CRLF,
+  MRB_HTTP2_UPSTREAM_TRAILERS,
+  MRB_HTTP2_UPSTREAM_DONE
+} mrb_http2_upstream_state;
+
+struct mrb_http2_upstream_req {
+  mrb_http2_upstream_pool *pool;
+  mrb_http2_upstream_conn *conn;
+  const mrb_http2_upstream_handler *handler;
+  void *ud;
+
+  // connect target and timeout
+  char *host;
+  int port;
+  unsigned int timeout;
+
+  // request headers and body added by the caller before sending
+  nghttp2_nv reqhdrs[MRB_HTTP2_HEADER_MAX];
+  size_t reqhdrslen;
+  struct evbuffer *reqbody;
+
+  // body sent on an HTTP/2 stream, put back in front of reqbody to send it
+  // again when the stream is refused. a streamed body isn't kept
+  struct evbuffer *reqbody_sent;
+
+  // serialized HTTP/1.x request head and body, kept to retry on a stale
+  // keepalive connection
+  struct evbuffer *request;
+
+  // HTTP/2 request line, stream and the next request on the same connection
+  char *method;
+  char *path;
+  char *authority;
+  int32_t stream_id;
+  mrb_http2_upstream_req *next;
+
+  // bytes of HTTP/2 response body not yet consumed for flow control
+  size_t unconsumed;
+
+  // response status code and headers, header names are lower case
+  int status;
+  nghttp2_nv headers[MRB_HTTP2_HEADER_MAX];
+  size_t headerslen;
+
+  // content-length of response or -1
+  int64_t content_length;
+
+  // decoded response body waiting to be consumed
+  struct evbuffer *body;
+
+  mrb_http2_upstream_state state;
+  int64_t remain;
+
+  // bytes of trailer lines read, discarded up to the header size limit
+  size_t trailers_size;
+
+  // run the parser again after a paused request was consumed
+  struct event *resume_ev;
+
+  // notify on_drain out of bufferevent and nghttp2 callbacks
+  struct event *drain_ev;
+
+  unsigned int h2 : 1;
+  unsigned int head : 1;
+  unsigned int keepalive : 1;
+  unsigned int chunked : 1;
+  unsigned int paused : 1;
+  unsigned int reused : 1;
+  unsigned int retried : 1;
+  unsigned int finished : 1;
+  unsigned int failed : 1;
+  unsigned int dispatching : 1;
+  unsigned int cancelled : 1;
+
+  // request body is written while the request is in flight, chunked on
+  // HTTP/1.1 without content-length
+  unsigned int body_streaming : 1;
+  unsigned int body_chunked : 1;
+  unsigned int body_deferred : 1;
+  unsigned int body_done : 1;
+};
+
+void mrb_http2_upstream_free(mrb_state *mrb, mrb_http2_upstream *upstream);
+
+// "unix:/path/to.sock" names a unix domain socket upstream, the port is unused
+#define MRB_HTTP2_UPSTREAM_UNIX_PREFIX "unix:"
+int mrb_http2_upstream_is_unix(const char *host);
+
+// Host header value sent to upstream, "localhost" for a unix domain socket.
+// the caller must free it
+char *mrb_http2_upstream_authority(const char *host, int port);
+
+mrb_http2_upstream_pool *mrb_http2_upstream_pool_new(mrb_state *mrb, struct event_base *evbase, size_t buffer_size,
+                                                     mrb_http2_resolver *resolver);
+void mrb_http2_upstream_pool_free(mrb_http2_upstream_pool *pool);
+
+mrb_http2_upstream_req *mrb_http2_upstream_request_new(mrb_http2_upstream_pool *pool,
+                                                       const mrb_http2_upstream_handler *handler, void *ud);
+int mrb_http2_upstream_request_add_header(mrb_http2_upstream_req *req, const uint8_t *name, size_t namelen,
+                                          const uint8_t *value, size_t valuelen);
+// without copying, name and value must live until the response headers
+// arrive or the request is freed
+int mrb_http2_upstream_request_add_header_ref(mrb_http2_upstream_req *req, const uint8_t *name, size_t namelen,
+                                              const uint8_t *value, size_t valuelen);
+int mrb_http2_upstream_request_send(mrb_http2_upstream_req *req, const mrb_http2_upstream *upstream,
+                                    const char *method);
+void mrb_http2_upstream_request_consumed(mrb_http2_upstream_req *req);
+
+// stream the request body, called before send. the body is written with
+// write_body as it arrives and ended with end_body
+void mrb_http2_upstream_request_stream_body(mrb_http2_upstream_req *req);
+int mrb_http2_upstream_request_write_body(mrb_http2_upstream_req *req, const uint8_t *data, size_t len);
+void mrb_http2_upstream_request_end_body(mrb_http2_upstream_req *req);
+
+// bytes of streamed request body not yet written to the upstream socket
+size_t mrb_http2_upstream_request_body_pending(mrb_http2_upstream_req *req);
+void mrb_http2_upstream_request_free(mrb_http2_upstream_req *req);
+
 #endif
@@ -1,18 +1,66 @@
 #include "mrb_http2_worker.h"
 
-mrb_http2_worker_t *mrb_http2_worker_init(mrb_state *mrb)
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t scoreboard_size(unsigned int workers)
 {
-  mrb_http2_worker_t *worker = (mrb_http2_worker_t *)mrb_malloc(mrb, sizeof(mrb_http2_worker_t));
+  return sizeof(mrb_http2_scoreboard) + sizeof(mrb_http2_worker_t) * (workers - 1);
+}
 
-  worker->session_requests_per_worker = 0;
-  worker->stream_requests_per_worker = 0;
-  worker->connected_sessions = 0;
-  worker->active_stream = 0;
+mrb_http2_scoreboard *mrb_http2_scoreboard_new(mrb_state *mrb, unsigned int workers)
+{
+  mrb_http2_scoreboard *scoreboard;
 
-  return worker;
+  if (workers == 0) {
+    workers = 1;
+  }
+  // anonymous shared mapping is inherited by forked workers, and zero filled
+  scoreboard = mmap(NULL, scoreboard_size(workers), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (scoreboard == MAP_FAILED) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "mmap scoreboard failed");
+  }
+  scoreboard->slotslen = workers;
+
+  return scoreboard;
+}
+
+void mrb_http2_scoreboard_free(mrb_http2_scoreboard *scoreboard)
+{
+  munmap(scoreboard, scoreboard_size(scoreboard->slotslen));
 }
 
-void mrb_http2_worker_free(mrb_state *mrb, mrb_http2_worker_t *worker)
+void mrb_http2_scoreboard_total(mrb_http2_scoreboard *scoreboard, mrb_http2_worker_t *total)
 {
-  mrb_free(mrb, worker);
+  mrb_http2_worker_t *worker;
+  unsigned int i;
+
+  memset(total, 0, sizeof(mrb_http2_worker_t));
+  for (i = 0; i < scoreboard->slotslen; i++) {
+    worker = &scoreboard->slots[i];
+    total->stream_requests_per_worker += MRB_HTTP2_WORKER_GET(worker, stream_requests_per_worker);
+    total->session_requests_per_worker += MRB_HTTP2_WORKER_GET(worker, session_requests_per_worker);
+    total->connected_sessions += MRB_HTTP2_WORKER_GET(worker, connected_sessions);
+    total->active_stream += MRB_HTTP2_WORKER_GET(worker, active_stream);
+    if (MRB_HTTP2_WORKER_GET(worker, loop_lag) > total->loop_lag) {
+      total->loop_lag = MRB_HTTP2_WORKER_GET(worker, loop_lag);
+    }
+    if (MRB_HTTP2_WORKER_GET(worker, pid) != 0) {
+      total->pid++;
+    }
+  }
+}
+
+mrb_http2_worker_t *mrb_http2_worker_init(mrb_http2_scoreboard *scoreboard, unsigned int id)
+{
+  mrb_http2_worker_t *worker = &scoreboard->slots[id % scoreboard->slotslen];
+
+  // sessions and streams of a dead worker are gone with it
+  __atomic_store_n(&worker->connected_sessions, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&worker->active_stream, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&worker->loop_lag, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&worker->pid, getpid(), __ATOMIC_RELAXED);
+
+  return worker;
 }
@@ -9,6 +9,12 @@
 
 #include "mruby.h"
 
+#include <sys/types.h>
+
+#define MRB_HTTP2_CACHE_LINE 64
+
+// a slot of the scoreboard, aligned to a cache line so that workers don't
+// write to the same line
 typedef struct {
 
   // the number of complete request per child
@@ -22,9 +28,35 @@ typedef struct {
   // the number of current processing stream
   uint64_t active_stream;
 
-} mrb_http2_worker_t;
+  // usec the event loop wakes up late, smoothed. sampled when workers are
+  // autoscaled
+  uint64_t loop_lag;
+
+  // process id of the worker, 0 when it isn't running
+  pid_t pid;
+
+} __attribute__((aligned(MRB_HTTP2_CACHE_LINE))) mrb_http2_worker_t;
+
+// counters are updated by the worker of the slot and read by others
+#define MRB_HTTP2_WORKER_INC(worker, field) __atomic_fetch_add(&(worker)->field, 1, __ATOMIC_RELAXED)
+#define MRB_HTTP2_WORKER_DEC(worker, field) __atomic_fetch_sub(&(worker)->field, 1, __ATOMIC_RELAXED)
+#define MRB_HTTP2_WORKER_GET(worker, field) __atomic_load_n(&(worker)->field, __ATOMIC_RELAXED)
+
+// slots of all workers in shared memory, mapped by the master before fork
+typedef struct {
+  unsigned int slotslen;
+  mrb_http2_worker_t slots[1];
+} mrb_http2_scoreboard;
+
+mrb_http2_scoreboard *mrb_http2_scoreboard_new(mrb_state *mrb, unsigned int workers);
+void mrb_http2_scoreboard_free(mrb_http2_scoreboard *scoreboard);
+
+// sum of all slots, loop_lag is the max and pid is the number of running
+// workers
+void mrb_http2_scoreboard_total(mrb_http2_scoreboard *scoreboard, mrb_http2_worker_t *total);
 
-mrb_http2_worker_t *mrb_http2_worker_init(mrb_state *);
-void mrb_http2_worker_free(mrb_state *mrb, mrb_http2_worker_t *);
+// the slot of worker id, gauges of a previous worker of the slot are reset
+// and totals are kept
+mrb_http2_worker_t *mrb_http2_worker_init(mrb_http2_scoreboard *scoreboard, unsigned int id);
 
 #endif
@@ -0,0 +1,16 @@
+def balancer_upstreams(balance)
+  {"app" => {:servers => ["127.0.0.1:8001", "127.0.0.1:8002"], :balance => balance}}
+end
+
+assert("HTTP2 balancer peak_ewma picks the faster backend") do
+  assert_equal([100, 0], HTTP2Test.balancer_select(balancer_upstreams("peak_ewma"), "app", [0.05, 1.0], 100))
+end
+
+assert("HTTP2 balancer peak_ewma picks a backend never sampled") do
+  counts = HTTP2Test.balancer_select(balancer_upstreams("peak_ewma"), "app", [0.05, 0], 100)
+  assert_true counts[1] > 0
+end
+
+assert("HTTP2 balancer round_robin") do
+  assert_equal([50, 50], HTTP2Test.balancer_select(balancer_upstreams("round_robin"), "app", [], 100))
+end
@@ -0,0 +1,12 @@
+assert("HTTP2 blocking pool runs jobs") do
+  assert_equal([2, 4, 6], HTTP2Test.blocking_run([1, 2, 3], 1))
+end
+
+assert("HTTP2 blocking pool runs jobs on threads") do
+  nums = (1..100).to_a
+  assert_equal(nums.map { |n| n * 2 }, HTTP2Test.blocking_run(nums, 4))
+end
+
+assert("HTTP2 blocking pool without jobs") do
+  assert_equal([], HTTP2Test.blocking_run([], 2))
+end
@@ -0,0 +1,14 @@
+assert("HTTP2 body in memory") do
+  assert_equal([11, "hello world", "hello world"], HTTP2Test.body(["hello", " ", "world"], 1024, 0))
+  assert_equal([11, "world", "hello world"], HTTP2Test.body(["hello", " ", "world"], 1024, 6))
+end
+
+assert("HTTP2 body spilled to a file") do
+  assert_equal([11, "hello world", "hello world"], HTTP2Test.body(["hello", " ", "world"], 4, 0))
+  assert_equal([11, "world", "hello world"], HTTP2Test.body(["hello", " ", "world"], 4, 6))
+end
+
+assert("HTTP2 large body spilled to a file") do
+  data = "a" * 5000 + "b" * 5000
+  assert_equal([20000, data + data, data + data], HTTP2Test.body([data, data], 8192, 0))
+end
@@ -0,0 +1,52 @@
+assert("HTTP2 cache request without Cache-Control") do
+  assert_equal([true, true], HTTP2Test.cache_request_cacheable("GET", [["accept", "*/*"]]))
+end
+
+assert("HTTP2 cache request with max-age=0") do
+  assert_equal([true, false], HTTP2Test.cache_request_cacheable("GET", [["cache-control", "max-age=0"]]))
+end
+
+assert("HTTP2 cache request with max-age") do
+  assert_equal([true, true], HTTP2Test.cache_request_cacheable("GET", [["cache-control", "max-age=60"]]))
+end
+
+assert("HTTP2 cache request with no-cache") do
+  assert_equal([true, false], HTTP2Test.cache_request_cacheable("GET", [["cache-control", "no-cache"]]))
+  assert_equal([true, false], HTTP2Test.cache_request_cacheable("GET", [["pragma", "no-cache"]]))
+end
+
+assert("HTTP2 cache request not stored") do
+  assert_false HTTP2Test.cache_request_cacheable("POST", [])[0]
+  assert_false HTTP2Test.cache_request_cacheable("GET", [["cache-control", "no-store"]])[0]
+  assert_false HTTP2Test.cache_request_cacheable("GET", [["authorization", "Basic eA=="]])[0]
+end
+
+assert("HTTP2 cache response with max-age") do
+  assert_equal([60, 0, 0], HTTP2Test.cache_response(200, [["cache-control", "max-age=60"]]))
+  assert_equal([60, 0, 0], HTTP2Test.cache_response(200, [["cache-control", "public, Max-Age=\"60\""]]))
+end
+
+assert("HTTP2 cache response with s-maxage") do
+  assert_equal([30, 0, 0], HTTP2Test.cache_response(200, [["cache-control", "max-age=60, s-maxage=30"]]))
+end
+
+assert("HTTP2 cache response with stale extensions") do
+  cc = "max-age=60, stale-while-revalidate=30, stale-if-error=600"
+  assert_equal([60, 30, 600], HTTP2Test.cache_response(200, [["cache-control", cc]]))
+  cc = "max-age=60, must-revalidate, stale-if-error=600"
+  assert_equal([60, 0, 0], HTTP2Test.cache_response(200, [["cache-control", cc]]))
+end
+
+assert("HTTP2 cache response not stored") do
+  assert_nil HTTP2Test.cache_response(200, [])
+  assert_nil HTTP2Test.cache_response(200, [["cache-control", "max-age=0"]])
+  assert_nil HTTP2Test.cache_response(200, [["cache-control", "no-store, max-age=60"]])
+  assert_nil HTTP2Test.cache_response(200, [["cache-control", "private, max-age=60"]])
+  assert_nil HTTP2Test.cache_response(200, [["cache-control", "max-age=60"], ["set-cookie", "a=b"]])
+  assert_nil HTTP2Test.cache_response(500, [["cache-control", "max-age=60"]])
+end
+
+assert("HTTP2 cache response with a huge max-age") do
+  cc = "max-age=99999999999999999999"
+  assert_equal([2147483648, 0, 0], HTTP2Test.cache_response(200, [["cache-control", cc]]))
+end
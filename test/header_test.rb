@@ -0,0 +1,20 @@
+assert("HTTP2 header lookup") do
+  assert_equal(["content-length", false], HTTP2Test.header_lookup("content-length"))
+  assert_equal(["host", false], HTTP2Test.header_lookup("host"))
+  assert_equal(["via", false], HTTP2Test.header_lookup("via"))
+  assert_equal([nil, false], HTTP2Test.header_lookup("x-forwarded-for"))
+  assert_equal([nil, false], HTTP2Test.header_lookup("content-type"))
+end
+
+assert("HTTP2 header lookup of hop-by-hop headers") do
+  %w(connection keep-alive proxy-connection te transfer-encoding upgrade).each do |name|
+    assert_equal([name, true], HTTP2Test.header_lookup(name))
+  end
+end
+
+assert("HTTP2 header listed in Connection") do
+  assert_true HTTP2Test.header_connection_listed("close, X-Foo", "x-foo")
+  assert_true HTTP2Test.header_connection_listed("keep-alive", "keep-alive")
+  assert_false HTTP2Test.header_connection_listed("x-foobar", "x-foo")
+  assert_false HTTP2Test.header_connection_listed("", "x-foo")
+end
@@ -0,0 +1,22 @@
+assert("HTTP2 listener host and port") do
+  assert_equal([["inet", 8080, false]], HTTP2Test.listener_resolve("127.0.0.1:8080", "80"))
+end
+
+assert("HTTP2 listener host without port") do
+  assert_equal([["inet", 80, false]], HTTP2Test.listener_resolve("127.0.0.1", "80"))
+end
+
+assert("HTTP2 listener unix socket") do
+  assert_equal([["unix", "/tmp/mrb_http2.sock", false]], HTTP2Test.listener_resolve("unix:/tmp/mrb_http2.sock", "80"))
+  assert_nil HTTP2Test.listener_resolve("unix:", "80")
+end
+
+assert("HTTP2 listener any address") do
+  addrs = HTTP2Test.listener_resolve("*:8080", "80")
+  assert_true addrs.size > 0
+  addrs.each do |family, port, v6only|
+    assert_equal 8080, port
+    # IPv6 leaves IPv4 to its own listener
+    assert_true v6only if family == "inet6" && addrs.any? { |a| a[0] == "inet" }
+  end
+end
@@ -0,0 +1,31 @@
+def maglev_upstreams(servers)
+  {"app" => {:servers => servers, :balance => "maglev"}}
+end
+
+def maglev_keys
+  (1..1000).map { |i| "/users/#{i}" }
+end
+
+assert("HTTP2 maglev picks the same backend for a key") do
+  servers = ["127.0.0.1:8001", "127.0.0.1:8002", "127.0.0.1:8003"]
+  first = HTTP2Test.balancer_select_key(maglev_upstreams(servers), "app", maglev_keys)
+  assert_equal first, HTTP2Test.balancer_select_key(maglev_upstreams(servers), "app", maglev_keys)
+end
+
+assert("HTTP2 maglev spreads keys over backends") do
+  servers = ["127.0.0.1:8001", "127.0.0.1:8002", "127.0.0.1:8003"]
+  picked = HTTP2Test.balancer_select_key(maglev_upstreams(servers), "app", maglev_keys)
+  servers.each do |server|
+    assert_true picked.select { |s| s == server }.size > 200
+  end
+end
+
+assert("HTTP2 maglev moves few keys when a backend is added") do
+  servers = ["127.0.0.1:8001", "127.0.0.1:8002", "127.0.0.1:8003"]
+  before = HTTP2Test.balancer_select_key(maglev_upstreams(servers), "app", maglev_keys)
+  after = HTTP2Test.balancer_select_key(maglev_upstreams(servers + ["127.0.0.1:8004"]), "app", maglev_keys)
+  moved = 0
+  before.each_with_index { |server, i| moved += 1 if server != after[i] }
+  # about 1/4 of keys go to the new backend
+  assert_true moved < 400
+end
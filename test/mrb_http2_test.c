@@ -0,0 +1,347 @@
+/*
+// mrb_http2_test.c - to test internal functions of mruby-http2
+//
+// See Copyright Notice in mrb_http2.c
+*/
+#include "../src/mrb_http2.h"
+#include "../src/mrb_http2_balancer.h"
+#include "../src/mrb_http2_blocking.h"
+#include "../src/mrb_http2_body.h"
+#include "../src/mrb_http2_cache.h"
+#include "../src/mrb_http2_header.h"
+#include "../src/mrb_http2_listener.h"
+
+// [[name, value], ...] to nva, the strings are referenced
+static size_t test_nva(mrb_state *mrb, mrb_value headers, nghttp2_nv *nva)
+{
+  mrb_value pair, name, value;
+  mrb_int i, n = RARRAY_LEN(headers);
+
+  if (n > MRB_HTTP2_HEADER_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many headers");
+  }
+  for (i = 0; i < n; i++) {
+    pair = mrb_ary_ref(mrb, headers, i);
+    name = mrb_ary_ref(mrb, pair, 0);
+    value = mrb_ary_ref(mrb, pair, 1);
+    mrb_http2_ref_nv(&nva[i], (uint8_t *)RSTRING_PTR(name), RSTRING_LEN(name), (uint8_t *)RSTRING_PTR(value),
+                     RSTRING_LEN(value));
+  }
+  return n;
+}
+
+// [cacheable, lookup]
+static mrb_value test_cache_request_cacheable(mrb_state *mrb, mrb_value self)
+{
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX];
+  mrb_value headers, ret;
+  char *method;
+  size_t nvlen;
+  int rv, lookup;
+
+  mrb_get_args(mrb, "zA", &method, &headers);
+  nvlen = test_nva(mrb, headers, nva);
+  rv = mrb_http2_cache_request_cacheable(method, nva, nvlen, &lookup);
+
+  ret = mrb_ary_new(mrb);
+  mrb_ary_push(mrb, ret, mrb_bool_value(rv == 0));
+  mrb_ary_push(mrb, ret, mrb_bool_value(lookup != 0));
+  return ret;
+}
+
+// times each backend of the group is selected in n requests, with the
+// ewma latency of backends given in seconds and 0 as never sampled
+static mrb_value test_balancer_select(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_balancer *balancer;
+  mrb_http2_balancer_group *group;
+  mrb_http2_balancer_backend *backend;
+  mrb_value upstreams, ewmas, ret;
+  mrb_int i, n;
+  char *name;
+  unsigned int counts[MRB_HTTP2_BALANCER_BACKEND_MAX] = {0};
+  double now = mrb_http2_balancer_now();
+
+  mrb_get_args(mrb, "HzAi", &upstreams, &name, &ewmas, &n);
+  balancer = mrb_http2_balancer_new(mrb, upstreams);
+  group = mrb_http2_balancer_find(balancer, name);
+  if (group == NULL) {
+    mrb_http2_balancer_free(mrb, balancer);
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown upstream: %S", mrb_str_new_cstr(mrb, name));
+  }
+  for (i = 0; i < RARRAY_LEN(ewmas) && i < group->backendslen; i++) {
+    group->backends[i].ewma = mrb_float(mrb_Float(mrb, mrb_ary_ref(mrb, ewmas, i)));
+    group->backends[i].ewma_time = now;
+  }
+
+  for (i = 0; i < n; i++) {
+    backend = mrb_http2_balancer_select(group, NULL, 0);
+    counts[backend - group->backends]++;
+    mrb_http2_balancer_release(group, backend, MRB_HTTP2_BALANCER_CANCELLED, 0);
+  }
+
+  ret = mrb_ary_new(mrb);
+  for (i = 0; i < group->backendslen; i++) {
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(counts[i]));
+  }
+  mrb_http2_balancer_free(mrb, balancer);
+  return ret;
+}
+
+// append parts to a body kept in memory up to buffer_size, and return
+// [length, read from offset, added to an evbuffer]
+static mrb_value test_body(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_body *body;
+  struct evbuffer *buf;
+  mrb_value parts, part, ret, str;
+  mrb_int i, buffer_size, offset;
+  ssize_t n;
+
+  mrb_get_args(mrb, "Aii", &parts, &buffer_size, &offset);
+  body = mrb_http2_body_new(mrb, buffer_size, NULL);
+  for (i = 0; i < RARRAY_LEN(parts); i++) {
+    part = mrb_ary_ref(mrb, parts, i);
+    if (mrb_http2_body_append(body, (uint8_t *)RSTRING_PTR(part), RSTRING_LEN(part)) != 0) {
+      mrb_http2_body_free(body);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "mrb_http2_body_append failed");
+    }
+  }
+
+  ret = mrb_ary_new(mrb);
+  mrb_ary_push(mrb, ret, mrb_fixnum_value(mrb_http2_body_length(body)));
+
+  str = mrb_str_new(mrb, NULL, mrb_http2_body_length(body));
+  n = mrb_http2_body_read(body, offset, (uint8_t *)RSTRING_PTR(str), RSTRING_LEN(str));
+  mrb_ary_push(mrb, ret, mrb_str_new(mrb, RSTRING_PTR(str), n > 0 ? n : 0));
+
+  buf = evbuffer_new();
+  mrb_http2_body_add_evbuffer(body, buf);
+  str = mrb_str_new(mrb, NULL, evbuffer_get_length(buf));
+  evbuffer_remove(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+  evbuffer_free(buf);
+  mrb_ary_push(mrb, ret, str);
+
+  mrb_http2_body_free(body);
+  return ret;
+}
+
+typedef struct {
+  mrb_http2_blocking_job job;
+  mrb_int n;
+  unsigned int *remain;
+  struct event_base *evbase;
+} test_blocking_job;
+
+static void *test_blocking_init(mrb_state *mrb, void *arg)
+{
+  return arg;
+}
+
+static int test_blocking_job_run(mrb_state *mrb, void *thread_data, mrb_http2_blocking_job *j)
+{
+  test_blocking_job *job = (test_blocking_job *)j;
+
+  return thread_data == job->remain ? (int)job->n * 2 : -1;
+}
+
+static void test_blocking_job_done(mrb_http2_blocking_job *j, int result)
+{
+  test_blocking_job *job = (test_blocking_job *)j;
+
+  job->job.result = result;
+  if (--*job->remain == 0) {
+    event_base_loopbreak(job->evbase);
+  }
+}
+
+// run each number on a pool of threads and return the doubled numbers in
+// the order of submission
+static mrb_value test_blocking_run(mrb_state *mrb, mrb_value self)
+{
+  struct event_base *evbase;
+  mrb_http2_blocking *pool;
+  test_blocking_job *jobs;
+  mrb_value nums, ret;
+  mrb_int i, n, threads;
+  unsigned int remain;
+
+  mrb_get_args(mrb, "Ai", &nums, &threads);
+  n = RARRAY_LEN(nums);
+  remain = n;
+  evbase = event_base_new();
+  pool = mrb_http2_blocking_new(mrb, evbase, threads, test_blocking_init, NULL, &remain);
+  if (pool == NULL) {
+    event_base_free(evbase);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "mrb_http2_blocking_new failed");
+  }
+
+  jobs = (test_blocking_job *)mrb_calloc(mrb, n > 0 ? n : 1, sizeof(test_blocking_job));
+  for (i = 0; i < n; i++) {
+    jobs[i].job.run = test_blocking_job_run;
+    jobs[i].job.done = test_blocking_job_done;
+    jobs[i].n = mrb_fixnum(mrb_ary_ref(mrb, nums, i));
+    jobs[i].remain = &remain;
+    jobs[i].evbase = evbase;
+    if (mrb_http2_blocking_submit(pool, &jobs[i].job) != 0) {
+      jobs[i].job.result = -1;
+      remain--;
+    }
+  }
+  if (remain > 0) {
+    event_base_dispatch(evbase);
+  }
+  mrb_http2_blocking_free(pool);
+  event_base_free(evbase);
+
+  ret = mrb_ary_new(mrb);
+  for (i = 0; i < n; i++) {
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(jobs[i].job.result));
+  }
+  mrb_free(mrb, jobs);
+  return ret;
+}
+
+// [[family, port or path, v6only], ...] of a listen spec, or nil when it
+// can't be resolved
+static mrb_value test_listener_resolve(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_listener_addr addrs[MRB_HTTP2_LISTENER_MAX];
+  mrb_value ret, addr;
+  char *spec, *service;
+  int i, n;
+
+  mrb_get_args(mrb, "zz", &spec, &service);
+  n = mrb_http2_listener_resolve(spec, service, addrs, 0, MRB_HTTP2_LISTENER_MAX);
+  if (n < 0) {
+    return mrb_nil_value();
+  }
+
+  ret = mrb_ary_new(mrb);
+  for (i = 0; i < n; i++) {
+    addr = mrb_ary_new(mrb);
+    switch (addrs[i].addr.ss_family) {
+    case AF_UNIX:
+      mrb_ary_push(mrb, addr, mrb_str_new_lit(mrb, "unix"));
+      mrb_ary_push(mrb, addr, mrb_str_new_cstr(mrb, ((struct sockaddr_un *)&addrs[i].addr)->sun_path));
+      break;
+    case AF_INET6:
+      mrb_ary_push(mrb, addr, mrb_str_new_lit(mrb, "inet6"));
+      mrb_ary_push(mrb, addr, mrb_fixnum_value(ntohs(((struct sockaddr_in6 *)&addrs[i].addr)->sin6_port)));
+      break;
+    default:
+      mrb_ary_push(mrb, addr, mrb_str_new_lit(mrb, "inet"));
+      mrb_ary_push(mrb, addr, mrb_fixnum_value(ntohs(((struct sockaddr_in *)&addrs[i].addr)->sin_port)));
+      break;
+    }
+    mrb_ary_push(mrb, addr, mrb_bool_value(addrs[i].v6only));
+    mrb_ary_push(mrb, ret, addr);
+  }
+  return ret;
+}
+
+// "host:port" of the backend selected for each key
+static mrb_value test_balancer_select_key(mrb_state *mrb, mrb_value self)
+{
+  mrb_http2_balancer *balancer;
+  mrb_http2_balancer_group *group;
+  mrb_http2_balancer_backend *backend;
+  mrb_value upstreams, keys, key, ret;
+  mrb_int i;
+  char *name, server[NI_MAXHOST + 8];
+
+  mrb_get_args(mrb, "HzA", &upstreams, &name, &keys);
+  balancer = mrb_http2_balancer_new(mrb, upstreams);
+  group = mrb_http2_balancer_find(balancer, name);
+  if (group == NULL) {
+    mrb_http2_balancer_free(mrb, balancer);
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown upstream: %S", mrb_str_new_cstr(mrb, name));
+  }
+
+  ret = mrb_ary_new(mrb);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    key = mrb_ary_ref(mrb, keys, i);
+    backend = mrb_http2_balancer_select(group, (uint8_t *)RSTRING_PTR(key), RSTRING_LEN(key));
+    snprintf(server, sizeof(server), "%s:%d", backend->host, backend->port);
+    mrb_ary_push(mrb, ret, mrb_str_new_cstr(mrb, server));
+    mrb_http2_balancer_release(group, backend, MRB_HTTP2_BALANCER_CANCELLED, 0);
+  }
+  mrb_http2_balancer_free(mrb, balancer);
+  return ret;
+}
+
+// [lifetime, stale-while-revalidate, stale-if-error] of a response to be
+// stored, or nil when it can't be stored
+static mrb_value test_cache_response(mrb_state *mrb, mrb_value self)
+{
+  nghttp2_nv nva[MRB_HTTP2_HEADER_MAX];
+  mrb_http2_cache *cache;
+  mrb_http2_cache_writer *writer;
+  mrb_http2_cache_entry *entry;
+  mrb_value headers, ret = mrb_nil_value();
+  mrb_int status;
+  size_t nvlen;
+  time_t now = time(NULL);
+
+  mrb_get_args(mrb, "iA", &status, &headers);
+  nvlen = test_nva(mrb, headers, nva);
+  cache = mrb_http2_cache_new(mrb, 1 << 20, 0, NULL, 0);
+  writer = mrb_http2_cache_writer_new(cache, "/", 1, NULL, 0, status, nva, nvlen, -1, "localhost", now);
+  if (writer != NULL) {
+    entry = mrb_http2_cache_writer_entry(writer);
+    ret = mrb_ary_new(mrb);
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(entry->expires - entry->stored));
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(entry->stale_while_revalidate));
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(entry->stale_if_error));
+    mrb_http2_cache_writer_free(writer);
+  }
+  mrb_http2_cache_free(cache);
+  return ret;
+}
+
+// [token name or nil for other headers, hop-by-hop]
+static mrb_value test_header_lookup(mrb_state *mrb, mrb_value self)
+{
+  // in the order of mrb_http2_header_token
+  static const char *names[] = {
+      NULL,         "age",      "connection",       "content-length", "cookie",            "host",
+      "keep-alive", "location", "proxy-connection", "te",             "transfer-encoding", "upgrade",
+      "via",
+  };
+  mrb_http2_header_token token;
+  mrb_value name, ret;
+
+  mrb_get_args(mrb, "S", &name);
+  token = mrb_http2_header_lookup((uint8_t *)RSTRING_PTR(name), RSTRING_LEN(name));
+
+  ret = mrb_ary_new(mrb);
+  mrb_ary_push(mrb, ret, names[token] != NULL ? mrb_str_new_cstr(mrb, names[token]) : mrb_nil_value());
+  mrb_ary_push(mrb, ret, mrb_bool_value(mrb_http2_header_hop_by_hop(token)));
+  return ret;
+}
+
+static mrb_value test_header_connection_listed(mrb_state *mrb, mrb_value self)
+{
+  nghttp2_nv nv;
+  mrb_value value, name;
+
+  mrb_get_args(mrb, "SS", &value, &name);
+  mrb_http2_ref_nv(&nv, (uint8_t *)"connection", sizeof("connection") - 1, (uint8_t *)RSTRING_PTR(value),
+                   RSTRING_LEN(value));
+  return mrb_bool_value(mrb_http2_header_connection_listed(&nv, (uint8_t *)RSTRING_PTR(name), RSTRING_LEN(name)));
+}
+
+void mrb_mruby_http2_gem_test(mrb_state *mrb)
+{
+  struct RClass *t = mrb_define_module(mrb, "HTTP2Test");
+
+  mrb_define_module_function(mrb, t, "cache_request_cacheable", test_cache_request_cacheable, MRB_ARGS_REQ(2));
+  mrb_define_module_function(mrb, t, "cache_response", test_cache_response, MRB_ARGS_REQ(2));
+  mrb_define_module_function(mrb, t, "header_lookup", test_header_lookup, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, t, "header_connection_listed", test_header_connection_listed, MRB_ARGS_REQ(2));
+  mrb_define_module_function(mrb, t, "balancer_select", test_balancer_select, MRB_ARGS_REQ(4));
+  mrb_define_module_function(mrb, t, "balancer_select_key", test_balancer_select_key, MRB_ARGS_REQ(3));
+  mrb_define_module_function(mrb, t, "body", test_body, MRB_ARGS_REQ(3));
+  mrb_define_module_function(mrb, t, "blocking_run", test_blocking_run, MRB_ARGS_REQ(2));
+  mrb_define_module_function(mrb, t, "listener_resolve", test_listener_resolve, MRB_ARGS_REQ(2));
+}